@@ -9,6 +9,7 @@
 
 extern POSITION* g_pChatterList; /* list of chatters */
 
+void AnswerPingFromServer(const char* pszReceivedText);
 BOOL GetNicknameFromUser(char* pszNickname);
 void GreetServer();
 void HandleAdminOrChatMessage(const char* pszReceivedText);
@@ -18,6 +19,7 @@ void HandleProtocolReply(const char* pszReplyMessage);
 void HandshakeWithServer();
 BOOL IsAdminOrChatMessage(const char* pszReceivedText);
 BOOL IsMultilineResponseTerminator(const char* pszMessage);
+BOOL IsPingFromServer(const char* pszReceivedText);
 void LeaveChatRoom();
 void PrintChatterName(void* pvChatterName);
 void PrintChattersInRoom();
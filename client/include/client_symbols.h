@@ -26,6 +26,14 @@
 	"ERROR: Changing your nickname while chatting is not allowed.\n"
 #endif //CHANGING_NICKNAME_NOT_ALLOWED
 
+/**
+ * @brief Longest line of a chat message, not counting its newline, that the
+ * server accepts.  Longer lines typed by the user are wrapped onto several.
+ */
+#ifndef CHAT_MESSAGE_MAX_LINE_LENGTH
+#define CHAT_MESSAGE_MAX_LINE_LENGTH	80
+#endif //CHAT_MESSAGE_MAX_LINE_LENGTH
+
 #ifndef CHAT_PROMPT_FORMAT
 #define CHAT_PROMPT_FORMAT      "%s > "
 #endif //CHAT_PROMPT_FORMAT
@@ -252,6 +260,44 @@
 // chat room
 #endif //PROTOCOL_HELO_COMMAND
 
+/**
+ * @brief Protocol commands that the user may type during a chat session.
+ * None of them is a chat message, so none is ended with a dot.  Every line
+ * after the DM command, up to a dot that the user types, is the direct
+ * message.
+ */
+#ifndef PROTOCOL_DM_COMMAND
+#define PROTOCOL_DM_COMMAND		"DM "
+#endif //PROTOCOL_DM_COMMAND
+
+#ifndef PROTOCOL_FOLLOW_COMMAND
+#define PROTOCOL_FOLLOW_COMMAND	"FOLLOW "
+#endif //PROTOCOL_FOLLOW_COMMAND
+
+#ifndef PROTOCOL_HISTORY_COMMAND
+#define PROTOCOL_HISTORY_COMMAND	"HISTORY "
+#endif //PROTOCOL_HISTORY_COMMAND
+
+#ifndef PROTOCOL_JOIN_COMMAND
+#define PROTOCOL_JOIN_COMMAND	"JOIN "
+#endif //PROTOCOL_JOIN_COMMAND
+
+#ifndef PROTOCOL_MUTE_COMMAND
+#define PROTOCOL_MUTE_COMMAND	"MUTE\n"
+#endif //PROTOCOL_MUTE_COMMAND
+
+#ifndef PROTOCOL_PART_COMMAND
+#define PROTOCOL_PART_COMMAND	"PART\n"
+#endif //PROTOCOL_PART_COMMAND
+
+#ifndef PROTOCOL_UNFOLLOW_COMMAND
+#define PROTOCOL_UNFOLLOW_COMMAND	"UNFOLLOW "
+#endif //PROTOCOL_UNFOLLOW_COMMAND
+
+#ifndef PROTOCOL_UNMUTE_COMMAND
+#define PROTOCOL_UNMUTE_COMMAND	"UNMUTE\n"
+#endif //PROTOCOL_UNMUTE_COMMAND
+
 /**
  * @brief Protocol command that tells the server to send us a list of the
  * names of who is currently in the chat room.
@@ -267,6 +313,22 @@
 // server
 #endif //PROTOCOL_NICK_COMMAND
 
+/**
+ * @brief Beginning of the PING the server sends to check that we are still
+ * here; the sequence number of the PING follows it.
+ */
+#ifndef PROTOCOL_PING_PREFIX
+#define PROTOCOL_PING_PREFIX	"PING "
+#endif //PROTOCOL_PING_PREFIX
+
+/**
+ * @brief Protocol command that answers a PING from the server.  The sequence
+ * number of the PING goes in for the %s.
+ */
+#ifndef PROTOCOL_PONG_COMMAND
+#define PROTOCOL_PONG_COMMAND	"PONG %s\n"
+#endif //PROTOCOL_PONG_COMMAND
+
 #ifndef PROTOCOL_QUIT_COMMAND
 #define PROTOCOL_QUIT_COMMAND	"QUIT\n"		// Protocol command that
 // 'logs the client off'
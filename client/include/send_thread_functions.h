@@ -15,6 +15,17 @@ extern BOOL g_bShouldTerminateSendThread;
 /* global handle to the send thread */
 extern HTHREAD g_hSendThread;
 
+/**
+ * @brief Sends a line that the user typed to the server.  A chat line is
+ * wrapped onto lines of no more than CHAT_MESSAGE_MAX_LINE_LENGTH characters,
+ * and ended with a dot, so that it is a chat message of its own.  Protocol
+ * commands, QUIT, and the lines of a direct message are not ended with a dot;
+ * a direct message is ended by the dot that the user types.
+ * @param pszLine Address of a buffer containing the line, with its newline.
+ * @return TRUE if the line was sent; FALSE if an error occurred.
+ */
+BOOL SendLineToServer(const char* pszLine);
+
 /**
  * @brief Returns a value that indicates whether the chat program should keep
  * waiting for the user to type lines to send to the server.
@@ -35,6 +35,34 @@ char g_szNickname[MAX_NICKNAME_LEN + 1]; /* global-scope */
 ///////////////////////////////////////////////////////////////////////////////
 // Publicly-exposed functions (to rest of the program)
 
+///////////////////////////////////////////////////////////////////////////////
+// AnswerPingFromServer function - Sends the server the PONG that answers the
+// PING it sent, so that it knows we are still here.
+//
+
+void AnswerPingFromServer(const char* pszReceivedText) {
+	if (!IsPingFromServer(pszReceivedText)) {
+		return;
+	}
+
+	/* The sequence number runs up to the end of the line */
+	const char* pszSequence = pszReceivedText + strlen(PROTOCOL_PING_PREFIX);
+	const int SEQUENCE_LENGTH = strcspn(pszSequence, "\r\n");
+
+	char szSequence[SEQUENCE_LENGTH + 1];
+	memset(szSequence, 0, SEQUENCE_LENGTH + 1);
+	strncpy(szSequence, pszSequence, SEQUENCE_LENGTH);
+
+	char szPongCommand[SEQUENCE_LENGTH + strlen(PROTOCOL_PONG_COMMAND) + 1];
+	sprintf(szPongCommand, PROTOCOL_PONG_COMMAND, szSequence);
+
+	if (0 >= Send(g_nClientSocket, szPongCommand)) {
+		if (GetLogFileHandle() != stdout) {
+			LogError("AnswerPingFromServer: Failed to send PONG.");
+		}
+	}
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // GetNicknameFromUser function
 //
@@ -105,6 +133,16 @@ void HandleAdminOrChatMessage(const char* pszReceivedText) {
 	// g_bReceivingChatterList variable will have the value of TRUE.  We
 	// put the names returned into a linked list.
 	if (g_bReceivingChatterList) {
+		/* The server lists this chatter, too; only the others are shown */
+		const int OWN_LENGTH = strlen(g_szNickname);
+		if (OWN_LENGTH > 0 && szTextToDump[0] == '@'
+				&& strncmp(szTextToDump + 1, g_szNickname, OWN_LENGTH) == 0
+				&& (szTextToDump[OWN_LENGTH + 1] == '\0'
+						|| szTextToDump[OWN_LENGTH + 1] == '\r'
+						|| szTextToDump[OWN_LENGTH + 1] == '\n')) {
+			return;
+		}
+
 		char* pszChatterName = (char*) malloc(
 				RECEIVED_TEXT_SIZE * sizeof(char));
 		if (pszChatterName == NULL) {
@@ -277,6 +315,18 @@ BOOL IsMultilineResponseTerminator(const char* pszMessage) {
 	return strcmp(pszMessage, ".\n") == 0;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// IsPingFromServer function
+
+BOOL IsPingFromServer(const char* pszReceivedText) {
+	if (IsNullOrWhiteSpace(pszReceivedText)) {
+		return FALSE;
+	}
+
+	return strncmp(pszReceivedText, PROTOCOL_PING_PREFIX,
+			strlen(PROTOCOL_PING_PREFIX)) == 0;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // LeaveChatRoom function - Sends the QUIT command to the server (per the
 // protocol) to tell the server that the user wants to leave the chat room.
@@ -71,6 +71,13 @@ void *ReceiveThread(void *pvData) {
             // bytes received.
             nTotalBytesReceived += nBytesReceived;
 
+            // The server checks that we are still here by sending PING;
+            // answer it straight away, without bothering the user with it.
+            if (IsPingFromServer(szReceivedTextCopy)) {
+                AnswerPingFromServer(szReceivedTextCopy);
+                continue;
+            }
+
             // Handle the data received from the server.
             ProcessReceivedText(szReceivedTextCopy, nBytesReceived);
 
@@ -97,7 +97,7 @@ void *SendThread(void *pvData) {
         // If we are here, then there is something to be sent.  Go ahead and
         // send it to the socket.  Just skip the current input if an error
         // occurs.
-        if (0 > Send(g_nClientSocket, szCurLine)) {
+        if (!SendLineToServer(szCurLine)) {
             // If we are here, then an error occurred with sending.
             continue;
         }
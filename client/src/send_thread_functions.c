@@ -17,6 +17,114 @@ BOOL g_bShouldTerminateSendThread = FALSE;
 
 HTHREAD g_hSendThread;
 
+///////////////////////////////////////////////////////////////////////////////
+// g_bDirectMessageOpen Global variable - Set once the user has sent the DM
+// command, until the user types the dot that ends the direct message.
+
+BOOL g_bDirectMessageOpen = FALSE;
+
+///////////////////////////////////////////////////////////////////////////////
+// IsProtocolCommandLine function - Determines whether a line that the user
+// typed is one of the protocol commands that may be sent during a session,
+// rather than a chat message.
+//
+
+BOOL IsProtocolCommandLine(const char* pszLine) {
+    return StartsWith(pszLine, PROTOCOL_DM_COMMAND)
+            || StartsWith(pszLine, PROTOCOL_JOIN_COMMAND)
+            || StartsWith(pszLine, PROTOCOL_HISTORY_COMMAND)
+            || StartsWith(pszLine, PROTOCOL_FOLLOW_COMMAND)
+            || StartsWith(pszLine, PROTOCOL_UNFOLLOW_COMMAND)
+            || strcasecmp(pszLine, PROTOCOL_PART_COMMAND) == 0
+            || strcasecmp(pszLine, PROTOCOL_MUTE_COMMAND) == 0
+            || strcasecmp(pszLine, PROTOCOL_UNMUTE_COMMAND) == 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendWrappedLine function - Sends a line to the server as one or more lines
+// of no more than CHAT_MESSAGE_MAX_LINE_LENGTH characters each, since the
+// server turns away chat messages with longer lines.
+//
+
+BOOL SendWrappedLine(const char* pszLine) {
+    int nLength = strlen(pszLine);
+    if (nLength > 0 && pszLine[nLength - 1] == '\n') {
+        nLength--;
+    }
+
+    const char* pchLine = pszLine;
+
+    while (nLength > 0) {
+        int nChunkLength = nLength < CHAT_MESSAGE_MAX_LINE_LENGTH
+                ? nLength : CHAT_MESSAGE_MAX_LINE_LENGTH;
+
+        /* A dot left on a line by itself would end the message early */
+        if (nLength - nChunkLength == 1 && pchLine[nChunkLength] == '.') {
+            nChunkLength--;
+        }
+
+        char szChunk[CHAT_MESSAGE_MAX_LINE_LENGTH + 2];
+        memset(szChunk, 0, CHAT_MESSAGE_MAX_LINE_LENGTH + 2);
+
+        memcpy(szChunk, pchLine, nChunkLength);
+        szChunk[nChunkLength] = '\n';
+
+        if (0 > Send(g_nClientSocket, szChunk)) {
+            return FALSE;
+        }
+
+        pchLine += nChunkLength;
+        nLength -= nChunkLength;
+    }
+
+    return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendLineToServer function
+
+BOOL SendLineToServer(const char* pszLine) {
+    if (IsNullOrWhiteSpace(pszLine)) {
+        return FALSE;
+    }
+
+    /* Commands go as they are.  QUIT ends the session, and so also whatever
+     * message was being sent. */
+    if (StartsWith(pszLine, "QUIT") || IsProtocolCommandLine(pszLine)) {
+        if (0 > Send(g_nClientSocket, pszLine)) {
+            return FALSE;
+        }
+
+        if (StartsWith(pszLine, PROTOCOL_DM_COMMAND)) {
+            g_bDirectMessageOpen = TRUE;
+        }
+
+        return TRUE;
+    }
+
+    /* A dot that the user types ends the direct message, if one is open, or
+     * else the chat message, which is empty */
+    if (strcmp(pszLine, MSG_TERMINATOR) == 0) {
+        g_bDirectMessageOpen = FALSE;
+
+        return 0 <= Send(g_nClientSocket, pszLine);
+    }
+
+    if (!SendWrappedLine(pszLine)) {
+        return FALSE;
+    }
+
+    /* The lines of a direct message run on until the user's own dot */
+    if (g_bDirectMessageOpen) {
+        return TRUE;
+    }
+
+    // Per protocol, a chat message runs up to a dot on a line by
+    // itself.  Each line the user types is a message of its own, so
+    // end it straight away.
+    return 0 <= Send(g_nClientSocket, MSG_TERMINATOR);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // ShouldKeepSending function - Examines the current line that is supposed to
 // contain the data that was just sent, and determines if it was, basically,
@@ -0,0 +1,143 @@
+// acceptor_shards.h - Defines the interface for running the accepting of new
+// connections on several threads at once.  With the -shards option, the
+// server has that many acceptor shards.  Each one listens on the server's
+// port with a socket of its own (the kernel spreads the incoming connections
+// over them, thanks to SO_REUSEPORT), and is pinned to a CPU of its own,
+// along with the threads of all the clients that it accepts.  The master
+// acceptor thread is shard 0.
+//
+
+#ifndef __ACCEPTOR_SHARDS_H__
+#define __ACCEPTOR_SHARDS_H__
+
+#include "stdafx.h"
+#include "server_symbols.h"
+
+/**
+ * @brief Structure that holds the state of an acceptor shard.
+ */
+typedef struct _tagACCEPTORSHARD {
+	/**
+	 * @name nIndex
+	 * @brief Number of the shard, from zero.
+	 */
+	int nIndex;
+
+	/**
+	 * @name nCpu
+	 * @brief Number of the CPU that the shard, and the threads of its
+	 * clients, are pinned to.
+	 */
+	int nCpu;
+
+	/**
+	 * @name nListenSocket
+	 * @brief File descriptor of the shard's listening socket.
+	 */
+	int nListenSocket;
+
+	/**
+	 * @name hThread
+	 * @brief Handle to the thread that accepts connections on the socket.
+	 * Shard 0 is run by the master acceptor thread, so this is not set for
+	 * it.
+	 */
+	HTHREAD hThread;
+
+	/**
+	 * @name nAcceptCount
+	 * @brief Count of the connections that the shard has accepted.
+	 */
+	atomic_ullong nAcceptCount;
+
+	/**
+	 * @name nConnectionCount
+	 * @brief Count of the connection IDs that have been handed out for
+	 * clients of the shard.
+	 */
+	atomic_ullong nConnectionCount;
+} ACCEPTORSHARD, *LPACCEPTORSHARD;
+
+/**
+ * @brief Reads the acceptor shard option from the command line.
+ * @param argc Count of command-line arguments.
+ * @param argv Array of the command-line arguments.
+ * @returns TRUE if the option, if given, is valid; FALSE otherwise.
+ * @remarks Options that are not about acceptor shards are skipped; the other
+ * parsers check them.
+ */
+BOOL ConfigureAcceptorShards(int argc, char* argv[]);
+
+/**
+ * @brief Gets the count of acceptor shards that are accepting connections,
+ * including the master acceptor thread.
+ * @returns The count; 1 unless the -shards option was given.
+ */
+int GetAcceptorShardCount();
+
+/**
+ * @brief Determines whether a command-line option is the acceptor shard
+ * option, which takes a value.
+ * @param pszOption The option, such as "-shards".
+ * @returns TRUE if it is; FALSE otherwise.
+ */
+BOOL IsAcceptorShardOption(const char* pszOption);
+
+/**
+ * @brief Hands out the next connection ID for a client of an acceptor shard.
+ * @param nShardIndex Number of the shard, or -1 for a client that belongs to
+ * no shard, such as one handed over by a hot restart.
+ * @returns The connection ID, which no other client of this server process
+ * has.  It is never zero.
+ * @remarks Only touches a counter of the shard's own, so acceptor shards do
+ * not contend over it.
+ */
+uint64_t NewConnectionID(int nShardIndex);
+
+/**
+ * @brief Counts a connection accepted by a shard.
+ * @param nShardIndex Number of the shard.
+ */
+void NoteShardAccept(int nShardIndex);
+
+/**
+ * @brief Pins the calling thread to the CPU of an acceptor shard.
+ * @param nShardIndex Number of the shard, or -1 for a thread that belongs to
+ * no shard, such as that of a client handed over by a hot restart.
+ * @remarks Does nothing unless the server runs more than one shard.
+ */
+void PinThreadToShard(int nShardIndex);
+
+/**
+ * @brief Reports how many connections each acceptor shard accepted, to the
+ * server log and console.
+ * @remarks Does nothing unless the server runs more than one shard.
+ */
+void ReportAcceptorShardStats();
+
+/**
+ * @brief Lets other sockets listen on the same port as the server's
+ * listening socket, so that the acceptor shards can.
+ * @param nServerSocket File descriptor of the server's listening socket.
+ * @remarks Must be called before the socket is bound.  Does nothing unless
+ * the server runs more than one shard.
+ */
+void ShareServerPort(int nServerSocket);
+
+/**
+ * @brief Opens the listening sockets of acceptor shards 1 and up, and starts
+ * their threads.
+ * @param nPort Port number that the server listens on.
+ * @remarks Shard 0 is the master acceptor thread, which must be started
+ * separately.  A shard whose socket cannot be set up is left out, with a
+ * message saying why; the server carries on with the others.
+ */
+void StartAcceptorShards(int nPort);
+
+/**
+ * @brief Stops the threads of acceptor shards 1 and up, and closes their
+ * listening sockets.
+ */
+void StopAcceptorShards();
+
+#endif /* __ACCEPTOR_SHARDS_H__ */
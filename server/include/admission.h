@@ -0,0 +1,78 @@
+// admission.h - Defines the interface for the admission check that every new
+// connection goes through as soon as it is accepted, before anything is
+// allocated or logged for it.  Connections over the total cap, or over the
+// cap for their IP address, are sent a canned reply and closed straight
+// away, so a flood of connections cannot use up the server's memory or
+// threads.
+//
+
+#ifndef __ADMISSION_H__
+#define __ADMISSION_H__
+
+#include "stdafx.h"
+#include "server_symbols.h"
+
+/**
+ * @brief Entry of the table of per-address connection counts.
+ */
+typedef struct _tagADDRESSCOUNT {
+	/**
+	 * @name nAddress
+	 * @brief IPv4 address, in network byte order.
+	 */
+	in_addr_t nAddress;
+
+	/**
+	 * @name nCount
+	 * @brief Count of admitted connections from the address that are still
+	 * open.  Zero if the entry is free.
+	 */
+	int nCount;
+} ADDRESSCOUNT, *LPADDRESSCOUNT;
+
+/**
+ * @brief Decides whether a newly-accepted connection may go on to become a
+ * client.
+ * @param nClientSocket File descriptor of the accepted socket.
+ * @param lpAddress Address of the IP address that the connection came from.
+ * @returns TRUE if the connection has been admitted; FALSE if it has been
+ * sent a canned 502 reply and closed.
+ * @remarks Allocates nothing.  Every connection that is admitted must be
+ * let go of with ReleaseAdmission when it is done with.
+ */
+BOOL AdmitConnection(int nClientSocket, const struct in_addr* lpAddress);
+
+/**
+ * @brief Counts a connection that was admitted by another server process, and
+ * handed over to this one by a hot restart.
+ * @param pszIPAddress String form of the IP address of the connection.
+ * @remarks The caps are not checked, since the connection is already open.
+ */
+void CountAdmittedConnection(const char* pszIPAddress);
+
+/**
+ * @brief Sets up the (empty) table of connection counts and the mutex that
+ * guards it.
+ * @remarks Must be called exactly once, when the application starts.
+ */
+void CreateAdmissionTable();
+
+/**
+ * @brief Releases the mutex that guards the table of connection counts.
+ */
+void DestroyAdmissionTable();
+
+/**
+ * @brief Lets go of the admission of a connection that has been closed, so
+ * that another one can take its place.
+ * @param pszIPAddress String form of the IP address of the connection.
+ */
+void ReleaseAdmission(const char* pszIPAddress);
+
+/**
+ * @brief Reports how many connections were turned away, to the server log
+ * and console.
+ */
+void ReportAdmissionStats();
+
+#endif /* __ADMISSION_H__ */
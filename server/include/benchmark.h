@@ -0,0 +1,75 @@
+// benchmark.h - Defines the interface for the microbenchmarks of the server's
+// hot functions, which are run by starting the server with -benchmark in
+// place of the port number.  The functions are measured against clients whose
+// sockets are never written to: whatever they are sent piles up in their
+// mailboxes, which are emptied between readings of the clock, so that the
+// numbers do not depend on the network.  The results are written out as JSON,
+// so that those of one build can be compared with those of another.
+//
+
+#ifndef __BENCHMARK_H__
+#define __BENCHMARK_H__
+
+#include "stdafx.h"
+#include "server_symbols.h"
+
+/**
+ * @brief Routine that calls the function that a benchmark measures, once.
+ * The argument is the number of the call, counting from zero.
+ */
+typedef void (*LPBENCHMARK_ROUTINE)(int nIteration);
+
+/**
+ * @brief Structure that holds the results of one benchmark.
+ */
+typedef struct _tagBENCHMARKRESULT {
+	/**
+	 * @name pszName
+	 * @brief Name of the benchmark, which is what it is called in the JSON.
+	 */
+	const char* pszName;
+
+	/**
+	 * @name nIterations
+	 * @brief Number of times the function was called.
+	 */
+	int nIterations;
+
+	/**
+	 * @name nTotalNanoseconds
+	 * @brief Time, in nanoseconds, that all of the calls took together.
+	 */
+	uint64_t nTotalNanoseconds;
+
+	/**
+	 * @name dBestNanoseconds
+	 * @brief Time, in nanoseconds, that a call took in the fastest batch of
+	 * BENCHMARK_BATCH_SIZE calls.  This is the least affected by whatever
+	 * else the machine was doing, so it is the one to compare between builds.
+	 */
+	double dBestNanoseconds;
+} BENCHMARKRESULT, *LPBENCHMARKRESULT;
+
+/**
+ * @brief Determines whether the server has been started to run the benchmarks.
+ * @param argc Count of the command-line arguments.
+ * @param argv The command-line arguments.
+ * @returns TRUE if the first argument is -benchmark; FALSE otherwise.
+ */
+BOOL IsBenchmarkMode(int argc, char* argv[]);
+
+/**
+ * @brief Runs the benchmarks and writes their results to the JSON file named
+ * on the command line.
+ * @param argc Count of the command-line arguments.
+ * @param argv The command-line arguments, which are -benchmark, the name of
+ * the file, and then optionally -clients and -iterations.
+ * @returns TRUE if the results were written; FALSE if the command line was not
+ * valid, or if the benchmark clients or the file could not be set up.
+ * @remarks Must be called after the application has been initialized, and
+ * before any real clients have connected.  Message logging must not have been
+ * started, so that the chat lines the benchmarks send are not written to disk.
+ */
+BOOL RunBenchmarks(int argc, char* argv[]);
+
+#endif /* __BENCHMARK_H__ */
@@ -0,0 +1,93 @@
+// binary_protocol.h - Defines the interface for the binary protocol, which a
+// client can switch its connection to by saying HELO BINARY instead of HELO.
+// Each command, chat line, reply and message is then sent as a frame whose
+// header gives its opcode and length, so neither end has to look for
+// newlines, or match command names, to tell where a frame ends and what it
+// is.
+//
+
+#ifndef __BINARY_PROTOCOL_H__
+#define __BINARY_PROTOCOL_H__
+
+#include "client_struct.h"
+#include "message_buffer.h"
+
+/**
+ * @brief Acts on a frame that was received from a client.
+ * @param lpSendingClient Reference to the CLIENTSTRUCT instance of the client
+ * who sent the frame.
+ * @param nOpcode One of the BINARY_OP_* values that are sent by clients.
+ * @param pszBuffer Address of the command line or chat line that was made
+ * from the frame by ReceiveFrameFromClient.
+ * @remarks Frames with opcodes that are not known are ignored.  Commands are
+ * acted on even while the client is sending a direct message, since they
+ * cannot be mistaken for the lines of the message.
+ */
+void HandleBinaryFrame(LPCLIENTSTRUCT lpSendingClient, int nOpcode,
+		char* pszBuffer);
+
+/**
+ * @brief Receives one frame from a client.
+ * @param lpSendingClient Reference to the CLIENTSTRUCT instance of the client.
+ * @param pnOpcode Address of storage that receives the opcode of the frame.
+ * @param ppszBuffer Address of a pointer that receives the address of the
+ * line that the frame stands for: the text protocol command, with its
+ * argument, for a command frame, or the line itself for a chat frame.  It is
+ * newline- and null-terminated, so that it can be handed to the same
+ * handlers as a line of text.  The caller must free it.
+ * @returns Count of bytes received, or zero if the client has closed the
+ * connection or sent a frame bigger than BINARY_MAX_CLIENT_PAYLOAD_LEN.  In
+ * the latter case the client's chat session is ended.
+ */
+int ReceiveFrameFromClient(LPCLIENTSTRUCT lpSendingClient, int* pnOpcode,
+		char** ppszBuffer);
+
+/**
+ * @brief Sends several messages to a client, each as a BINARY_OP_MESSAGE
+ * frame, with a single system call where possible.
+ * @param nSocket File descriptor of the client's socket.
+ * @param lpBuffers Address of an array of references to the messages.
+ * @param nCount Count of entries in the lpBuffers array.  No more than
+ * IOV_MAX / 2.
+ * @returns Total number of bytes sent, or -1 if an error occurred.
+ * @remarks The headers are put in front of the messages by the kernel; the
+ * messages are not copied.
+ */
+int SendFramedBuffersToClient(int nSocket, LPMESSAGEBUFFER* lpBuffers,
+		int nCount);
+
+/**
+ * @brief Sends a message, formatted for the text protocol, to a client as a
+ * frame.
+ * @param nSocket File descriptor of the client's socket.
+ * @param pszMessage Address of the message, which is a single line.
+ * @returns Total number of bytes sent, or -1 if an error occurred.
+ * @remarks A line that starts with a three-digit reply code is sent as a
+ * BINARY_OP_REPLY frame; a dot on a line by itself as a BINARY_OP_END frame;
+ * anything else as a BINARY_OP_MESSAGE frame.  The trailing newline is
+ * dropped.
+ */
+int SendFramedToClient(int nSocket, const char* pszMessage);
+
+/**
+ * @brief Sends the header of a frame to a client, ahead of a payload that
+ * the caller sends by other means, such as sendfile().
+ * @param nSocket File descriptor of the client's socket.
+ * @param nOpcode One of the BINARY_OP_* values that are sent by the server.
+ * @param nPayloadLength Length, in bytes, of the payload.  No more than
+ * BINARY_MAX_PAYLOAD_LEN.
+ * @returns TRUE if the header was sent; FALSE if an error occurred.
+ */
+BOOL SendFrameHeader(int nSocket, int nOpcode, size_t nPayloadLength);
+
+/**
+ * @brief Sends a whole frame, whose payload is a string, to a client.
+ * @param nSocket File descriptor of the client's socket.
+ * @param nOpcode One of the BINARY_OP_* values that are sent by the server.
+ * @param pszPayload Address of the payload.  Its terminating null is not
+ * sent.
+ * @returns Total number of bytes sent, or -1 if an error occurred.
+ */
+int SendFrameToClient(int nSocket, int nOpcode, const char* pszPayload);
+
+#endif /* __BINARY_PROTOCOL_H__ */
@@ -7,11 +7,12 @@
 
 /**
  * @brief Callback used to search the list of clients for a particular client.
- * @param pvClientId UUID that refers to a specific client.
+ * @param pvClientId Address of the connection ID (a uint64_t) that refers
+ * to a specific client.
  * @param pvClientStruct Address of an instance of CLIENTSTRUCT referring to the
  * current client in the list being searched.
  * @returns TRUE if the client referenced by pClientStruct has a value for its
- * clientID member that is equal to that referenced by pvClientId; FALSE
+ * nConnectionID member that is equal to that referenced by pvClientId; FALSE
  * otherwise.
  */
 BOOL FindClientByID(void* pvClientId, void* pvClientStruct);
@@ -9,7 +9,28 @@
 #define ___CLIENT_MANAGER_H__
 
 #include "client_struct.h"
+#include "message_buffer.h"
 
+/**
+ * @brief Sends a message that is already in a buffer to every connected
+ * client.
+ * @param lpMessage Reference to the MESSAGEBUFFER instance, which is shared
+ * by all of the recipients rather than copied for each of them.
+ * @returns Total count of bytes sent.
+ */
+int BroadcastBufferToAllClients(LPMESSAGEBUFFER lpMessage);
+
+/**
+ * @brief Sends a message that is already in a buffer to every connected
+ * client except the one given.
+ * @param lpMessage Reference to the MESSAGEBUFFER instance, which is shared
+ * by all of the recipients rather than copied for each of them.
+ * @param lpSendingClient Reference to the CLIENTSTRUCT instance of the client
+ * that is not sent the message, or NULL to send it to every client.
+ * @returns Total count of bytes sent.
+ */
+int BroadcastBufferToAllClientsExceptSender(LPMESSAGEBUFFER lpMessage,
+		LPCLIENTSTRUCT lpSendingClient);
 int BroadcastToAllClients(const char* pszMessage);
 int BroadcastToAllClientsExceptSender(const char* pszMessage,
 		LPCLIENTSTRUCT lpSendingClient);
@@ -10,16 +10,33 @@
 
 #include "stdafx.h"
 #include "server_symbols.h"
+#include "heartbeat.h"
+#include "mailbox.h"
+#include "message_assembler.h"
+#include "rate_limiter.h"
+#include "room.h"
+#include "timer_wheel.h"
 
 /**
  * @brief Structure that contains information about connected clients.
  */
 typedef struct _tagCLIENTSTRUCT {
 	/**
-	 * @name clientID
-	 * @brief Holds a UUID value that uniquely identifies this client.
+	 * @name nConnectionID
+	 * @brief Number that uniquely identifies this client within this server
+	 * process: the number of the acceptor shard that accepted it, above the
+	 * count of connections that shard had accepted.  Clients are told apart
+	 * by comparing this, one word, rather than a UUID.
 	 */
-    UUID clientID;
+	uint64_t nConnectionID;
+
+	/**
+	 * @name pszUUIDLabel
+	 * @brief UUID that labels this client outside of this server, as a
+	 * string; NULL until GetClientUUIDLabel is first called, since most
+	 * clients never need one.
+	 */
+	_Atomic(char*) pszUUIDLabel;
 
     /**
      * @name szIPAddress
@@ -28,6 +45,14 @@ typedef struct _tagCLIENTSTRUCT {
      */
 	char szIPAddress[IPADDRLEN];
 
+	/**
+	 * @name bAdmissionReleased
+	 * @brief Flag that is set once the client's connection no longer counts
+	 * against the admission limits of its address, so that it is only taken
+	 * off them once.
+	 */
+	atomic_int bAdmissionReleased;
+
 	/**
 	 * @name pszNickname
 	 * @brief Address of a buffer that tracks the current chat nickname
@@ -35,6 +60,21 @@ typedef struct _tagCLIENTSTRUCT {
 	 */
 	char* pszNickname;
 
+	/**
+	 * @name szChatPrefix
+	 * @brief The "!nickname: " that goes in front of each chat message the
+	 * client sends, built once when the nickname is registered rather than
+	 * for every message.
+	 */
+	char szChatPrefix[MAX_NICKNAME_LEN + 4];
+
+	/**
+	 * @name nChatPrefixLength
+	 * @brief Length of szChatPrefix, not counting the null terminator; zero
+	 * if the client has not registered a nickname.
+	 */
+	int nChatPrefixLength;
+
 	/**
 	 * @name nSocket
 	 * @brief Value of the socket file descriptor to use when communicating
@@ -49,6 +89,29 @@ typedef struct _tagCLIENTSTRUCT {
 	 */
 	HTHREAD hClientThread; /* handle to the thread this client is chatting on */
 
+	/**
+	 * @name bStopRequested
+	 * @brief Stop token of the client's thread.  Set by StopClientThread when
+	 * the connection has been cleaned up, and checked by the thread each time
+	 * round its loop.
+	 */
+	atomic_int bStopRequested;
+
+	/**
+	 * @name nPresenceBatchID
+	 * @brief ID of the last batched notice that announced this client's own
+	 * join or leave, so that the client is not sent that notice; zero if none.
+	 */
+	atomic_ullong nPresenceBatchID;
+
+	/**
+	 * @name nShardIndex
+	 * @brief Number of the acceptor shard that accepted the client, whose CPU
+	 * the client's thread runs on; -1 if the client was handed over by a hot
+	 * restart.
+	 */
+	int nShardIndex;
+
 	/**
 	 * @name nBytesReceived
 	 * @brief Set this member to the total number of bytes received from the
@@ -68,13 +131,204 @@ typedef struct _tagCLIENTSTRUCT {
 	 * state.
 	 */
 	BOOL bConnected;
+
+	/**
+	 * @name bBinaryProtocol
+	 * @brief Flag that indicates whether this client said HELO BINARY, and
+	 * so sends and is sent binary protocol frames rather than lines of text.
+	 */
+	BOOL bBinaryProtocol;
+
+	/**
+	 * @name lpDeflateStream
+	 * @brief Reference to the state of the compression of what this client
+	 * is sent, or NULL if the client did not say HELO DEFLATE.
+	 */
+	struct _tagDEFLATESTREAM* lpDeflateStream;
+
+	/**
+	 * @name messageBucket
+	 * @brief Token bucket that limits how many chat messages per second this
+	 * client may send.
+	 */
+	TOKENBUCKET messageBucket;
+
+	/**
+	 * @name byteBucket
+	 * @brief Token bucket that limits how many bytes of chat messages per
+	 * second this client may send.
+	 */
+	TOKENBUCKET byteBucket;
+
+	/**
+	 * @name nThrottledMessageCount
+	 * @brief Count of this client's chat messages that were held back because
+	 * the client was sending too fast.
+	 */
+	long nThrottledMessageCount;
+
+	/**
+	 * @name nDroppedMessageCount
+	 * @brief Count of this client's chat messages that were thrown away
+	 * because the client was sending too fast.
+	 */
+	long nDroppedMessageCount;
+
+	/**
+	 * @name lpRoom
+	 * @brief Reference to the chat room that this client is currently in, or
+	 * NULL if the client is not in any room.
+	 */
+	LPROOM lpRoom;
+
+	/**
+	 * @name nRoomSlot
+	 * @brief Index of the entry occupied by this client in the member array
+	 * of the room referenced by lpRoom.
+	 */
+	int nRoomSlot;
+
+	/**
+	 * @name lpFollowedHashtags
+	 * @brief References to the entries of the hashtag index for the hashtags
+	 * this client follows.  Only the first nFollowedHashtagCount are valid.
+	 */
+	struct _tagHASHTAGENTRY* lpFollowedHashtags[MAX_FOLLOWED_HASHTAGS];
+
+	/**
+	 * @name nFollowedHashtagCount
+	 * @brief Count of hashtags that this client follows.
+	 */
+	int nFollowedHashtagCount;
+
+	/**
+	 * @name nDeliveryStamp
+	 * @brief Stamp of the last fan-out to hashtag followers that sent this
+	 * client a message; keeps a message from being sent to it twice.
+	 */
+	unsigned int nDeliveryStamp;
+
+	/**
+	 * @name lpNicknameEntry
+	 * @brief Reference to the entry of the nickname index that holds this
+	 * client's nickname, or NULL if the client has not registered one.
+	 */
+	struct _tagNICKNAMEENTRY* lpNicknameEntry;
+
+	/**
+	 * @name bMuted
+	 * @brief Flag that indicates whether this client has muted the chat
+	 * messages of the other members of its room.
+	 */
+	BOOL bMuted;
+
+	/**
+	 * @name szDmRecipient
+	 * @brief Nickname of the chatter to whom the lines this client sends are
+	 * to be delivered, after a DM command; empty when the client is not in
+	 * the middle of sending a direct message.
+	 */
+	char szDmRecipient[MAX_NICKNAME_LEN + 1];
+
+	/**
+	 * @name nDmRecipientNodeId
+	 * @brief Node ID of the server the recipient of the direct message is
+	 * connected to, if that is not this server; otherwise zero.
+	 */
+	uint32_t nDmRecipientNodeId;
+
+	/**
+	 * @name chatMessage
+	 * @brief The lines of the chat message this client is in the middle of
+	 * sending, which are broadcast together when the terminating dot comes.
+	 */
+	MESSAGEASSEMBLER chatMessage;
+
+	/**
+	 * @name handshakeTimer
+	 * @brief Timer that expires if the client has not said HELO in time.
+	 */
+	TIMER handshakeTimer;
+
+	/**
+	 * @name idleTimer
+	 * @brief Timer that expires if the client has not sent anything for too
+	 * long.  It is armed again each time the client sends a line.
+	 */
+	TIMER idleTimer;
+
+	/**
+	 * @name heartbeatTimer
+	 * @brief Timer that sends the client its next PING, or that expires if
+	 * the client has not answered the last one in time.
+	 */
+	TIMER heartbeatTimer;
+
+	/**
+	 * @name lpTimerWheel
+	 * @brief Reference to the timing wheel of the client's thread, on which
+	 * the timers above are kept; NULL until the thread has started.
+	 */
+	LPTIMERWHEEL lpTimerWheel;
+
+	/**
+	 * @name nExpiredTimeout
+	 * @brief One of the TIMEOUT_KIND_ values, saying which timeout, if any,
+	 * has expired and is waiting to be acted on.
+	 */
+	int nExpiredTimeout;
+
+	/**
+	 * @name mailbox
+	 * @brief Messages that are waiting to be written to the client.  Other
+	 * threads post to it; only the client's own thread writes to its socket.
+	 */
+	MAILBOX mailbox;
+
+	/**
+	 * @name nPingSequence
+	 * @brief Sequence number of the last PING sent to the client.
+	 */
+	unsigned int nPingSequence;
+
+	/**
+	 * @name nPingSentAt
+	 * @brief Time, in microseconds on the monotonic clock, at which the PING
+	 * that the client has yet to answer was sent; zero if it has answered
+	 * them all.
+	 */
+	uint64_t nPingSentAt;
+
+	/**
+	 * @name rttStats
+	 * @brief Round-trip times of the PINGs that the client has answered.
+	 */
+	RTTSTATS rttStats;
+
+	/**
+	 * @name nRefCount
+	 * @brief Count of references to this instance.  The list of clients
+	 * holds one; code that looks up a client and then uses it outside of any
+	 * lock holds another for as long as it uses it.
+	 */
+	atomic_int nRefCount;
 } CLIENTSTRUCT, *LPCLIENTSTRUCT;
 
+/**
+ * @brief Adds a reference to a client structure, so that it is not freed
+ * while it is being used.
+ * @param lpClient Reference to the CLIENTSTRUCT instance.
+ * @remarks Every call must be matched by a call to ReleaseClient.
+ */
+void AddClientRef(LPCLIENTSTRUCT lpClient);
+
 /**
  * @brief Creates an instance of a CLIENTSTRUCT structure and fills it with info
  * about the client.
  * @param nClientSocket Client's server endpoint socket file descriptor.
  * @param pszClientIPAddress Client's IP address as a string (i.e., 268.7.34.2)
+ * @param nShardIndex Number of the acceptor shard that accepted the client,
+ * or -1 for a client handed over by a hot restart.
  * @returns LPCLIENTSTRUCT pointing to the newly-created-and-initialized instance
  * of the client structure.
  * @remarks Supplies a reference to an instance of CLIENTSTRUCT filled with the
@@ -82,16 +336,41 @@ typedef struct _tagCLIENTSTRUCT {
  * chat messages.
  */
 LPCLIENTSTRUCT CreateClientStruct(int nClientSocket,
-		const char* pszClientIPAddress);
+		const char* pszClientIPAddress, int nShardIndex);
+
+/**
+ * @brief Formats a connection ID as a string, such as "2.1043" for the 1043rd
+ * connection accepted by acceptor shard 1.
+ * @param nConnectionID The connection ID.
+ * @param pszBuffer Address of a buffer of at least CONNECTION_ID_STRING_SIZE
+ * bytes to receive the string.
+ * @returns The address of the buffer, so the call can be used as an argument.
+ * @remarks Nothing is allocated.
+ */
+char* FormatConnectionID(uint64_t nConnectionID, char* pszBuffer);
 
 /**
  * @brief Releases the memory allocated for a client structure pointer back
  * to the system.
  * @param pClientStruct Pointer to a CLIENTSTRUCT instance whose memory is to
  * be freed.
+ * @remarks Drops the reference held by the list of clients; the memory is
+ * not actually freed until any other references are released as well.
  */
 void FreeClient(void* pClientStruct);
 
+/**
+ * @brief Gets the UUID that labels a client outside of this server, making
+ * one up the first time it is asked for.
+ * @param lpCS Reference to the CLIENTSTRUCT instance.
+ * @returns The UUID as a string, which belongs to the client structure and
+ * must not be freed; or NULL if lpCS is NULL.
+ * @remarks May be called on any thread.  Clients are identified within the
+ * server by their connection IDs; nothing reads /dev/urandom for a client
+ * unless this is called.
+ */
+const char* GetClientUUIDLabel(LPCLIENTSTRUCT lpCS);
+
 /**
  * @brief Determines whether the client referenced is in the connnected state.
  * @remarks Connected state is defined as (a) being connected over TCP and
@@ -99,4 +378,31 @@ void FreeClient(void* pClientStruct);
  */
 BOOL IsClientConnected(void* pvClientStruct);
 
+/**
+ * @brief Stops a client's connection from counting against the admission
+ * limits of its address, so that another connection may take its place.
+ * @param lpClient Reference to the CLIENTSTRUCT instance.
+ * @remarks Called when the connection is closed, even if the structure stays
+ * on the list of clients for a while after; and again, harmlessly, when the
+ * structure is freed.
+ */
+void ReleaseClientAdmission(LPCLIENTSTRUCT lpClient);
+
+/**
+ * @brief Releases a reference to a client structure that was obtained by a
+ * call to AddClientRef, freeing the structure if it was the last one.
+ * @param lpClient Reference to the CLIENTSTRUCT instance.
+ */
+void ReleaseClient(LPCLIENTSTRUCT lpClient);
+
+/**
+ * @brief Gives a client the UUID label that it had before, such as in the
+ * server process that handed it over in a hot restart.
+ * @param lpCS Reference to the CLIENTSTRUCT instance.
+ * @param pszUUIDLabel The UUID as a string, or an empty string if the client
+ * did not have one yet.
+ * @remarks Replaces any label that was made up for the client before.
+ */
+void SetClientUUIDLabel(LPCLIENTSTRUCT lpCS, const char* pszUUIDLabel);
+
 #endif /* __CLIENT_STRUCT_H__ */
@@ -9,11 +9,30 @@
 #define __CLIENT_THREAD_MANAGER_H__
 
 #include "client_struct.h"
+#include "message_buffer.h"
 
 /**
- * @brief Indicates whether a client thread should be terminated.
+ * @brief Ends a chat session that the server, rather than the client, has
+ * decided to end.
+ * @param lpSendingClient Reference to the CLIENTSTRUCT instance of the client.
+ * @param pszReason Line to send to the client to tell it why, or NULL to send
+ * nothing, such as when the client has stopped reading.
+ * @remarks Does what EndChatSession does, except that no goodbye is sent, and
+ * that it is not fatal if the reason cannot be sent.
  */
-extern BOOL g_bShouldTerminateClientThread;
+void AbortChatSession(LPCLIENTSTRUCT lpSendingClient, const char* pszReason);
+
+/**
+ * @brief Adds a line that a client sent to the chat message it is in the
+ * middle of sending.
+ * @param lpSendingClient Reference to the CLIENTSTRUCT instance of the client.
+ * @param pszLine Address of a buffer containing the line received from the
+ * client.
+ * @remarks The message is not broadcast until the client sends a dot on a
+ * line by itself; see FinishChatMessage.  Lines from a client that has not
+ * said HELO, or has not registered a nickname, are ignored.
+ */
+void AddChatMessageLine(LPCLIENTSTRUCT lpSendingClient, const char* pszLine);
 
 /**
  * @brief Returns a value indicating whether more clients are flagged as
@@ -25,9 +44,9 @@ BOOL AreTooManyClientsConnected();
 
 /**
  * @brief Takes the specified chat message and prepends the nickname of the
- * sending client to it
+ * sending client to each of its lines
  * @param pszChatMessage Address of the character array containing the chat
- * message.
+ * message, which may have more than one line.
  * @param lpSendingClient Reference to a CLIENTSTRUCT instance containing data
  * on the client who sent the chat message.
  * @remarks When a particular chatter in a chat room sends a message, the
@@ -45,6 +64,18 @@ void BroadcastChatMessage(const char* pszChatMessage,
  * leads to the client on the server's end. */
 void CleanupClientConnection(LPCLIENTSTRUCT lpSendingClient);
 
+/**
+ * @brief Writes out everything that is waiting in a client's mailbox.
+ * @param lpCurrentClient Reference to the CLIENTSTRUCT instance of the client.
+ * @returns Total number of bytes written, or -1 if a write failed, in which
+ * case what was still waiting is thrown away.
+ * @remarks Must be called on the client's own thread, which is the only one
+ * that writes to the client's socket.  A write that stalls, or a mailbox that
+ * overflowed, sets the nExpiredTimeout member of the client, for the thread to
+ * act on.
+ */
+int DeliverClientMailbox(LPCLIENTSTRUCT lpCurrentClient);
+
 /**
  * @brief Ends a chat session for the specified client, upon its request.
  * @returns TRUE if the session was ended successfully; FALSE otherwise.
@@ -55,6 +86,18 @@ void CleanupClientConnection(LPCLIENTSTRUCT lpSendingClient);
  */
 BOOL EndChatSession(LPCLIENTSTRUCT lpSendingClient);
 
+/**
+ * @brief Broadcasts the chat message a client has been sending, upon the dot
+ * that ends it.
+ * @param lpSendingClient Reference to the CLIENTSTRUCT instance of the client.
+ * @returns TRUE, since the dot is always handled.
+ * @remarks The lines of the message are broadcast together, as one message.
+ * If a line was too long, or the message did not fit into
+ * CHAT_MESSAGE_MAX_LENGTH bytes, the client is sent an error reply instead,
+ * and the message is thrown away.
+ */
+BOOL FinishChatMessage(LPCLIENTSTRUCT lpSendingClient);
+
 /**
  * @brief Determines the count of client entries in the linked list that are
  * flagged as currently connected.
@@ -83,15 +126,6 @@ LPCLIENTSTRUCT GetSendingClientInfo(void* pvClientThreadUserState);
  */
 BOOL HandleProtocolCommand(LPCLIENTSTRUCT lpSendingClient, char* pszBuffer);
 
-/**
- * @brief Callback that is called for each entry in the client list to kill
- * client threads that are no longer needed for communications.
- * @param pClientStruct Address of an instance of CLIENTSTRUCT containing
- * information about the thread that is being used to communicate with the
- * client at the current element in the list.
- */
-void KillClientThread(void* pClientStruct);
-
 /**
  * @brief Creates and launches a new thread of execution to handle
  * communications with a particular client.
@@ -110,6 +144,26 @@ void LaunchNewClientThread(LPCLIENTSTRUCT lpCS);
  */
 void LogClientID(LPCLIENTSTRUCT lpCS);
 
+/**
+ * @brief Processes the server's behavior upon receiving the HELO BINARY
+ * command.
+ * @param lpSendingClient Pointer to an instance of CLIENTSTRUCT that refers
+ * to the client who sent the command.
+ * @remarks Confirms the switch to binary frames with a line of text, and then
+ * does what ProcessHeloCommand does, replying with a frame.
+ */
+void ProcessHeloBinaryCommand(LPCLIENTSTRUCT lpSendingClient);
+
+/**
+ * @brief Processes the server's behavior upon receiving the HELO DEFLATE
+ * command.
+ * @param lpSendingClient Pointer to an instance of CLIENTSTRUCT that refers
+ * to the client who sent the command.
+ * @remarks Confirms the switch to compression with a line of text, and then
+ * does what ProcessHeloCommand does, compressing the reply.
+ */
+void ProcessHeloDeflateCommand(LPCLIENTSTRUCT lpSendingClient);
+
 /**
  * @brief Processes the server's behavior upon receiveing the HELO comamnd.
  * @param lpSendingClient Pointer to an instance of CLIENTSTRUCT that refers
@@ -123,12 +177,27 @@ void ProcessHeloCommand(LPCLIENTSTRUCT lpSendingClient);
  * @brief Processes the server's behavior upon receiveing the LIST comamnd.
  * @param lpSendingClient Pointer to an instance of CLIENTSTRUCT that refers
  * to the client who sent the command.
- * @remarks This function iterates over the list of clients, sending the
- * list of currently connected clients back to the client who sent the
- * command.
+ * @remarks The client is sent the nicknames of all the chatters on the
+ * roster, including its own, and the version of the roster.  The reply is
+ * built only when the roster has changed, and goes out in a single write.
  */
 void ProcessListCommand(LPCLIENTSTRUCT lpSendingClient);
 
+/**
+ * @brief Processes the server's behavior upon receiving the LIST SINCE
+ * command.
+ * @param lpSendingClient Pointer to an instance of CLIENTSTRUCT that refers
+ * to the client who sent the command.
+ * @param pszBuffer Address of a buffer containing the command, and the
+ * version of the roster that the client has.
+ * @returns TRUE, since the command is always handled.
+ * @remarks The client is sent just the joins and leaves since that version,
+ * if they are still known; otherwise it is sent the whole roster, as for
+ * LIST.
+ */
+BOOL ProcessListSinceCommand(LPCLIENTSTRUCT lpSendingClient,
+		char* pszBuffer);
+
 /**
  * @brief Performs a synchronous recieve operation from the client, looking for
  * data until a newline has been receieved.
@@ -149,15 +218,59 @@ int ReceiveFromClient(LPCLIENTSTRUCT lpSendingClient, char** ppszReplyBuffer);
  */
 void ReportClientSessionStats(LPCLIENTSTRUCT lpSendingClient);
 
+/**
+ * @brief Sends several messages to the client designated, with a single
+ * system call where possible.
+ * @param lpCurrentClient Pointer to a CLIENTSTRUCT that contains data about
+ * the client that the messages should be sent to.
+ * @param lpBuffers Address of an array of references to the messages.
+ * @param nCount Count of entries in the lpBuffers array.
+ * @returns Total number of bytes sent, or -1 if an error occurred.
+ * @remarks The messages are posted to the client's mailbox without being
+ * copied, and are later gathered straight out of their buffers by the kernel,
+ * with a single system call where possible.  On the client's own thread, they
+ * are written out before this function returns.
+ */
+int SendBuffersToClient(LPCLIENTSTRUCT lpCurrentClient,
+		LPMESSAGEBUFFER* lpBuffers, int nCount);
+
+/**
+ * @brief Sends the dot on a line by itself that ends a multiline response.
+ * @param lpSendingClient Pointer to a CLIENTSTRUCT that contains data about
+ * the client that the response is being sent to.
+ */
+void SendMultilineDataTerminator(LPCLIENTSTRUCT lpSendingClient);
+
 /**
  * @brief Sends the data in pszMessage to the client designated.
  * @param lpCurrentClient Pointer to a CLIENTSTRUCT that contains data about
  * the client that the message should be sent to.
  * @param pszMessage Address of the buffer containing the message to be sent.
  * @returns Total number of bytes sent, or -1 if an error occurred.
+ * @remarks May be called on any thread; it never waits for the client.  The
+ * message is posted to the client's mailbox, and is written out by the
+ * client's own thread, straight away if that is the calling thread.
  */
 int SendToClient(LPCLIENTSTRUCT lpCurrentClient, const char* pszMessage);
 
+/**
+ * @brief Determines whether the thread of a client should stop, either
+ * because the server is shutting down or because the client's connection
+ * has been cleaned up.
+ * @param lpSendingClient Reference to the CLIENTSTRUCT instance of the client.
+ * @returns TRUE if the thread should leave its loop; FALSE otherwise.
+ */
+BOOL ShouldClientThreadStop(LPCLIENTSTRUCT lpSendingClient);
+
+/**
+ * @brief Sets the stop token of a client's thread, and wakes the thread up
+ * so that it sees it without waiting for the client to send anything.
+ * @param lpSendingClient Reference to the CLIENTSTRUCT instance of the client.
+ * @remarks May be called on any thread.  The thread stops by itself, the next
+ * time round its loop.
+ */
+void StopClientThread(LPCLIENTSTRUCT lpSendingClient);
+
 /**
  * @brief Executes logic from when a newly-connected client makes the count
  * of connected clients exceed the maximum allowed.
@@ -165,12 +278,4 @@ int SendToClient(LPCLIENTSTRUCT lpCurrentClient, const char* pszMessage);
  * information about the newly-connected client. */
 void TellClientTooManyPeopleChatting(LPCLIENTSTRUCT lpSendingClient);
 
-/**
- * @brief Semaphore that gets signaled to indicate that this client thread
- * should terminate in an orderly fashion.
- * @param signum Signal code corresponding to the signal that triggered this
- * semaphore.
- */
-void TerminateClientThread(int signum);
-
 #endif /* __CLIENT_THREAD_MANAGER_H__ */
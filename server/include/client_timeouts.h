@@ -0,0 +1,74 @@
+// client_timeouts.h - Defines the interface for the deadlines that each
+// client connection is held to: saying HELO soon enough after connecting,
+// not going quiet for too long, and not leaving the server's writes to it
+// stuck.  The timers are kept on a timing wheel that belongs to the client's
+// own thread, which is the thread that acts on them when they expire.
+//
+
+#ifndef __CLIENT_TIMEOUTS_H__
+#define __CLIENT_TIMEOUTS_H__
+
+#include "client_struct.h"
+#include "timer_wheel.h"
+
+/**
+ * @brief Disconnects a client whose timeout has expired, telling it why if it
+ * can still be told.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the client.
+ * @remarks Called by the client's thread when it finds the nExpiredTimeout
+ * member of the client set.  The expiry is counted and logged.
+ */
+void HandleClientTimeout(LPCLIENTSTRUCT lpClient);
+
+/**
+ * @brief Restarts the idle timeout of a client that has just sent something,
+ * and stops its handshake timeout once it has said HELO.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the client.
+ * @remarks Arming and cancelling timers takes constant time, so this is cheap
+ * enough to do for every line received.
+ */
+void NoteClientInput(LPCLIENTSTRUCT lpClient);
+
+/**
+ * @brief Disconnects a client that has fallen so far behind that its mailbox
+ * overflowed, as if a write to it had stalled.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the client.
+ * @remarks Must be called on the client's own thread.
+ */
+void NoteClientFellBehind(LPCLIENTSTRUCT lpClient);
+
+/**
+ * @brief Looks at why a write to a client failed, and has the client
+ * disconnected for it: for a write stall, if the write made no progress for
+ * the write-stall timeout; otherwise, the next time its thread reads.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the client.
+ * @remarks Must be called on the client's own thread, right after the write,
+ * while errno still says why it failed.
+ */
+void NoteClientWriteFailed(LPCLIENTSTRUCT lpClient);
+
+/**
+ * @brief Reports how many clients each of the timeouts disconnected, to the
+ * server log and console.
+ */
+void ReportTimeoutStats();
+
+/**
+ * @brief Arms the timeouts of a client whose thread is starting.
+ * @param lpWheel Reference to the timing wheel of the client's thread.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the client.
+ * @remarks Clients that have not said HELO get the handshake timeout; those
+ * that have (because they were handed over by a hot restart) get the idle
+ * timeout.  The wheel must outlive the timeouts.  The write-stall timeout is
+ * not a timer; it is set on the client's socket, since only the client's own
+ * thread writes to it.
+ */
+void StartClientTimeouts(LPTIMERWHEEL lpWheel, LPCLIENTSTRUCT lpClient);
+
+/**
+ * @brief Disarms all of the timeouts of a client whose thread is ending.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the client.
+ */
+void StopClientTimeouts(LPCLIENTSTRUCT lpClient);
+
+#endif /* __CLIENT_TIMEOUTS_H__ */
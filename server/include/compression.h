@@ -0,0 +1,295 @@
+// compression.h - Defines the interface for compressing what the server sends
+// to clients that said HELO DEFLATE.  Everything such a client is sent is one
+// raw deflate stream, flushed at the end of each batch of messages so that
+// the client can show them straight away.
+//
+// Each room has a compression group.  A room message that goes to several
+// compressed members is compressed once, by the group, and the same bytes
+// are posted to the mailbox of every member that is in step with the group.  A member
+// falls out of step when it is sent anything else (a reply, a direct
+// message, and so on), since that is compressed by its own stream; it gets
+// back in step the next time the group starts over with an empty history.
+//
+
+#ifndef __COMPRESSION_H__
+#define __COMPRESSION_H__
+
+#include "stdafx.h"
+#include "server_symbols.h"
+
+#include "message_buffer.h"
+
+struct _tagCLIENTSTRUCT;
+
+/**
+ * @brief Structure that collects the output of a deflate stream, so that it
+ * can be posted to a client's mailbox as one message.  The storage is kept
+ * from one use to the next.
+ */
+typedef struct _tagDEFLATEOUTPUT {
+	/**
+	 * @name pData
+	 * @brief Address of the storage that holds the compressed bytes.
+	 */
+	unsigned char* pData;
+
+	/**
+	 * @name nLength
+	 * @brief Count of bytes in pData that are in use.
+	 */
+	size_t nLength;
+
+	/**
+	 * @name nCapacity
+	 * @brief Count of bytes that pData can hold.
+	 */
+	size_t nCapacity;
+} DEFLATEOUTPUT, *LPDEFLATEOUTPUT;
+
+/**
+ * @brief Structure that holds the state of a compression group.  Guarded by
+ * the member mutex of the room that owns it.
+ */
+typedef struct _tagDEFLATEGROUP {
+	/**
+	 * @name stream
+	 * @brief The deflate stream that room messages are compressed with.
+	 */
+	z_stream stream;
+
+	/**
+	 * @name bInitialized
+	 * @brief Flag that is set once the stream has been set up, which is only
+	 * done when the room first has a compressed member to send to.
+	 */
+	BOOL bInitialized;
+
+	/**
+	 * @name bAtBoundary
+	 * @brief Flag that is set when nothing the stream compresses next can
+	 * refer back to what it compressed before, so that any compressed member
+	 * can start taking its output.
+	 */
+	BOOL bAtBoundary;
+
+	/**
+	 * @name nBatchesSinceReset
+	 * @brief Count of messages compressed since the history of the stream
+	 * was last emptied.
+	 */
+	int nBatchesSinceReset;
+
+	/**
+	 * @name bBatchCompressed
+	 * @brief Flag that is set once the message that is being delivered has
+	 * been compressed.  Messages that no compressed member is sent are never
+	 * compressed.
+	 */
+	BOOL bBatchCompressed;
+
+	/**
+	 * @name bBatchFromBoundary
+	 * @brief Whether the message that is being delivered was compressed
+	 * right after a boundary.
+	 */
+	BOOL bBatchFromBoundary;
+
+	/**
+	 * @name nBatchPrivateCount
+	 * @brief Count of compressed members who were not in step with the
+	 * group, and so were sent their own copies of the message that is being
+	 * delivered.
+	 */
+	int nBatchPrivateCount;
+
+	/**
+	 * @name nLastPrivateCount
+	 * @brief Value of nBatchPrivateCount for the previous message.
+	 */
+	int nLastPrivateCount;
+
+	/**
+	 * @name output
+	 * @brief Storage that the compressed message is collected in.
+	 */
+	DEFLATEOUTPUT output;
+
+	/**
+	 * @name lpBatchOutput
+	 * @brief Reference to the compressed message, which is posted to the
+	 * mailbox of every member that is in step; NULL until it is made.
+	 */
+	LPMESSAGEBUFFER lpBatchOutput;
+} DEFLATEGROUP, *LPDEFLATEGROUP;
+
+/**
+ * @brief Structure that holds the state of the compression of what is sent
+ * to one client.
+ */
+typedef struct _tagDEFLATESTREAM {
+	/**
+	 * @name stream
+	 * @brief The deflate stream that is used for whatever the client is sent
+	 * while it is not in step with a compression group.
+	 */
+	z_stream stream;
+
+	/**
+	 * @name hMutex
+	 * @brief Handle to the mutex that is held while anything is compressed
+	 * for the client.  The output is posted to the client's mailbox before
+	 * the mutex is let go, so that the client gets it in the order in which
+	 * it was made, and the stream stays whole.
+	 */
+	HMUTEX hMutex;
+
+	/**
+	 * @name output
+	 * @brief Storage that what the stream compresses is collected in.
+	 */
+	DEFLATEOUTPUT output;
+
+	/**
+	 * @name lpGroup
+	 * @brief Reference to the compression group that the client is in step
+	 * with, or NULL if it is not.  Only ever compared, never followed, by
+	 * code that does not hold the member mutex of the group's room.
+	 */
+	LPDEFLATEGROUP lpGroup;
+
+	/**
+	 * @name bStale
+	 * @brief Flag that is set when the client has been sent output that did
+	 * not come from the stream, so the stream must be reset before it is
+	 * used again.
+	 */
+	BOOL bStale;
+
+	/**
+	 * @name nBytesIn
+	 * @brief Count of bytes of data the client has been sent, before
+	 * compression.
+	 */
+	long nBytesIn;
+
+	/**
+	 * @name nBytesOut
+	 * @brief Count of bytes the data came to after compression.
+	 */
+	long nBytesOut;
+
+	/**
+	 * @name nCpuNanoseconds
+	 * @brief CPU time spent compressing for this client alone.
+	 */
+	uint64_t nCpuNanoseconds;
+} DEFLATESTREAM, *LPDEFLATESTREAM;
+
+/**
+ * @brief Gets ready to deliver a message to the members of a room.
+ * @param lpGroup Reference to the room's compression group.
+ * @remarks The caller must hold the member mutex of the room until it has
+ * called EndDeflateGroupBatch.
+ */
+void BeginDeflateGroupBatch(LPDEFLATEGROUP lpGroup);
+
+/**
+ * @brief Compresses a chunk of the lines of a room's log and sends it to a
+ * client, for the HISTORY command.
+ * @param pvClient Address of the CLIENTSTRUCT instance of the client.
+ * @param pchData Address of the chunk.
+ * @param nLength Length, in bytes, of the chunk.
+ * @returns Count of compressed bytes sent, or -1 if an error occurred.
+ * @remarks Called on the client's own thread, which writes each chunk out
+ * before the next one is read from the log.
+ * @remarks Has the signature of an LPLOG_DATA_ROUTINE, so that it can be
+ * passed to CopyMessageLogTail.
+ */
+long CompressLogDataToClient(void* pvClient, const char* pchData,
+		size_t nLength);
+
+/**
+ * @brief Creates a compression group, for a new room.
+ * @returns Reference to the new DEFLATEGROUP instance.
+ * @remarks The deflate stream is not set up until it is needed.
+ */
+LPDEFLATEGROUP CreateDeflateGroup();
+
+/**
+ * @brief Creates the compression state for a client that said HELO DEFLATE.
+ * @returns Reference to the new DEFLATESTREAM instance.
+ */
+LPDEFLATESTREAM CreateDeflateStream();
+
+/**
+ * @brief Finishes delivering a message to the members of a room.
+ * @param lpGroup Reference to the room's compression group.
+ */
+void EndDeflateGroupBatch(LPDEFLATEGROUP lpGroup);
+
+/**
+ * @brief Releases the memory of a compression group back to the system.
+ * @param lpGroup Reference to the DEFLATEGROUP instance.
+ */
+void FreeDeflateGroup(LPDEFLATEGROUP lpGroup);
+
+/**
+ * @brief Releases the compression state of a client back to the system.
+ * @param lpStream Reference to the DEFLATESTREAM instance.
+ */
+void FreeDeflateStream(LPDEFLATESTREAM lpStream);
+
+/**
+ * @brief Takes a client out of step with its room's compression group, when
+ * it leaves the room.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the client.
+ * @remarks The caller must hold the member mutex of the room.  Does nothing
+ * for clients that are not compressed.
+ */
+void LeaveDeflateGroup(struct _tagCLIENTSTRUCT* lpClient);
+
+/**
+ * @brief Reports the totals of what was compressed for all the compressed
+ * clients, and what it cost, to the server log and console.
+ */
+void ReportCompressionStats();
+
+/**
+ * @brief Reports what was compressed for one client, and what it cost, to
+ * the server log and console.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the client.
+ * @param pszClientID String form of the client's ID.
+ * @remarks Does nothing for clients that are not compressed.
+ */
+void ReportDeflateStreamStats(struct _tagCLIENTSTRUCT* lpClient,
+		const char* pszClientID);
+
+/**
+ * @brief Compresses data with a client's own stream, flushing the stream at
+ * the end, and posts the output to the client's mailbox.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the client.
+ * @param pIov Address of an array of the pieces of the data.
+ * @param nIovCount Count of entries in the pIov array.
+ * @returns Count of compressed bytes posted, or -1 if an error occurred.
+ * @remarks The pieces of a batch, such as the history of a room, should be
+ * passed in one call, so that the stream is flushed once for all of them.
+ */
+int SendCompressedToClient(struct _tagCLIENTSTRUCT* lpClient,
+		const struct iovec* pIov, int nIovCount);
+
+/**
+ * @brief Sends a room message to a compressed member of the room.
+ * @param lpGroup Reference to the room's compression group.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the member.
+ * @param pszMessage Address of the message.
+ * @returns Count of compressed bytes posted, or -1 if an error occurred.
+ * @remarks If the member is in step with the group, or can be brought into
+ * step with it, its mailbox is sent the group's compressed copy of the
+ * message, which is made the first time it is needed.  Otherwise the message is compressed
+ * for the member alone.  Must be called between BeginDeflateGroupBatch and
+ * EndDeflateGroupBatch.
+ */
+int SendGroupMessageToClient(LPDEFLATEGROUP lpGroup,
+		struct _tagCLIENTSTRUCT* lpClient, const char* pszMessage);
+
+#endif /* __COMPRESSION_H__ */
@@ -0,0 +1,36 @@
+// dm_manager.h - Defines the interface for a set of functions that deliver
+// direct messages (DMs) from one chatter to another.
+//
+
+#ifndef __DM_MANAGER_H__
+#define __DM_MANAGER_H__
+
+#include "client_struct.h"
+
+/**
+ * @brief Processes the server's behavior upon receiving the DM command.
+ * @param lpSendingClient Pointer to an instance of CLIENTSTRUCT that refers
+ * to the client who sent the command.
+ * @param pszBuffer Address of a buffer containing data received from the
+ * client.
+ * @returns TRUE, since the command is always handled.
+ * @remarks If the recipient is connected, the lines the client sends after
+ * this command, up to a line containing only a dot, are delivered to the
+ * recipient alone.
+ */
+BOOL ProcessDmCommand(LPCLIENTSTRUCT lpSendingClient, char* pszBuffer);
+
+/**
+ * @brief Delivers a line of a direct message to its recipient, or ends the
+ * direct message if the line is the message terminator.
+ * @param lpSendingClient Pointer to an instance of CLIENTSTRUCT that refers
+ * to the client who is sending the direct message.
+ * @param pszBuffer Address of a buffer containing the line received from the
+ * client.
+ * @returns TRUE, since the line is always handled.
+ * @remarks The recipient is looked up by nickname in constant time, and is
+ * sent the line directly; no lock on the list of clients is taken.
+ */
+BOOL ProcessDirectMessageLine(LPCLIENTSTRUCT lpSendingClient, char* pszBuffer);
+
+#endif /* __DM_MANAGER_H__ */
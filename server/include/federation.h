@@ -0,0 +1,284 @@
+// federation.h - Defines the interface to the links between chattr servers,
+// over which the chat messages, joins and leaves of each server are relayed
+// to the others, so that chatters connected to different servers can see one
+// another in the same rooms.
+//
+
+#ifndef __FEDERATION_H__
+#define __FEDERATION_H__
+
+#include "stdafx.h"
+#include "server_symbols.h"
+
+/**
+ * @brief Structure that contains an event that has been published by, or
+ * received from, a server in the cluster.
+ * @remarks The strings are not null-terminated; when an event is decoded
+ * from a frame, they point into the frame.
+ */
+typedef struct _tagPEEREVENT {
+	/**
+	 * @name nType
+	 * @brief One of the PEER_EVENT_* values.
+	 */
+	int nType;
+
+	/**
+	 * @name nHops
+	 * @brief Count of times the event has been relayed so far.
+	 */
+	int nHops;
+
+	/**
+	 * @name nOriginNodeId
+	 * @brief Node ID of the server the event happened on.
+	 */
+	uint32_t nOriginNodeId;
+
+	/**
+	 * @name nOriginIncarnation
+	 * @brief Incarnation of the origin server's process, which is the time,
+	 * in microseconds since the epoch, that the process started federating.
+	 */
+	uint64_t nOriginIncarnation;
+
+	/**
+	 * @name nSequence
+	 * @brief Number that the origin server gave the event.  Each server
+	 * numbers its events in increasing order, starting again from zero in
+	 * each incarnation.
+	 */
+	uint64_t nSequence;
+
+	/**
+	 * @name pchRoomName
+	 * @brief Address of the name of the room the event happened in.
+	 */
+	const char* pchRoomName;
+
+	/**
+	 * @name nRoomNameLength
+	 * @brief Length, in chars, of the room name.
+	 */
+	int nRoomNameLength;
+
+	/**
+	 * @name pchNickname
+	 * @brief Address of the nickname of the chatter the event is about.
+	 */
+	const char* pchNickname;
+
+	/**
+	 * @name nNicknameLength
+	 * @brief Length, in chars, of the nickname.
+	 */
+	int nNicknameLength;
+
+	/**
+	 * @name pchText
+	 * @brief Address of the text of the event.
+	 */
+	const char* pchText;
+
+	/**
+	 * @name nTextLength
+	 * @brief Length, in chars, of the text.
+	 */
+	int nTextLength;
+} PEEREVENT, *LPPEEREVENT;
+
+/**
+ * @brief Entry of the table that remembers which events have been seen from
+ * each node, so that an event that reaches this server by more than one path
+ * is only delivered once.
+ */
+typedef struct _tagPEERORIGIN {
+	/**
+	 * @name nNodeId
+	 * @brief ID of the node the events came from.
+	 */
+	uint32_t nNodeId;
+
+	/**
+	 * @name nIncarnation
+	 * @brief Latest incarnation of the node that events have been seen from.
+	 * The window of sequence numbers below belongs to it alone.
+	 */
+	uint64_t nIncarnation;
+
+	/**
+	 * @name nHighestSequence
+	 * @brief Highest sequence number seen from the node.
+	 */
+	uint64_t nHighestSequence;
+
+	/**
+	 * @name nSeenMask
+	 * @brief Bit n is set if the event numbered nHighestSequence - n has been
+	 * seen.  Events that are more than 63 behind the highest are dropped.
+	 */
+	uint64_t nSeenMask;
+} PEERORIGIN, *LPPEERORIGIN;
+
+/**
+ * @brief Structure that contains information about a link to a peer server.
+ * @remarks Events to be relayed over the link are encoded into pBuffer as
+ * they are published.  The federation flusher thread swaps the buffer out
+ * every FEDERATION_FLUSH_INTERVAL_MS and sends its contents as one frame, so
+ * a burst of events costs one write per link rather than one per event.
+ */
+typedef struct _tagPEERLINK {
+	/**
+	 * @name nSocket
+	 * @brief File descriptor of the socket that is connected to the peer.
+	 */
+	int nSocket;
+
+	/**
+	 * @name nRemoteNodeId
+	 * @brief Node ID of the peer, or zero until its HELLO event arrives.
+	 */
+	uint32_t nRemoteNodeId;
+
+	/**
+	 * @name szAddress
+	 * @brief Address of the peer, as <host>:<port>, for display purposes.
+	 */
+	char szAddress[NI_MAXHOST + 8];
+
+	/**
+	 * @name pBuffer
+	 * @brief Address of the storage for the encoded events that are waiting
+	 * to be sent to the peer.
+	 */
+	char* pBuffer;
+
+	/**
+	 * @name nBufferLength
+	 * @brief Count of bytes in pBuffer that are in use.
+	 */
+	size_t nBufferLength;
+
+	/**
+	 * @name nBufferCapacity
+	 * @brief Count of bytes that pBuffer can hold.
+	 */
+	size_t nBufferCapacity;
+
+	/**
+	 * @name nEventCount
+	 * @brief Count of events encoded in pBuffer.
+	 */
+	int nEventCount;
+
+	/**
+	 * @name pSpareBuffer
+	 * @brief Address of the storage that is swapped with pBuffer when the
+	 * events are sent.  Only the federation flusher thread touches it.
+	 */
+	char* pSpareBuffer;
+
+	/**
+	 * @name nSpareCapacity
+	 * @brief Count of bytes that pSpareBuffer can hold.
+	 */
+	size_t nSpareCapacity;
+
+	/**
+	 * @name bClosed
+	 * @brief Flag that is set once the link has failed and is to be removed.
+	 */
+	BOOL bClosed;
+
+	/**
+	 * @name hMutex
+	 * @brief Handle to the mutex that guards the buffer and flags of this
+	 * structure.
+	 */
+	HMUTEX hMutex;
+
+	/**
+	 * @name nRefCount
+	 * @brief Count of threads that are using this structure.  It is freed
+	 * when the count drops to zero.
+	 */
+	atomic_int nRefCount;
+} PEERLINK, *LPPEERLINK;
+
+/**
+ * @brief Reads the federation options from the command line.
+ * @param argc Count of command-line arguments.
+ * @param argv The command-line arguments.
+ * @returns TRUE if the options are valid (or there are none); FALSE if any
+ * of them is not.
+ * @remarks The options are FEDERATION_NODE_OPTION <id>,
+ * FEDERATION_PEER_PORT_OPTION <port> and, any number of times,
+ * FEDERATION_PEER_OPTION <host>:<port>.  Federation is only started if the
+ * peer port, or at least one peer, is specified.
+ */
+BOOL ConfigureFederation(int argc, char* argv[]);
+
+/**
+ * @brief Gets the node IDs of the peer servers this server is linked to.
+ * @param pnNodeIds Address of an array to fill in.
+ * @param nMaxCount Count of elements in the array.
+ * @returns Count of node IDs filled in.  Each node is listed once, however
+ * many links there are to it, and only once it has said who it is.
+ */
+int GetLinkedNodeIds(uint32_t* pnNodeIds, int nMaxCount);
+
+/**
+ * @brief Gets the ID of this server's node.
+ * @returns The node ID, which is unique within the cluster.
+ */
+uint32_t GetLocalNodeId();
+
+/**
+ * @brief Determines whether this server is part of a cluster.
+ * @returns TRUE if federation has been started; FALSE otherwise.
+ */
+BOOL IsFederationRunning();
+
+/**
+ * @brief Queues an event to be relayed to all the peer servers.
+ * @param nType One of the PEER_EVENT_* values.
+ * @param pszRoomName Name of the room the event happened in.  An empty
+ * string, or NULL, for joins and leaves of the chat as a whole.
+ * @param pszNickname Nickname of the chatter the event is about, or NULL.
+ * @param pszText For PEER_EVENT_CHAT, the message exactly as it was sent to
+ * the room; otherwise NULL.
+ * @remarks Does nothing if federation is not running.  Never blocks on the
+ * network; the event is sent by the federation flusher thread.
+ */
+void PublishRoomEvent(int nType, const char* pszRoomName,
+		const char* pszNickname, const char* pszText);
+
+/**
+ * @brief Queues an event to be sent to one peer server, which does not relay
+ * it any further.
+ * @param nNodeId Node ID of the peer server, which must be linked to this
+ * one directly.
+ * @param nType One of the PEER_EVENT_NICKNAME_* values.
+ * @param nRequestId Number that ties a reply to its request; travels in the
+ * sequence number of the event.
+ * @param pszNickname Nickname the event is about, or NULL.
+ * @param pszText Text of the event, or NULL.
+ * @returns TRUE if the event was queued; FALSE if there is no link to the
+ * node.
+ */
+BOOL SendToPeerNode(uint32_t nNodeId, int nType, uint64_t nRequestId,
+		const char* pszNickname, const char* pszText);
+
+/**
+ * @brief Starts accepting links from, and making links to, the peer servers
+ * named on the command line.
+ * @remarks Does nothing if no federation options were given.
+ */
+void StartFederation();
+
+/**
+ * @brief Closes all the peer links and stops the federation threads.
+ */
+void StopFederation();
+
+#endif /* __FEDERATION_H__ */
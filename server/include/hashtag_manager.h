@@ -0,0 +1,112 @@
+// hashtag_manager.h - Defines the interface for a set of functions that keep
+// track of which chatters follow which hashtags, and that deliver tagged chat
+// messages to their followers.
+//
+
+#ifndef __HASHTAG_MANAGER_H__
+#define __HASHTAG_MANAGER_H__
+
+#include "client_struct.h"
+#include "message_scanner.h"
+
+/**
+ * @brief Entry of the hashtag index, which records the set of clients that
+ * follow a particular hashtag.
+ */
+typedef struct _tagHASHTAGENTRY {
+	/**
+	 * @name szHashtag
+	 * @brief The hashtag, in the form produced by NormalizeHashtag.
+	 */
+	char szHashtag[MAX_HASHTAG_LEN + 1];
+
+	/**
+	 * @name ppFollowers
+	 * @brief Compact array of references to the clients following the
+	 * hashtag.  Only the first nFollowerCount entries are valid.
+	 */
+	struct _tagCLIENTSTRUCT** ppFollowers;
+
+	/**
+	 * @name nFollowerCount
+	 * @brief Count of valid entries in the ppFollowers array.
+	 */
+	int nFollowerCount;
+
+	/**
+	 * @name nFollowerCapacity
+	 * @brief Count of entries for which storage in ppFollowers is allocated.
+	 */
+	int nFollowerCapacity;
+
+	/**
+	 * @name pNext
+	 * @brief Next entry in the same bucket of the index.
+	 */
+	struct _tagHASHTAGENTRY* pNext;
+} HASHTAGENTRY, *LPHASHTAGENTRY;
+
+/**
+ * @brief Sets up the (empty) hashtag index and the mutex that guards it.
+ * @remarks Must be called exactly once, when the application starts.
+ */
+void CreateHashtagIndex();
+
+/**
+ * @brief Sends a chat message to the followers of the hashtags it contains
+ * who are not in the sender's room.
+ * @param lpTokens Address of a MESSAGETOKENS instance filled in by the
+ * ScanMessageTokens function from the text of the chat message.
+ * @param pszMessage Address of the buffer containing the message to be sent.
+ * @param lpSendingClient Reference to the CLIENTSTRUCT instance of the sender.
+ * @returns Total number of bytes sent.
+ * @remarks Each follower receives the message at most once, no matter how
+ * many of the hashtags it follows.  Only the followers of the hashtags in the
+ * message are visited, never the whole list of clients.
+ */
+int DeliverToHashtagFollowers(LPMESSAGETOKENS lpTokens,
+		const char* pszMessage, LPCLIENTSTRUCT lpSendingClient);
+
+/**
+ * @brief Releases the memory occupied by the hashtag index and its mutex.
+ */
+void DestroyHashtagIndex();
+
+/**
+ * @brief Adds a client to the followers of a hashtag without replying to it.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the client.
+ * @param pszHashtag The hashtag, with or without its leading '#'.
+ * @returns TRUE if the client now follows the hashtag; FALSE otherwise.
+ * @remarks Used to restore the hashtags a client followed when it is handed
+ * over from another server process.
+ */
+BOOL FollowHashtag(LPCLIENTSTRUCT lpClient, const char* pszHashtag);
+
+/**
+ * @brief Processes the server's behavior upon receiving the FOLLOW command.
+ * @param lpSendingClient Pointer to an instance of CLIENTSTRUCT that refers
+ * to the client who sent the command.
+ * @param pszBuffer Address of a buffer containing data received from the
+ * client.
+ * @returns TRUE, since the command is always handled.
+ */
+BOOL ProcessFollowCommand(LPCLIENTSTRUCT lpSendingClient, char* pszBuffer);
+
+/**
+ * @brief Processes the server's behavior upon receiving the UNFOLLOW command.
+ * @param lpSendingClient Pointer to an instance of CLIENTSTRUCT that refers
+ * to the client who sent the command.
+ * @param pszBuffer Address of a buffer containing data received from the
+ * client.
+ * @returns TRUE, since the command is always handled.
+ */
+BOOL ProcessUnfollowCommand(LPCLIENTSTRUCT lpSendingClient, char* pszBuffer);
+
+/**
+ * @brief Removes a client from the followers of every hashtag it follows.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the client.
+ * @remarks Called when a client's chat session ends.
+ */
+void UnfollowAllHashtags(LPCLIENTSTRUCT lpClient);
+
+#endif /* __HASHTAG_MANAGER_H__ */
@@ -0,0 +1,126 @@
+// heartbeat.h - Defines the interface for the PING/PONG heartbeat.  Every so
+// often the thread of each client sends it a PING, and the client has to
+// answer with a PONG before the heartbeat timeout, or be disconnected.  This
+// finds the clients whose connections have died without being closed, which
+// would otherwise only be noticed when a write to them failed.  The time each
+// PING takes to be answered is kept, per client, as a smoothed average and a
+// histogram.
+//
+
+#ifndef __HEARTBEAT_H__
+#define __HEARTBEAT_H__
+
+#include "stdafx.h"
+#include "server_symbols.h"
+
+struct _tagCLIENTSTRUCT;
+
+/**
+ * @brief Structure that holds the round-trip times measured for a client.
+ * Only ever touched by the thread of the client that owns it, so it needs no
+ * lock.
+ */
+typedef struct _tagRTTSTATS {
+	/**
+	 * @name dSmoothedMs
+	 * @brief Exponentially-weighted moving average of the round-trip times,
+	 * in milliseconds.
+	 */
+	double dSmoothedMs;
+
+	/**
+	 * @name dMinimumMs
+	 * @brief Shortest round-trip time, in milliseconds.
+	 */
+	double dMinimumMs;
+
+	/**
+	 * @name dMaximumMs
+	 * @brief Longest round-trip time, in milliseconds.
+	 */
+	double dMaximumMs;
+
+	/**
+	 * @name nSampleCount
+	 * @brief Count of the PINGs that were answered.
+	 */
+	unsigned long long nSampleCount;
+
+	/**
+	 * @name anBuckets
+	 * @brief Histogram of the round-trip times; see
+	 * HEARTBEAT_RTT_BUCKET_COUNT for what each bucket counts.
+	 */
+	unsigned long long anBuckets[HEARTBEAT_RTT_BUCKET_COUNT];
+} RTTSTATS, *LPRTTSTATS;
+
+/**
+ * @brief Reads the heartbeat options from the command line.
+ * @param argc Count of command-line arguments.
+ * @param argv Array of the command-line arguments.
+ * @returns TRUE if the options, if any, are valid; FALSE otherwise.
+ * @remarks Options that are not about the heartbeat are skipped; the other
+ * parsers check them.
+ */
+BOOL ConfigureHeartbeat(int argc, char* argv[]);
+
+/**
+ * @brief Determines whether a line received from a client is an answer to a
+ * PING.
+ * @param pszBuffer The line.
+ * @returns TRUE if it is; FALSE otherwise.
+ */
+BOOL IsHeartbeatReply(const char* pszBuffer);
+
+/**
+ * @brief Determines whether a command-line option is one of the heartbeat
+ * options, each of which takes a value.
+ * @param pszOption The option, such as "-pinginterval".
+ * @returns TRUE if it is; FALSE otherwise.
+ */
+BOOL IsHeartbeatOption(const char* pszOption);
+
+/**
+ * @brief Handles the PONG command, by which a client answers a PING.
+ * @param lpSendingClient Reference to the CLIENTSTRUCT instance of the client.
+ * @param pszBuffer The command line, such as "PONG 12".
+ * @returns TRUE, since the command is always handled, even if it answers a
+ * PING other than the last one (in which case it is ignored).
+ * @remarks Must be called on the client's own thread.  The answer does not
+ * count as input for the idle timeout.
+ */
+BOOL ProcessPongCommand(struct _tagCLIENTSTRUCT* lpSendingClient,
+		const char* pszBuffer);
+
+/**
+ * @brief Reports how many PINGs were sent and answered, and the histogram of
+ * the round-trip times of all the clients, to the server log and console.
+ */
+void ReportHeartbeatStats();
+
+/**
+ * @brief Reports the round-trip times of a client, to the server log and
+ * console.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the client.
+ * @param pszClientID String form of the client's ID.
+ * @remarks Does nothing for clients that never answered a PING.
+ */
+void ReportRttStats(struct _tagCLIENTSTRUCT* lpClient,
+		const char* pszClientID);
+
+/**
+ * @brief Starts sending a client PINGs, once it has said HELO.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the client.
+ * @remarks Must be called on the client's own thread, after its timeouts have
+ * been started, since the heartbeat timer goes on the same timing wheel.
+ * Does nothing if the heartbeat is turned off.
+ */
+void StartClientHeartbeat(struct _tagCLIENTSTRUCT* lpClient);
+
+/**
+ * @brief Stops sending a client PINGs.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the client.
+ */
+void StopClientHeartbeat(struct _tagCLIENTSTRUCT* lpClient);
+
+#endif /* __HEARTBEAT_H__ */
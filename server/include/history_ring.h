@@ -0,0 +1,79 @@
+// history_ring.h - Defines the HISTORYRING structure, which keeps the most
+// recent chat messages of a room, and the functions that manipulate it.
+//
+
+#ifndef __HISTORY_RING_H__
+#define __HISTORY_RING_H__
+
+#include "stdafx.h"
+#include "server_symbols.h"
+#include "message_buffer.h"
+
+/**
+ * @brief Fixed-capacity ring of the most recent chat messages broadcast in a
+ * room.  When the ring is full, each new message takes the place of the
+ * oldest one.
+ */
+typedef struct _tagHISTORYRING {
+	/**
+	 * @name lpEntries
+	 * @brief References to the messages in the ring.  The ring holds one
+	 * reference to each of them.
+	 */
+	LPMESSAGEBUFFER lpEntries[HISTORY_RING_CAPACITY];
+
+	/**
+	 * @name nNext
+	 * @brief Index of the entry that the next message is stored in.
+	 */
+	int nNext;
+
+	/**
+	 * @name nCount
+	 * @brief Count of messages in the ring.
+	 */
+	int nCount;
+
+	/**
+	 * @name hMutex
+	 * @brief Handle to the mutex that guards the ring.
+	 */
+	HMUTEX hMutex;
+} HISTORYRING, *LPHISTORYRING;
+
+/**
+ * @brief Adds a message to the ring, dropping the oldest message if the ring
+ * is full.
+ * @param lpRing Reference to the HISTORYRING instance.
+ * @param lpBuffer Reference to the message.  The ring adds its own reference.
+ */
+void AddToHistoryRing(LPHISTORYRING lpRing, LPMESSAGEBUFFER lpBuffer);
+
+/**
+ * @brief Releases the messages held by the ring and the mutex that guards
+ * it.
+ * @param lpRing Reference to the HISTORYRING instance.
+ */
+void DestroyHistoryRing(LPHISTORYRING lpRing);
+
+/**
+ * @brief Gets the most recent messages in the ring.
+ * @param lpRing Reference to the HISTORYRING instance.
+ * @param lpBuffers Address of an array that receives references to the
+ * messages, oldest first.  A reference is added to each one; the caller must
+ * release them with ReleaseMessageBuffer.
+ * @param nMaxCount Count of entries in the lpBuffers array.
+ * @returns Count of messages stored in lpBuffers.
+ * @remarks The ring is locked only long enough to add the references, so the
+ * time it is locked does not depend on how long the messages are.
+ */
+int GetRecentHistory(LPHISTORYRING lpRing, LPMESSAGEBUFFER* lpBuffers,
+		int nMaxCount);
+
+/**
+ * @brief Sets up an empty ring and the mutex that guards it.
+ * @param lpRing Reference to the HISTORYRING instance.
+ */
+void InitializeHistoryRing(LPHISTORYRING lpRing);
+
+#endif /* __HISTORY_RING_H__ */
@@ -0,0 +1,189 @@
+// hot_restart.h - Defines the interface for hot restarts, in which the running
+// server hands its listening socket and its clients over to a newly exec'd
+// server process, so that the server can be upgraded without any chatter
+// being disconnected.
+//
+
+#ifndef __HOT_RESTART_H__
+#define __HOT_RESTART_H__
+
+#include "stdafx.h"
+#include "server_symbols.h"
+
+/**
+ * @brief First message sent over the handoff channel.  Carries the listening
+ * socket as ancillary data.
+ */
+typedef struct _tagHOTRESTARTHEADER {
+	/**
+	 * @name nMagic
+	 * @brief Always HOT_RESTART_MAGIC.
+	 */
+	uint32_t nMagic;
+
+	/**
+	 * @name nVersion
+	 * @brief Always HOT_RESTART_VERSION.
+	 */
+	uint32_t nVersion;
+
+	/**
+	 * @name nClientCount
+	 * @brief Count of HOTRESTARTCLIENT messages that follow this one.
+	 */
+	int32_t nClientCount;
+} HOTRESTARTHEADER, *LPHOTRESTARTHEADER;
+
+/**
+ * @brief Serialized state of one client, sent over the handoff channel with
+ * the client's socket as ancillary data.
+ */
+typedef struct _tagHOTRESTARTCLIENT {
+	/**
+	 * @name szUUIDLabel
+	 * @brief The UUID that labels the client outside of the server, or an
+	 * empty string if it has never been asked for.
+	 */
+	char szUUIDLabel[CLIENT_UUID_LABEL_SIZE];
+
+	/**
+	 * @name szIPAddress
+	 * @brief IP address the client is connected from.
+	 */
+	char szIPAddress[IPADDRLEN];
+
+	/**
+	 * @name szNickname
+	 * @brief The client's nickname, or an empty string if it has not
+	 * registered one yet.
+	 */
+	char szNickname[MAX_NICKNAME_LEN + 1];
+
+	/**
+	 * @name szRoomName
+	 * @brief Name of the room the client is in, or an empty string if it has
+	 * not issued the HELO command yet.
+	 */
+	char szRoomName[MAX_ROOM_NAME_LEN + 1];
+
+	/**
+	 * @name szDmRecipient
+	 * @brief Nickname of the chatter the client is in the middle of sending
+	 * a direct message to, if any.
+	 */
+	char szDmRecipient[MAX_NICKNAME_LEN + 1];
+
+	/**
+	 * @name szChatMessage
+	 * @brief The lines of the chat message the client is in the middle of
+	 * sending, if any, so that the lines it sends after the handoff are
+	 * added to them.
+	 */
+	char szChatMessage[CHAT_MESSAGE_MAX_LENGTH + 1];
+
+	/**
+	 * @name nChatMessageFault
+	 * @brief One of the MESSAGE_ASSEMBLY_* values, saying whether the chat
+	 * message the client is in the middle of sending is still good.
+	 */
+	int32_t nChatMessageFault;
+
+	/**
+	 * @name szFollowedHashtags
+	 * @brief The hashtags the client follows.  Only the first
+	 * nFollowedHashtagCount entries are valid.
+	 */
+	char szFollowedHashtags[MAX_FOLLOWED_HASHTAGS][MAX_HASHTAG_LEN + 1];
+
+	/**
+	 * @name nFollowedHashtagCount
+	 * @brief Count of valid entries in szFollowedHashtags.
+	 */
+	int32_t nFollowedHashtagCount;
+
+	/**
+	 * @name nBytesReceived
+	 * @brief Total count of bytes received from the client so far.
+	 */
+	int64_t nBytesReceived;
+
+	/**
+	 * @name nBytesSent
+	 * @brief Total count of bytes sent to the client so far.
+	 */
+	int64_t nBytesSent;
+
+	/**
+	 * @name bConnected
+	 * @brief Whether the client has issued the HELO command.
+	 */
+	int32_t bConnected;
+
+	/**
+	 * @name bMuted
+	 * @brief Whether the client has muted its room.
+	 */
+	int32_t bMuted;
+
+	/**
+	 * @name bBinaryProtocol
+	 * @brief Whether the client has switched to binary protocol frames.
+	 */
+	int32_t bBinaryProtocol;
+
+	/**
+	 * @name bDeflate
+	 * @brief Whether what the client is sent is compressed.  The new process
+	 * starts a new deflate stream for the client, which is fine, since the
+	 * old one always stops at a flush.
+	 */
+	int32_t bDeflate;
+} HOTRESTARTCLIENT, *LPHOTRESTARTCLIENT;
+
+/**
+ * @brief Sets up hot restarts, which are started by sending this process the
+ * SIGUSR2 signal.
+ * @param argv The command-line arguments this process was started with.  The
+ * new server process is started with the same arguments.
+ * @remarks Must be called exactly once, before any thread starts waiting on
+ * a socket.  The path of this program's executable is saved now, so that a
+ * new build copied over it is the one that is started.
+ */
+void InstallHotRestartHandler(char* argv[]);
+
+/**
+ * @brief Determines whether this process was started by a hot restart, and
+ * so must take over from the previous server process.
+ * @returns TRUE if so; FALSE if this is an ordinary start.
+ */
+BOOL IsHotRestartPending();
+
+/**
+ * @brief Takes over the listening socket and the clients of the server
+ * process that started this one.
+ * @remarks The clients are put back into their rooms, with their nicknames
+ * and hashtags, without anything being sent to them.  Exits if the handoff
+ * fails, in which case the previous server process carries on.
+ */
+void TakeOverFromPreviousServer();
+
+/**
+ * @brief Blocks the calling thread until data can be read from a socket.
+ * @param nSocket File descriptor of the socket.
+ * @param nWakeFd File descriptor of an eventfd that also ends the wait, such
+ * as that of a client's mailbox; -1 if there is none.
+ * @param nTimeoutMs Longest time, in milliseconds, to wait for; -1 to wait
+ * for as long as it takes.
+ * @returns TRUE if data (or an error, or the end of the stream) can be read
+ * from the socket; FALSE if the time ran out, the eventfd was written, a
+ * shutdown was requested, or a hot restart stopped the thread from waiting.
+ * @remarks While a hot restart is handing this server's sockets over to the
+ * new server process, the threads that call this function stop reading, so
+ * that not a byte is lost between the two processes.  If the hot restart
+ * fails, they carry on and FALSE is returned; the caller should wait again.
+ * Callers must check IsShutdownRequested before waiting again, since the
+ * shutdown eventfd stays readable once it has been written.
+ */
+BOOL WaitForSocketInput(int nSocket, int nWakeFd, int nTimeoutMs);
+
+#endif /* __HOT_RESTART_H__ */
@@ -0,0 +1,203 @@
+// mailbox.h - Defines the MAILBOX structure, a lock-free queue of the
+// messages that are waiting to be written to a client, and the functions
+// that post messages to it and take them off it.  Any thread may post to a
+// mailbox; only the thread that owns the client takes messages off it, and
+// so only that thread ever writes to the client's socket.
+//
+// The queue is an intrusive multi-producer, single-consumer linked list.
+// Posting a message is one atomic exchange, with no lock and no waiting for
+// the owner thread, however slow the client is.  The owner thread is woken
+// up through an eventfd, which is only written when the mailbox goes from
+// having nothing to wake it up for to having something.
+//
+
+#ifndef __MAILBOX_H__
+#define __MAILBOX_H__
+
+#include "stdafx.h"
+#include "server_symbols.h"
+
+#include "message_buffer.h"
+
+/**
+ * @brief Structure that holds one message in a mailbox.
+ */
+typedef struct _tagMAILBOXITEM {
+	/**
+	 * @name lpNext
+	 * @brief Reference to the message that was posted after this one, or
+	 * NULL if this is the last one (or if the thread posting the next one
+	 * has not linked it in yet).
+	 */
+	_Atomic(struct _tagMAILBOXITEM*) lpNext;
+
+	/**
+	 * @name lpBuffer
+	 * @brief Reference to the message.  The item holds a reference to it of
+	 * its own, so the same buffer can be posted to any number of mailboxes.
+	 */
+	LPMESSAGEBUFFER lpBuffer;
+
+	/**
+	 * @name bEncoded
+	 * @brief Flag that is set if the message is already in the form it is to
+	 * go out on the wire in (such as compressed), and so is written to the
+	 * client as it is; if not set, the message is text, which is framed for
+	 * clients that speak the binary protocol.
+	 */
+	BOOL bEncoded;
+} MAILBOXITEM, *LPMAILBOXITEM;
+
+/**
+ * @brief Structure that holds a mailbox.
+ */
+typedef struct _tagMAILBOX {
+	/**
+	 * @name lpHead
+	 * @brief Reference to the message that was posted last.  Threads that
+	 * post messages swap themselves in here.
+	 */
+	_Atomic(LPMAILBOXITEM) lpHead;
+
+	/**
+	 * @name lpTail
+	 * @brief Reference to the next message to take off.  Only touched by the
+	 * owner thread.
+	 */
+	LPMAILBOXITEM lpTail;
+
+	/**
+	 * @name stub
+	 * @brief Placeholder item that keeps the list from ever being empty, so
+	 * that posting never has to touch lpTail.
+	 */
+	MAILBOXITEM stub;
+
+	/**
+	 * @name nWakeFd
+	 * @brief File descriptor of the eventfd that the owner thread waits on,
+	 * along with the client's socket.
+	 */
+	int nWakeFd;
+
+	/**
+	 * @name bWakePending
+	 * @brief Flag that is set once the eventfd has been written, so that
+	 * threads that post after that do not write it again.  Cleared by the
+	 * owner thread before it takes the messages off.
+	 */
+	atomic_int bWakePending;
+
+	/**
+	 * @name nItemCount
+	 * @brief Count of the messages waiting in the mailbox.
+	 */
+	atomic_int nItemCount;
+
+	/**
+	 * @name bOverflowed
+	 * @brief Flag that is set if a message could not be posted because
+	 * MAILBOX_MAX_ITEM_COUNT messages were already waiting.
+	 */
+	atomic_int bOverflowed;
+} MAILBOX, *LPMAILBOX;
+
+/**
+ * @brief Makes the calling thread the owner of a mailbox, which is the only
+ * thread that may take messages off it.
+ * @param lpMailbox Reference to the MAILBOX instance, or NULL if the calling
+ * thread is giving up the mailbox it owns.
+ */
+void ClaimMailbox(LPMAILBOX lpMailbox);
+
+/**
+ * @brief Clears the wakeup of the owner thread, before it takes the messages
+ * off the mailbox.
+ * @param lpMailbox Reference to the MAILBOX instance.
+ * @remarks Must be called on the owner thread.  Messages posted from then on
+ * wake the owner thread up again.
+ */
+void ClearMailboxWakeup(LPMAILBOX lpMailbox);
+
+/**
+ * @brief Throws away any messages left in a mailbox, and closes its eventfd.
+ * @param lpMailbox Reference to the MAILBOX instance.
+ * @remarks Only to be called once nothing can post to the mailbox any more,
+ * such as when the client structure it is part of is freed.
+ */
+void DestroyMailbox(LPMAILBOX lpMailbox);
+
+/**
+ * @brief Releases the reference that a mailbox item holds to its message,
+ * and the item itself, back to the system.
+ * @param lpItem Reference to the MAILBOXITEM instance.
+ */
+void FreeMailboxItem(LPMAILBOXITEM lpItem);
+
+/**
+ * @brief Sets up an empty mailbox, and the eventfd that wakes its owner.
+ * @param lpMailbox Reference to the MAILBOX instance.
+ * @returns TRUE if the mailbox was set up; FALSE if the eventfd could not be
+ * created.
+ */
+BOOL InitializeMailbox(LPMAILBOX lpMailbox);
+
+/**
+ * @brief Determines whether the calling thread owns a mailbox.
+ * @param lpMailbox Reference to the MAILBOX instance.
+ * @returns TRUE if it does; FALSE otherwise.
+ */
+BOOL IsMailboxOwner(LPMAILBOX lpMailbox);
+
+/**
+ * @brief Determines whether a message could not be posted to a mailbox
+ * because it was full.
+ * @param lpMailbox Reference to the MAILBOX instance.
+ * @returns TRUE if one could not; FALSE otherwise.
+ * @remarks Once set, this stays set; a client whose mailbox has overflowed
+ * has lost messages, and is disconnected.
+ */
+BOOL IsMailboxOverflowed(LPMAILBOX lpMailbox);
+
+/**
+ * @brief Posts a message to a mailbox, and wakes up the owner thread if it
+ * is not already awake.
+ * @param lpMailbox Reference to the MAILBOX instance.
+ * @param lpBuffer Reference to the message.  The mailbox adds a reference of
+ * its own; the caller keeps the one it has.
+ * @param bEncoded TRUE if the message is to be written to the client as it
+ * is; FALSE if it is text.
+ * @returns TRUE if the message was posted; FALSE if the mailbox is full.
+ * @remarks May be called on any thread, while holding any lock.
+ */
+BOOL PostToMailbox(LPMAILBOX lpMailbox, LPMESSAGEBUFFER lpBuffer,
+		BOOL bEncoded);
+
+/**
+ * @brief Reports how many messages were posted to mailboxes, how many times
+ * their owners had to be woken up, and how many mailboxes overflowed, to the
+ * server log and console.
+ */
+void ReportMailboxStats();
+
+/**
+ * @brief Takes the oldest message off a mailbox.
+ * @param lpMailbox Reference to the MAILBOX instance.
+ * @returns Reference to the MAILBOXITEM instance holding the message, which
+ * the caller must free with FreeMailboxItem; or NULL if the mailbox is empty.
+ * @remarks Must be called on the owner thread.  Every message whose posting
+ * had finished when this function was called is taken off, in the order in
+ * which they were posted, before NULL is returned.
+ */
+LPMAILBOXITEM TakeFromMailbox(LPMAILBOX lpMailbox);
+
+/**
+ * @brief Wakes up the owner thread of a mailbox, unless it has already been
+ * woken up since it last cleared its wakeup.
+ * @param lpMailbox Reference to the MAILBOX instance.
+ * @remarks May be called on any thread, such as to have the owner thread
+ * notice that it has been asked to stop.
+ */
+void WakeMailboxOwner(LPMAILBOX lpMailbox);
+
+#endif /* __MAILBOX_H__ */
@@ -10,7 +10,14 @@
 // Count of how many currently-connected clients there are
 extern int g_nClientCount;
 
-extern BOOL g_bShouldTerminateMasterThread;
+/**
+ * @brief Accepts connections on a listening socket, and launches a thread for
+ * each client, until the server stops.
+ * @param nServerSocket File descriptor of the listening socket.
+ * @param nShardIndex Number of the acceptor shard that the socket belongs to,
+ * which the clients accepted on it then belong to as well.
+ */
+void AcceptClientConnections(int nServerSocket, int nShardIndex);
 
 /* This is the 'big daddy' thread that accepts all new client connections
  * and then passes each client connection off to its own little 'sub-thread' */
@@ -20,8 +20,8 @@ BOOL IsClientCountZero();
 
 void MakeServerEndpointReusable(int nServerSocket);
 
-void TerminateMasterThread(int signum);
 
-LPCLIENTSTRUCT WaitForNewClientConnection(int nServerSocket);
+LPCLIENTSTRUCT WaitForNewClientConnection(int nServerSocket,
+		int nShardIndex);
 
 #endif /* __MAT_FUNCTIONS_H__ */
@@ -0,0 +1,111 @@
+// message_assembler.h - Defines the interface for putting together the lines
+// of a multi-line chat message.  Per protocol, a chat message is one or more
+// lines, each no more than CHAT_MESSAGE_MAX_LINE_LENGTH characters long, ended
+// by a dot on a line by itself.  Each client has an assembler with an arena of
+// a fixed size, into which the lines are copied as they come in; when the dot
+// comes, the whole message is broadcast at once, as one fan-out and one entry
+// in the history of the room, rather than one for each line.
+//
+
+#ifndef __MESSAGE_ASSEMBLER_H__
+#define __MESSAGE_ASSEMBLER_H__
+
+#include "stdafx.h"
+#include "server_symbols.h"
+
+/**
+ * @brief Structure that holds a chat message that is being put together.
+ * Only ever touched by the thread of the client that owns it, so it needs no
+ * lock.
+ */
+typedef struct _tagMESSAGEASSEMBLER {
+	/**
+	 * @name szArena
+	 * @brief The lines received so far, each ended by a newline, followed by
+	 * a null terminator.
+	 */
+	char szArena[CHAT_MESSAGE_MAX_LENGTH + 1];
+
+	/**
+	 * @name nLength
+	 * @brief Count of bytes in szArena, not counting the null terminator.
+	 */
+	int nLength;
+
+	/**
+	 * @name nLineCount
+	 * @brief Count of the lines in szArena.
+	 */
+	int nLineCount;
+
+	/**
+	 * @name nFault
+	 * @brief One of the MESSAGE_ASSEMBLY_* values, saying whether the message
+	 * is still good.  Once it is not, the rest of its lines are thrown away as
+	 * they come in, up to the dot.
+	 */
+	int nFault;
+} MESSAGEASSEMBLER, *LPMESSAGEASSEMBLER;
+
+/**
+ * @brief Adds a line to the chat message that is being put together.
+ * @param lpAssembler Reference to the assembler.
+ * @param pszLine The line, as received; a newline at its end is optional.
+ * @returns The fault of the message after the line was added:
+ * MESSAGE_ASSEMBLY_OK if it is still good, otherwise the reason it is not.
+ * @remarks A line that is too long, or that does not fit into the arena, is
+ * not added, and neither is any line after it until the assembler is reset.
+ */
+int AddLineToMessage(LPMESSAGEASSEMBLER lpAssembler, const char* pszLine);
+
+/**
+ * @brief Gets the chat message that has been put together so far.
+ * @param lpAssembler Reference to the assembler.
+ * @returns The lines of the message, each ended by a newline, or an empty
+ * string if no line has been added.
+ */
+const char* GetAssembledMessage(LPMESSAGEASSEMBLER lpAssembler);
+
+/**
+ * @brief Gets the length of the chat message that has been put together so
+ * far.
+ * @param lpAssembler Reference to the assembler.
+ * @returns The length, in bytes.
+ */
+int GetAssembledMessageLength(LPMESSAGEASSEMBLER lpAssembler);
+
+/**
+ * @brief Gets the fault of the chat message that has been put together so
+ * far.
+ * @param lpAssembler Reference to the assembler.
+ * @returns MESSAGE_ASSEMBLY_OK if the message is good; otherwise, the reason
+ * it is not.
+ */
+int GetMessageAssemblyFault(LPMESSAGEASSEMBLER lpAssembler);
+
+/**
+ * @brief Determines whether the lines of a chat message are being put
+ * together, that is, whether any line has come in since the last dot.
+ * @param lpAssembler Reference to the assembler.
+ * @returns TRUE if they are; FALSE otherwise.
+ */
+BOOL IsMessageBeingAssembled(LPMESSAGEASSEMBLER lpAssembler);
+
+/**
+ * @brief Empties an assembler, ready for the next chat message.
+ * @param lpAssembler Reference to the assembler.
+ */
+void ResetMessageAssembler(LPMESSAGEASSEMBLER lpAssembler);
+
+/**
+ * @brief Puts the lines of a chat message back into an assembler, such as
+ * after a hot restart.
+ * @param lpAssembler Reference to the assembler.
+ * @param pszMessage The lines, as got from GetAssembledMessage.
+ * @param nFault The fault of the message, as returned by the last call to
+ * AddLineToMessage.
+ */
+void RestoreMessageAssembler(LPMESSAGEASSEMBLER lpAssembler,
+		const char* pszMessage, int nFault);
+
+#endif /* __MESSAGE_ASSEMBLER_H__ */
@@ -0,0 +1,140 @@
+// message_buffer.h - Defines the MESSAGEBUFFER structure, which holds a fully-
+// formatted message that is ready to be sent to clients, and the functions
+// that create and share MESSAGEBUFFER instances.
+//
+
+#ifndef __MESSAGE_BUFFER_H__
+#define __MESSAGE_BUFFER_H__
+
+#include "stdafx.h"
+#include "server_symbols.h"
+
+/**
+ * @brief Structure that holds a message, formatted exactly as it is sent on
+ * the wire, so that it can be sent to any number of clients, and kept in the
+ * history of a room, without being copied or formatted again.
+ * @remarks Instances are reference-counted and are never changed after they
+ * are created, so they may be shared freely between threads.
+ */
+typedef struct _tagMESSAGEBUFFER {
+	/**
+	 * @name nRefCount
+	 * @brief Count of references to this instance.  The instance is freed
+	 * when the last reference is released.
+	 */
+	atomic_int nRefCount;
+
+	/**
+	 * @name nLength
+	 * @brief Length, in bytes, of the message, not counting the null
+	 * terminator.
+	 */
+	int nLength;
+
+	/**
+	 * @name szData
+	 * @brief The message itself, null-terminated.
+	 */
+	char szData[];
+} MESSAGEBUFFER, *LPMESSAGEBUFFER;
+
+/**
+ * @brief Structure that holds the state of a message buffer that is being
+ * built up, piece by piece, before it is shared.
+ * @remarks The pieces are copied straight into the buffer that is sent, so
+ * nothing is allocated but the buffer itself, and nothing is formatted.
+ */
+typedef struct _tagMESSAGEBUILDER {
+	/**
+	 * @name lpBuffer
+	 * @brief Reference to the message buffer being built.
+	 */
+	LPMESSAGEBUFFER lpBuffer;
+
+	/**
+	 * @name nCapacity
+	 * @brief Count of bytes of text that the buffer has room for, not
+	 * counting the null terminator.
+	 */
+	int nCapacity;
+} MESSAGEBUILDER, *LPMESSAGEBUILDER;
+
+/**
+ * @brief Adds a reference to a message buffer.
+ * @param lpBuffer Reference to the MESSAGEBUFFER instance.
+ * @remarks Every call must be matched by a call to ReleaseMessageBuffer.
+ */
+void AddMessageBufferRef(LPMESSAGEBUFFER lpBuffer);
+
+/**
+ * @brief Adds some text to the end of a message buffer that is being built.
+ * @param lpBuilder Reference to the MESSAGEBUILDER instance.
+ * @param pchText Address of the text.  Need not be null-terminated.
+ * @param nLength Count of the bytes of text.
+ * @remarks Text that does not fit in the capacity that the builder was begun
+ * with is cut off.
+ */
+void AppendToMessage(LPMESSAGEBUILDER lpBuilder, const char* pchText,
+		int nLength);
+
+/**
+ * @brief Begins building a message buffer.
+ * @param lpBuilder Reference to the MESSAGEBUILDER instance.
+ * @param nCapacity Count of the bytes of text that the message is going to
+ * hold, not counting the null terminator.
+ * @remarks The buffer is allocated here, once; every call must be matched by
+ * a call to EndMessage.
+ */
+void BeginMessage(LPMESSAGEBUILDER lpBuilder, int nCapacity);
+
+/**
+ * @brief Creates a message buffer holding a prefix followed by some text.
+ * @param pszPrefix Address of the prefix (such as "!nickname: ").  May be
+ * NULL or empty.
+ * @param pszText Address of the text that follows the prefix.
+ * @returns Reference to the new MESSAGEBUFFER instance, which has one
+ * reference that belongs to the caller.
+ */
+LPMESSAGEBUFFER CreateMessageBuffer(const char* pszPrefix, const char* pszText);
+
+/**
+ * @brief Creates a message buffer holding a copy of some bytes, such as a
+ * message that has already been compressed, which need not be text.
+ * @param pvData Address of the bytes.
+ * @param nLength Count of the bytes.
+ * @returns Reference to the new MESSAGEBUFFER instance, which has one
+ * reference that belongs to the caller.
+ * @remarks The copy is null-terminated all the same.
+ */
+LPMESSAGEBUFFER CreateMessageBufferFromBytes(const void* pvData, int nLength);
+
+/**
+ * @brief Creates a message buffer from a template that has one "%s" in it,
+ * such as NEW_CHATTER_JOINED, with a value put in place of the "%s".
+ * @param pszTemplate Address of the template.
+ * @param pszValue Address of the value, such as a nickname.
+ * @returns Reference to the new MESSAGEBUFFER instance, which has one
+ * reference that belongs to the caller.
+ * @remarks Does what sprintf would, without parsing the template as a format
+ * string or going through a buffer on the stack.  Only the first "%s" is
+ * replaced.
+ */
+LPMESSAGEBUFFER CreateMessageFromTemplate(const char* pszTemplate,
+		const char* pszValue);
+
+/**
+ * @brief Finishes building a message buffer.
+ * @param lpBuilder Reference to the MESSAGEBUILDER instance.
+ * @returns Reference to the MESSAGEBUFFER instance, which has one reference
+ * that belongs to the caller, and which may not be changed from then on.
+ */
+LPMESSAGEBUFFER EndMessage(LPMESSAGEBUILDER lpBuilder);
+
+/**
+ * @brief Releases a reference to a message buffer, freeing it if it was the
+ * last one.
+ * @param lpBuffer Reference to the MESSAGEBUFFER instance.
+ */
+void ReleaseMessageBuffer(LPMESSAGEBUFFER lpBuffer);
+
+#endif /* __MESSAGE_BUFFER_H__ */
@@ -0,0 +1,246 @@
+// message_log.h - Defines the interface to the durable, append-only log in
+// which the chat messages of each room, and the direct messages, are kept.
+//
+
+#ifndef __MESSAGE_LOG_H__
+#define __MESSAGE_LOG_H__
+
+#include "stdafx.h"
+#include "server_symbols.h"
+
+/**
+ * @brief Entry of the sparse index that is kept alongside each segment of a
+ * message log.  One entry is written for the first line of each segment and
+ * then for every LOG_INDEX_INTERVAL lines after that.
+ */
+typedef struct _tagLOGINDEXENTRY {
+	/**
+	 * @name nSequence
+	 * @brief Sequence number of the line.  Lines are numbered from zero, in
+	 * the order they were appended, across all the segments of the log.
+	 */
+	uint64_t nSequence;
+
+	/**
+	 * @name nPosition
+	 * @brief Offset, in bytes, of the start of the line within its segment.
+	 */
+	uint64_t nPosition;
+
+	/**
+	 * @name nTimestamp
+	 * @brief Time at which the line was appended, in milliseconds since the
+	 * epoch.
+	 */
+	int64_t nTimestamp;
+} LOGINDEXENTRY, *LPLOGINDEXENTRY;
+
+/**
+ * @brief Structure that contains information about an open message log.
+ * @remarks A log is a directory of segment files, named for the sequence
+ * number of their first line.  Each segment holds the lines exactly as they
+ * were sent on the wire, so that a range of it can be sent to a client as it
+ * is.  Only the newest segment is written to; it is mapped into memory, and
+ * lines are appended to it by copying them into the mapping.  The pages are
+ * written to disk by the log flusher thread, which syncs every log that has
+ * changed once per LOG_SYNC_INTERVAL_MS (group commit).
+ */
+typedef struct _tagMESSAGELOG {
+	/**
+	 * @name szDirectory
+	 * @brief Path to the directory that holds the segments of the log.
+	 */
+	char szDirectory[PATH_MAX];
+
+	/**
+	 * @name nSegmentFd
+	 * @brief File descriptor of the newest segment.
+	 */
+	int nSegmentFd;
+
+	/**
+	 * @name pSegmentData
+	 * @brief Address of the memory mapping of the newest segment.
+	 */
+	char* pSegmentData;
+
+	/**
+	 * @name nIndexFd
+	 * @brief File descriptor of the index of the newest segment.
+	 */
+	int nIndexFd;
+
+	/**
+	 * @name nWritePosition
+	 * @brief Offset, within the newest segment, at which the next line is
+	 * appended.
+	 */
+	size_t nWritePosition;
+
+	/**
+	 * @name nBaseSequence
+	 * @brief Sequence number of the first line of the newest segment.
+	 */
+	uint64_t nBaseSequence;
+
+	/**
+	 * @name nNextSequence
+	 * @brief Sequence number that the next line appended will have.
+	 */
+	uint64_t nNextSequence;
+
+	/**
+	 * @name nRetiredSegmentFd
+	 * @brief File descriptor of a segment that has been filled up but not
+	 * yet synced and closed by the log flusher thread, or -1.
+	 */
+	int nRetiredSegmentFd;
+
+	/**
+	 * @name nRetiredIndexFd
+	 * @brief File descriptor of the index of the retired segment, or -1.
+	 */
+	int nRetiredIndexFd;
+
+	/**
+	 * @name bSyncPending
+	 * @brief Flag that indicates whether lines have been appended since the
+	 * log flusher thread last synced the log.
+	 */
+	BOOL bSyncPending;
+
+	/**
+	 * @name hMutex
+	 * @brief Handle to the mutex that guards the members of this structure.
+	 */
+	HMUTEX hMutex;
+} MESSAGELOG, *LPMESSAGELOG;
+
+/**
+ * @brief Routine that is handed the lines of a message log, a chunk at a
+ * time, by CopyMessageLogTail.
+ * @returns Count of bytes the routine sent on, or -1 to stop the copy.
+ */
+typedef long (*LPLOG_DATA_ROUTINE)(void* pvUserState, const char* pchData,
+		size_t nLength);
+
+/**
+ * @brief Structure that tells the routines that walk the tail of a message
+ * log where to send it.
+ */
+typedef struct _tagLOGTAILTARGET {
+	/**
+	 * @name nSocket
+	 * @brief File descriptor of the socket that SendMessageLogTail sends
+	 * the lines to.
+	 */
+	int nSocket;
+
+	/**
+	 * @name bFramed
+	 * @brief Whether SendMessageLogTail sends the lines in binary protocol
+	 * data frames.
+	 */
+	BOOL bFramed;
+
+	/**
+	 * @name lpfnDataRoutine
+	 * @brief Routine that CopyMessageLogTail hands the lines to.
+	 */
+	LPLOG_DATA_ROUTINE lpfnDataRoutine;
+
+	/**
+	 * @name pvUserState
+	 * @brief Value that is passed through to lpfnDataRoutine.
+	 */
+	void* pvUserState;
+} LOGTAILTARGET, *LPLOGTAILTARGET;
+
+/**
+ * @brief Appends a line to a message log.
+ * @param lpLog Reference to the MESSAGELOG instance.
+ * @param pszHeader Address of text to be written ahead of the line, such as
+ * the nickname of the recipient of a direct message.  May be NULL.
+ * @param pszLine Address of the line.  A newline is added if it does not end
+ * in one.
+ * @returns TRUE if the line was appended; FALSE otherwise.
+ * @remarks The line is copied into the mapped segment; no I/O is done unless
+ * the segment is full, so callers are not held up waiting for the disk.
+ */
+BOOL AppendToMessageLog(LPMESSAGELOG lpLog, const char* pszHeader,
+		const char* pszLine);
+
+/**
+ * @brief Syncs and closes a message log, and frees the memory it occupies.
+ * @param lpLog Reference to the MESSAGELOG instance.
+ */
+void CloseMessageLog(LPMESSAGELOG lpLog);
+
+/**
+ * @brief Reads the most recent lines of a message log and hands them to a
+ * routine, a chunk at a time.
+ * @param lpLog Reference to the MESSAGELOG instance.
+ * @param nLineCount Count of lines to copy.  If the log has fewer lines, all
+ * of them are copied.
+ * @param lpfnDataRoutine Routine to hand the lines to.  A chunk may end in
+ * the middle of a line.
+ * @param pvUserState Value to pass to the routine.
+ * @returns Total of the counts returned by the routine, or -1 if an error
+ * occurred.
+ * @remarks For clients whose data has to be transformed on its way to them,
+ * such as by compression, and so cannot be sent with SendMessageLogTail.
+ */
+long CopyMessageLogTail(LPMESSAGELOG lpLog, int nLineCount,
+		LPLOG_DATA_ROUTINE lpfnDataRoutine, void* pvUserState);
+
+/**
+ * @brief Gets the log in which direct messages are kept.
+ * @returns Reference to the MESSAGELOG instance, or NULL if message logging
+ * is not running.
+ */
+LPMESSAGELOG GetDirectMessageLog();
+
+/**
+ * @brief Opens a message log, creating it if it does not exist yet.
+ * @param pszName Name of the log, which is used as a path relative to
+ * LOG_DIRECTORY_PATH (for example, "rooms/lobby").
+ * @returns Reference to the MESSAGELOG instance, or NULL if the log could not
+ * be opened.
+ * @remarks If the server stopped without closing the log, the lines that had
+ * been synced to disk are recovered, and appending carries on after them.
+ */
+LPMESSAGELOG OpenMessageLog(const char* pszName);
+
+/**
+ * @brief Sends the most recent lines of a message log to a socket, straight
+ * from the segment files.
+ * @param lpLog Reference to the MESSAGELOG instance.
+ * @param nSocket File descriptor of the socket to send the lines to.
+ * @param nLineCount Count of lines to send.  If the log has fewer lines, all
+ * of them are sent.
+ * @param bFramed TRUE if the socket belongs to a client that speaks the
+ * binary protocol, in which case the lines are sent in BINARY_OP_DATA frames.
+ * @returns Total number of bytes sent, or -1 if an error occurred.
+ * @remarks The lines are sent with sendfile(), so they go from the page
+ * cache to the socket without being read into, or formatted in, user space.
+ * The sparse index is used to find where the first line starts, so at most
+ * LOG_INDEX_INTERVAL lines are scanned to find it.
+ */
+long SendMessageLogTail(LPMESSAGELOG lpLog, int nSocket, int nLineCount,
+		BOOL bFramed);
+
+/**
+ * @brief Opens the direct message log and starts the log flusher thread.
+ * @remarks Must be called exactly once, when the application starts.  If the
+ * log directory cannot be used, the server runs without a message log.
+ */
+void StartMessageLogging();
+
+/**
+ * @brief Stops the log flusher thread and syncs and closes the direct
+ * message log.
+ * @remarks Room logs are closed when their rooms are freed.
+ */
+void StopMessageLogging();
+
+#endif /* __MESSAGE_LOG_H__ */
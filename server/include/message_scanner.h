@@ -0,0 +1,69 @@
+// message_scanner.h - Defines the interface to the scanner that picks the
+// hashtags and at-mentions out of the text of a chat message.
+//
+
+#ifndef __MESSAGE_SCANNER_H__
+#define __MESSAGE_SCANNER_H__
+
+#include "stdafx.h"
+#include "server_symbols.h"
+
+/**
+ * @brief Structure that receives the tokens of interest found in the text of
+ * a chat message.
+ */
+typedef struct _tagMESSAGETOKENS {
+	/**
+	 * @name szHashtags
+	 * @brief Distinct hashtags (without the leading '#', in lowercase) that
+	 * appear in the message, in order of first appearance.
+	 */
+	char szHashtags[MAX_HASHTAGS_PER_MESSAGE][MAX_HASHTAG_LEN + 1];
+
+	/**
+	 * @name nHashtagCount
+	 * @brief Count of valid entries in the szHashtags array.
+	 */
+	int nHashtagCount;
+
+	/**
+	 * @name szMentions
+	 * @brief Distinct nicknames (without the leading '@') that are mentioned
+	 * in the message, in order of first appearance.
+	 */
+	char szMentions[MAX_MENTIONS_PER_MESSAGE][MAX_NICKNAME_LEN + 1];
+
+	/**
+	 * @name nMentionCount
+	 * @brief Count of valid entries in the szMentions array.
+	 */
+	int nMentionCount;
+} MESSAGETOKENS, *LPMESSAGETOKENS;
+
+/**
+ * @brief Puts a hashtag into the canonical form in which it is stored in the
+ * hashtag index.
+ * @param pszDest Address of a buffer of at least MAX_HASHTAG_LEN + 1 chars
+ * to receive the result.
+ * @param pszSource Address of the hashtag, with or without its leading '#'.
+ * @returns TRUE if the hashtag is valid; FALSE otherwise.
+ * @remarks Hashtags are compared without regard to case, so the canonical
+ * form is in lowercase.  Trailing punctuation is not part of a hashtag.
+ */
+BOOL NormalizeHashtag(char* pszDest, const char* pszSource);
+
+/**
+ * @brief Scans the text of a chat message, in a single pass, for hashtags
+ * and at-mentions.
+ * @param pszMessage Address of the text of the chat message.
+ * @param lpTokens Address of a MESSAGETOKENS instance that receives the
+ * tokens that are found.
+ * @remarks At most MAX_HASHTAGS_PER_MESSAGE distinct hashtags and
+ * MAX_MENTIONS_PER_MESSAGE distinct mentions are reported; hashtags longer
+ * than MAX_HASHTAG_LEN chars, and mentions longer than MAX_NICKNAME_LEN
+ * chars, are ignored.  Hashtags are put in lowercase, but the nicknames in
+ * mentions are left as they are, since nicknames are case-sensitive.
+ */
+void ScanMessageTokens(const char* pszMessage, LPMESSAGETOKENS lpTokens);
+
+#endif /* __MESSAGE_SCANNER_H__ */
@@ -5,6 +5,90 @@
 #ifndef __NICKNAME_MANAGER_H__
 #define __NICKNAME_MANAGER_H__
 
+#include "client_struct.h"
+#include "message_scanner.h"
+
+/**
+ * @brief Entry of the nickname index, which maps each registered nickname to
+ * the client that registered it.
+ */
+typedef struct _tagNICKNAMEENTRY {
+	/**
+	 * @name szNickname
+	 * @brief The nickname.  A copy is kept here so that the entry can always
+	 * be found, even after the client's own copy has been blanked out.
+	 */
+	char szNickname[MAX_NICKNAME_LEN + 1];
+
+	/**
+	 * @name lpClient
+	 * @brief Reference to the client that registered the nickname.
+	 */
+	struct _tagCLIENTSTRUCT* lpClient;
+
+	/**
+	 * @name pNext
+	 * @brief Next entry in the same bucket of the index.
+	 */
+	struct _tagNICKNAMEENTRY* pNext;
+} NICKNAMEENTRY, *LPNICKNAMEENTRY;
+
+/**
+ * @brief Claims a nickname in the nickname index and stores it in the client.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the client.
+ * @param pszNickname The nickname, which must already have been parsed.
+ * @returns TRUE if the nickname is now the client's; FALSE if it is too long
+ * or another client already has it.
+ * @remarks Nothing is sent to the client or the other chatters.
+ */
+BOOL AssignClientNickname(LPCLIENTSTRUCT lpClient, const char* pszNickname);
+
+/**
+ * @brief Sets up the (empty) nickname index and the mutex that guards it.
+ * @remarks Must be called exactly once, when the application starts.
+ */
+void CreateNicknameIndex();
+
+/**
+ * @brief Sends a notification to each chatter who is mentioned in a chat
+ * message but would not otherwise see it, because the chatter is in another
+ * room or has muted the chat in the sender's room.
+ * @param lpTokens Address of a MESSAGETOKENS instance filled in by the
+ * ScanMessageTokens function from the text of the chat message.
+ * @param pszChatMessage Address of the text of the chat message.
+ * @param lpSendingClient Reference to the CLIENTSTRUCT instance of the sender.
+ * @returns Total number of bytes sent.
+ * @remarks Each mention costs a single lookup in the nickname index, so the
+ * cost of this function does not depend on the count of clients.
+ */
+int DeliverMentionNotifications(LPMESSAGETOKENS lpTokens,
+		const char* pszChatMessage, LPCLIENTSTRUCT lpSendingClient);
+
+/**
+ * @brief Releases the memory occupied by the nickname index and its mutex.
+ */
+void DestroyNicknameIndex();
+
+/**
+ * @brief Calls a function for the nickname of each chatter on this server.
+ * @param lpfnAction Address of the function to call.
+ * @remarks The nickname index is locked while the function is called, so it
+ * must not register or release nicknames.
+ */
+void ForEachNickname(void (*lpfnAction)(const char*));
+
+/**
+ * @brief Looks up the client that has registered a nickname.
+ * @param pszNickname Nickname to look up.  The comparison is case-sensitive.
+ * @returns Reference to the CLIENTSTRUCT instance of the client, or NULL if
+ * no client has registered the nickname.
+ * @remarks The lookup takes constant time and holds no lock once it returns.
+ * A reference is added to the client that is returned, so that it remains
+ * valid even if the client disconnects; the caller must call ReleaseClient
+ * when done with it.
+ */
+LPCLIENTSTRUCT GetClientByNickname(const char* pszNickname);
+
 /**
  * @brief Parses the user's chosen nickname.  Really just tokenizes src on
  * spaces and returns the second token (ostensibly, the value after the NICK
@@ -27,4 +111,12 @@ void GetNicknameFromUser(char* dest, char* src);
  */
 BOOL RegisterClientNickname(LPCLIENTSTRUCT lpSendingClient, char* pszBuffer);
 
+/**
+ * @brief Removes a client's nickname from the nickname index, so that the
+ * nickname may be registered by another chatter.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the client.
+ * @remarks Does nothing if the client has not registered a nickname.
+ */
+void ReleaseNickname(LPCLIENTSTRUCT lpClient);
+
 #endif /* __NICKNAME_MANAGER_H__ */
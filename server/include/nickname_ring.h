@@ -0,0 +1,153 @@
+// nickname_ring.h - Defines the interface for keeping nicknames unique across
+// a cluster of chattr servers.  Nicknames are spread over the servers with a
+// consistent-hash ring; the server a nickname hashes to (its owner) keeps
+// track of which server's chatter, if any, has it.
+//
+
+#ifndef __NICKNAME_RING_H__
+#define __NICKNAME_RING_H__
+
+#include "stdafx.h"
+#include "server_symbols.h"
+
+#include "federation.h"
+
+/**
+ * @brief Point on the nickname ring.  Each node has
+ * NICKNAME_RING_VIRTUAL_NODES of them; a nickname is owned by the node of the
+ * first point at or after the nickname's hash, going around the ring.
+ */
+typedef struct _tagNICKNAMERINGPOINT {
+	/**
+	 * @name nHash
+	 * @brief Position of the point on the ring.
+	 */
+	uint64_t nHash;
+
+	/**
+	 * @name nNodeId
+	 * @brief ID of the node the point belongs to.
+	 */
+	uint32_t nNodeId;
+} NICKNAMERINGPOINT, *LPNICKNAMERINGPOINT;
+
+/**
+ * @brief Entry of the table of the nicknames this server owns that have been
+ * taken, and the servers whose chatters took them.
+ */
+typedef struct _tagNICKNAMECLAIM {
+	/**
+	 * @name szNickname
+	 * @brief The nickname that has been taken.
+	 */
+	char szNickname[MAX_NICKNAME_LEN + 1];
+
+	/**
+	 * @name nHolderNodeId
+	 * @brief Node ID of the server the chatter who took it is connected to.
+	 */
+	uint32_t nHolderNodeId;
+
+	/**
+	 * @name pNext
+	 * @brief Next entry in the same bucket.
+	 */
+	struct _tagNICKNAMECLAIM* pNext;
+} NICKNAMECLAIM, *LPNICKNAMECLAIM;
+
+/**
+ * @brief Claim or lookup that has been sent to the owner of a nickname, and
+ * is waiting for its answer.
+ */
+typedef struct _tagNICKNAMEREQUEST {
+	/**
+	 * @name nRequestId
+	 * @brief ID that the reply is matched on, or zero if the slot is free.
+	 */
+	uint64_t nRequestId;
+
+	/**
+	 * @name bAnswered
+	 * @brief Flag that is set once the reply has arrived.
+	 */
+	atomic_int bAnswered;
+
+	/**
+	 * @name nResult
+	 * @brief The result carried by the reply.
+	 */
+	uint32_t nResult;
+} NICKNAMEREQUEST, *LPNICKNAMEREQUEST;
+
+/**
+ * @brief Makes sure that no chatter on any server in the cluster has a
+ * nickname, and records it as taken by a chatter on this server.
+ * @param pszNickname The nickname.
+ * @returns TRUE if the nickname was free (or this server is not part of a
+ * cluster); FALSE if a chatter on another server has it.
+ * @remarks Costs one round trip to the owner of the nickname, unless that is
+ * this server.  The caller must already have claimed the nickname locally.
+ */
+BOOL ClaimClusterNickname(const char* pszNickname);
+
+/**
+ * @brief Sets up the nickname ring, with only this server on it.
+ * @remarks Must be called exactly once, before any peer link comes up.
+ */
+void CreateNicknameRing();
+
+/**
+ * @brief Frees the nicknames that were taken by chatters on a server that
+ * this server has lost its link to.
+ * @param nNodeId Node ID of the server.
+ */
+void ForgetNodeNicknames(uint32_t nNodeId);
+
+/**
+ * @brief Gets the owner of a nickname.
+ * @param pszNickname The nickname.
+ * @returns Node ID of the server that arbitrates claims on the nickname.
+ */
+uint32_t GetNicknameOwner(const char* pszNickname);
+
+/**
+ * @brief Acts on a nickname event that a peer server sent to this one.
+ * @param nFromNodeId Node ID of the peer server.
+ * @param lpEvent Reference to the PEEREVENT instance.
+ */
+void HandleNicknameEvent(uint32_t nFromNodeId, LPPEEREVENT lpEvent);
+
+/**
+ * @brief Determines whether an event type is one of those sent to a single
+ * peer server by this module.
+ * @param nType One of the PEER_EVENT_* values.
+ * @returns TRUE if so; FALSE if the event is relayed to the whole cluster.
+ */
+BOOL IsNicknameEvent(int nType);
+
+/**
+ * @brief Rebuilds the nickname ring from the servers this one is linked to.
+ * @remarks Called whenever a peer link comes up or goes down.  The nicknames
+ * of this server's chatters are then claimed again from their owners, since
+ * some of them will have moved to other servers.
+ */
+void RebuildNicknameRing();
+
+/**
+ * @brief Tells the owner of a nickname that this server's chatter no longer
+ * has it.
+ * @param pszNickname The nickname.
+ */
+void ReleaseClusterNickname(const char* pszNickname);
+
+/**
+ * @brief Finds out which server in the cluster the chatter with a nickname is
+ * connected to.
+ * @param pszNickname The nickname.
+ * @returns Node ID of the server, or zero if nobody has the nickname.
+ * @remarks Costs one round trip to the owner of the nickname, unless that is
+ * this server.
+ */
+uint32_t ResolveClusterNickname(const char* pszNickname);
+
+#endif /* __NICKNAME_RING_H__ */
@@ -0,0 +1,95 @@
+// presence.h - Defines the interface for telling the chatters who has joined
+// and who has left the chat.  While chatters come and go at an ordinary pace,
+// each join and leave is announced straight away, by itself.  During a storm
+// (such as when thousands of clients reconnect after a network blip) that
+// would mean a notice to every chatter for every join, so the joins and leaves
+// are instead gathered up and announced together, in one notice for all of
+// them, such as "!@a, @b and 4998 others joined the chat room." or "!@a
+// joined, @b left, 3000 more joined and 1998 more left."  The longer the storm
+// goes on, the longer they are gathered for.
+//
+
+#ifndef __PRESENCE_H__
+#define __PRESENCE_H__
+
+#include "stdafx.h"
+#include "server_symbols.h"
+
+#include "client_struct.h"
+
+/**
+ * @brief Structure that holds the joins and leaves that are waiting to be
+ * announced in a batched notice, in the order they came in.
+ */
+typedef struct _tagPRESENCEBATCH {
+	/**
+	 * @name nBatchID
+	 * @brief ID of the batch, which is stored in the CLIENTSTRUCT of each of
+	 * the chatters in it who are connected to this server, so that they are
+	 * not sent the notice about themselves.
+	 */
+	uint64_t nBatchID;
+
+	/**
+	 * @name nCount
+	 * @brief Count of the joins and leaves in the batch.
+	 */
+	int nCount;
+
+	/**
+	 * @name nJoinedCount
+	 * @brief Count of those that are joins; the rest are leaves.
+	 */
+	int nJoinedCount;
+
+	/**
+	 * @name bNamedJoined
+	 * @brief For each of the entries of szNicknames, TRUE if it is a join;
+	 * FALSE if it is a leave.
+	 */
+	BOOL bNamedJoined[PRESENCE_NAMED_NICKNAME_COUNT];
+
+	/**
+	 * @name szNicknames
+	 * @brief The nicknames of the first of them, which the notice names.
+	 * Only the first nCount entries, up to PRESENCE_NAMED_NICKNAME_COUNT, are
+	 * valid.
+	 */
+	char szNicknames[PRESENCE_NAMED_NICKNAME_COUNT][MAX_NICKNAME_LEN + 1];
+} PRESENCEBATCH, *LPPRESENCEBATCH;
+
+/**
+ * @brief Tells the chatters on this server that a chatter has joined or left
+ * the chat.
+ * @param pszNickname The nickname of the chatter.
+ * @param bJoined TRUE if the chatter joined; FALSE if the chatter left.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the chatter, who
+ * is not sent the notice, or NULL if the chatter is connected to another
+ * server.
+ * @remarks The notice is sent straight away, on the calling thread, unless
+ * there is a storm of joins and leaves going on, in which case it is batched
+ * with the others, and sent later by the presence notice thread.  Either way,
+ * the chatter is not sent it.
+ */
+void AnnouncePresence(const char* pszNickname, BOOL bJoined,
+		LPCLIENTSTRUCT lpClient);
+
+/**
+ * @brief Reports how many joins and leaves there were, and how many of them
+ * were batched, to the server log and console.
+ */
+void ReportPresenceStats();
+
+/**
+ * @brief Starts the thread that sends the batched notices.
+ */
+void StartPresenceNotifier();
+
+/**
+ * @brief Stops the thread that sends the batched notices.  Joins and leaves
+ * that have not been announced yet never are.
+ * @remarks Must only be called once a shutdown has been requested.
+ */
+void StopPresenceNotifier();
+
+#endif /* __PRESENCE_H__ */
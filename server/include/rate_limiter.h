@@ -0,0 +1,110 @@
+// rate_limiter.h - Defines the interface for limiting how fast each client may
+// send chat messages.  Every client has two token buckets, one counting
+// messages and one counting bytes; a chat message is let through only if both
+// buckets have enough tokens for it.  The check is made before the message is
+// formatted or fanned out, so a flood costs the server as little as possible.
+//
+
+#ifndef __RATE_LIMITER_H__
+#define __RATE_LIMITER_H__
+
+#include "stdafx.h"
+#include "server_symbols.h"
+
+struct _tagCLIENTSTRUCT;
+
+/**
+ * @brief Structure that holds the state of one token bucket.  Only ever
+ * touched by the thread of the client that owns it, so it needs no lock.
+ */
+typedef struct _tagTOKENBUCKET {
+	/**
+	 * @name dTokens
+	 * @brief Count of tokens in the bucket.  May go below zero when a message
+	 * bigger than the whole bucket is let through; the client then has to
+	 * wait for the debt to be paid off.
+	 */
+	double dTokens;
+
+	/**
+	 * @name dCapacity
+	 * @brief Most tokens the bucket can hold, which is the biggest burst the
+	 * client can send without being held to the rate.
+	 */
+	double dCapacity;
+
+	/**
+	 * @name dRefillRate
+	 * @brief Tokens added to the bucket per second.  Zero means the bucket
+	 * never runs out.
+	 */
+	double dRefillRate;
+
+	/**
+	 * @name nLastRefill
+	 * @brief Time, in nanoseconds on the monotonic clock, that the bucket was
+	 * last refilled.
+	 */
+	uint64_t nLastRefill;
+} TOKENBUCKET, *LPTOKENBUCKET;
+
+/**
+ * @brief Checks a chat message that a client wants to send against the
+ * client's rate limits, and carries out the rate-limiting policy if it is
+ * over them.
+ * @param lpSendingClient Reference to the CLIENTSTRUCT instance of the client.
+ * @param nLength Length, in bytes, of the chat message.
+ * @returns TRUE if the message should be delivered; FALSE if it was dropped,
+ * or if the client was disconnected.
+ * @remarks Under the queue policy, the calling thread waits until the client
+ * is back under its rates, and then TRUE is returned.  While it waits, it
+ * still writes out the client's mailbox and runs its timing wheel; FALSE is
+ * returned, and the message dropped, if a shutdown or one of the client's
+ * timeouts cuts the wait short.  Must be called on the client's own thread.
+ */
+BOOL AdmitChatMessage(struct _tagCLIENTSTRUCT* lpSendingClient,
+		size_t nLength);
+
+/**
+ * @brief Reads the rate-limiting options from the command line.
+ * @param argc Count of command-line arguments.
+ * @param argv Array of the command-line arguments.
+ * @returns TRUE if the options, if any, are valid; FALSE otherwise.
+ * @remarks Options that are not about rate limiting are skipped; the other
+ * parsers check them.
+ */
+BOOL ConfigureRateLimits(int argc, char* argv[]);
+
+/**
+ * @brief Gets the time on a clock that is not affected by changes to the
+ * wall-clock time.
+ * @returns The time, in nanoseconds.
+ */
+uint64_t GetMonotonicNanoseconds();
+
+/**
+ * @brief Fills a new client's token buckets, according to the configured
+ * rates.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the client.
+ */
+void InitializeClientRateLimits(struct _tagCLIENTSTRUCT* lpClient);
+
+/**
+ * @brief Determines whether a command-line option is one of the
+ * rate-limiting options, each of which takes a value.
+ * @param pszOption The option, such as "-msgrate".
+ * @returns TRUE if it is; FALSE otherwise.
+ */
+BOOL IsRateLimitOption(const char* pszOption);
+
+/**
+ * @brief Reports how many of a client's chat messages were held back or
+ * dropped, to the server log and console.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the client.
+ * @param pszClientID String form of the client's ID.
+ * @remarks Does nothing for clients that never went over their rates.
+ */
+void ReportRateLimitStats(struct _tagCLIENTSTRUCT* lpClient,
+		const char* pszClientID);
+
+#endif /* __RATE_LIMITER_H__ */
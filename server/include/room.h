@@ -0,0 +1,143 @@
+// room.h - Defines the ROOM structure, which tracks the membership of a single
+// chat room, and the functions that create and manipulate ROOM instances.
+//
+
+#ifndef __ROOM_H__
+#define __ROOM_H__
+
+#include "stdafx.h"
+#include "server_symbols.h"
+#include "compression.h"
+#include "history_ring.h"
+#include "message_log.h"
+
+/**
+ * @brief Forward declaration of the CLIENTSTRUCT structure.
+ */
+struct _tagCLIENTSTRUCT;
+
+/**
+ * @brief Structure that contains information about a chat room and the
+ * chatters who are currently in it.
+ */
+typedef struct _tagROOM {
+	/**
+	 * @name szName
+	 * @brief Name of the room, as given to the JOIN command.
+	 */
+	char szName[MAX_ROOM_NAME_LEN + 1];
+
+	/**
+	 * @name ppMembers
+	 * @brief Compact array of references to the clients that are members of
+	 * this room.  Only the first nMemberCount entries are valid.
+	 * @remarks Each member remembers its index into this array (see the
+	 * nRoomSlot member of CLIENTSTRUCT) so that it can be removed in constant
+	 * time by moving the last member into its slot.
+	 */
+	struct _tagCLIENTSTRUCT** ppMembers;
+
+	/**
+	 * @name nMemberCount
+	 * @brief Count of valid entries in the ppMembers array.
+	 */
+	int nMemberCount;
+
+	/**
+	 * @name nMemberCapacity
+	 * @brief Count of entries for which storage in ppMembers is allocated.
+	 */
+	int nMemberCapacity;
+
+	/**
+	 * @name hMemberMutex
+	 * @brief Handle to the mutex that guards the member array of this room.
+	 */
+	HMUTEX hMemberMutex;
+
+	/**
+	 * @name historyRing
+	 * @brief The most recent chat messages broadcast in this room, which are
+	 * replayed to chatters when they arrive.
+	 */
+	HISTORYRING historyRing;
+
+	/**
+	 * @name lpLog
+	 * @brief Reference to the durable log of the chat messages of this room,
+	 * or NULL if the log could not be opened.
+	 */
+	LPMESSAGELOG lpLog;
+
+	/**
+	 * @name lpDeflateGroup
+	 * @brief Reference to the compression group through which the chat
+	 * messages and notices of this room are compressed, once each, for the
+	 * members that said HELO DEFLATE.  Guarded by hMemberMutex.
+	 */
+	LPDEFLATEGROUP lpDeflateGroup;
+} ROOM, *LPROOM;
+
+/**
+ * @brief Adds a client to the member array of a room.
+ * @param lpRoom Reference to the ROOM instance to add the client to.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the new member.
+ * @returns TRUE if the client was added; FALSE otherwise.
+ * @remarks The caller must hold the member mutex of the room.  The index of
+ * the slot occupied by the new member is saved in its nRoomSlot member.
+ */
+BOOL AddRoomMember(LPROOM lpRoom, struct _tagCLIENTSTRUCT* lpClient);
+
+/**
+ * @brief Syncs and closes the message log of a room, if it is open.
+ * @param pvRoom Pointer to a ROOM instance.
+ */
+void CloseRoomLog(void* pvRoom);
+
+/**
+ * @brief Creates an instance of a ROOM structure having the specified name
+ * and no members.
+ * @param pszName Name of the new room.
+ * @returns LPROOM pointing to the newly-created-and-initialized instance.
+ */
+LPROOM CreateRoom(const char* pszName);
+
+/**
+ * @brief Callback used to search the list of rooms for a particular room.
+ * @param pvName String containing the name of the room to find.
+ * @param pvRoom Address of the ROOM instance at the current list element.
+ * @returns TRUE if the names match (case-sensitive); FALSE otherwise.
+ */
+BOOL FindRoomByName(void* pvName, void* pvRoom);
+
+/**
+ * @brief Releases the memory allocated for a room back to the system.
+ * @param pvRoom Pointer to a ROOM instance whose memory is to be freed.
+ */
+void FreeRoom(void* pvRoom);
+
+/**
+ * @brief Determines whether the text specified is usable as a room name.
+ * @param pszName Proposed name for a room.
+ * @returns TRUE if the name is non-blank, alphanumeric, and no longer than
+ * MAX_ROOM_NAME_LEN characters; FALSE otherwise.
+ */
+BOOL IsRoomNameValid(const char* pszName);
+
+/**
+ * @brief Opens the message log of a room, unless it is already open.
+ * @param pvRoom Pointer to a ROOM instance.
+ * @remarks If the log cannot be opened, the room carries on without one.
+ */
+void OpenRoomLog(void* pvRoom);
+
+/**
+ * @brief Removes a client from the member array of a room.
+ * @param lpRoom Reference to the ROOM instance to remove the client from.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the member.
+ * @remarks The caller must hold the member mutex of the room.  The last
+ * member of the array is moved into the slot that is vacated.
+ */
+void RemoveRoomMember(LPROOM lpRoom, struct _tagCLIENTSTRUCT* lpClient);
+
+#endif /* __ROOM_H__ */
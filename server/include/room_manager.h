@@ -0,0 +1,143 @@
+// room_manager.h - Defines the interface for a set of functions that move
+// clients between chat rooms and deliver messages to the members of a room.
+//
+
+#ifndef __ROOM_MANAGER_H__
+#define __ROOM_MANAGER_H__
+
+#include "client_struct.h"
+#include "message_buffer.h"
+#include "room.h"
+
+/**
+ * @brief Sends a chat message to every member of a room except the client
+ * who sent it and the members who have muted the chat in the room, and adds
+ * it to the history of the room.
+ * @param lpRoom Reference to the ROOM instance whose members should receive
+ * the message.
+ * @param lpMessage Reference to the MESSAGEBUFFER instance that holds the
+ * message to be sent.  The history of the room adds its own reference.
+ * @param lpSendingClient Reference to the CLIENTSTRUCT instance of the sender.
+ * @returns Total number of bytes sent.
+ */
+int BroadcastChatToRoom(LPROOM lpRoom, LPMESSAGEBUFFER lpMessage,
+		LPCLIENTSTRUCT lpSendingClient);
+
+/**
+ * @brief Sends a message to every member of a room except the client who
+ * sent it.
+ * @param lpRoom Reference to the ROOM instance whose members should receive
+ * the message.
+ * @param pszMessage Address of the buffer containing the message to be sent.
+ * @param lpSendingClient Reference to the CLIENTSTRUCT instance of the sender.
+ * May be NULL, in which case all members of the room receive the message.
+ * @returns Total number of bytes sent.
+ * @remarks Only the members of the room are visited, so the cost of this
+ * function is proportional to the size of the room, not of the server.
+ */
+int BroadcastToRoomExceptSender(LPROOM lpRoom, const char* pszMessage,
+		LPCLIENTSTRUCT lpSendingClient);
+
+/**
+ * @brief Syncs and closes the message logs of all the rooms.
+ * @remarks Used when another server process is about to take the logs over.
+ * While they are closed, chat messages are not logged.
+ */
+void CloseAllRoomLogs();
+
+/**
+ * @brief Delivers a chat message that was said in a room on a peer server to
+ * the members of the room of the same name on this server.
+ * @param pszRoomName Name of the room.
+ * @param pszMessage The chat message, exactly as it is to be sent.
+ * @returns Total number of bytes sent.
+ * @remarks The message is also kept in the room's history and log.  Nothing
+ * is done if the room has no members on this server.
+ */
+int DeliverPeerChatToRoom(const char* pszRoomName, const char* pszMessage);
+
+/**
+ * @brief Delivers a notice (such as that a chatter joined the room) from a
+ * peer server to the members of the room of the same name on this server.
+ * @param pszRoomName Name of the room.
+ * @param pszNotice The notice, exactly as it is to be sent.
+ * @returns Total number of bytes sent.
+ */
+int DeliverPeerNoticeToRoom(const char* pszRoomName, const char* pszNotice);
+
+/**
+ * @brief Moves a client into the room having the specified name, creating
+ * the room if it does not exist yet.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the client.
+ * @param pszRoomName Name of the room to join.
+ * @returns Reference to the room that was joined, or NULL if the maximum
+ * count of rooms has been reached.
+ * @remarks If the client is already in a room, it leaves that room first.
+ */
+LPROOM JoinRoom(LPCLIENTSTRUCT lpClient, const char* pszRoomName);
+
+/**
+ * @brief Removes a client from the room it is currently in, if any.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the client.
+ * @remarks Rooms other than the default room are destroyed when their last
+ * member leaves.
+ */
+void LeaveCurrentRoom(LPCLIENTSTRUCT lpClient);
+
+/**
+ * @brief Processes the server's behavior upon receiving the JOIN command.
+ * @param lpSendingClient Pointer to an instance of CLIENTSTRUCT that refers
+ * to the client who sent the command.
+ * @param pszBuffer Address of a buffer containing data received from the
+ * client.
+ * @returns TRUE, since the command is always handled.
+ */
+BOOL ProcessJoinCommand(LPCLIENTSTRUCT lpSendingClient, char* pszBuffer);
+
+/**
+ * @brief Processes the server's behavior upon receiving the PART command.
+ * @param lpSendingClient Pointer to an instance of CLIENTSTRUCT that refers
+ * to the client who sent the command.
+ * @remarks Moves the client back into the default room.
+ */
+void ProcessPartCommand(LPCLIENTSTRUCT lpSendingClient);
+
+/**
+ * @brief Opens again the message logs of all the rooms that were closed by
+ * the CloseAllRoomLogs function.
+ */
+void OpenAllRoomLogs();
+
+/**
+ * @brief Processes the server's behavior upon receiving the HISTORY command.
+ * @param lpSendingClient Pointer to an instance of CLIENTSTRUCT that refers
+ * to the client who sent the command.
+ * @param pszBuffer Address of a buffer containing data received from the
+ * client.
+ * @returns TRUE, since the command is always handled.
+ * @remarks Sends up to the requested count of the most recent lines of the
+ * log of the client's room, straight from the segment files on disk.
+ */
+BOOL ProcessHistoryCommand(LPCLIENTSTRUCT lpSendingClient, char* pszBuffer);
+
+/**
+ * @brief Processes the server's behavior upon receiving the MUTE or UNMUTE
+ * command.
+ * @param lpSendingClient Pointer to an instance of CLIENTSTRUCT that refers
+ * to the client who sent the command.
+ * @param bMuted TRUE if the client no longer wants to be sent the chat
+ * messages of the other members of its room; FALSE if it wants them again.
+ * @remarks Muted clients still receive notices, messages that mention them,
+ * and messages tagged with hashtags they follow.
+ */
+void ProcessMuteCommand(LPCLIENTSTRUCT lpSendingClient, BOOL bMuted);
+
+/**
+ * @brief Sends a client the most recent chat messages of the room it is in.
+ * @param lpClient Reference to the CLIENTSTRUCT instance of the client.
+ * @remarks At most HISTORY_REPLAY_COUNT messages are sent, all with a single
+ * write, so the cost does not depend on how much has been said in the room.
+ */
+void ReplayRoomHistory(LPCLIENTSTRUCT lpClient);
+
+#endif /* __ROOM_MANAGER_H__ */
@@ -0,0 +1,88 @@
+// roster.h - Defines the interface for the roster, which is the list of the
+// nicknames of the chatters on this server that the LIST command returns.
+// The whole reply to LIST is kept ready in a shared message buffer, and is
+// only built again after the roster has changed, so that LIST costs a single
+// write.  Each change gives the roster a new version number, and the last
+// ROSTER_CHANGE_LOG_SIZE changes are kept, so that a client that already has
+// the roster at some version can be sent just the joins and leaves since.
+//
+
+#ifndef __ROSTER_H__
+#define __ROSTER_H__
+
+#include "stdafx.h"
+#include "server_symbols.h"
+
+#include "message_buffer.h"
+
+/**
+ * @brief Structure that holds one change to the roster.
+ */
+typedef struct _tagROSTERCHANGE {
+	/**
+	 * @name nVersion
+	 * @brief Version that the roster had just after the change.
+	 */
+	uint64_t nVersion;
+
+	/**
+	 * @name bJoined
+	 * @brief TRUE if the nickname was added to the roster; FALSE if it was
+	 * taken out.
+	 */
+	BOOL bJoined;
+
+	/**
+	 * @name szNickname
+	 * @brief The nickname.
+	 */
+	char szNickname[MAX_NICKNAME_LEN + 1];
+} ROSTERCHANGE, *LPROSTERCHANGE;
+
+/**
+ * @brief Adds a nickname to the roster, giving the roster a new version.
+ * @param pszNickname The nickname, which must not already be on the roster.
+ * @remarks Called with the nickname index locked, so that the changes to the
+ * roster are made in the same order as those to the index.
+ */
+void AddToRoster(const char* pszNickname);
+
+/**
+ * @brief Sets up the roster, empty and at version zero.
+ */
+void CreateRoster();
+
+/**
+ * @brief Throws away the roster, and the reply to LIST that was kept for it.
+ */
+void DestroyRoster();
+
+/**
+ * @brief Gets the reply to LIST SINCE for a client that has the roster at the
+ * version given: the joins and leaves since then, in the order they happened.
+ * @param nVersion The version the client has.
+ * @returns Reference to a MESSAGEBUFFER with the whole reply, which the caller
+ * must release with ReleaseMessageBuffer; or NULL if the changes since that
+ * version are no longer kept, or if there is no such version, in which case
+ * the client has to be sent the whole roster instead.
+ */
+LPMESSAGEBUFFER GetRosterChangesSince(uint64_t nVersion);
+
+/**
+ * @brief Gets the reply to LIST: the nicknames of all the chatters on the
+ * roster, and the version of the roster.
+ * @returns Reference to a MESSAGEBUFFER with the whole reply, which the caller
+ * must release with ReleaseMessageBuffer.
+ * @remarks The reply is only built again if the roster has changed since it
+ * was last built; otherwise the same buffer is shared.
+ */
+LPMESSAGEBUFFER GetRosterSnapshot();
+
+/**
+ * @brief Takes a nickname out of the roster, giving the roster a new version.
+ * @param pszNickname The nickname.
+ * @remarks Called with the nickname index locked, like AddToRoster.
+ */
+void RemoveFromRoster(const char* pszNickname);
+
+#endif /* __ROSTER_H__ */
@@ -14,21 +14,32 @@ BOOL CheckCommandLineArgs(int argc, char *argv[]);
  * @brief Frees resources consumed by the server and exits the application
  * with the specified code.
  * @param nExitCode Exit code to supply to the operating system when this
- * program is terminated.
+ * program is terminated, unless an earlier call asked for another one.
+ * @remarks Does not return.  Called on any thread but the main one, it only
+ * requests a shutdown and ends the calling thread; the main thread then frees
+ * the resources and exits.
  */
 void CleanupServer(int nExitCode);
 void ConfigureLogFile();
 void CreateClientListMutex();
 void CreateMasterAcceptorThread();
+void CreateRoomListMutex();
 struct sockaddr_in* CreateSockAddr();
 void DestroyClientListMutex();
+void DestroyRoomListMutex();
+
+/**
+ * @brief Computes a hash (FNV-1a) of a string, for use as a key in the hash
+ * indices the server keeps.
+ * @param pszValue Address of the string to be hashed.
+ * @returns The hash value.  Use the low-order bits to pick a bucket.
+ */
+unsigned int GetStringHash(const char* pszValue);
 BOOL InitializeApplication();
-void InstallSigintHandler();
 void ParseCommandLine(int argc, char *argv[],
 	int* pnPort, BOOL* pbDiagnosticMode);
 void PrintSoftwareTitleAndCopyright();
 void QuitServer();
-void ServerCleanupHandler(int signum);
 void SetUpServerOnPort(int nPort);
 
 #endif /* __SERVER_FUNCTIONS_H__ */
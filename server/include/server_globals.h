@@ -16,6 +16,13 @@
  */
 extern POSITION* g_pClientList;
 
+/**
+ * @brief Reference to the linked list of chat rooms.
+ * @remarks Each element's data is a ROOM instance.  Access to the list must
+ * be guarded by the room-list mutex.
+ */
+extern POSITION* g_pRoomList;
+
 ///////////////////////////////////////////////////////////////////////////////
 // Getter and setter accessors for file-scoped globals
 
@@ -33,6 +40,13 @@ HMUTEX GetClientListMutex();
  */
 HTHREAD GetMasterThreadHandle();
 
+/**
+ * @brief Gets a handle to the mutex used for accessing the list of rooms.
+ * @returns Handle to the mutex; INVALID_HANDLE_VALUE if it has not been
+ * initialized yet.
+ */
+HMUTEX GetRoomListMutex();
+
 /**
  * @brief Gets a value that specifies the port number on which this server
  * has been configured to listen.
@@ -73,6 +87,12 @@ void SetDiagnosticMode(BOOL value);
  */
 void SetMasterThreadHandle(HTHREAD value);
 
+/**
+ * @brief Sets the handle value to use for the room-list mutex.
+ * @param value New value for the mutex handle.
+ */
+void SetRoomListMutex(HMUTEX value);
+
 /**
  * @brief Sets the port number on which this server is configured to listen.
  * @param value New value for the port number.
@@ -5,6 +5,392 @@
 #ifndef __SERVER_SYMBOLS_H__
 #define __SERVER_SYMBOLS_H__
 
+/**
+ * @brief Error message to display when the listening socket of an acceptor
+ * shard could not be set up.  The shard number and the reason follow.
+ */
+#ifndef ACCEPTOR_SHARD_FAILED
+#define ACCEPTOR_SHARD_FAILED \
+	"server: Failed to start acceptor shard %d: %s\n"
+#endif //ACCEPTOR_SHARD_FAILED
+
+/**
+ * @brief Most acceptor shards that the -shards option may ask for.
+ */
+#ifndef ACCEPTOR_SHARD_MAX_COUNT
+#define ACCEPTOR_SHARD_MAX_COUNT		64
+#endif //ACCEPTOR_SHARD_MAX_COUNT
+
+/**
+ * @brief Command-line option that sets how many acceptor shards the server
+ * runs.  Each has its own listening socket on the server's port, and is
+ * pinned to a CPU along with the threads of the clients it accepts.
+ */
+#ifndef ACCEPTOR_SHARD_OPTION
+#define ACCEPTOR_SHARD_OPTION			"-shards"
+#endif //ACCEPTOR_SHARD_OPTION
+
+/**
+ * @brief Format of the line that reports, when the server shuts down, how
+ * many connections each acceptor shard accepted.
+ */
+#ifndef ACCEPTOR_SHARD_STATS
+#define ACCEPTOR_SHARD_STATS \
+	"Acceptor shard %d (CPU %d): %llu connections accepted.\n"
+#endif //ACCEPTOR_SHARD_STATS
+
+/**
+ * @brief Count of entries in the table of per-address connection counts.  A
+ * power of two, and more than twice ADMISSION_MAX_CONNECTIONS, so that the
+ * table can never fill up and its probe sequences stay short.
+ */
+#ifndef ADMISSION_ADDRESS_TABLE_SIZE
+#define ADMISSION_ADDRESS_TABLE_SIZE	1024
+#endif //ADMISSION_ADDRESS_TABLE_SIZE
+
+/**
+ * @brief Most connections, from all addresses together, that are let past
+ * the admission check at once.  No more than MAX_CLIENT_LIST_ENTRIES, so that
+ * the list of clients can never overflow.
+ */
+#ifndef ADMISSION_MAX_CONNECTIONS
+#define ADMISSION_MAX_CONNECTIONS		MAX_CLIENT_LIST_ENTRIES
+#endif //ADMISSION_MAX_CONNECTIONS
+
+/**
+ * @brief Most connections from any one IP address that are let past the
+ * admission check at once.
+ */
+#ifndef ADMISSION_MAX_CONNECTIONS_PER_ADDRESS
+#define ADMISSION_MAX_CONNECTIONS_PER_ADDRESS	16
+#endif //ADMISSION_MAX_CONNECTIONS_PER_ADDRESS
+
+/**
+ * @brief Format of the line that reports, when the server shuts down, how
+ * many connections were turned away as soon as they were accepted.
+ */
+#ifndef ADMISSION_STATS
+#define ADMISSION_STATS \
+	"Admission: %llu connections rejected at accept (%llu over the total " \
+	"cap, %llu over the per-address cap).\n"
+#endif //ADMISSION_STATS
+
+/**
+ * @brief Number of times each benchmark calls the function it measures
+ * between readings of the clock.  The mailboxes of the benchmark clients are
+ * emptied after each batch, outside of the time measured.
+ */
+#ifndef BENCHMARK_BATCH_SIZE
+#define BENCHMARK_BATCH_SIZE			64
+#endif //BENCHMARK_BATCH_SIZE
+
+/**
+ * @brief Chat message that the benchmarks broadcast.  It has a hashtag, which
+ * no one follows, so that the message is scanned the way most of them are.
+ */
+#ifndef BENCHMARK_CHAT_LINE
+#define BENCHMARK_CHAT_LINE	\
+	"Has anyone had a chance to try out the new build yet? #release\n"
+#endif //BENCHMARK_CHAT_LINE
+
+/**
+ * @brief Address given to the benchmark clients.  It is not an IP address,
+ * so they are never counted against the connections from any real address.
+ */
+#ifndef BENCHMARK_CLIENT_ADDRESS
+#define BENCHMARK_CLIENT_ADDRESS		"benchmark"
+#endif //BENCHMARK_CLIENT_ADDRESS
+
+/**
+ * @brief Error message displayed when a benchmark client cannot be given its
+ * nickname or be put in the benchmark room, such as when the server already
+ * has a chatter with that nickname.
+ */
+#ifndef BENCHMARK_CLIENT_REJECTED
+#define BENCHMARK_CLIENT_REJECTED	\
+	"server: Benchmark client %d could not be given a nickname and a room.\n"
+#endif //BENCHMARK_CLIENT_REJECTED
+
+/**
+ * @brief Command-line option that sets how many benchmark clients there are.
+ */
+#ifndef BENCHMARK_CLIENTS_OPTION
+#define BENCHMARK_CLIENTS_OPTION		"-clients"
+#endif //BENCHMARK_CLIENTS_OPTION
+
+/**
+ * @brief Number of benchmarks that are run.
+ */
+#ifndef BENCHMARK_COUNT
+#define BENCHMARK_COUNT					6
+#endif //BENCHMARK_COUNT
+
+/**
+ * @brief Number of benchmark clients there are if the -clients option is not
+ * given.
+ */
+#ifndef BENCHMARK_DEFAULT_CLIENT_COUNT
+#define BENCHMARK_DEFAULT_CLIENT_COUNT	100
+#endif //BENCHMARK_DEFAULT_CLIENT_COUNT
+
+/**
+ * @brief Number of times each function is called if the -iterations option
+ * is not given.
+ */
+#ifndef BENCHMARK_DEFAULT_ITERATION_COUNT
+#define BENCHMARK_DEFAULT_ITERATION_COUNT	10000
+#endif //BENCHMARK_DEFAULT_ITERATION_COUNT
+
+/**
+ * @brief Command-line option that sets how many times each function is
+ * called.
+ */
+#ifndef BENCHMARK_ITERATIONS_OPTION
+#define BENCHMARK_ITERATIONS_OPTION		"-iterations"
+#endif //BENCHMARK_ITERATIONS_OPTION
+
+/**
+ * @brief Formats of the start of the JSON file that the benchmark results are
+ * written to, of each result in it, and of its end.  The comma that separates
+ * the results is written before each of them but the first.
+ */
+#ifndef BENCHMARK_JSON_HEADER
+#define BENCHMARK_JSON_HEADER	\
+	"{\n  \"clients\": %d,\n  \"batch_size\": %d,\n  \"socket_io\": " \
+	"\"stubbed\",\n  \"benchmarks\": ["
+#endif //BENCHMARK_JSON_HEADER
+
+#ifndef BENCHMARK_JSON_RESULT
+#define BENCHMARK_JSON_RESULT	\
+	"%s\n    {\"name\": \"%s\", \"iterations\": %d, \"total_ns\": %llu, " \
+	"\"mean_ns\": %.1f, \"best_ns\": %.1f}"
+#endif //BENCHMARK_JSON_RESULT
+
+#ifndef BENCHMARK_JSON_FOOTER
+#define BENCHMARK_JSON_FOOTER			"\n  ]\n}\n"
+#endif //BENCHMARK_JSON_FOOTER
+
+/**
+ * @brief NICK command whose nickname the benchmarks parse.
+ */
+#ifndef BENCHMARK_NICK_COMMAND
+#define BENCHMARK_NICK_COMMAND			"NICK benchmarker\n"
+#endif //BENCHMARK_NICK_COMMAND
+
+/**
+ * @brief Format of the nicknames of the benchmark clients.
+ */
+#ifndef BENCHMARK_NICKNAME_FORMAT
+#define BENCHMARK_NICKNAME_FORMAT		"bench%d"
+#endif //BENCHMARK_NICKNAME_FORMAT
+
+/**
+ * @brief Command-line option, given in place of the port number, that runs
+ * the benchmarks instead of the server.
+ */
+#ifndef BENCHMARK_OPTION
+#define BENCHMARK_OPTION				"-benchmark"
+#endif //BENCHMARK_OPTION
+
+/**
+ * @brief Error message displayed when the file that the benchmark results go
+ * in cannot be written.
+ */
+#ifndef BENCHMARK_OUTPUT_FAILED
+#define BENCHMARK_OUTPUT_FAILED	\
+	"server: Failed to write the benchmark results to '%s': %s\n"
+#endif //BENCHMARK_OUTPUT_FAILED
+
+/**
+ * @brief Message displayed once the benchmark results have been written.
+ */
+#ifndef BENCHMARK_RESULTS_WRITTEN
+#define BENCHMARK_RESULTS_WRITTEN	\
+	"server: Benchmark results for %d clients written to '%s'.\n"
+#endif //BENCHMARK_RESULTS_WRITTEN
+
+/**
+ * @brief Room that the benchmark clients chat in, so that the benchmarks do
+ * not add to the history or the log of the default room.
+ */
+#ifndef BENCHMARK_ROOM_NAME
+#define BENCHMARK_ROOM_NAME				"benchmark"
+#endif //BENCHMARK_ROOM_NAME
+
+/**
+ * @brief Error message displayed when a benchmark client cannot be set up.
+ */
+#ifndef BENCHMARK_SETUP_FAILED
+#define BENCHMARK_SETUP_FAILED	\
+	"server: Failed to set up benchmark client %d: %s\n"
+#endif //BENCHMARK_SETUP_FAILED
+
+/**
+ * @brief Size, in bytes, of the header of a binary protocol frame: a
+ * big-endian 32-bit value whose top 8 bits are the opcode and whose low 24
+ * bits are the length of the payload that follows.
+ */
+#ifndef BINARY_FRAME_HEADER_SIZE
+#define BINARY_FRAME_HEADER_SIZE	4
+#endif //BINARY_FRAME_HEADER_SIZE
+
+/**
+ * @brief Largest payload, in bytes, of a frame that a client may send.  A
+ * client that sends a bigger one is disconnected.
+ */
+#ifndef BINARY_MAX_CLIENT_PAYLOAD_LEN
+#define BINARY_MAX_CLIENT_PAYLOAD_LEN	BUFLEN
+#endif //BINARY_MAX_CLIENT_PAYLOAD_LEN
+
+/**
+ * @brief Largest payload, in bytes, that fits in the 24-bit length of a
+ * binary protocol frame.
+ */
+#ifndef BINARY_MAX_PAYLOAD_LEN
+#define BINARY_MAX_PAYLOAD_LEN		0xFFFFFF
+#endif //BINARY_MAX_PAYLOAD_LEN
+
+/**
+ * @brief Opcode of the frame in which a client sends a line of a chat
+ * message (or of a direct message, after BINARY_OP_DM).
+ */
+#ifndef BINARY_OP_CHAT
+#define BINARY_OP_CHAT				0x01
+#endif //BINARY_OP_CHAT
+
+/**
+ * @brief Opcode of the frame in which the server sends lines of a room's
+ * history, exactly as they are kept in its log, newlines and all.
+ */
+#ifndef BINARY_OP_DATA
+#define BINARY_OP_DATA				0x84
+#endif //BINARY_OP_DATA
+
+/**
+ * @brief Opcode of the frame in which a client sends the DM command.  The
+ * payload is the nickname of the recipient.
+ */
+#ifndef BINARY_OP_DM
+#define BINARY_OP_DM				0x0D
+#endif //BINARY_OP_DM
+
+/**
+ * @brief Opcode of the frame that ends a direct message (from a client) or a
+ * multi-line reply (from the server).  Takes the place of the dot on a line
+ * by itself.
+ */
+#ifndef BINARY_OP_END
+#define BINARY_OP_END				0x02
+#endif //BINARY_OP_END
+
+/**
+ * @brief Opcode of the frame in which a client sends the FOLLOW command.  The
+ * payload is the hashtag.
+ */
+#ifndef BINARY_OP_FOLLOW
+#define BINARY_OP_FOLLOW			0x09
+#endif //BINARY_OP_FOLLOW
+
+/**
+ * @brief Opcode of the frame in which a client sends the HISTORY command.
+ * The payload is the count, in decimal.
+ */
+#ifndef BINARY_OP_HISTORY
+#define BINARY_OP_HISTORY			0x08
+#endif //BINARY_OP_HISTORY
+
+/**
+ * @brief Opcode of the frame in which a client sends the JOIN command.  The
+ * payload is the name of the room.
+ */
+#ifndef BINARY_OP_JOIN
+#define BINARY_OP_JOIN				0x06
+#endif //BINARY_OP_JOIN
+
+/**
+ * @brief Opcode of the frame in which a client sends the LIST command.
+ */
+#ifndef BINARY_OP_LIST
+#define BINARY_OP_LIST				0x04
+#endif //BINARY_OP_LIST
+
+/**
+ * @brief Opcode of the frame in which the server sends a chat message or a
+ * notice, without its trailing newline.
+ */
+#ifndef BINARY_OP_MESSAGE
+#define BINARY_OP_MESSAGE			0x82
+#endif //BINARY_OP_MESSAGE
+
+/**
+ * @brief Opcode of the frame in which a client sends the MUTE command.
+ */
+#ifndef BINARY_OP_MUTE
+#define BINARY_OP_MUTE				0x0B
+#endif //BINARY_OP_MUTE
+
+/**
+ * @brief Opcode of the frame in which a client sends the NICK command.  The
+ * payload is the nickname.
+ */
+#ifndef BINARY_OP_NICK
+#define BINARY_OP_NICK				0x03
+#endif //BINARY_OP_NICK
+
+/**
+ * @brief Opcode of the frame in which a client sends the PART command.
+ */
+#ifndef BINARY_OP_PART
+#define BINARY_OP_PART				0x07
+#endif //BINARY_OP_PART
+
+/**
+ * @brief Opcode of the frame in which the server sends a PING.  The payload
+ * is the sequence number of the PING, in decimal.
+ */
+#ifndef BINARY_OP_PING
+#define BINARY_OP_PING				0x85
+#endif //BINARY_OP_PING
+
+/**
+ * @brief Opcode of the frame in which a client answers a PING.  The payload
+ * is the sequence number of the PING being answered.
+ */
+#ifndef BINARY_OP_PONG
+#define BINARY_OP_PONG				0x0E
+#endif //BINARY_OP_PONG
+
+/**
+ * @brief Opcode of the frame in which a client sends the QUIT command.
+ */
+#ifndef BINARY_OP_QUIT
+#define BINARY_OP_QUIT				0x05
+#endif //BINARY_OP_QUIT
+
+/**
+ * @brief Opcode of the frame in which the server sends a reply.  The payload
+ * is the reply code, as a big-endian 16-bit number, followed by the text of
+ * the reply without the code or the trailing newline.
+ */
+#ifndef BINARY_OP_REPLY
+#define BINARY_OP_REPLY				0x81
+#endif //BINARY_OP_REPLY
+
+/**
+ * @brief Opcode of the frame in which a client sends the UNFOLLOW command.
+ * The payload is the hashtag.
+ */
+#ifndef BINARY_OP_UNFOLLOW
+#define BINARY_OP_UNFOLLOW			0x0A
+#endif //BINARY_OP_UNFOLLOW
+
+/**
+ * @brief Opcode of the frame in which a client sends the UNMUTE command.
+ */
+#ifndef BINARY_OP_UNMUTE
+#define BINARY_OP_UNMUTE			0x0C
+#endif //BINARY_OP_UNMUTE
+
 /**
  * @brief Standardized size for buffers.
  */
@@ -12,10 +398,23 @@
 #define BUFLEN					1024
 #endif //BUFLEN
 
-#ifndef CALLING_CLEANUP_HANDLER
-#define CALLING_CLEANUP_HANDLER \
-	"\nserver: Calling cleanup handler...\n"
-#endif //CALLING_CLEANUP_HANDLER
+/**
+ * @brief Most bytes that a chat message may have, counting the newline at the
+ * end of each of its lines.  This is the size of the arena that each client's
+ * lines are put together in; a longer message is thrown away, and the client
+ * is sent ERROR_CHAT_MESSAGE_TOO_LONG.
+ */
+#ifndef CHAT_MESSAGE_MAX_LENGTH
+#define CHAT_MESSAGE_MAX_LENGTH		2048
+#endif //CHAT_MESSAGE_MAX_LENGTH
+
+/**
+ * @brief Most characters that each line of a chat message may have, not
+ * counting the newline at its end, per protocol.
+ */
+#ifndef CHAT_MESSAGE_MAX_LINE_LENGTH
+#define CHAT_MESSAGE_MAX_LINE_LENGTH	80
+#endif //CHAT_MESSAGE_MAX_LINE_LENGTH
 
 /**
  * @brief Defines a format string for logging how many bytes were just
@@ -48,7 +447,7 @@
     "C[%s:%d]: <disconnected>\n"
 #endif //CLIENT_DISCONNECTED
 
-#define CLIENT_ID_FORMAT        "C[%s:%d] Client ID is '{%s}'.\n"
+#define CLIENT_ID_FORMAT        "C[%s:%d] Connection ID is %s.\n"
 
 #ifndef CLIENT_IP_ADDR_UNK
 #define CLIENT_IP_ADDR_UNK		"server: Client IP address not known.\n"
@@ -59,11 +458,124 @@
 	"Client '{%s}': %ld B received, %ld B sent.\n"
 #endif //CLIENT_SESSION_STATS
 
+/**
+ * @brief Format of the line that is logged when a client is disconnected
+ * because one of its timeouts expired.
+ */
+#ifndef CLIENT_TIMED_OUT
+#define CLIENT_TIMED_OUT \
+	"C[%s:%d]: Timed out %s; disconnecting.\n"
+#endif //CLIENT_TIMED_OUT
+
 #ifndef CLIENT_THREAD_ENDING
 #define CLIENT_THREAD_ENDING \
 	"server: Client thread ending.\n"
 #endif // CLIENT_THREAD_ENDING
 
+/**
+ * @brief Format of the line that is logged, in diagnostic mode, with the UUID
+ * that labels a client outside of this server.
+ */
+#ifndef CLIENT_UUID_LABEL_FORMAT
+#define CLIENT_UUID_LABEL_FORMAT \
+	"C[%s:%d] Client UUID is '{%s}'.\n"
+#endif //CLIENT_UUID_LABEL_FORMAT
+
+/**
+ * @brief Size, in bytes, of a client's UUID label as a string (36 hex digits
+ * and dashes), including the null terminator.
+ */
+#ifndef CLIENT_UUID_LABEL_SIZE
+#define CLIENT_UUID_LABEL_SIZE			37
+#endif //CLIENT_UUID_LABEL_SIZE
+
+/**
+ * @brief Level that deflate streams compress at.  Chat text is short and
+ * repetitive, so the default level already finds most of what there is to
+ * find.
+ */
+#ifndef COMPRESSION_LEVEL
+#define COMPRESSION_LEVEL			6
+#endif //COMPRESSION_LEVEL
+
+/**
+ * @brief How much memory zlib uses for the state of each deflate stream, on
+ * its scale of 1 to 9.
+ */
+#ifndef COMPRESSION_MEM_LEVEL
+#define COMPRESSION_MEM_LEVEL		8
+#endif //COMPRESSION_MEM_LEVEL
+
+/**
+ * @brief Size, in bytes, of the chunks that compressed output is written to
+ * the socket in.
+ */
+#ifndef COMPRESSION_OUTPUT_CHUNK_SIZE
+#define COMPRESSION_OUTPUT_CHUNK_SIZE	16384
+#endif //COMPRESSION_OUTPUT_CHUNK_SIZE
+
+/**
+ * @brief Count of messages a room's compression group compresses between
+ * resets of its history, when some of the room's compressed members are not
+ * in step with it.  Those members can only rejoin the group after a reset,
+ * and until then their copies are compressed for each of them separately.
+ */
+#ifndef COMPRESSION_RESYNC_INTERVAL
+#define COMPRESSION_RESYNC_INTERVAL	64
+#endif //COMPRESSION_RESYNC_INTERVAL
+
+/**
+ * @brief Format of the line that reports how well the data sent to one
+ * client was compressed, when its session ends.
+ */
+#ifndef COMPRESSION_SESSION_STATS
+#define COMPRESSION_SESSION_STATS \
+	"Client '{%s}': %ld B compressed to %ld B (%.2f:1), %.3f ms CPU.\n"
+#endif //COMPRESSION_SESSION_STATS
+
+/**
+ * @brief Format of the line that reports how well all the data sent to
+ * compressed clients was compressed, when the server shuts down.
+ */
+#ifndef COMPRESSION_STATS
+#define COMPRESSION_STATS \
+	"Compression: %llu B compressed to %llu B (%.2f:1), %.3f ms CPU; " \
+	"%llu room messages compressed once for %llu recipients.\n"
+#endif //COMPRESSION_STATS
+
+/**
+ * @brief Base-two logarithm of the size of the history window of each
+ * deflate stream.  Streams are raw deflate, with no zlib header or trailer.
+ */
+#ifndef COMPRESSION_WINDOW_BITS
+#define COMPRESSION_WINDOW_BITS		15
+#endif //COMPRESSION_WINDOW_BITS
+
+/**
+ * @brief Count of the low-order bits of a connection ID that hold the number
+ * of the connection within its acceptor shard.  The bits above them hold the
+ * number of the shard, plus one; zero there means a client that was handed
+ * over by a hot restart.
+ */
+#ifndef CONNECTION_ID_COUNTER_BITS
+#define CONNECTION_ID_COUNTER_BITS		48
+#endif //CONNECTION_ID_COUNTER_BITS
+
+/**
+ * @brief Format of a connection ID as a string: the shard part, then the
+ * counter part.
+ */
+#ifndef CONNECTION_ID_FORMAT
+#define CONNECTION_ID_FORMAT			"%u.%llu"
+#endif //CONNECTION_ID_FORMAT
+
+/**
+ * @brief Size, in bytes, of a buffer that holds a connection ID as a string.
+ */
+#ifndef CONNECTION_ID_STRING_SIZE
+#define CONNECTION_ID_STRING_SIZE		32
+#endif //CONNECTION_ID_STRING_SIZE
+
 /**
  * @brief Copyright message to display on the server's console.
  */
@@ -71,6 +583,14 @@
 #define COPYRIGHT_MESSAGE	"Copyright (c) 2018-19 by Brian Hart.\n\n"
 #endif //COPYRIGHT_MESSAGE
 
+/**
+ * @brief Name of the room that clients are placed into when they issue the
+ * HELO command, and that they return to when they PART another room.
+ */
+#ifndef DEFAULT_ROOM_NAME
+#define DEFAULT_ROOM_NAME			"lobby"
+#endif //DEFAULT_ROOM_NAME
+
 #ifndef DIAGNOSTIC_MODE_PARM_COUNT
 #define DIAGNOSTIC_MODE_PARM_COUNT		3
 #endif //DIAGNOSTIC_MODE_PARM_COUNT
@@ -80,6 +600,14 @@
 	"server: Disconnected client detected."
 #endif //DISCONNECTED_CLIENT_DETECTED
 
+/**
+ * @brief Prefix put in front of each line of a direct message when it is
+ * sent to its recipient.
+ */
+#ifndef DM_MESSAGE_PREFIX
+#define DM_MESSAGE_PREFIX			"!%s (DM): "
+#endif //DM_MESSAGE_PREFIX
+
 #ifndef ERROR_CANT_ADD_NULL_CLIENT
 #define ERROR_CANT_ADD_NULL_CLIENT \
 	"ERROR: Can't add a null reference to the list of connected clients.\n"
@@ -90,6 +618,55 @@
 	"ERROR: No storage specified for diagnostic mode indicator.\n"
 #endif //ERROR_CANT_PARSE_DIAGNOSTIC_MODE
 
+/**
+ * @brief Error reply that is sent to a client, when it sends the dot that ends
+ * a chat message, if one of the lines of the message was longer than
+ * CHAT_MESSAGE_MAX_LINE_LENGTH.  The message is thrown away.
+ */
+#ifndef ERROR_CHAT_LINE_TOO_LONG
+#define ERROR_CHAT_LINE_TOO_LONG	\
+	"415 Each line of a chat message may be no more than 80 characters " \
+	"long; the message was dropped.\n"
+#endif //ERROR_CHAT_LINE_TOO_LONG
+
+/**
+ * @brief Error reply that is sent to a client, when it sends the dot that ends
+ * a chat message, if the message did not fit into CHAT_MESSAGE_MAX_LENGTH
+ * bytes.  The message is thrown away.
+ */
+#ifndef ERROR_CHAT_MESSAGE_TOO_LONG
+#define ERROR_CHAT_MESSAGE_TOO_LONG	\
+	"416 The chat message is too long; the message was dropped.\n"
+#endif //ERROR_CHAT_MESSAGE_TOO_LONG
+
+/**
+ * @brief Error reply that is sent to clients who issue the DM command for a
+ * nickname that no connected chatter has, or whose recipient disconnects
+ * while the direct message is being sent.
+ */
+#ifndef ERROR_DM_RECIPIENT_NOT_FOUND
+#define ERROR_DM_RECIPIENT_NOT_FOUND \
+	"411 No chatter with that nickname is connected.\n"
+#endif //ERROR_DM_RECIPIENT_NOT_FOUND
+
+/**
+ * @brief Error reply that is sent to clients who issue the DM command with
+ * their own nickname.
+ */
+#ifndef ERROR_DM_TO_SELF
+#define ERROR_DM_TO_SELF \
+	"412 You cannot send a direct message to yourself.\n"
+#endif //ERROR_DM_TO_SELF
+
+/**
+ * @brief Error reply that is sent to a client, just before it is disconnected,
+ * when it floods the chat and the rate-limiting policy is "disconnect".
+ */
+#ifndef ERROR_FLOOD_DISCONNECT
+#define ERROR_FLOOD_DISCONNECT		"509 You have been disconnected for " \
+									"sending messages too fast.\n"
+#endif //ERROR_FLOOD_DISCONNECT
+
 /**
  * @brief Message to send to clients indicating that the server application
  * has been forcibly terminated by its console interactive user.
@@ -99,16 +676,101 @@
 									"operator.\n"
 #endif //ERROR_FORCED_DISCONNECT
 
+/**
+ * @brief Error reply that is sent to a client, just before it is
+ * disconnected, when it has not said HELO within TIMEOUT_HANDSHAKE_MS of
+ * connecting.
+ */
+#ifndef ERROR_HANDSHAKE_TIMEOUT
+#define ERROR_HANDSHAKE_TIMEOUT		"510 Timed out waiting for HELO.\n"
+#endif //ERROR_HANDSHAKE_TIMEOUT
+
+/**
+ * @brief Error reply that is sent to clients when a hashtag is given to the
+ * FOLLOW or UNFOLLOW command and it's an invalid format or length.
+ */
+#ifndef ERROR_HASHTAG_INVALID
+#define ERROR_HASHTAG_INVALID \
+	"408 Hashtag is invalid format or length.\n"
+#endif //ERROR_HASHTAG_INVALID
+
+/**
+ * @brief Error reply that is sent when a hashtag nobody follows yet is to be
+ * followed but the maximum count of hashtags is already being followed.
+ */
+#ifndef ERROR_HASHTAG_LIMIT_REACHED
+#define ERROR_HASHTAG_LIMIT_REACHED \
+	"507 The maximum count of followed hashtags has been reached.\n"
+#endif //ERROR_HASHTAG_LIMIT_REACHED
+
+/**
+ * @brief Reply sent to a client, on a best-effort basis, just before it is
+ * disconnected, when it has not answered a PING within the heartbeat timeout.
+ */
+#ifndef ERROR_HEARTBEAT_TIMEOUT
+#define ERROR_HEARTBEAT_TIMEOUT \
+	"512 You have been disconnected for not answering PING.\n"
+#endif //ERROR_HEARTBEAT_TIMEOUT
+
+/**
+ * @brief Error reply that is sent to clients who issue the HISTORY command
+ * with a count that is not a number from 1 to HISTORY_MAX_LINE_COUNT.
+ */
+#ifndef ERROR_HISTORY_COUNT_INVALID
+#define ERROR_HISTORY_COUNT_INVALID \
+	"413 The count of lines of history must be from 1 to %d.\n"
+#endif //ERROR_HISTORY_COUNT_INVALID
+
+/**
+ * @brief Error reply that is sent to clients who issue the HISTORY command
+ * when the log of their room could not be opened, or could not be read.
+ */
+#ifndef ERROR_HISTORY_UNAVAILABLE
+#define ERROR_HISTORY_UNAVAILABLE \
+	"508 The history of this room is not available.\n"
+#endif //ERROR_HISTORY_UNAVAILABLE
+
+/**
+ * @brief Error reply that is sent to a client, just before it is
+ * disconnected, when it has sent nothing for TIMEOUT_IDLE_MS.
+ */
+#ifndef ERROR_IDLE_TIMEOUT
+#define ERROR_IDLE_TIMEOUT \
+	"511 You have been disconnected for being idle too long.\n"
+#endif //ERROR_IDLE_TIMEOUT
+
+/**
+ * @brief Error reply that is sent when the LIST SINCE command is not followed
+ * by a roster version number.
+ */
+#ifndef ERROR_LIST_VERSION_INVALID
+#define ERROR_LIST_VERSION_INVALID	\
+	"417 LIST SINCE must be followed by the version of the list of " \
+	"chatters.\n"
+#endif //ERROR_LIST_VERSION_INVALID
+
 /**
  * @brief Protocol response sent when too many clients are already connected.
  * @remarks Error reply to a HELO command from a client when more than the
- * maximum allowed connected clients are already connected.
+ * maximum allowed connected clients are already connected.  Also sent, as a
+ * canned reply, to a connection that is turned away as soon as it is
+ * accepted because ADMISSION_MAX_CONNECTIONS are already open.
  */
 #ifndef ERROR_MAX_CONNECTIONS_EXCEEDED
 #define ERROR_MAX_CONNECTIONS_EXCEEDED \
     "502 The maximum count of connected clients has been exceeded.\n"
 #endif //ERROR_MAX_CONNECTIONS_EXCEEDED
 
+/**
+ * @brief Canned reply that a connection is sent, just before it is closed,
+ * when too many connections are already open from its IP address.
+ */
+#ifndef ERROR_MAX_CONNECTIONS_PER_ADDRESS_EXCEEDED
+#define ERROR_MAX_CONNECTIONS_PER_ADDRESS_EXCEEDED \
+    "502 The maximum count of connections from your address has been " \
+    "exceeded.\n"
+#endif //ERROR_MAX_CONNECTIONS_PER_ADDRESS_EXCEEDED
+
 #ifndef ERROR_NICKNAME_IN_USE
 #define ERROR_NICKNAME_IN_USE \
     "504 The requested nickname is already in use.\n"
@@ -145,16 +807,76 @@
     "402 Nickname is invalid format or length."
 #endif //ERROR_NICK_TOO_LONG
 
+/**
+ * @brief Error reply that is sent to clients who issue the UNFOLLOW command
+ * for a hashtag that they are not following.
+ */
+#ifndef ERROR_NOT_FOLLOWING_HASHTAG
+#define ERROR_NOT_FOLLOWING_HASHTAG \
+	"410 You are not following that hashtag.\n"
+#endif //ERROR_NOT_FOLLOWING_HASHTAG
+
+/**
+ * @brief Error reply that is sent to clients who issue the PART command while
+ * they are in the default room.
+ */
+#ifndef ERROR_NOT_IN_ROOM
+#define ERROR_NOT_IN_ROOM \
+	"407 You are not in a room that you can leave.\n"
+#endif //ERROR_NOT_IN_ROOM
+
+/**
+ * @brief Error reply that is sent to a client when a chat message of theirs is
+ * thrown away because they are sending too fast, and the rate-limiting policy
+ * is "drop".
+ */
+#ifndef ERROR_RATE_LIMITED
+#define ERROR_RATE_LIMITED	\
+	"414 You are sending messages too fast; the message was dropped.\n"
+#endif //ERROR_RATE_LIMITED
+
+/**
+ * @brief Error reply that is sent when a new room is requested but the
+ * maximum count of rooms already exists.
+ */
+#ifndef ERROR_ROOM_LIMIT_REACHED
+#define ERROR_ROOM_LIMIT_REACHED \
+	"506 The maximum count of chat rooms has been reached.\n"
+#endif //ERROR_ROOM_LIMIT_REACHED
+
+/**
+ * @brief Error reply that is sent to clients when a room name is proposed
+ * and it's an invalid format or length.
+ */
+#ifndef ERROR_ROOM_NAME_INVALID
+#define ERROR_ROOM_NAME_INVALID \
+	"406 Room name is invalid format or length.\n"
+#endif //ERROR_ROOM_NAME_INVALID
+
 #ifndef ERROR_TOO_MANY_CLIENTS
 #define ERROR_TOO_MANY_CLIENTS \
     "ERROR: Maximum number of connected clients (%d) exceeded.\n"
 #endif //ERROR_TOO_MANY_CLIENTS
 
+/**
+ * @brief Error reply that is sent to clients who issue the FOLLOW command
+ * when they already follow MAX_FOLLOWED_HASHTAGS hashtags.
+ */
+#ifndef ERROR_TOO_MANY_FOLLOWED_HASHTAGS
+#define ERROR_TOO_MANY_FOLLOWED_HASHTAGS \
+	"409 You are already following the maximum count of hashtags.\n"
+#endif //ERROR_TOO_MANY_FOLLOWED_HASHTAGS
+
 #ifndef FAILED_ALLOC_CLIENT_STRUCT
 #define FAILED_ALLOC_CLIENT_STRUCT \
     "Failed to allocate memory for client list entry structure.\n"
 #endif //FAILED_ALLOC_CLIENT_STRUCT
 
+#ifndef FAILED_CREATE_MAILBOX
+#define FAILED_CREATE_MAILBOX \
+	"server: Failed to create the mailbox of a new client: %s\n"
+#endif //FAILED_CREATE_MAILBOX
+
 #ifndef FAILED_CREATE_NEW_CLIENT
 #define FAILED_CREATE_NEW_CLIENT	"server: Failed to create new client " \
 									"list entry.\n"
@@ -175,6 +897,151 @@
 									"channel.\n"
 #endif //FAILED_LAUNCH_CLIENT_THREAD
 
+#ifndef FAILED_LAUNCH_LOG_FLUSHER_THREAD
+#define FAILED_LAUNCH_LOG_FLUSHER_THREAD \
+	"server: Failed to launch the message log flusher thread.\n"
+#endif //FAILED_LAUNCH_LOG_FLUSHER_THREAD
+
+#ifndef FAILED_LAUNCH_PRESENCE_THREAD
+#define FAILED_LAUNCH_PRESENCE_THREAD \
+	"server: Failed to launch the presence notice thread.\n"
+#endif //FAILED_LAUNCH_PRESENCE_THREAD
+
+#ifndef FAILED_LAUNCH_FEDERATION_THREAD
+#define FAILED_LAUNCH_FEDERATION_THREAD \
+	"server: Failed to launch a peer server link thread.\n"
+#endif //FAILED_LAUNCH_FEDERATION_THREAD
+
+#ifndef FAILED_LAUNCH_HOT_RESTART_THREAD
+#define FAILED_LAUNCH_HOT_RESTART_THREAD \
+	"server: Failed to launch the hot restart thread.\n"
+#endif //FAILED_LAUNCH_HOT_RESTART_THREAD
+
+#ifndef FAILED_LAUNCH_SHUTDOWN_THREAD
+#define FAILED_LAUNCH_SHUTDOWN_THREAD \
+	"server: Failed to launch the shutdown signal thread.\n"
+#endif //FAILED_LAUNCH_SHUTDOWN_THREAD
+
+/**
+ * @brief Size, in bytes, of the header of each event in an inter-node frame:
+ * type (1), hop count (1), room name length (2), origin node ID (4), origin
+ * incarnation (8), sequence number (8), nickname length (2) and text length
+ * (2), all big-endian.
+ */
+#ifndef FEDERATION_EVENT_HEADER_SIZE
+#define FEDERATION_EVENT_HEADER_SIZE	28
+#endif //FEDERATION_EVENT_HEADER_SIZE
+
+/**
+ * @brief Time, in milliseconds, between sends of the events queued for each
+ * peer link.  All the events queued for a link in one interval go out in one
+ * frame.
+ */
+#ifndef FEDERATION_FLUSH_INTERVAL_MS
+#define FEDERATION_FLUSH_INTERVAL_MS	5
+#endif //FEDERATION_FLUSH_INTERVAL_MS
+
+/**
+ * @brief Size, in bytes, of the header of an inter-node frame: payload length
+ * (4) and event count (2), big-endian, and two reserved bytes.
+ */
+#ifndef FEDERATION_FRAME_HEADER_SIZE
+#define FEDERATION_FRAME_HEADER_SIZE	8
+#endif //FEDERATION_FRAME_HEADER_SIZE
+
+/**
+ * @brief Message to display when the server starts listening for links from
+ * peer servers.
+ */
+#ifndef FEDERATION_LISTENING_ON_PORT
+#define FEDERATION_LISTENING_ON_PORT \
+	"server: Node %u listening for peer servers on port %d\n"
+#endif //FEDERATION_LISTENING_ON_PORT
+
+/**
+ * @brief Largest payload, in bytes, of an inter-node frame.  A peer that
+ * sends a bigger one, or falls so far behind that more than this much is
+ * queued for it, is disconnected (and reconnects).
+ */
+#ifndef FEDERATION_MAX_FRAME_SIZE
+#define FEDERATION_MAX_FRAME_SIZE		(1024 * 1024)
+#endif //FEDERATION_MAX_FRAME_SIZE
+
+/**
+ * @brief Largest count of servers an event is relayed through.  Duplicate
+ * suppression already keeps events from going around in circles; this is a
+ * backstop for when the table of origins is full.
+ */
+#ifndef FEDERATION_MAX_HOPS
+#define FEDERATION_MAX_HOPS				8
+#endif //FEDERATION_MAX_HOPS
+
+/**
+ * @brief Largest count of peer links, inbound and outbound, that a server
+ * can have at once.
+ */
+#ifndef FEDERATION_MAX_LINKS
+#define FEDERATION_MAX_LINKS			32
+#endif //FEDERATION_MAX_LINKS
+
+/**
+ * @brief Largest count of nodes whose recent events are remembered for
+ * duplicate suppression.
+ */
+#ifndef FEDERATION_MAX_NODES
+#define FEDERATION_MAX_NODES			64
+#endif //FEDERATION_MAX_NODES
+
+/**
+ * @brief Largest count of -peer options that may be given on the command
+ * line.
+ */
+#ifndef FEDERATION_MAX_PEERS
+#define FEDERATION_MAX_PEERS			16
+#endif //FEDERATION_MAX_PEERS
+
+/**
+ * @brief Command-line option that sets this server's node ID, which must be
+ * unique within the cluster.  Defaults to the port number.
+ */
+#ifndef FEDERATION_NODE_OPTION
+#define FEDERATION_NODE_OPTION			"-node"
+#endif //FEDERATION_NODE_OPTION
+
+/**
+ * @brief Command-line option, followed by <host>:<port>, that makes the
+ * server link to a peer server's peer port.  May be given more than once.
+ */
+#ifndef FEDERATION_PEER_OPTION
+#define FEDERATION_PEER_OPTION			"-peer"
+#endif //FEDERATION_PEER_OPTION
+
+/**
+ * @brief Command-line option that sets the port on which the server accepts
+ * links from peer servers.
+ */
+#ifndef FEDERATION_PEER_PORT_OPTION
+#define FEDERATION_PEER_PORT_OPTION		"-peerport"
+#endif //FEDERATION_PEER_PORT_OPTION
+
+/**
+ * @brief Time, in milliseconds, between attempts to (re)connect to a peer
+ * server, or to bind the peer port if it is still in use (for example, by
+ * the server process that a hot restart is replacing).
+ */
+#ifndef FEDERATION_RETRY_INTERVAL_MS
+#define FEDERATION_RETRY_INTERVAL_MS	1000
+#endif //FEDERATION_RETRY_INTERVAL_MS
+
+/**
+ * @brief Time, in milliseconds, that sending a frame to a peer server may
+ * block for before the link is given up on.  Keeps one slow peer from holding
+ * up the others.
+ */
+#ifndef FEDERATION_SEND_TIMEOUT_MS
+#define FEDERATION_SEND_TIMEOUT_MS		1000
+#endif //FEDERATION_SEND_TIMEOUT_MS
+
 /**
  * @brief Error message to display when we've failed to receive text from the
  * client.
@@ -184,6 +1051,15 @@
     "ERROR: Failed to receive the line of text back from the client.\n"
 #endif //FAILED_RECEIVE_TEXT_FROM_CLIENT
 
+/**
+ * @brief Error message to display when the write-stall timeout could not be
+ * set on the socket of a client.
+ */
+#ifndef FAILED_SET_SEND_TIMEOUT
+#define FAILED_SET_SEND_TIMEOUT \
+	"server: Failed to set the send timeout of socket %d: %s\n"
+#endif //FAILED_SET_SEND_TIMEOUT
+
 /**
  * @brief Error message that is displayed when a function is given a NULL
  * pointer for its pvData parameter.
@@ -204,6 +1080,209 @@
     "wasn't expecting it.\n"
 #endif //INVALID_PTR_ARG
 
+/**
+ * @brief Count of buckets in the hashtag index.  Must be a power of two.
+ */
+#ifndef HASHTAG_INDEX_BUCKET_COUNT
+#define HASHTAG_INDEX_BUCKET_COUNT	1024
+#endif //HASHTAG_INDEX_BUCKET_COUNT
+
+/**
+ * @brief Count of followers for which room is made when a hashtag gets its
+ * first follower.  The array doubles in size as needed after that.
+ */
+#ifndef HASHTAG_INITIAL_FOLLOWER_CAPACITY
+#define HASHTAG_INITIAL_FOLLOWER_CAPACITY	4
+#endif //HASHTAG_INITIAL_FOLLOWER_CAPACITY
+
+/**
+ * @brief Default time, in seconds, between the PINGs that the server sends
+ * each client.  Zero turns the heartbeat off.
+ */
+#ifndef HEARTBEAT_DEFAULT_INTERVAL_SECONDS
+#define HEARTBEAT_DEFAULT_INTERVAL_SECONDS	30
+#endif //HEARTBEAT_DEFAULT_INTERVAL_SECONDS
+
+/**
+ * @brief Default time, in seconds, that a client has to answer a PING before
+ * it is disconnected.
+ */
+#ifndef HEARTBEAT_DEFAULT_TIMEOUT_SECONDS
+#define HEARTBEAT_DEFAULT_TIMEOUT_SECONDS	10
+#endif //HEARTBEAT_DEFAULT_TIMEOUT_SECONDS
+
+/**
+ * @brief Command-line option that sets the time between PINGs, in seconds.
+ */
+#ifndef HEARTBEAT_INTERVAL_OPTION
+#define HEARTBEAT_INTERVAL_OPTION		"-pinginterval"
+#endif //HEARTBEAT_INTERVAL_OPTION
+
+/**
+ * @brief Count of buckets in a histogram of round-trip times.  Bucket zero
+ * counts the round trips shorter than a millisecond; bucket i, those of
+ * at least 2^(i-1) but less than 2^i milliseconds; and the last bucket, all
+ * of the longer ones.
+ */
+#ifndef HEARTBEAT_RTT_BUCKET_COUNT
+#define HEARTBEAT_RTT_BUCKET_COUNT		16
+#endif //HEARTBEAT_RTT_BUCKET_COUNT
+
+/**
+ * @brief Weight given to each new round-trip time in the smoothed round-trip
+ * time of a client (the same weight TCP gives its samples).
+ */
+#ifndef HEARTBEAT_RTT_EWMA_WEIGHT
+#define HEARTBEAT_RTT_EWMA_WEIGHT		0.125
+#endif //HEARTBEAT_RTT_EWMA_WEIGHT
+
+/**
+ * @brief Format of the line that reports the round-trip times of a client
+ * when its session ends.
+ */
+#ifndef HEARTBEAT_SESSION_STATS
+#define HEARTBEAT_SESSION_STATS \
+	"C[%s]: Round trip %.3f ms smoothed, %.3f ms min, %.3f ms max, " \
+	"over %llu PINGs;%s\n"
+#endif //HEARTBEAT_SESSION_STATS
+
+/**
+ * @brief Format of the line that reports, when the server shuts down, how
+ * many PINGs were sent and answered, and the histogram of round-trip times.
+ */
+#ifndef HEARTBEAT_STATS
+#define HEARTBEAT_STATS \
+	"Heartbeat: %llu PINGs sent, %llu answered; round trips:%s\n"
+#endif //HEARTBEAT_STATS
+
+/**
+ * @brief Command-line option that sets the time a client has to answer a
+ * PING, in seconds.
+ */
+#ifndef HEARTBEAT_TIMEOUT_OPTION
+#define HEARTBEAT_TIMEOUT_OPTION		"-pingtimeout"
+#endif //HEARTBEAT_TIMEOUT_OPTION
+
+/**
+ * @brief Largest count of lines of history that can be asked for with the
+ * HISTORY command.
+ */
+#ifndef HISTORY_MAX_LINE_COUNT
+#define HISTORY_MAX_LINE_COUNT		10000
+#endif //HISTORY_MAX_LINE_COUNT
+
+/**
+ * @brief Count of chat messages kept in the history of each room.  When it is
+ * full, each new message takes the place of the oldest one.
+ */
+#ifndef HISTORY_RING_CAPACITY
+#define HISTORY_RING_CAPACITY		64
+#endif //HISTORY_RING_CAPACITY
+
+/**
+ * @brief Count of the most recent chat messages of a room that are sent to
+ * chatters when they arrive in it.  Must not be more than
+ * HISTORY_RING_CAPACITY.
+ */
+#ifndef HISTORY_REPLAY_COUNT
+#define HISTORY_REPLAY_COUNT		20
+#endif //HISTORY_REPLAY_COUNT
+
+/**
+ * @brief Time, in milliseconds, that the server waits for the new server
+ * process to confirm that it has taken over, during a hot restart.
+ */
+#ifndef HOT_RESTART_ACK_TIMEOUT_MS
+#define HOT_RESTART_ACK_TIMEOUT_MS	10000
+#endif //HOT_RESTART_ACK_TIMEOUT_MS
+
+/**
+ * @brief Message to display when a hot restart has been handed off to the
+ * new server process, right before this one exits.
+ */
+#ifndef HOT_RESTART_COMPLETE
+#define HOT_RESTART_COMPLETE \
+	"server: Handed %d client(s) over to the new server process (pid %d).\n"
+#endif //HOT_RESTART_COMPLETE
+
+/**
+ * @brief Message to display when a hot restart could not be carried out.
+ * The server keeps running as it was.
+ */
+#ifndef HOT_RESTART_FAILED
+#define HOT_RESTART_FAILED \
+	"server: Hot restart failed (%s); carrying on as before.\n"
+#endif //HOT_RESTART_FAILED
+
+/**
+ * @brief Name of the environment variable through which the server process
+ * started by a hot restart is told the file descriptor of its end of the
+ * handoff channel.
+ */
+#ifndef HOT_RESTART_FD_VARIABLE
+#define HOT_RESTART_FD_VARIABLE		"CHATTR_HOT_RESTART_FD"
+#endif //HOT_RESTART_FD_VARIABLE
+
+/**
+ * @brief Value at the start of the first message sent over the handoff
+ * channel, so that the new server process knows it is talking to a server.
+ */
+#ifndef HOT_RESTART_MAGIC
+#define HOT_RESTART_MAGIC			0x43485254u	/* "CHRT" */
+#endif //HOT_RESTART_MAGIC
+
+/**
+ * @brief Time, in milliseconds, between checks of whether the threads have
+ * stopped reading from their sockets, during a hot restart.
+ */
+#ifndef HOT_RESTART_POLL_INTERVAL_MS
+#define HOT_RESTART_POLL_INTERVAL_MS	10
+#endif //HOT_RESTART_POLL_INTERVAL_MS
+
+/**
+ * @brief Time, in milliseconds, that the server waits for all of its threads
+ * to stop reading from their sockets before it gives up on a hot restart.
+ */
+#ifndef HOT_RESTART_QUIESCE_TIMEOUT_MS
+#define HOT_RESTART_QUIESCE_TIMEOUT_MS	2000
+#endif //HOT_RESTART_QUIESCE_TIMEOUT_MS
+
+/**
+ * @brief Message to display when the operator asks for a hot restart (by
+ * sending the server the SIGUSR2 signal).
+ */
+#ifndef HOT_RESTART_STARTING
+#define HOT_RESTART_STARTING \
+	"server: Hot restart requested; handing over to a new server process...\n"
+#endif //HOT_RESTART_STARTING
+
+/**
+ * @brief Message to display when a server process started by a hot restart
+ * has taken over from the previous one.
+ */
+#ifndef HOT_RESTART_TAKEN_OVER
+#define HOT_RESTART_TAKEN_OVER \
+	"server: Took over %d client(s) from the previous server process.\n"
+#endif //HOT_RESTART_TAKEN_OVER
+
+/**
+ * @brief Message to display when a server process started by a hot restart
+ * could not take over from the previous one.
+ */
+#ifndef HOT_RESTART_TAKEOVER_FAILED
+#define HOT_RESTART_TAKEOVER_FAILED \
+	"server: Failed to take over from the previous server process.\n"
+#endif //HOT_RESTART_TAKEOVER_FAILED
+
+/**
+ * @brief Version of the layout of the messages sent over the handoff
+ * channel.  Must be changed whenever HOTRESTARTHEADER or HOTRESTARTCLIENT
+ * change, so that a server is never handed state it would misread.
+ */
+#ifndef HOT_RESTART_VERSION
+#define HOT_RESTART_VERSION			5
+#endif //HOT_RESTART_VERSION
+
 /**
  * @brief Maximum length of a string containing a valid IPv4 IP address.
  */
@@ -211,6 +1290,28 @@
 #define IPADDRLEN   				20
 #endif //IPADDRLEN
 
+/**
+ * @brief Size, in bytes, of the chunks that lines are read from a message
+ * log in, when they cannot be sent to a client straight from the file.
+ */
+#ifndef LOG_COPY_CHUNK_SIZE
+#define LOG_COPY_CHUNK_SIZE			65536
+#endif //LOG_COPY_CHUNK_SIZE
+
+/**
+ * @brief Path to the directory under which the durable message logs are kept.
+ */
+#ifndef LOG_DIRECTORY_PATH
+#define LOG_DIRECTORY_PATH			"/home/bhart/logs/chattr/history"
+#endif //LOG_DIRECTORY_PATH
+
+/**
+ * @brief Name of the message log that direct messages are kept in.
+ */
+#ifndef LOG_DM_NAME
+#define LOG_DM_NAME					"dm"
+#endif //LOG_DM_NAME
+
 /**
  * @brief fopen() mode for opening the log file.
  */
@@ -225,6 +1326,89 @@
 #define LOG_FILE_PATH				"/home/bhart/logs/chattr/server.log"
 #endif //LOG_FILE_PATH
 
+/**
+ * @brief Extension of the files that hold the sparse index of each segment
+ * of a message log.
+ */
+#ifndef LOG_INDEX_EXTENSION
+#define LOG_INDEX_EXTENSION			".idx"
+#endif //LOG_INDEX_EXTENSION
+
+/**
+ * @brief Count of lines of a message log segment per entry of its index.
+ */
+#ifndef LOG_INDEX_INTERVAL
+#define LOG_INDEX_INTERVAL			64
+#endif //LOG_INDEX_INTERVAL
+
+/**
+ * @brief Format of the name of the message log of a chat room.
+ */
+#ifndef LOG_ROOM_NAME_FORMAT
+#define LOG_ROOM_NAME_FORMAT		"rooms/%s"
+#endif //LOG_ROOM_NAME_FORMAT
+
+/**
+ * @brief Extension of the files that hold the segments of a message log.
+ */
+#ifndef LOG_SEGMENT_EXTENSION
+#define LOG_SEGMENT_EXTENSION		".log"
+#endif //LOG_SEGMENT_EXTENSION
+
+/**
+ * @brief Format of the path of a segment file (or its index): the log
+ * directory, then the sequence number of the first line of the segment,
+ * padded with zeroes so that the files sort in order, then the extension.
+ */
+#ifndef LOG_SEGMENT_NAME_FORMAT
+#define LOG_SEGMENT_NAME_FORMAT		"%s/%020llu%s"
+#endif //LOG_SEGMENT_NAME_FORMAT
+
+/**
+ * @brief Size, in bytes, of each segment of a message log.
+ */
+#ifndef LOG_SEGMENT_SIZE
+#define LOG_SEGMENT_SIZE			(16 * 1024 * 1024)
+#endif //LOG_SEGMENT_SIZE
+
+/**
+ * @brief Interval, in milliseconds, at which the message logs that have
+ * changed are synced to disk.  Lines appended within the same interval share
+ * a single sync (group commit).
+ */
+#ifndef LOG_SYNC_INTERVAL_MS
+#define LOG_SYNC_INTERVAL_MS		20
+#endif //LOG_SYNC_INTERVAL_MS
+
+/**
+ * @brief Most messages that the thread of a client writes out with one call
+ * to writev(), when it empties the client's mailbox.
+ */
+#ifndef MAILBOX_DRAIN_BATCH_SIZE
+#define MAILBOX_DRAIN_BATCH_SIZE	64
+#endif //MAILBOX_DRAIN_BATCH_SIZE
+
+/**
+ * @brief Most messages that may be waiting in the mailbox of a client.  A
+ * client that falls this far behind is disconnected, as if a write to it had
+ * stalled, rather than being allowed to use up the server's memory.
+ */
+#ifndef MAILBOX_MAX_ITEM_COUNT
+#define MAILBOX_MAX_ITEM_COUNT		4096
+#endif //MAILBOX_MAX_ITEM_COUNT
+
+/**
+ * @brief Format of the line that reports, when the server shuts down, how
+ * many messages were posted to the mailboxes of clients, how many times their
+ * threads had to be woken up for them, and how many clients fell too far
+ * behind.
+ */
+#ifndef MAILBOX_STATS
+#define MAILBOX_STATS \
+	"Mailboxes: %llu messages posted, %llu wakeups, %llu clients fell " \
+	"behind.\n"
+#endif //MAILBOX_STATS
+
 #ifndef MAX_ALLOWED_CONNECTIONS
 #define MAX_ALLOWED_CONNECTIONS     20
 #endif //MAX_ALLOWED_CONNECTIONS
@@ -234,19 +1418,113 @@
 #endif //MAX_CLIENT_LIST_ENTRIES
 
 /**
- * @brief Per protocol, the maximum length a line can be is 255 chars,
- * whether it's a command or a chat message.
+ * @brief Maximum count of hashtags that one client may follow.
+ */
+#ifndef MAX_FOLLOWED_HASHTAGS
+#define MAX_FOLLOWED_HASHTAGS		32
+#endif //MAX_FOLLOWED_HASHTAGS
+
+/**
+ * @brief Maximum count of distinct hashtags that may be followed, across all
+ * clients, at the same time.  Bounds the size of the hashtag index.
+ */
+#ifndef MAX_HASHTAG_COUNT
+#define MAX_HASHTAG_COUNT			4096
+#endif //MAX_HASHTAG_COUNT
+
+/**
+ * @brief Maximum length (in characters, not counting the '#') of a hashtag.
+ */
+#ifndef MAX_HASHTAG_LEN
+#define MAX_HASHTAG_LEN				31
+#endif //MAX_HASHTAG_LEN
+
+/**
+ * @brief Maximum count of distinct hashtags in one chat message that are
+ * used to deliver it to followers.  Any others are ignored.
+ */
+#ifndef MAX_HASHTAGS_PER_MESSAGE
+#define MAX_HASHTAGS_PER_MESSAGE	8
+#endif //MAX_HASHTAGS_PER_MESSAGE
+
+/**
+ * @brief Per protocol, the maximum length a line can be is 255 chars,
+ * whether it's a command or a chat message.
+ */
+#ifndef MAX_LINE_LENGTH
+#define MAX_LINE_LENGTH             255
+#endif //MAX_LINE_LENGTH
+
+/**
+ * @brief Maximum length (in characters) for a nickname.
+ */
+#ifndef MAX_NICKNAME_LEN
+#define MAX_NICKNAME_LEN            15
+#endif //MAX_NICKNAME_LEN
+
+/**
+ * @brief Maximum count of chat rooms that may exist at the same time.
+ */
+#ifndef MAX_ROOM_COUNT
+#define MAX_ROOM_COUNT				256
+#endif //MAX_ROOM_COUNT
+
+/**
+ * @brief Maximum length (in characters) for the name of a chat room.
+ */
+#ifndef MAX_ROOM_NAME_LEN
+#define MAX_ROOM_NAME_LEN			15
+#endif //MAX_ROOM_NAME_LEN
+
+/**
+ * @brief Maximum count of distinct chatters, mentioned in one chat message,
+ * that are sent a notification about it.  Any others are ignored.
+ */
+#ifndef MAX_MENTIONS_PER_MESSAGE
+#define MAX_MENTIONS_PER_MESSAGE	8
+#endif //MAX_MENTIONS_PER_MESSAGE
+
+/**
+ * @brief Prefix put in front of a chat message that is sent to a chatter it
+ * mentions who is in another room, or who has muted the room.
+ */
+#ifndef MENTION_NOTIFICATION_PREFIX
+#define MENTION_NOTIFICATION_PREFIX	"!@%s mentioned you in room %s: "
+#endif //MENTION_NOTIFICATION_PREFIX
+
+/**
+ * @brief Fault of a chat message that has a line longer than
+ * CHAT_MESSAGE_MAX_LINE_LENGTH.
+ */
+#ifndef MESSAGE_ASSEMBLY_LINE_TOO_LONG
+#define MESSAGE_ASSEMBLY_LINE_TOO_LONG	1
+#endif //MESSAGE_ASSEMBLY_LINE_TOO_LONG
+
+/**
+ * @brief Fault of a chat message that is being put together whose lines have
+ * all fitted so far.
  */
-#ifndef MAX_LINE_LENGTH
-#define MAX_LINE_LENGTH             255
-#endif //MAX_LINE_LENGTH
+#ifndef MESSAGE_ASSEMBLY_OK
+#define MESSAGE_ASSEMBLY_OK				0
+#endif //MESSAGE_ASSEMBLY_OK
 
 /**
- * @brief Maximum length (in characters) for a nickname.
+ * @brief Fault of a chat message that does not fit into
+ * CHAT_MESSAGE_MAX_LENGTH bytes.
  */
-#ifndef MAX_NICKNAME_LEN
-#define MAX_NICKNAME_LEN            15
-#endif //MAX_NICKNAME_LEN
+#ifndef MESSAGE_ASSEMBLY_TOO_LONG
+#define MESSAGE_ASSEMBLY_TOO_LONG		2
+#endif //MESSAGE_ASSEMBLY_TOO_LONG
+
+#ifndef MESSAGE_LOG_OPEN_FAILED
+#define MESSAGE_LOG_OPEN_FAILED \
+	"server: Could not open message log '%s': %s\n"
+#endif //MESSAGE_LOG_OPEN_FAILED
+
+#ifndef MESSAGE_LOG_WRITE_FAILED
+#define MESSAGE_LOG_WRITE_FAILED \
+	"server: Could not write to message log '%s': %s\n"
+#endif //MESSAGE_LOG_WRITE_FAILED
 
 #ifndef MIN_NICKNAME_PREFIX_SIZE
 #define MIN_NICKNAME_PREFIX_SIZE	4
@@ -266,6 +1544,54 @@
 #define	MSG_TERMINATOR			".\n"
 #endif //MSG_TERMINATOR
 
+/**
+ * @brief Count of buckets in the nickname index.  Must be a power of two.
+ */
+#ifndef NICKNAME_INDEX_BUCKET_COUNT
+#define NICKNAME_INDEX_BUCKET_COUNT	1024
+#endif //NICKNAME_INDEX_BUCKET_COUNT
+
+/**
+ * @brief Largest length, in chars, of the result carried by a
+ * PEER_EVENT_NICKNAME_REPLY.
+ */
+#ifndef NICKNAME_REPLY_MAX_LEN
+#define NICKNAME_REPLY_MAX_LEN			15
+#endif //NICKNAME_REPLY_MAX_LEN
+
+/**
+ * @brief Time, in milliseconds, that a chatter's thread waits for the owner
+ * of a nickname to answer a claim or lookup.  If no answer comes, a claim is
+ * granted, and a lookup finds nobody.
+ */
+#ifndef NICKNAME_REQUEST_TIMEOUT_MS
+#define NICKNAME_REQUEST_TIMEOUT_MS		2000
+#endif //NICKNAME_REQUEST_TIMEOUT_MS
+
+/**
+ * @brief Time, in milliseconds, between checks for the answer to a claim or
+ * lookup.
+ */
+#ifndef NICKNAME_REQUEST_POLL_INTERVAL_MS
+#define NICKNAME_REQUEST_POLL_INTERVAL_MS	1
+#endif //NICKNAME_REQUEST_POLL_INTERVAL_MS
+
+/**
+ * @brief Largest count of claims and lookups that may be waiting for an
+ * answer at once.
+ */
+#ifndef NICKNAME_MAX_PENDING_REQUESTS
+#define NICKNAME_MAX_PENDING_REQUESTS	256
+#endif //NICKNAME_MAX_PENDING_REQUESTS
+
+/**
+ * @brief Count of points each node has on the nickname ring.  The more there
+ * are, the more evenly the nicknames are spread over the nodes.
+ */
+#ifndef NICKNAME_RING_VIRTUAL_NODES
+#define NICKNAME_RING_VIRTUAL_NODES		64
+#endif //NICKNAME_RING_VIRTUAL_NODES
+
 /**
  * @brief Server's administrative message saying a new chatter joined.
  */
@@ -288,6 +1614,32 @@
 									"from %s.>\n"
 #endif //NEW_CLIENT_CONN
 
+/**
+ * @brief Response to the HELO BINARY command, signifying that everything
+ * after this line, in both directions, is sent in binary protocol frames.
+ */
+#ifndef OK_BINARY_MODE
+#define OK_BINARY_MODE \
+	"214 OK. Switching to binary frames.\n"
+#endif //OK_BINARY_MODE
+
+/**
+ * @brief Response to the HELO DEFLATE command, signifying that everything
+ * the server sends after this line is a raw deflate stream.
+ */
+#ifndef OK_DEFLATE_MODE
+#define OK_DEFLATE_MODE \
+	"215 OK. Switching to deflate.\n"
+#endif //OK_DEFLATE_MODE
+
+/**
+ * @brief Response to the DM command signifying that the recipient is
+ * connected and that the lines of the direct message may now be sent.
+ */
+#ifndef OK_DM_READY
+#define OK_DM_READY					"212 OK, what do you want to tell @%s?\n"
+#endif //OK_DM_READY
+
 /**
  * @brief Response to the HELO command indicating operation succeeded.
  * @remarks The HELO command is issued by clients right after they establish
@@ -310,17 +1662,58 @@
 #define OK_GOODBYE					"200 Goodbye.\n"
 #endif //OK_GOODBYE
 
+/**
+ * @brief Response to the FOLLOW command signifying operation succeeded.
+ */
+#ifndef OK_HASHTAG_FOLLOWED
+#define OK_HASHTAG_FOLLOWED			"208 OK you are now following #%s.\n"
+#endif //OK_HASHTAG_FOLLOWED
+
+/**
+ * @brief Response to the UNFOLLOW command signifying operation succeeded.
+ */
+#ifndef OK_HASHTAG_UNFOLLOWED
+#define OK_HASHTAG_UNFOLLOWED		"209 OK you are no longer following " \
+									"#%s.\n"
+#endif //OK_HASHTAG_UNFOLLOWED
+
+/**
+ * @brief Response to the HISTORY command signifying operation succeeded.
+ * @remarks The lines of history are delivered after this response, exactly
+ * as they were first sent, oldest first, and then a dot on a line by itself
+ * follows, indicating the end of the response.
+ */
+#ifndef OK_HISTORY_FOLLOWS
+#define OK_HISTORY_FOLLOWS \
+	"213 OK. History of room %s follows.  Ends with .\n"
+#endif //OK_HISTORY_FOLLOWS
+
+/**
+ * @brief Response from the server to the LIST SINCE command, when the changes
+ * since the version the client gave are still known.  The first number is
+ * that version and the second is the current one.
+ * @remarks Each change follows on a line of its own, in the order they
+ * happened, with ROSTER_JOINED_PREFIX or ROSTER_LEFT_PREFIX in front of the
+ * nickname, and then a dot on a line by itself.
+ */
+#ifndef OK_LIST_CHANGES_FOLLOW
+#define OK_LIST_CHANGES_FOLLOW \
+	"204 OK. Changes to the list of chatters since version %llu follow; " \
+	"it is now at version %llu.  Ends with .\n"
+#endif //OK_LIST_CHANGES_FOLLOW
+
 /**
  * @brief Response from the server in the case where a LIST command is issued
  * by the client.
  * @remarks The LIST command is used by clients to ask the server for a list
  * of the nicknames of all currently active chatters.  The list is delivered
  * after this response, one nickname per line, and then a dot on a line by
- * itself follows, indicating the end of the response.
+ * itself follows, indicating the end of the response.  The number is the
+ * version of the list, which the client may give to LIST SINCE later on.
  */
 #ifndef OK_LIST_FOLLOWS
 #define OK_LIST_FOLLOWS \
-	"203 OK. List of chatters follows.  Ends with .\n"
+	"203 OK. List of chatters at version %llu follows.  Ends with .\n"
 #endif //OK_LIST_FOLLOWS
 
 /**
@@ -332,30 +1725,324 @@
 #define OK_NICK_REGISTERED			"202 OK your nickname is %s.\n"
 #endif //OK_NICK_REGISTERED
 
+/**
+ * @brief Response to the JOIN command signifying operation succeeded.
+ */
+#ifndef OK_ROOM_JOINED
+#define OK_ROOM_JOINED				"206 OK you are now in room %s.\n"
+#endif //OK_ROOM_JOINED
+
+/**
+ * @brief Response to the PART command signifying operation succeeded.
+ */
+#ifndef OK_ROOM_PARTED
+#define OK_ROOM_PARTED				"207 OK you left room %s and are " \
+									"back in room %s.\n"
+#endif //OK_ROOM_PARTED
+
+/**
+ * @brief Response to the MUTE command signifying operation succeeded.
+ */
+#ifndef OK_ROOM_MUTED
+#define OK_ROOM_MUTED				"210 OK the chat in your room is now " \
+									"muted.\n"
+#endif //OK_ROOM_MUTED
+
+/**
+ * @brief Response to the UNMUTE command signifying operation succeeded.
+ */
+#ifndef OK_ROOM_UNMUTED
+#define OK_ROOM_UNMUTED				"211 OK the chat in your room is no " \
+									"longer muted.\n"
+#endif //OK_ROOM_UNMUTED
+
 #ifndef OUT_OF_MEMORY
 #define OUT_OF_MEMORY \
     "server: Insufficient operating system memory.\n"
 #endif //OUT_OF_MEMORY
 
+/**
+ * @brief Type of the inter-node event that carries a chat message said in a
+ * room.  The text is the message exactly as it was sent to the room.
+ */
+#ifndef PEER_EVENT_CHAT
+#define PEER_EVENT_CHAT					2
+#endif //PEER_EVENT_CHAT
+
+/**
+ * @brief Type of the event that carries a line of a direct message to the
+ * server its recipient is connected to.  The nickname is the recipient's; the
+ * text is the line, prefixed with the sender's nickname.
+ */
+#ifndef PEER_EVENT_DIRECT_MESSAGE
+#define PEER_EVENT_DIRECT_MESSAGE		9
+#endif //PEER_EVENT_DIRECT_MESSAGE
+
+/**
+ * @brief Type of the inter-node event that a server sends first on each peer
+ * link, to say what its node ID is.
+ */
+#ifndef PEER_EVENT_HELLO
+#define PEER_EVENT_HELLO				1
+#endif //PEER_EVENT_HELLO
+
+/**
+ * @brief Type of the inter-node event that says a chatter joined a room.
+ */
+#ifndef PEER_EVENT_JOIN
+#define PEER_EVENT_JOIN					3
+#endif //PEER_EVENT_JOIN
+
+/**
+ * @brief Type of the inter-node event that says a chatter left a room.
+ */
+#ifndef PEER_EVENT_LEAVE
+#define PEER_EVENT_LEAVE				4
+#endif //PEER_EVENT_LEAVE
+
+/**
+ * @brief Type of the event that asks the owner of a nickname to record it as
+ * taken by a chatter on the sending server.  The reply says whether it was;
+ * a request ID of zero means no reply is wanted.
+ */
+#ifndef PEER_EVENT_NICKNAME_CLAIM
+#define PEER_EVENT_NICKNAME_CLAIM		5
+#endif //PEER_EVENT_NICKNAME_CLAIM
+
+/**
+ * @brief Type of the event that asks the owner of a nickname which server the
+ * chatter who has it is connected to.  The reply is the node ID, or zero.
+ */
+#ifndef PEER_EVENT_NICKNAME_LOOKUP
+#define PEER_EVENT_NICKNAME_LOOKUP		7
+#endif //PEER_EVENT_NICKNAME_LOOKUP
+
+/**
+ * @brief Type of the event that tells the owner of a nickname that the
+ * sending server's chatter no longer has it.
+ */
+#ifndef PEER_EVENT_NICKNAME_RELEASE
+#define PEER_EVENT_NICKNAME_RELEASE		6
+#endif //PEER_EVENT_NICKNAME_RELEASE
+
+/**
+ * @brief Type of the event that answers a claim or lookup.  The sequence
+ * number is the ID of the request; the text is the result, in decimal.
+ */
+#ifndef PEER_EVENT_NICKNAME_REPLY
+#define PEER_EVENT_NICKNAME_REPLY		8
+#endif //PEER_EVENT_NICKNAME_REPLY
+
+/**
+ * @brief Message to display when a link to a peer server goes down.
+ */
+#ifndef PEER_LINK_DOWN
+#define PEER_LINK_DOWN					"server: Link to node %u (%s) is down.\n"
+#endif //PEER_LINK_DOWN
+
+/**
+ * @brief Message to display when a link to a peer server comes up.
+ */
+#ifndef PEER_LINK_UP
+#define PEER_LINK_UP					"server: Linked to node %u (%s).\n"
+#endif //PEER_LINK_UP
+
 #ifndef PORT_NUMBER_NOT_VALID
 #define PORT_NUMBER_NOT_VALID \
         "server: Port number must be in the range 1024-49151 inclusive.\n"
 #endif //PORT_NUMBER_NOT_VALID
 
+/**
+ * @brief Longest time, in milliseconds, that the joins and leaves of a storm
+ * are held back for before they are announced, when chatters are coming and
+ * going many times faster than PRESENCE_STORM_RATE.
+ */
+#ifndef PRESENCE_BATCH_MAX_INTERVAL_MS
+#define PRESENCE_BATCH_MAX_INTERVAL_MS	4000
+#endif //PRESENCE_BATCH_MAX_INTERVAL_MS
+
+/**
+ * @brief Shortest time, in milliseconds, that the joins and leaves of a storm
+ * are held back for before they are announced.  The interval grows with the
+ * rate of joins and leaves, up to PRESENCE_BATCH_MAX_INTERVAL_MS, so that the
+ * count of notices each chatter is sent during a storm stays about the same
+ * however big the storm is.
+ */
+#ifndef PRESENCE_BATCH_MIN_INTERVAL_MS
+#define PRESENCE_BATCH_MIN_INTERVAL_MS	250
+#endif //PRESENCE_BATCH_MIN_INTERVAL_MS
+
+/**
+ * @brief How a chatter who joined is named in a batched notice that has both
+ * joins and leaves in it.
+ */
+#ifndef PRESENCE_MIXED_JOINED_FORMAT
+#define PRESENCE_MIXED_JOINED_FORMAT	"@%s joined"
+#endif //PRESENCE_MIXED_JOINED_FORMAT
+
+/**
+ * @brief How a chatter who left is named in a batched notice that has both
+ * joins and leaves in it.
+ */
+#ifndef PRESENCE_MIXED_LEFT_FORMAT
+#define PRESENCE_MIXED_LEFT_FORMAT		"@%s left"
+#endif //PRESENCE_MIXED_LEFT_FORMAT
+
+/**
+ * @brief Count of the other chatters who joined, in a batched notice that has
+ * both joins and leaves in it.
+ */
+#ifndef PRESENCE_MIXED_MORE_JOINED_FORMAT
+#define PRESENCE_MIXED_MORE_JOINED_FORMAT	"%d more joined"
+#endif //PRESENCE_MIXED_MORE_JOINED_FORMAT
+
+/**
+ * @brief Count of the other chatters who left, in a batched notice that has
+ * both joins and leaves in it.
+ */
+#ifndef PRESENCE_MIXED_MORE_LEFT_FORMAT
+#define PRESENCE_MIXED_MORE_LEFT_FORMAT	"%d more left"
+#endif //PRESENCE_MIXED_MORE_LEFT_FORMAT
+
+/**
+ * @brief Template of a batched notice that has both joins and leaves in it,
+ * such as "!@a joined, @b left, 3000 more joined and 1998 more left."
+ */
+#ifndef PRESENCE_MIXED_NOTICE
+#define PRESENCE_MIXED_NOTICE			"!%s.\n"
+#endif //PRESENCE_MIXED_NOTICE
+
+/**
+ * @brief Count of the nicknames that are named in a batched notice; the rest
+ * are only counted.
+ */
+#ifndef PRESENCE_NAMED_NICKNAME_COUNT
+#define PRESENCE_NAMED_NICKNAME_COUNT	2
+#endif //PRESENCE_NAMED_NICKNAME_COUNT
+
+/**
+ * @brief What follows the nicknames named in a batched notice, if just one
+ * more chatter came or went.
+ */
+#ifndef PRESENCE_ONE_OTHER
+#define PRESENCE_ONE_OTHER				" and 1 other"
+#endif //PRESENCE_ONE_OTHER
+
+/**
+ * @brief What follows the nicknames named in a batched notice, with the count
+ * of the other chatters who came or went.
+ */
+#ifndef PRESENCE_OTHERS_FORMAT
+#define PRESENCE_OTHERS_FORMAT			" and %d others"
+#endif //PRESENCE_OTHERS_FORMAT
+
+/**
+ * @brief Length, in milliseconds, of the windows that the joins and leaves are
+ * counted over to tell whether there is a storm.
+ */
+#ifndef PRESENCE_RATE_WINDOW_MS
+#define PRESENCE_RATE_WINDOW_MS			1000
+#endif //PRESENCE_RATE_WINDOW_MS
+
+/**
+ * @brief Format of the statistics on presence notices, saying how many joins
+ * and leaves there were, how many were announced by themselves, and how many
+ * batched notices the rest went out in.
+ */
+#ifndef PRESENCE_STATS
+#define PRESENCE_STATS \
+	"Presence: %llu joins and leaves, %llu announced one by one, %llu in " \
+	"%llu batched notices.\n"
+#endif //PRESENCE_STATS
+
+/**
+ * @brief Count of joins and leaves in a PRESENCE_RATE_WINDOW_MS window from
+ * which on they are batched, instead of each being announced by itself.
+ */
+#ifndef PRESENCE_STORM_RATE
+#define PRESENCE_STORM_RATE				20
+#endif //PRESENCE_STORM_RATE
+
+/**
+ * @brief Command that a client sends to start a direct message to a single
+ * other chatter.
+ */
+#ifndef PROTOCOL_DM_COMMAND
+#define PROTOCOL_DM_COMMAND		"DM "
+#endif //PROTOCOL_DM_COMMAND
+
+/**
+ * @brief Command that a client sends to be sent the chat messages, from any
+ * room, that are tagged with a particular hashtag.
+ */
+#ifndef PROTOCOL_FOLLOW_COMMAND
+#define PROTOCOL_FOLLOW_COMMAND	"FOLLOW "
+#endif //PROTOCOL_FOLLOW_COMMAND
+
+// Protocol command that does what HELO does, and also switches the connection
+// over to binary protocol frames
+#ifndef PROTOCOL_HELO_BINARY_COMMAND
+#define PROTOCOL_HELO_BINARY_COMMAND	"HELO BINARY\n"
+#endif //PROTOCOL_HELO_BINARY_COMMAND
+
+// Protocol command that does what HELO does, and also has everything the
+// server sends from then on compressed
+#ifndef PROTOCOL_HELO_DEFLATE_COMMAND
+#define PROTOCOL_HELO_DEFLATE_COMMAND	"HELO DEFLATE\n"
+#endif //PROTOCOL_HELO_DEFLATE_COMMAND
+
 // Protocol command that gets this client marked as a member of the chat room
 #ifndef PROTOCOL_HELO_COMMAND
 #define PROTOCOL_HELO_COMMAND	"HELO\n"
 #endif //PROTOCOL_HELO_COMMAND
 
+// Protocol command that asks for the most recent lines of the room's log
+#ifndef PROTOCOL_HISTORY_COMMAND
+#define PROTOCOL_HISTORY_COMMAND	"HISTORY "
+#endif //PROTOCOL_HISTORY_COMMAND
+
+// Protocol command that moves this client into another chat room
+#ifndef PROTOCOL_JOIN_COMMAND
+#define PROTOCOL_JOIN_COMMAND	"JOIN "
+#endif //PROTOCOL_JOIN_COMMAND
+
 #ifndef PROTOCOL_LIST_COMMAND
 #define PROTOCOL_LIST_COMMAND	"LIST\n"
 #endif //PROTOCOL_LIST_COMMAND
 
+// Protocol command that asks for the changes to the list of chatters since a
+// version of it that the client already has
+#ifndef PROTOCOL_LIST_SINCE_COMMAND
+#define PROTOCOL_LIST_SINCE_COMMAND	"LIST SINCE "
+#endif //PROTOCOL_LIST_SINCE_COMMAND
+
+// Protocol command that stops delivery of the chat in this client's room
+#ifndef PROTOCOL_MUTE_COMMAND
+#define PROTOCOL_MUTE_COMMAND	"MUTE\n"
+#endif //PROTOCOL_MUTE_COMMAND
+
 // Protocol command that registers this user's chat handle with the server
 #ifndef PROTOCOL_NICK_COMMAND
 #define PROTOCOL_NICK_COMMAND	"NICK "
 #endif //PROTOCOL_NICK_COMMAND
 
+// Protocol command that moves this client back into the default room
+#ifndef PROTOCOL_PART_COMMAND
+#define PROTOCOL_PART_COMMAND	"PART\n"
+#endif //PROTOCOL_PART_COMMAND
+
+/**
+ * @brief Format of the PING the server sends to check that a client is still
+ * there.  The client answers with PONG and the same sequence number.
+ */
+#ifndef PROTOCOL_PING_FORMAT
+#define PROTOCOL_PING_FORMAT	"PING %u\n"
+#endif //PROTOCOL_PING_FORMAT
+
+#ifndef PROTOCOL_PONG_COMMAND
+#define PROTOCOL_PONG_COMMAND	"PONG "
+#endif //PROTOCOL_PONG_COMMAND
+
 /**
  * @brief Protocol command that 'logs the client off' from the chat server.
  */
@@ -363,6 +2050,177 @@
 #define PROTOCOL_QUIT_COMMAND	"QUIT\n"
 #endif //PROTOCOL_QUIT_COMMAND
 
+/**
+ * @brief Command that a client sends to stop following a hashtag.
+ */
+#ifndef PROTOCOL_UNFOLLOW_COMMAND
+#define PROTOCOL_UNFOLLOW_COMMAND	"UNFOLLOW "
+#endif //PROTOCOL_UNFOLLOW_COMMAND
+
+// Protocol command that restarts delivery of the chat in this client's room
+#ifndef PROTOCOL_UNMUTE_COMMAND
+#define PROTOCOL_UNMUTE_COMMAND	"UNMUTE\n"
+#endif //PROTOCOL_UNMUTE_COMMAND
+
+/**
+ * @brief Command-line option, followed by a count of seconds, that sets how
+ * many seconds' worth of messages and bytes a client may send in one burst
+ * before it is held to the rates.
+ */
+#ifndef RATE_LIMIT_BURST_OPTION
+#define RATE_LIMIT_BURST_OPTION			"-burst"
+#endif //RATE_LIMIT_BURST_OPTION
+
+/**
+ * @brief Command-line option, followed by a count of bytes, that sets how many
+ * bytes of chat messages per second each client may send.  Zero means no
+ * limit.
+ */
+#ifndef RATE_LIMIT_BYTE_RATE_OPTION
+#define RATE_LIMIT_BYTE_RATE_OPTION		"-byterate"
+#endif //RATE_LIMIT_BYTE_RATE_OPTION
+
+/**
+ * @brief Seconds' worth of messages and bytes a client may send in one burst,
+ * unless the -burst option says otherwise.
+ */
+#ifndef RATE_LIMIT_DEFAULT_BURST_SECONDS
+#define RATE_LIMIT_DEFAULT_BURST_SECONDS		4
+#endif //RATE_LIMIT_DEFAULT_BURST_SECONDS
+
+/**
+ * @brief Bytes of chat messages per second each client may send, unless the
+ * -byterate option says otherwise.
+ */
+#ifndef RATE_LIMIT_DEFAULT_BYTES_PER_SECOND
+#define RATE_LIMIT_DEFAULT_BYTES_PER_SECOND		4096
+#endif //RATE_LIMIT_DEFAULT_BYTES_PER_SECOND
+
+/**
+ * @brief Chat messages per second each client may send, unless the -msgrate
+ * option says otherwise.
+ */
+#ifndef RATE_LIMIT_DEFAULT_MESSAGES_PER_SECOND
+#define RATE_LIMIT_DEFAULT_MESSAGES_PER_SECOND	5
+#endif //RATE_LIMIT_DEFAULT_MESSAGES_PER_SECOND
+
+/**
+ * @brief Command-line option, followed by a count of messages, that sets how
+ * many chat messages per second each client may send.  Zero means no limit.
+ */
+#ifndef RATE_LIMIT_MESSAGE_RATE_OPTION
+#define RATE_LIMIT_MESSAGE_RATE_OPTION	"-msgrate"
+#endif //RATE_LIMIT_MESSAGE_RATE_OPTION
+
+/**
+ * @brief Rate-limiting policy under which a client that sends too fast is
+ * disconnected.
+ */
+#ifndef RATE_LIMIT_POLICY_DISCONNECT
+#define RATE_LIMIT_POLICY_DISCONNECT		2
+#endif //RATE_LIMIT_POLICY_DISCONNECT
+
+#ifndef RATE_LIMIT_POLICY_DISCONNECT_NAME
+#define RATE_LIMIT_POLICY_DISCONNECT_NAME	"disconnect"
+#endif //RATE_LIMIT_POLICY_DISCONNECT_NAME
+
+/**
+ * @brief Rate-limiting policy under which the messages a client sends too fast
+ * are thrown away, and the client is sent ERROR_RATE_LIMITED.
+ */
+#ifndef RATE_LIMIT_POLICY_DROP
+#define RATE_LIMIT_POLICY_DROP			1
+#endif //RATE_LIMIT_POLICY_DROP
+
+#ifndef RATE_LIMIT_POLICY_DROP_NAME
+#define RATE_LIMIT_POLICY_DROP_NAME		"drop"
+#endif //RATE_LIMIT_POLICY_DROP_NAME
+
+/**
+ * @brief Command-line option, followed by the name of one of the policies,
+ * that sets what is done with a client that sends too fast.
+ */
+#ifndef RATE_LIMIT_POLICY_OPTION
+#define RATE_LIMIT_POLICY_OPTION		"-ratepolicy"
+#endif //RATE_LIMIT_POLICY_OPTION
+
+/**
+ * @brief Rate-limiting policy under which a client that sends too fast is made
+ * to wait.  Its messages are held back, and the rest of what it sends waits
+ * in its socket, until it is back under the rates.  This is the default.
+ */
+#ifndef RATE_LIMIT_POLICY_QUEUE
+#define RATE_LIMIT_POLICY_QUEUE			0
+#endif //RATE_LIMIT_POLICY_QUEUE
+
+#ifndef RATE_LIMIT_POLICY_QUEUE_NAME
+#define RATE_LIMIT_POLICY_QUEUE_NAME	"queue"
+#endif //RATE_LIMIT_POLICY_QUEUE_NAME
+
+/**
+ * @brief Format of the line that reports, at the end of a client's session,
+ * how many of its chat messages were held back or dropped.
+ */
+#ifndef RATE_LIMIT_SESSION_STATS
+#define RATE_LIMIT_SESSION_STATS \
+	"Client '{%s}': %ld chat messages held back, %ld dropped by rate limits.\n"
+#endif //RATE_LIMIT_SESSION_STATS
+
+/**
+ * @brief Initial count of entries allocated for the member array of a room.
+ */
+#ifndef ROOM_INITIAL_MEMBER_CAPACITY
+#define ROOM_INITIAL_MEMBER_CAPACITY	8
+#endif //ROOM_INITIAL_MEMBER_CAPACITY
+
+/**
+ * @brief Administrative message to the members of a room saying that a
+ * chatter joined it.
+ */
+#ifndef ROOM_CHATTER_JOINED
+#define ROOM_CHATTER_JOINED			"!@%s joined room %s.\n"
+#endif //ROOM_CHATTER_JOINED
+
+/**
+ * @brief Administrative message to the members of a room saying that a
+ * chatter left it.
+ */
+#ifndef ROOM_CHATTER_LEFT
+#define ROOM_CHATTER_LEFT			"!@%s left room %s.\n"
+#endif //ROOM_CHATTER_LEFT
+
+/**
+ * @brief Count of the last changes to the roster that are kept, so that LIST
+ * SINCE can be answered with just the joins and leaves.  A client whose
+ * version is older than that is sent the whole roster.
+ */
+#ifndef ROSTER_CHANGE_LOG_SIZE
+#define ROSTER_CHANGE_LOG_SIZE		256
+#endif //ROSTER_CHANGE_LOG_SIZE
+
+/**
+ * @brief What goes in front of each nickname in the reply to LIST.
+ */
+#ifndef ROSTER_ENTRY_PREFIX
+#define ROSTER_ENTRY_PREFIX			"!@"
+#endif //ROSTER_ENTRY_PREFIX
+
+/**
+ * @brief What goes in front of the nickname of each chatter who joined, in
+ * the reply to LIST SINCE.
+ */
+#ifndef ROSTER_JOINED_PREFIX
+#define ROSTER_JOINED_PREFIX		"!+@"
+#endif //ROSTER_JOINED_PREFIX
+
+/**
+ * @brief What goes in front of the nickname of each chatter who left, in the
+ * reply to LIST SINCE.  Must be as long as ROSTER_JOINED_PREFIX.
+ */
+#ifndef ROSTER_LEFT_PREFIX
+#define ROSTER_LEFT_PREFIX			"!-@"
+#endif //ROSTER_LEFT_PREFIX
+
 /**
  * @brief Format string for logging data sent by the server.
  */
@@ -424,6 +2282,51 @@
 #define SERVER_SHUTTING_DOWN        "server: Shutting down...\n"
 #endif //SERVER_SHUTTING_DOWN
 
+/**
+ * @brief Longest time, in milliseconds, that a shutdown waits for the threads
+ * of the clients to say goodbye to them and stop by themselves.  Clients that
+ * are left after that are disconnected from the thread that is shutting the
+ * server down.
+ */
+#ifndef SHUTDOWN_DRAIN_TIMEOUT_MS
+#define SHUTDOWN_DRAIN_TIMEOUT_MS		3000
+#endif //SHUTDOWN_DRAIN_TIMEOUT_MS
+
+/**
+ * @brief Message to display if the signals that shut the server down cannot
+ * be routed to the shutdown signal thread.
+ */
+#ifndef SHUTDOWN_HANDLER_FAILED
+#define SHUTDOWN_HANDLER_FAILED \
+	"server: Unable to install the shutdown handler: %s\n"
+#endif //SHUTDOWN_HANDLER_FAILED
+
+/**
+ * @brief Interval, in milliseconds, at which a shutdown checks whether the
+ * threads have stopped yet.
+ */
+#ifndef SHUTDOWN_POLL_INTERVAL_MS
+#define SHUTDOWN_POLL_INTERVAL_MS		10
+#endif //SHUTDOWN_POLL_INTERVAL_MS
+
+/**
+ * @brief Message to display when a signal (such as the one sent by CTRL+C)
+ * tells the server to shut down.
+ */
+#ifndef SHUTDOWN_SIGNAL_RECEIVED
+#define SHUTDOWN_SIGNAL_RECEIVED \
+	"\nserver: Received %s; shutting down...\n"
+#endif //SHUTDOWN_SIGNAL_RECEIVED
+
+/**
+ * @brief Message to display if some threads had not stopped by the time
+ * SHUTDOWN_DRAIN_TIMEOUT_MS was up.
+ */
+#ifndef SHUTDOWN_THREADS_LEFT
+#define SHUTDOWN_THREADS_LEFT \
+	"server: %d thread(s) had not stopped after %d ms.\n"
+#endif //SHUTDOWN_THREADS_LEFT
+
 /**
  * @brief Title of this software for displaying on the console.
  */
@@ -431,12 +2334,109 @@
 #define SOFTWARE_TITLE              "Chattr TCP chat server v1.0\n"
 #endif //SOFTWARE_TITLE
 
+/**
+ * @brief Values of the nExpiredTimeout member of a CLIENTSTRUCT, which say
+ * which of the client's timeouts expired, if any.
+ */
+#ifndef TIMEOUT_KIND_NONE
+#define TIMEOUT_KIND_NONE			0
+#endif //TIMEOUT_KIND_NONE
+
+#ifndef TIMEOUT_KIND_HANDSHAKE
+#define TIMEOUT_KIND_HANDSHAKE		1
+#endif //TIMEOUT_KIND_HANDSHAKE
+
+#ifndef TIMEOUT_KIND_IDLE
+#define TIMEOUT_KIND_IDLE			2
+#endif //TIMEOUT_KIND_IDLE
+
+#ifndef TIMEOUT_KIND_WRITE_STALL
+#define TIMEOUT_KIND_WRITE_STALL	3
+#endif //TIMEOUT_KIND_WRITE_STALL
+
+#ifndef TIMEOUT_KIND_HEARTBEAT
+#define TIMEOUT_KIND_HEARTBEAT		4
+#endif //TIMEOUT_KIND_HEARTBEAT
+
+/**
+ * @brief Time, in milliseconds, that a client has to say HELO after it
+ * connects.
+ */
+#ifndef TIMEOUT_HANDSHAKE_MS
+#define TIMEOUT_HANDSHAKE_MS		30000
+#endif //TIMEOUT_HANDSHAKE_MS
+
+/**
+ * @brief Time, in milliseconds, that a client that has said HELO may go
+ * without sending anything before it is disconnected.
+ */
+#ifndef TIMEOUT_IDLE_MS
+#define TIMEOUT_IDLE_MS				600000
+#endif //TIMEOUT_IDLE_MS
+
+/**
+ * @brief Format of the line that reports, when the server shuts down, how
+ * many clients were disconnected by each of the timeouts.
+ */
+#ifndef TIMEOUT_STATS
+#define TIMEOUT_STATS \
+	"Timeouts: %llu handshake, %llu idle, %llu write stall, " \
+	"%llu unanswered PING.\n"
+#endif //TIMEOUT_STATS
+
+/**
+ * @brief Time, in milliseconds, that a write to a client may go without
+ * making any progress before the client is disconnected.
+ */
+#ifndef TIMEOUT_WRITE_STALL_MS
+#define TIMEOUT_WRITE_STALL_MS		30000
+#endif //TIMEOUT_WRITE_STALL_MS
+
+/**
+ * @brief Count of levels of a timing wheel.  With 64 slots a level and a
+ * one-second tick, three levels reach out to about three days.
+ */
+#ifndef TIMER_WHEEL_LEVEL_COUNT
+#define TIMER_WHEEL_LEVEL_COUNT		3
+#endif //TIMER_WHEEL_LEVEL_COUNT
+
+/**
+ * @brief Count of bits of the tick number that pick a slot within a level of
+ * a timing wheel.
+ */
+#ifndef TIMER_WHEEL_SLOT_BITS
+#define TIMER_WHEEL_SLOT_BITS		6
+#endif //TIMER_WHEEL_SLOT_BITS
+
+/**
+ * @brief Count of slots in each level of a timing wheel.
+ */
+#ifndef TIMER_WHEEL_SLOT_COUNT
+#define TIMER_WHEEL_SLOT_COUNT		(1 << TIMER_WHEEL_SLOT_BITS)
+#endif //TIMER_WHEEL_SLOT_COUNT
+
+/**
+ * @brief Length, in milliseconds, of a tick of a timing wheel.  Client
+ * threads also wake up this often, while they wait for input, to run their
+ * wheels.
+ */
+#ifndef TIMER_WHEEL_TICK_MS
+#define TIMER_WHEEL_TICK_MS			1000
+#endif //TIMER_WHEEL_TICK_MS
+
 /**
  * @brief Usage message to be displayed if the user has not specified correct
  * command-line paramters on startup.
  */
 #ifndef USAGE_STRING
-#define USAGE_STRING				"Usage: server <port_num>\n"
+#define USAGE_STRING				"Usage: server <port_num> [-v] " \
+	"[-node <id>] [-peerport <port_num>] [-peer <host>:<port_num>]... " \
+	"[-msgrate <count>] [-byterate <count>] [-burst <seconds>] " \
+	"[-ratepolicy queue|drop|disconnect] " \
+	"[-pinginterval <seconds>] [-pingtimeout <seconds>] " \
+	"[-shards <count>]\n" \
+	"       server -benchmark <json_file> [-clients <count>] " \
+	"[-iterations <count>]\n"
 #endif //USAGE_STRING
 
 /**
@@ -0,0 +1,77 @@
+// shutdown.h - Defines the interface for shutting the server down.  The
+// signals that end the server (SIGINT, from CTRL+C, and SIGTERM) are blocked
+// in every thread and read from a signalfd by a thread of their own, so no
+// work is ever done inside a signal handler.  A shutdown is requested by
+// setting a stop flag and an eventfd; the threads check the flag at the top
+// of their loops and poll the eventfd along with their sockets, and so each
+// one stops by itself, at a point of its own choosing, within one trip round
+// its loop.
+//
+
+#ifndef __SHUTDOWN_H__
+#define __SHUTDOWN_H__
+
+#include "stdafx.h"
+#include "server_symbols.h"
+
+/**
+ * @brief Counts the calling thread among the threads that a shutdown waits
+ * for.
+ * @remarks The thread must call EndStoppableThread when it stops.
+ */
+void BeginStoppableThread();
+
+/**
+ * @brief Stops counting the calling thread among the threads that a shutdown
+ * waits for.
+ */
+void EndStoppableThread();
+
+/**
+ * @brief Gets the file descriptor of the eventfd that becomes readable once a
+ * shutdown has been requested, and stays readable from then on.
+ * @returns The file descriptor, or -1 if InstallShutdownHandler has not been
+ * called.
+ */
+int GetShutdownEventFd();
+
+/**
+ * @brief Blocks SIGINT and SIGTERM, and starts the thread that reads them from
+ * a signalfd and requests a shutdown when one comes in.
+ * @remarks Must be called before any other thread is started, so that all of
+ * them inherit the blocked signals.  Exits the program if the signals cannot
+ * be set up.
+ */
+void InstallShutdownHandler();
+
+/**
+ * @brief Determines whether a shutdown has been requested.
+ * @returns TRUE if one has; FALSE otherwise.
+ */
+BOOL IsShutdownRequested();
+
+/**
+ * @brief Requests that the server shut down, waking every thread that is
+ * polling the shutdown eventfd.
+ * @remarks Async-signal-safe, and may be called any number of times from any
+ * thread.
+ */
+void RequestServerShutdown();
+
+/**
+ * @brief Stops the shutdown signal thread, and closes the signalfd.
+ * @remarks Must only be called once a shutdown has been requested.  The
+ * eventfd is left open, since threads that are still stopping may poll it.
+ */
+void StopShutdownHandler();
+
+/**
+ * @brief Waits for the threads counted by BeginStoppableThread (other than
+ * the calling thread) to stop.
+ * @param nTimeoutMs Longest time to wait, in milliseconds.
+ * @returns Count of the threads that had not stopped when the time was up;
+ * zero if all of them did.
+ */
+int WaitForStoppableThreads(int nTimeoutMs);
+
+#endif /* __SHUTDOWN_H__ */
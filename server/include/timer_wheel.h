@@ -0,0 +1,142 @@
+// timer_wheel.h - Defines the TIMERWHEEL structure, a hashed hierarchical
+// timing wheel, and the functions that arm, cancel and run its timers.
+// Arming and cancelling a timer take constant time, whatever the count of
+// timers, since each timer is only ever linked into, or out of, the slot
+// that its deadline hashes to.  A wheel is owned by one thread, which is the
+// only one that may touch it or its timers, so it needs no lock.
+//
+
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include "stdafx.h"
+#include "server_symbols.h"
+
+struct _tagTIMER;
+
+/**
+ * @brief Routine that is called, on the thread that owns the wheel, when a
+ * timer expires.  The timer is no longer armed when it is called, so the
+ * routine may arm it again.
+ */
+typedef void (*LPTIMER_ROUTINE)(struct _tagTIMER* lpTimer,
+		void* pvUserState);
+
+/**
+ * @brief Structure that holds a timer.  Timers are embedded in the structures
+ * they are for, so that arming one never allocates.
+ */
+typedef struct _tagTIMER {
+	/**
+	 * @name lpNext
+	 * @brief Reference to the next timer in the same slot, or NULL.
+	 */
+	struct _tagTIMER* lpNext;
+
+	/**
+	 * @name lpPrev
+	 * @brief Reference to the previous timer in the same slot, or NULL if
+	 * this timer is the first one.
+	 */
+	struct _tagTIMER* lpPrev;
+
+	/**
+	 * @name ppSlot
+	 * @brief Address of the head of the slot the timer is linked into, or
+	 * NULL if the timer is not armed.
+	 */
+	struct _tagTIMER** ppSlot;
+
+	/**
+	 * @name nDeadline
+	 * @brief Tick of the wheel at which the timer expires.
+	 */
+	uint64_t nDeadline;
+
+	/**
+	 * @name lpfnRoutine
+	 * @brief Routine to call when the timer expires.
+	 */
+	LPTIMER_ROUTINE lpfnRoutine;
+
+	/**
+	 * @name pvUserState
+	 * @brief Value to pass to lpfnRoutine.
+	 */
+	void* pvUserState;
+} TIMER, *LPTIMER;
+
+/**
+ * @brief Structure that holds a hashed hierarchical timing wheel.  Level 0
+ * has a slot for each of the next TIMER_WHEEL_SLOT_COUNT ticks; each slot of
+ * the levels above it stands for TIMER_WHEEL_SLOT_COUNT times as many ticks
+ * as a slot of the level below, and its timers are moved down a level when
+ * the level below comes round to them.
+ */
+typedef struct _tagTIMERWHEEL {
+	/**
+	 * @name lpSlots
+	 * @brief Heads of the doubly-linked lists of the timers in each slot.
+	 */
+	LPTIMER lpSlots[TIMER_WHEEL_LEVEL_COUNT][TIMER_WHEEL_SLOT_COUNT];
+
+	/**
+	 * @name nCurrentTick
+	 * @brief Tick the wheel has been run up to.
+	 */
+	uint64_t nCurrentTick;
+
+	/**
+	 * @name nStartTime
+	 * @brief Time, in milliseconds on the monotonic clock, of tick zero.
+	 */
+	uint64_t nStartTime;
+} TIMERWHEEL, *LPTIMERWHEEL;
+
+/**
+ * @brief Arms a timer, or re-arms it if it is armed already.
+ * @param lpWheel Reference to the TIMERWHEEL instance.
+ * @param lpTimer Reference to the TIMER instance.
+ * @param nDelayMs Milliseconds from now until the timer expires.  Rounded up
+ * to a whole number of ticks, and to at least one tick.
+ * @param lpfnRoutine Routine to call when the timer expires.
+ * @param pvUserState Value to pass to lpfnRoutine.
+ */
+void ArmTimer(LPTIMERWHEEL lpWheel, LPTIMER lpTimer, long nDelayMs,
+		LPTIMER_ROUTINE lpfnRoutine, void* pvUserState);
+
+/**
+ * @brief Disarms a timer.  Does nothing if the timer is not armed.
+ * @param lpTimer Reference to the TIMER instance.
+ */
+void CancelTimer(LPTIMER lpTimer);
+
+/**
+ * @brief Gets the time on a clock that is not affected by changes to the
+ * wall-clock time.
+ * @returns Time, in milliseconds, since some unspecified starting point.
+ */
+uint64_t GetMonotonicMilliseconds();
+
+/**
+ * @brief Sets up an empty wheel, whose tick zero is now.
+ * @param lpWheel Reference to the TIMERWHEEL instance.
+ */
+void InitializeTimerWheel(LPTIMERWHEEL lpWheel);
+
+/**
+ * @brief Determines whether a timer is armed.
+ * @param lpTimer Reference to the TIMER instance.
+ * @returns TRUE if the timer is armed; FALSE otherwise.
+ */
+BOOL IsTimerArmed(LPTIMER lpTimer);
+
+/**
+ * @brief Runs the wheel up to the current time, calling the routines of the
+ * timers that expire on the way.
+ * @param lpWheel Reference to the TIMERWHEEL instance.
+ * @returns Count of timers that expired.
+ */
+int RunTimerWheel(LPTIMERWHEEL lpWheel);
+
+#endif /* __TIMER_WHEEL_H__ */
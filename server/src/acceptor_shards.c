@@ -0,0 +1,341 @@
+// acceptor_shards.c - Implementation of the acceptor shards, which accept new
+// connections on several threads at once, each with a listening socket of its
+// own on the server's port.
+//
+// A shard owns the clients it accepts: their threads run on the shard's CPU,
+// next to the shard, so that a storm of reconnections is spread over the CPUs
+// instead of all going through one thread.  Messages for clients of other
+// shards go through the mailboxes of the clients, so no lock is shared
+// between shards on the way.
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "acceptor_shards.h"
+#include "mat.h"
+#include "server_functions.h"
+#include "shutdown.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Global variables (used in this file only)
+
+/**
+ * @brief Count of acceptor shards that the -shards option asked for.
+ */
+static int g_nRequestedShardCount = 1;
+
+/**
+ * @brief Count of acceptor shards that are accepting connections, including
+ * the master acceptor thread.
+ */
+static atomic_int g_nShardCount = 1;
+
+/**
+ * @brief The acceptor shards.  Entry 0 is the master acceptor thread.
+ */
+static ACCEPTORSHARD g_shards[ACCEPTOR_SHARD_MAX_COUNT];
+
+/**
+ * @brief Count of the connection IDs that have been handed out for clients
+ * that belong to no shard.
+ */
+static atomic_ullong g_nUnshardedConnectionCount = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// AcceptorShardThread thread procedure - Accepts connections on the socket of
+// a shard, from the CPU of the shard.
+//
+
+void* AcceptorShardThread(void* pvShard) {
+	LPACCEPTORSHARD lpShard = (LPACCEPTORSHARD) pvShard;
+
+	BeginStoppableThread();
+
+	PinThreadToShard(lpShard->nIndex);
+
+	AcceptClientConnections(lpShard->nListenSocket, lpShard->nIndex);
+
+	EndStoppableThread();
+
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AssignShardCpus function - Gives each shard one of the CPUs that this
+// process may run on, going round them again if there are more shards than
+// CPUs.
+//
+
+void AssignShardCpus() {
+	cpu_set_t allowedCpus;
+	CPU_ZERO(&allowedCpus);
+
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &allowedCpus) < 0
+			|| CPU_COUNT(&allowedCpus) == 0) {
+		for (int i = 0; i < ACCEPTOR_SHARD_MAX_COUNT; i++) {
+			g_shards[i].nCpu = -1;	// leave the threads where they are
+		}
+		return;
+	}
+
+	int nCpu = -1;
+
+	for (int i = 0; i < ACCEPTOR_SHARD_MAX_COUNT; i++) {
+		do {
+			nCpu = (nCpu + 1) % CPU_SETSIZE;
+		} while (!CPU_ISSET(nCpu, &allowedCpus));
+
+		g_shards[i].nCpu = nCpu;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// OpenShardSocket function - Opens a listening socket on the server's port,
+// alongside the ones that are already there.  Returns -1, with errno set, if
+// that cannot be done.
+//
+
+int OpenShardSocket(int nPort) {
+	/* The socket is not handed over by a hot restart; the new process
+	 * opens its own */
+	const int nSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (nSocket < 0) {
+		return -1;
+	}
+
+	const int ON = 1;
+
+	struct sockaddr_in* pSockAddr = CreateSockAddr();
+
+	GetServerAddrInfo(nPort, pSockAddr);
+
+	if (setsockopt(nSocket, SOL_SOCKET, SO_REUSEADDR, &ON, sizeof(ON)) < 0
+			|| setsockopt(nSocket, SOL_SOCKET, SO_REUSEPORT, &ON,
+					sizeof(ON)) < 0
+			|| BindSocket(nSocket, pSockAddr) < 0
+			|| ListenSocket(nSocket) < 0) {
+		const int SAVED_ERRNO = errno;
+
+		FreeBuffer((void**) &pSockAddr);
+		close(nSocket);
+
+		errno = SAVED_ERRNO;
+		return -1;
+	}
+
+	FreeBuffer((void**) &pSockAddr);
+
+	return nSocket;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// ConfigureAcceptorShards function
+
+BOOL ConfigureAcceptorShards(int argc, char* argv[]) {
+	if (argc < MIN_NUM_ARGS || argv == NULL) {
+		return FALSE;
+	}
+
+	for (int i = 2; i < argc; i++) {
+		if (!IsAcceptorShardOption(argv[i])) {
+			continue;	// checked by the other parsers
+		}
+
+		if (i + 1 >= argc) {
+			return FALSE;
+		}
+
+		long lValue = 0;
+		int nResult = StringToLong(argv[++i], &lValue);
+		if ((nResult != OK && nResult != EXACTLY_CORRECT) || lValue < 1
+				|| lValue > ACCEPTOR_SHARD_MAX_COUNT) {
+			return FALSE;
+		}
+
+		g_nRequestedShardCount = (int) lValue;
+	}
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetAcceptorShardCount function
+
+int GetAcceptorShardCount() {
+	return atomic_load(&g_nShardCount);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsAcceptorShardOption function
+
+BOOL IsAcceptorShardOption(const char* pszOption) {
+	return EqualsNoCase(pszOption, ACCEPTOR_SHARD_OPTION);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// NewConnectionID function
+
+uint64_t NewConnectionID(int nShardIndex) {
+	atomic_ullong* pnCount = &g_nUnshardedConnectionCount;
+	uint64_t nShardPart = 0;
+
+	if (nShardIndex >= 0 && nShardIndex < ACCEPTOR_SHARD_MAX_COUNT) {
+		pnCount = &(g_shards[nShardIndex].nConnectionCount);
+		nShardPart = (uint64_t) nShardIndex + 1;
+	}
+
+	const uint64_t COUNTER_MASK =
+			(((uint64_t) 1) << CONNECTION_ID_COUNTER_BITS) - 1;
+
+	const uint64_t nCount = (atomic_fetch_add(pnCount, 1) + 1) & COUNTER_MASK;
+
+	return (nShardPart << CONNECTION_ID_COUNTER_BITS) | nCount;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// NoteShardAccept function
+
+void NoteShardAccept(int nShardIndex) {
+	if (nShardIndex < 0 || nShardIndex >= ACCEPTOR_SHARD_MAX_COUNT) {
+		return;
+	}
+
+	atomic_fetch_add(&(g_shards[nShardIndex].nAcceptCount), 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PinThreadToShard function
+
+void PinThreadToShard(int nShardIndex) {
+	if (g_nRequestedShardCount <= 1) {
+		return;	// not sharded; the scheduler places the threads
+	}
+
+	if (nShardIndex < 0 || nShardIndex >= ACCEPTOR_SHARD_MAX_COUNT
+			|| g_shards[nShardIndex].nCpu < 0) {
+		return;
+	}
+
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(g_shards[nShardIndex].nCpu, &cpus);
+
+	/* Not being pinned only costs some locality, so a failure is not
+	 * reported */
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReportAcceptorShardStats function
+
+void ReportAcceptorShardStats() {
+	if (g_nRequestedShardCount <= 1) {
+		return;
+	}
+
+	const int SHARD_COUNT = atomic_load(&g_nShardCount);
+
+	for (int i = 0; i < SHARD_COUNT; i++) {
+		const unsigned long long ACCEPTED = atomic_load(
+				&(g_shards[i].nAcceptCount));
+
+		fprintf(stdout, ACCEPTOR_SHARD_STATS, i, g_shards[i].nCpu, ACCEPTED);
+
+		if (GetLogFileHandle() != stdout) {
+			LogInfo(ACCEPTOR_SHARD_STATS, i, g_shards[i].nCpu, ACCEPTED);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ShareServerPort function
+
+void ShareServerPort(int nServerSocket) {
+	if (g_nRequestedShardCount <= 1 || !IsSocketValid(nServerSocket)) {
+		return;
+	}
+
+	const int ON = 1;
+
+	if (setsockopt(nServerSocket, SOL_SOCKET, SO_REUSEPORT, &ON,
+			sizeof(ON)) < 0) {
+		fprintf(stderr, ACCEPTOR_SHARD_FAILED, 0, strerror(errno));
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StartAcceptorShards function
+
+void StartAcceptorShards(int nPort) {
+	AssignShardCpus();
+
+	g_shards[0].nIndex = 0;
+	g_shards[0].nListenSocket = GetServerSocket();
+	g_shards[0].hThread = INVALID_HANDLE_VALUE;
+	atomic_init(&(g_shards[0].nAcceptCount), 0);
+
+	int nShardCount = 1;
+
+	for (int i = 1; i < g_nRequestedShardCount; i++) {
+		/* The shards that did start are numbered without gaps */
+		LPACCEPTORSHARD lpShard = &(g_shards[nShardCount]);
+
+		lpShard->nIndex = nShardCount;
+		lpShard->hThread = INVALID_HANDLE_VALUE;
+		atomic_init(&(lpShard->nAcceptCount), 0);
+
+		lpShard->nListenSocket = OpenShardSocket(nPort);
+		if (lpShard->nListenSocket < 0) {
+			fprintf(stderr, ACCEPTOR_SHARD_FAILED, i, strerror(errno));
+			continue;
+		}
+
+		lpShard->hThread = CreateThreadEx(AcceptorShardThread, lpShard);
+		if (INVALID_HANDLE_VALUE == lpShard->hThread) {
+			fprintf(stderr, ACCEPTOR_SHARD_FAILED, i,
+					"the thread could not be created");
+
+			close(lpShard->nListenSocket);
+			lpShard->nListenSocket = -1;
+			continue;
+		}
+
+		nShardCount++;
+	}
+
+	atomic_store(&g_nShardCount, nShardCount);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StopAcceptorShards function
+
+void StopAcceptorShards() {
+	const int SHARD_COUNT = atomic_load(&g_nShardCount);
+
+	/* The shards poll the shutdown eventfd, and stop along with the master
+	 * acceptor thread */
+	RequestServerShutdown();
+
+	for (int i = 1; i < SHARD_COUNT; i++) {
+		LPACCEPTORSHARD lpShard = &(g_shards[i]);
+
+		if (INVALID_HANDLE_VALUE != lpShard->hThread) {
+			WaitThread(lpShard->hThread);
+			DestroyThread(lpShard->hThread);
+
+			lpShard->hThread = INVALID_HANDLE_VALUE;
+		}
+
+		if (lpShard->nListenSocket >= 0) {
+			close(lpShard->nListenSocket);
+			lpShard->nListenSocket = -1;
+		}
+	}
+}
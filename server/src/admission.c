@@ -0,0 +1,264 @@
+// admission.c - Implementation of the admission check that every new
+// connection goes through as soon as it is accepted
+//
+// The per-address counts are kept in a fixed-size, open-addressed table with
+// linear probing, so that no memory is allocated for a connection until it
+// has been admitted.  Entries are removed by shifting the ones after them
+// back, rather than by leaving tombstones, so the table never needs to be
+// rebuilt.
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "admission.h"
+#include "server_functions.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Global variables (used in this file only)
+
+/**
+ * @brief Table of the count of admitted connections from each IP address.
+ */
+ADDRESSCOUNT g_aAddressCounts[ADMISSION_ADDRESS_TABLE_SIZE];
+
+/**
+ * @brief Count of admitted connections, from all addresses, that are open.
+ */
+int g_nAdmittedCount = 0;
+
+/**
+ * @brief Handle to the mutex that guards the table and the count.
+ */
+HMUTEX g_hAdmissionMutex = INVALID_HANDLE_VALUE;
+
+/**
+ * @brief Counts of the connections that were turned away, for each of the
+ * caps.
+ */
+atomic_ullong g_nRejectedTotalCount = 0;
+atomic_ullong g_nRejectedPerAddressCount = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// GetAddressSlot function - Gets the slot of the table at which the probe for
+// an address starts.
+//
+
+int GetAddressSlot(in_addr_t nAddress) {
+	/* Fibonacci hashing spreads addresses from the same subnet, which
+	 * differ only in their low bits, across the table */
+	return (int) (((uint32_t) nAddress * 2654435769U)
+			& (ADMISSION_ADDRESS_TABLE_SIZE - 1));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FindAddressSlot function - Finds the slot that holds the count for an
+// address, or else the free slot where it would go.  Returns -1 if the address
+// is not in the table and the table is full.  The caller must hold the
+// admission mutex.
+//
+
+int FindAddressSlot(in_addr_t nAddress) {
+	int nSlot = GetAddressSlot(nAddress);
+
+	for (int i = 0; i < ADMISSION_ADDRESS_TABLE_SIZE; i++) {
+		if (g_aAddressCounts[nSlot].nCount == 0
+				|| g_aAddressCounts[nSlot].nAddress == nAddress) {
+			return nSlot;
+		}
+
+		nSlot = (nSlot + 1) & (ADMISSION_ADDRESS_TABLE_SIZE - 1);
+	}
+
+	return -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RemoveAddressSlot function - Frees a slot of the table, moving back any
+// entries after it that would otherwise no longer be found.  The caller must
+// hold the admission mutex.
+//
+
+void RemoveAddressSlot(int nSlot) {
+	const int MASK = ADMISSION_ADDRESS_TABLE_SIZE - 1;
+
+	int nNext = (nSlot + 1) & MASK;
+
+	while (g_aAddressCounts[nNext].nCount != 0) {
+		const int HOME = GetAddressSlot(g_aAddressCounts[nNext].nAddress);
+
+		/* The entry may move into the free slot only if its probe sequence
+		 * passes through it, that is, if the free slot is cyclically
+		 * between its home slot and where it is now */
+		const int DISTANCE_TO_FREE = (nSlot - HOME) & MASK;
+		const int DISTANCE_TO_NEXT = (nNext - HOME) & MASK;
+
+		if (DISTANCE_TO_FREE < DISTANCE_TO_NEXT) {
+			g_aAddressCounts[nSlot] = g_aAddressCounts[nNext];
+			nSlot = nNext;
+		}
+
+		nNext = (nNext + 1) & MASK;
+	}
+
+	g_aAddressCounts[nSlot].nAddress = 0;
+	g_aAddressCounts[nSlot].nCount = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RejectConnection function - Sends a connection a canned reply and closes
+// it.  The reply is sent without waiting, since the connection is not worth
+// holding up the accepting of others for.
+//
+
+void RejectConnection(int nClientSocket, const char* pszReply) {
+	if (send(nClientSocket, pszReply, strlen(pszReply),
+			MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+		/* Nothing to do; the connection is being closed anyway */
+	}
+
+	close(nClientSocket);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// AdmitConnection function
+
+BOOL AdmitConnection(int nClientSocket, const struct in_addr* lpAddress) {
+	if (!IsSocketValid(nClientSocket) || lpAddress == NULL) {
+		return FALSE;
+	}
+
+	const char* pszReply = NULL;
+	BOOL bOverTotal = FALSE;
+
+	LockMutex(g_hAdmissionMutex);
+	{
+		const int SLOT = FindAddressSlot(lpAddress->s_addr);
+
+		if (g_nAdmittedCount >= ADMISSION_MAX_CONNECTIONS || SLOT < 0) {
+			pszReply = ERROR_MAX_CONNECTIONS_EXCEEDED;
+			bOverTotal = TRUE;
+		} else if (g_aAddressCounts[SLOT].nCount
+				>= ADMISSION_MAX_CONNECTIONS_PER_ADDRESS) {
+			pszReply = ERROR_MAX_CONNECTIONS_PER_ADDRESS_EXCEEDED;
+		} else {
+			g_aAddressCounts[SLOT].nAddress = lpAddress->s_addr;
+			g_aAddressCounts[SLOT].nCount++;
+			g_nAdmittedCount++;
+		}
+	}
+	UnlockMutex(g_hAdmissionMutex);
+
+	if (pszReply == NULL) {
+		return TRUE;
+	}
+
+	atomic_fetch_add(bOverTotal ? &g_nRejectedTotalCount
+			: &g_nRejectedPerAddressCount, 1);
+
+	RejectConnection(nClientSocket, pszReply);
+
+	return FALSE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CountAdmittedConnection function
+
+void CountAdmittedConnection(const char* pszIPAddress) {
+	struct in_addr address;
+
+	if (IsNullOrWhiteSpace(pszIPAddress)
+			|| inet_pton(AF_INET, pszIPAddress, &address) != 1) {
+		return;
+	}
+
+	LockMutex(g_hAdmissionMutex);
+	{
+		const int SLOT = FindAddressSlot(address.s_addr);
+		if (SLOT >= 0) {
+			g_aAddressCounts[SLOT].nAddress = address.s_addr;
+			g_aAddressCounts[SLOT].nCount++;
+		}
+
+		g_nAdmittedCount++;
+	}
+	UnlockMutex(g_hAdmissionMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateAdmissionTable function
+
+void CreateAdmissionTable() {
+	if (INVALID_HANDLE_VALUE != g_hAdmissionMutex) {
+		return;
+	}
+
+	memset(g_aAddressCounts, 0, sizeof(g_aAddressCounts));
+	g_nAdmittedCount = 0;
+
+	g_hAdmissionMutex = CreateMutex();
+	if (INVALID_HANDLE_VALUE == g_hAdmissionMutex) {
+		CleanupServer(ERROR);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DestroyAdmissionTable function
+
+void DestroyAdmissionTable() {
+	if (INVALID_HANDLE_VALUE == g_hAdmissionMutex) {
+		return;
+	}
+
+	DestroyMutex(g_hAdmissionMutex);
+	g_hAdmissionMutex = INVALID_HANDLE_VALUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReleaseAdmission function
+
+void ReleaseAdmission(const char* pszIPAddress) {
+	struct in_addr address;
+
+	if (IsNullOrWhiteSpace(pszIPAddress)
+			|| inet_pton(AF_INET, pszIPAddress, &address) != 1) {
+		return;
+	}
+
+	LockMutex(g_hAdmissionMutex);
+	{
+		const int SLOT = FindAddressSlot(address.s_addr);
+		if (SLOT >= 0 && g_aAddressCounts[SLOT].nCount > 0) {
+			if (--g_aAddressCounts[SLOT].nCount == 0) {
+				RemoveAddressSlot(SLOT);
+			}
+		}
+
+		if (g_nAdmittedCount > 0) {
+			g_nAdmittedCount--;
+		}
+	}
+	UnlockMutex(g_hAdmissionMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReportAdmissionStats function
+
+void ReportAdmissionStats() {
+	const unsigned long long TOTAL = atomic_load(&g_nRejectedTotalCount);
+	const unsigned long long PER_ADDRESS = atomic_load(
+			&g_nRejectedPerAddressCount);
+
+	fprintf(stdout, ADMISSION_STATS, TOTAL + PER_ADDRESS, TOTAL,
+			PER_ADDRESS);
+
+	if (GetLogFileHandle() != stdout) {
+		LogInfo(ADMISSION_STATS, TOTAL + PER_ADDRESS, TOTAL, PER_ADDRESS);
+	}
+}
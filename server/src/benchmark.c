@@ -0,0 +1,443 @@
+// benchmark.c - Implementation of the microbenchmarks of the server's hot
+// functions
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "benchmark.h"
+#include "client_list_manager.h"
+#include "client_manager.h"
+#include "client_thread_functions.h"
+#include "mailbox.h"
+#include "mat_functions.h"
+#include "message_buffer.h"
+#include "nickname_manager.h"
+#include "rate_limiter.h"
+#include "room_manager.h"
+#include "roster.h"
+#include "server_functions.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Global variables (used in this file only)
+
+/**
+ * @brief The benchmark clients.  The first of them is the one that the chat
+ * messages are sent from.  Only the first g_nBenchmarkClientCount entries are
+ * valid.
+ */
+static LPCLIENTSTRUCT* g_lppBenchmarkClients = NULL;
+
+/**
+ * @brief The other ends of the sockets of the benchmark clients, which
+ * nothing is ever written to or read from.
+ */
+static int* g_pnBenchmarkPeerSockets = NULL;
+
+/**
+ * @brief Count of the benchmark clients that have been set up.
+ */
+static int g_nBenchmarkClientCount = 0;
+
+/**
+ * @brief The line that HandleProtocolCommand is given.  It is a chat message,
+ * which is the line clients send most, and which is only known not to be a
+ * command once it has been checked against all of them.
+ */
+static char g_szBenchmarkChatLine[BUFLEN];
+
+/**
+ * @brief The notice that is broadcast to all of the benchmark clients.
+ */
+static LPMESSAGEBUFFER g_lpBenchmarkNotice = NULL;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// BenchmarkBroadcastBufferToAllClients function - Sends a notice to every
+// client on the list of clients.
+//
+
+void BenchmarkBroadcastBufferToAllClients(int nIteration) {
+	BroadcastBufferToAllClients(g_lpBenchmarkNotice);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BenchmarkBroadcastChatMessage function - Builds a chat message and sends it
+// to the other members of the sender's room.
+//
+
+void BenchmarkBroadcastChatMessage(int nIteration) {
+	BroadcastChatMessage(BENCHMARK_CHAT_LINE, g_lppBenchmarkClients[0]);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BenchmarkGetClientByNickname function - Looks up each benchmark client in
+// the nickname index in turn.
+//
+
+void BenchmarkGetClientByNickname(int nIteration) {
+	LPCLIENTSTRUCT lpClient = GetClientByNickname(
+			g_lppBenchmarkClients[nIteration
+					% g_nBenchmarkClientCount]->pszNickname);
+
+	ReleaseClient(lpClient);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BenchmarkGetNicknameFromUser function - Parses the nickname out of a NICK
+// command.  The command is copied first each time, since it is parsed in
+// place.
+//
+
+void BenchmarkGetNicknameFromUser(int nIteration) {
+	char szCommand[] = BENCHMARK_NICK_COMMAND;
+
+	char szNickname[sizeof(szCommand)];
+	memset(szNickname, 0, sizeof(szNickname));
+
+	GetNicknameFromUser(szNickname, szCommand);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BenchmarkGetRosterSnapshot function - Gets the reply to LIST, which is
+// built the first time and shared after that.
+//
+
+void BenchmarkGetRosterSnapshot(int nIteration) {
+	ReleaseMessageBuffer(GetRosterSnapshot());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BenchmarkHandleProtocolCommand function - Works out that a chat line is not
+// a protocol command.
+//
+
+void BenchmarkHandleProtocolCommand(int nIteration) {
+	HandleProtocolCommand(g_lppBenchmarkClients[0], g_szBenchmarkChatLine);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DestroyBenchmarkClients function - Takes the benchmark clients out of their
+// room, the nickname index and the list of clients, and closes their sockets.
+//
+
+void DestroyBenchmarkClients() {
+	for (int i = 0; i < g_nBenchmarkClientCount; i++) {
+		LPCLIENTSTRUCT lpClient = g_lppBenchmarkClients[i];
+		const int CLIENT_SOCKET = lpClient->nSocket;
+
+		LeaveCurrentRoom(lpClient);
+
+		ReleaseNickname(lpClient);
+
+		lpClient->bConnected = FALSE;
+
+		free(lpClient->pszNickname);
+		lpClient->pszNickname = NULL;
+
+		/* Whatever is still in its mailbox goes with it */
+		LockMutex(GetClientListMutex());
+		{
+			LPPOSITION pos = FindElement(g_pClientList,
+					&(lpClient->nConnectionID), FindClientByID);
+			if (pos != NULL) {
+				g_pClientList = pos;
+				RemoveElement(&g_pClientList, FreeClient);
+			}
+		}
+		UnlockMutex(GetClientListMutex());
+
+		close(CLIENT_SOCKET);
+		close(g_pnBenchmarkPeerSockets[i]);
+	}
+
+	free(g_lppBenchmarkClients);
+	g_lppBenchmarkClients = NULL;
+
+	free(g_pnBenchmarkPeerSockets);
+	g_pnBenchmarkPeerSockets = NULL;
+
+	g_nBenchmarkClientCount = 0;
+
+	ReleaseMessageBuffer(g_lpBenchmarkNotice);
+	g_lpBenchmarkNotice = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateBenchmarkClients function - Sets up the benchmark clients, each with a
+// nickname, in the benchmark room, and on the list of clients, just as if they
+// had connected and said HELO and NICK, but without anyone being told.  Each
+// one is given one end of a socket pair, so that it looks connected, but as
+// this thread is not the owner of any of their mailboxes, nothing is ever
+// written to them.  Returns FALSE if they could not all be set up.
+//
+
+BOOL CreateBenchmarkClients(int nClientCount) {
+	g_lppBenchmarkClients = (LPCLIENTSTRUCT*) malloc(
+			nClientCount * sizeof(LPCLIENTSTRUCT));
+	g_pnBenchmarkPeerSockets = (int*) malloc(nClientCount * sizeof(int));
+
+	if (g_lppBenchmarkClients == NULL || g_pnBenchmarkPeerSockets == NULL) {
+		fprintf(stderr, OUT_OF_MEMORY);
+
+		CleanupServer(ERROR);
+	}
+
+	g_nBenchmarkClientCount = 0;
+
+	for (int i = 0; i < nClientCount; i++) {
+		int nSockets[2];
+
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, nSockets) < 0) {
+			fprintf(stderr, BENCHMARK_SETUP_FAILED, i, strerror(errno));
+			return FALSE;
+		}
+
+		LPCLIENTSTRUCT lpClient = CreateClientStruct(nSockets[0],
+				BENCHMARK_CLIENT_ADDRESS, 0);
+
+		g_lppBenchmarkClients[i] = lpClient;
+		g_pnBenchmarkPeerSockets[i] = nSockets[1];
+		g_nBenchmarkClientCount++;
+
+		/* The benchmarks send as fast as they can, so the rate limits are
+		 * turned off; a bucket with no refill rate never makes anyone wait */
+		lpClient->messageBucket.dRefillRate = 0.0;
+		lpClient->byteBucket.dRefillRate = 0.0;
+
+		AddNewlyConnectedClientToList(lpClient);
+
+		lpClient->bConnected = TRUE;
+
+		char szNickname[MAX_NICKNAME_LEN + 1];
+		memset(szNickname, 0, MAX_NICKNAME_LEN + 1);
+
+		snprintf(szNickname, MAX_NICKNAME_LEN + 1, BENCHMARK_NICKNAME_FORMAT,
+				i);
+
+		if (!AssignClientNickname(lpClient, szNickname)) {
+			fprintf(stderr, BENCHMARK_CLIENT_REJECTED, i);
+			return FALSE;
+		}
+
+		if (JoinRoom(lpClient, BENCHMARK_ROOM_NAME) == NULL) {
+			fprintf(stderr, BENCHMARK_CLIENT_REJECTED, i);
+			return FALSE;
+		}
+	}
+
+	memset(g_szBenchmarkChatLine, 0, BUFLEN);
+	strncpy(g_szBenchmarkChatLine, BENCHMARK_CHAT_LINE, BUFLEN - 1);
+
+	g_lpBenchmarkNotice = CreateMessageFromTemplate(NEW_CHATTER_JOINED,
+			g_lppBenchmarkClients[0]->pszNickname);
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DrainBenchmarkMailboxes function - Throws away everything that the
+// benchmark clients have been sent.  This thread owns each mailbox just for
+// as long as it takes to empty it.
+//
+
+void DrainBenchmarkMailboxes() {
+	for (int i = 0; i < g_nBenchmarkClientCount; i++) {
+		LPMAILBOX lpMailbox = &(g_lppBenchmarkClients[i]->mailbox);
+		LPMAILBOXITEM lpItem = NULL;
+
+		ClaimMailbox(lpMailbox);
+
+		ClearMailboxWakeup(lpMailbox);
+
+		while ((lpItem = TakeFromMailbox(lpMailbox)) != NULL) {
+			FreeMailboxItem(lpItem);
+		}
+	}
+
+	ClaimMailbox(NULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ParseBenchmarkOptions function - Gets the -clients and -iterations options
+// from the command line.  Returns FALSE if either of them is not valid.
+//
+
+BOOL ParseBenchmarkOptions(int argc, char* argv[], int* pnClientCount,
+		int* pnIterationCount) {
+	*pnClientCount = BENCHMARK_DEFAULT_CLIENT_COUNT;
+	*pnIterationCount = BENCHMARK_DEFAULT_ITERATION_COUNT;
+
+	for (int i = 3; i < argc; i++) {
+		if (i + 1 >= argc) {
+			return FALSE;
+		}
+
+		const char* pszOption = argv[i];
+
+		long lValue = 0;
+		int nResult = StringToLong(argv[++i], &lValue);
+		if ((nResult != OK && nResult != EXACTLY_CORRECT) || lValue <= 0) {
+			return FALSE;
+		}
+
+		if (EqualsNoCase(pszOption, BENCHMARK_CLIENTS_OPTION)
+				&& lValue <= MAX_CLIENT_LIST_ENTRIES) {
+			*pnClientCount = (int) lValue;
+		} else if (EqualsNoCase(pszOption, BENCHMARK_ITERATIONS_OPTION)
+				&& lValue <= INT_MAX) {
+			*pnIterationCount = (int) lValue;
+		} else {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RunBenchmark function - Calls the routine of a benchmark the number of
+// times given, in batches of BENCHMARK_BATCH_SIZE, and times each batch.  One
+// batch is run first, and not timed, so that the caches are warm.
+//
+
+void RunBenchmark(LPBENCHMARKRESULT lpResult, const char* pszName,
+		LPBENCHMARK_ROUTINE lpfnRoutine, int nIterationCount) {
+	memset(lpResult, 0, sizeof(BENCHMARKRESULT));
+
+	lpResult->pszName = pszName;
+	lpResult->nIterations = nIterationCount;
+	lpResult->dBestNanoseconds = -1.0;
+
+	for (int i = 0; i < BENCHMARK_BATCH_SIZE; i++) {
+		lpfnRoutine(i);
+	}
+
+	DrainBenchmarkMailboxes();
+
+	int nDone = 0;
+
+	while (nDone < nIterationCount) {
+		const int BATCH_COUNT = MinimumOf(BENCHMARK_BATCH_SIZE,
+				nIterationCount - nDone);
+
+		const uint64_t START = GetMonotonicNanoseconds();
+
+		for (int i = 0; i < BATCH_COUNT; i++) {
+			lpfnRoutine(nDone + i);
+		}
+
+		const uint64_t ELAPSED = GetMonotonicNanoseconds() - START;
+
+		/* The clients' mailboxes are emptied outside of the time measured,
+		 * as their own threads would have done */
+		DrainBenchmarkMailboxes();
+
+		lpResult->nTotalNanoseconds += ELAPSED;
+
+		const double PER_CALL = (double) ELAPSED / BATCH_COUNT;
+		if (lpResult->dBestNanoseconds < 0.0
+				|| PER_CALL < lpResult->dBestNanoseconds) {
+			lpResult->dBestNanoseconds = PER_CALL;
+		}
+
+		nDone += BATCH_COUNT;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WriteBenchmarkResults function - Writes the results of the benchmarks out
+// as JSON.
+//
+
+void WriteBenchmarkResults(FILE* fpOutput, LPBENCHMARKRESULT lpResults,
+		int nCount) {
+	fprintf(fpOutput, BENCHMARK_JSON_HEADER, g_nBenchmarkClientCount,
+			BENCHMARK_BATCH_SIZE);
+
+	for (int i = 0; i < nCount; i++) {
+		fprintf(fpOutput, BENCHMARK_JSON_RESULT, i > 0 ? "," : "",
+				lpResults[i].pszName, lpResults[i].nIterations,
+				(unsigned long long) lpResults[i].nTotalNanoseconds,
+				(double) lpResults[i].nTotalNanoseconds
+						/ lpResults[i].nIterations,
+				lpResults[i].dBestNanoseconds);
+	}
+
+	fprintf(fpOutput, BENCHMARK_JSON_FOOTER);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// IsBenchmarkMode function
+
+BOOL IsBenchmarkMode(int argc, char* argv[]) {
+	return argc >= 2 && argv != NULL && EqualsNoCase(argv[1], BENCHMARK_OPTION);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RunBenchmarks function
+
+BOOL RunBenchmarks(int argc, char* argv[]) {
+	int nClientCount = 0;
+	int nIterationCount = 0;
+
+	if (argc < 3 || IsNullOrWhiteSpace(argv[2])
+			|| !ParseBenchmarkOptions(argc, argv, &nClientCount,
+					&nIterationCount)) {
+		fprintf(stderr, USAGE_STRING);
+		return FALSE;
+	}
+
+	/* The file is opened first, so that a bad name is found out before
+	 * anything is run */
+	const char* pszOutputPath = argv[2];
+
+	FILE* fpOutput = fopen(pszOutputPath, "w");
+	if (fpOutput == NULL) {
+		fprintf(stderr, BENCHMARK_OUTPUT_FAILED, pszOutputPath,
+				strerror(errno));
+		return FALSE;
+	}
+
+	if (!CreateBenchmarkClients(nClientCount)) {
+		DestroyBenchmarkClients();
+
+		fclose(fpOutput);
+		return FALSE;
+	}
+
+	BENCHMARKRESULT results[BENCHMARK_COUNT];
+	int nResultCount = 0;
+
+	RunBenchmark(&results[nResultCount++], "HandleProtocolCommand",
+			BenchmarkHandleProtocolCommand, nIterationCount);
+	RunBenchmark(&results[nResultCount++], "GetNicknameFromUser",
+			BenchmarkGetNicknameFromUser, nIterationCount);
+	RunBenchmark(&results[nResultCount++], "BroadcastChatMessage",
+			BenchmarkBroadcastChatMessage, nIterationCount);
+	RunBenchmark(&results[nResultCount++], "GetRosterSnapshot",
+			BenchmarkGetRosterSnapshot, nIterationCount);
+	RunBenchmark(&results[nResultCount++], "GetClientByNickname",
+			BenchmarkGetClientByNickname, nIterationCount);
+	RunBenchmark(&results[nResultCount++], "BroadcastBufferToAllClients",
+			BenchmarkBroadcastBufferToAllClients, nIterationCount);
+
+	WriteBenchmarkResults(fpOutput, results, nResultCount);
+
+	DestroyBenchmarkClients();
+
+	if (fclose(fpOutput) != 0) {
+		fprintf(stderr, BENCHMARK_OUTPUT_FAILED, pszOutputPath,
+				strerror(errno));
+		return FALSE;
+	}
+
+	fprintf(stdout, BENCHMARK_RESULTS_WRITTEN, nClientCount, pszOutputPath);
+
+	return TRUE;
+}
@@ -0,0 +1,462 @@
+// binary_protocol.c - Implementation of the binary protocol.
+//
+// A frame is a BINARY_FRAME_HEADER_SIZE header followed by its payload.  The
+// header is a big-endian 32-bit value; its top 8 bits are the opcode and its
+// low 24 bits the length of the payload.  Frames from clients carry commands
+// (with their argument as the payload) and chat lines.  Frames from the
+// server carry replies (the reply code as a big-endian 16-bit number, then
+// the text), messages, the end of a multi-line reply, and history data.
+//
+// Command frames are turned back into the command line of the text protocol
+// before they are handed to the same handlers that the text protocol uses,
+// so the two protocols cannot drift apart; but which handler gets the frame
+// is decided by its opcode alone.
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "binary_protocol.h"
+#include "client_thread_functions.h"
+#include "dm_manager.h"
+#include "hashtag_manager.h"
+#include "heartbeat.h"
+#include "nickname_manager.h"
+#include "room_manager.h"
+#include "server_functions.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Global variables (used in this file only)
+
+/**
+ * @brief What to put in front of the payload of a frame from a client, by
+ * opcode, to turn it into the line the text protocol would have sent.
+ */
+static const char* const g_ppszCommandPrefixes[BINARY_OP_PONG + 1] = {
+	[BINARY_OP_CHAT] = "",
+	[BINARY_OP_END] = ".",
+	[BINARY_OP_NICK] = PROTOCOL_NICK_COMMAND,
+	[BINARY_OP_LIST] = "LIST",
+	[BINARY_OP_QUIT] = "QUIT",
+	[BINARY_OP_JOIN] = PROTOCOL_JOIN_COMMAND,
+	[BINARY_OP_PART] = "PART",
+	[BINARY_OP_HISTORY] = PROTOCOL_HISTORY_COMMAND,
+	[BINARY_OP_FOLLOW] = PROTOCOL_FOLLOW_COMMAND,
+	[BINARY_OP_UNFOLLOW] = PROTOCOL_UNFOLLOW_COMMAND,
+	[BINARY_OP_MUTE] = "MUTE",
+	[BINARY_OP_UNMUTE] = "UNMUTE",
+	[BINARY_OP_DM] = PROTOCOL_DM_COMMAND,
+	[BINARY_OP_PONG] = PROTOCOL_PONG_COMMAND
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// GetCommandPrefix function - Gets what goes in front of the payload of a
+// frame with the opcode given.  Opcodes that are not known get nothing.
+//
+
+const char* GetCommandPrefix(int nOpcode) {
+	if (nOpcode < 0 || nOpcode > BINARY_OP_PONG
+			|| g_ppszCommandPrefixes[nOpcode] == NULL) {
+		return "";
+	}
+
+	return g_ppszCommandPrefixes[nOpcode];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PutFrameHeader function - Encodes the header of a frame.
+//
+
+void PutFrameHeader(unsigned char* pHeader, int nOpcode,
+		size_t nPayloadLength) {
+	pHeader[0] = (unsigned char) nOpcode;
+	pHeader[1] = (unsigned char) (nPayloadLength >> 16);
+	pHeader[2] = (unsigned char) (nPayloadLength >> 8);
+	pHeader[3] = (unsigned char) nPayloadLength;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReceiveFully function - Reads exactly nSize bytes from a client's socket.
+// Returns FALSE if the connection fails or is closed first.
+//
+
+BOOL ReceiveFully(int nSocket, void* pvBuffer, size_t nSize) {
+	size_t nTotalRead = 0;
+
+	while (nTotalRead < nSize) {
+		ssize_t nRead = read(nSocket, (char*) pvBuffer + nTotalRead,
+				nSize - nTotalRead);
+		if (nRead < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (nRead <= 0) {
+			return FALSE;
+		}
+
+		nTotalRead += (size_t) nRead;
+	}
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendVectorToClient function - Hands the pieces of one or more frames to
+// writev() at once, and carries on from where it left off if only some of
+// them are written.
+//
+
+int SendVectorToClient(int nSocket, struct iovec* pIov, int nIovCount) {
+	int nTotalBytesSent = 0;
+
+	while (nIovCount > 0) {
+		ssize_t nBytesSent = writev(nSocket, pIov, nIovCount);
+		if (nBytesSent < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (nBytesSent <= 0) {
+			return ERROR;
+		}
+
+		nTotalBytesSent += (int) nBytesSent;
+
+		/* Skip over the pieces that were written in full, and the part of
+		 * the next one that was written, if any */
+		while (nIovCount > 0 && (size_t) nBytesSent >= pIov->iov_len) {
+			nBytesSent -= pIov->iov_len;
+			pIov++;
+			nIovCount--;
+		}
+
+		if (nIovCount > 0) {
+			pIov->iov_base = (char*) pIov->iov_base + nBytesSent;
+			pIov->iov_len -= nBytesSent;
+		}
+	}
+
+	return nTotalBytesSent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// HandleBinaryFrame function
+
+void HandleBinaryFrame(LPCLIENTSTRUCT lpSendingClient, int nOpcode,
+		char* pszBuffer) {
+	if (lpSendingClient == NULL || pszBuffer == NULL) {
+		return;
+	}
+
+	if (ShouldClientThreadStop(lpSendingClient)) {
+		return;
+	}
+
+	/* per protocol, QUIT is the only command a client that is not in the
+	 * connected state can send; a binary client has already said HELO */
+	if (nOpcode == BINARY_OP_QUIT) {
+		EndChatSession(lpSendingClient);
+		return;
+	}
+
+	if (lpSendingClient->bConnected == FALSE) {
+		return;
+	}
+
+	const BOOL IS_SENDING_DM =
+			!IsNullOrWhiteSpace(lpSendingClient->szDmRecipient);
+
+	switch (nOpcode) {
+	case BINARY_OP_CHAT:
+		if (IS_SENDING_DM) {
+			ProcessDirectMessageLine(lpSendingClient, pszBuffer);
+		} else {
+			BroadcastChatMessage(pszBuffer, lpSendingClient);
+		}
+		break;
+
+	case BINARY_OP_END:
+		if (IS_SENDING_DM) {
+			ProcessDirectMessageLine(lpSendingClient, pszBuffer);
+		}
+		break;
+
+	case BINARY_OP_NICK:
+		RegisterClientNickname(lpSendingClient, pszBuffer);
+		break;
+
+	case BINARY_OP_LIST:
+		ProcessListCommand(lpSendingClient);
+		break;
+
+	case BINARY_OP_JOIN:
+		ProcessJoinCommand(lpSendingClient, pszBuffer);
+		break;
+
+	case BINARY_OP_PART:
+		ProcessPartCommand(lpSendingClient);
+		break;
+
+	case BINARY_OP_HISTORY:
+		ProcessHistoryCommand(lpSendingClient, pszBuffer);
+		break;
+
+	case BINARY_OP_FOLLOW:
+		ProcessFollowCommand(lpSendingClient, pszBuffer);
+		break;
+
+	case BINARY_OP_UNFOLLOW:
+		ProcessUnfollowCommand(lpSendingClient, pszBuffer);
+		break;
+
+	case BINARY_OP_MUTE:
+		ProcessMuteCommand(lpSendingClient, TRUE);
+		break;
+
+	case BINARY_OP_UNMUTE:
+		ProcessMuteCommand(lpSendingClient, FALSE);
+		break;
+
+	case BINARY_OP_DM:
+		ProcessDmCommand(lpSendingClient, pszBuffer);
+		break;
+
+	case BINARY_OP_PONG:
+		ProcessPongCommand(lpSendingClient, pszBuffer);
+		break;
+
+	default:
+		break;	// not an opcode we know; ignore the frame
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReceiveFrameFromClient function
+
+int ReceiveFrameFromClient(LPCLIENTSTRUCT lpSendingClient, int* pnOpcode,
+		char** ppszBuffer) {
+	if (lpSendingClient == NULL) {
+		fprintf(stderr, ERROR_NO_SENDING_CLIENT_SPECIFIED);
+
+		CleanupServer(ERROR);
+	}
+
+	if (pnOpcode == NULL || ppszBuffer == NULL) {
+		CleanupServer(ERROR);	// Required parameters
+	}
+
+	*ppszBuffer = NULL;
+
+	unsigned char header[BINARY_FRAME_HEADER_SIZE];
+
+	if (!ReceiveFully(lpSendingClient->nSocket, header,
+			BINARY_FRAME_HEADER_SIZE)) {
+		return 0;
+	}
+
+	const int OPCODE = header[0];
+	const size_t PAYLOAD_LENGTH = ((size_t) header[1] << 16)
+			| ((size_t) header[2] << 8) | (size_t) header[3];
+
+	if (PAYLOAD_LENGTH > BINARY_MAX_CLIENT_PAYLOAD_LEN) {
+		/* We cannot skip the frame without reading it, and no client of
+		 * ours sends one this big; so we hang up. */
+		EndChatSession(lpSendingClient);
+		return 0;
+	}
+
+	const char* pszPrefix = GetCommandPrefix(OPCODE);
+	const size_t PREFIX_LENGTH = strlen(pszPrefix);
+
+	/* Room for the prefix, the payload, a newline and a null terminator */
+	char* pszBuffer = (char*) malloc(PREFIX_LENGTH + PAYLOAD_LENGTH + 2);
+	if (pszBuffer == NULL) {
+		CleanupServer(ERROR);
+	}
+
+	memcpy(pszBuffer, pszPrefix, PREFIX_LENGTH);
+
+	char* pchPayload = pszBuffer + PREFIX_LENGTH;
+
+	if (PAYLOAD_LENGTH > 0
+			&& !ReceiveFully(lpSendingClient->nSocket, pchPayload,
+					PAYLOAD_LENGTH)) {
+		free(pszBuffer);
+		return 0;
+	}
+
+	/* A frame stands for one line; anything after a newline in the payload
+	 * is dropped rather than being taken for another line */
+	size_t nLineLength = PAYLOAD_LENGTH;
+
+	char* pchNewline = (char*) memchr(pchPayload, '\n', PAYLOAD_LENGTH);
+	if (pchNewline != NULL) {
+		nLineLength = (size_t) (pchNewline - pchPayload);
+	}
+
+	pchPayload[nLineLength] = '\n';
+	pchPayload[nLineLength + 1] = '\0';
+
+	const int BYTES_RECEIVED = (int) (BINARY_FRAME_HEADER_SIZE
+			+ PAYLOAD_LENGTH);
+
+	/* Inform the server console's user how many bytes we got. */
+	LogInfo(CLIENT_BYTES_RECD_FORMAT, lpSendingClient->szIPAddress,
+			lpSendingClient->nSocket, BYTES_RECEIVED);
+
+	if (GetLogFileHandle() != stdout) {
+		fprintf(stdout, CLIENT_BYTES_RECD_FORMAT, lpSendingClient->szIPAddress,
+				lpSendingClient->nSocket, BYTES_RECEIVED);
+	}
+
+	/* Save the total bytes received from this client */
+	lpSendingClient->nBytesReceived += BYTES_RECEIVED;
+
+	LogInfo(CLIENT_DATA_FORMAT, lpSendingClient->szIPAddress,
+			lpSendingClient->nSocket, pszBuffer);
+
+	if (GetLogFileHandle() != stdout) {
+		fprintf(stdout,
+		CLIENT_DATA_FORMAT, lpSendingClient->szIPAddress,
+				lpSendingClient->nSocket, pszBuffer);
+	}
+
+	*pnOpcode = OPCODE;
+	*ppszBuffer = pszBuffer;
+
+	return BYTES_RECEIVED;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendFramedBuffersToClient function
+
+int SendFramedBuffersToClient(int nSocket, LPMESSAGEBUFFER* lpBuffers,
+		int nCount) {
+	if (!IsSocketValid(nSocket) || lpBuffers == NULL) {
+		return ERROR;
+	}
+
+	if (nCount <= 0 || nCount > IOV_MAX / 2) {
+		return ERROR;
+	}
+
+	unsigned char headers[nCount][BINARY_FRAME_HEADER_SIZE];
+	struct iovec iov[2 * nCount];
+
+	for (int i = 0; i < nCount; i++) {
+		size_t nLength = (size_t) lpBuffers[i]->nLength;
+		if (nLength > 0 && lpBuffers[i]->szData[nLength - 1] == '\n') {
+			nLength--;
+		}
+
+		PutFrameHeader(headers[i], BINARY_OP_MESSAGE, nLength);
+
+		iov[2 * i].iov_base = headers[i];
+		iov[2 * i].iov_len = BINARY_FRAME_HEADER_SIZE;
+		iov[2 * i + 1].iov_base = lpBuffers[i]->szData;
+		iov[2 * i + 1].iov_len = nLength;
+	}
+
+	return SendVectorToClient(nSocket, iov, 2 * nCount);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendFramedToClient function
+
+int SendFramedToClient(int nSocket, const char* pszMessage) {
+	if (!IsSocketValid(nSocket) || pszMessage == NULL) {
+		return ERROR;
+	}
+
+	size_t nLength = strlen(pszMessage);
+	if (nLength > 0 && pszMessage[nLength - 1] == '\n') {
+		nLength--;
+	}
+
+	if (nLength > BINARY_MAX_PAYLOAD_LEN - 2) {
+		return ERROR;
+	}
+
+	/* Room for the header, and the reply code if there is one */
+	unsigned char header[BINARY_FRAME_HEADER_SIZE + 2];
+
+	struct iovec iov[2];
+	iov[0].iov_base = header;
+	iov[0].iov_len = BINARY_FRAME_HEADER_SIZE;
+	iov[1].iov_base = (char*) pszMessage;
+	iov[1].iov_len = nLength;
+
+	if (nLength == 1 && pszMessage[0] == '.') {
+		PutFrameHeader(header, BINARY_OP_END, 0);
+		iov[1].iov_len = 0;
+	} else if (nLength >= 4 && isdigit(pszMessage[0])
+			&& isdigit(pszMessage[1]) && isdigit(pszMessage[2])
+			&& pszMessage[3] == ' ') {
+		const int REPLY_CODE = (pszMessage[0] - '0') * 100
+				+ (pszMessage[1] - '0') * 10 + (pszMessage[2] - '0');
+
+		PutFrameHeader(header, BINARY_OP_REPLY, 2 + nLength - 4);
+		header[BINARY_FRAME_HEADER_SIZE] = (unsigned char) (REPLY_CODE >> 8);
+		header[BINARY_FRAME_HEADER_SIZE + 1] = (unsigned char) REPLY_CODE;
+
+		iov[0].iov_len = BINARY_FRAME_HEADER_SIZE + 2;
+		iov[1].iov_base = (char*) pszMessage + 4;
+		iov[1].iov_len = nLength - 4;
+	} else {
+		PutFrameHeader(header, BINARY_OP_MESSAGE, nLength);
+	}
+
+	return SendVectorToClient(nSocket, iov, 2);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendFrameHeader function
+
+BOOL SendFrameHeader(int nSocket, int nOpcode, size_t nPayloadLength) {
+	if (!IsSocketValid(nSocket) || nPayloadLength > BINARY_MAX_PAYLOAD_LEN) {
+		return FALSE;
+	}
+
+	unsigned char header[BINARY_FRAME_HEADER_SIZE];
+
+	PutFrameHeader(header, nOpcode, nPayloadLength);
+
+	struct iovec iov;
+	iov.iov_base = header;
+	iov.iov_len = BINARY_FRAME_HEADER_SIZE;
+
+	return SendVectorToClient(nSocket, &iov, 1) == BINARY_FRAME_HEADER_SIZE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendFrameToClient function
+
+int SendFrameToClient(int nSocket, int nOpcode, const char* pszPayload) {
+	if (!IsSocketValid(nSocket) || pszPayload == NULL) {
+		return ERROR;
+	}
+
+	const size_t PAYLOAD_LENGTH = strlen(pszPayload);
+	if (PAYLOAD_LENGTH > BINARY_MAX_PAYLOAD_LEN) {
+		return ERROR;
+	}
+
+	unsigned char header[BINARY_FRAME_HEADER_SIZE];
+
+	PutFrameHeader(header, nOpcode, PAYLOAD_LENGTH);
+
+	/* The header and the payload go in one call, so that the frame cannot
+	 * be split up by a message that another thread is sending the client */
+	struct iovec iov[2];
+	iov[0].iov_base = header;
+	iov[0].iov_len = BINARY_FRAME_HEADER_SIZE;
+	iov[1].iov_base = (char*) pszPayload;
+	iov[1].iov_len = PAYLOAD_LENGTH;
+
+	return SendVectorToClient(nSocket, iov, 2);
+}
@@ -21,19 +21,13 @@ BOOL FindClientByID(void* pvClientId, void* pvClientStruct) {
         return FALSE;
     }
 
-    // Try to extract the search key (client UUID) from
-    // the input.
-    if (!IsUUIDValid((UUID*) pvClientId)) {
-        return FALSE;
-    }
-
     // Get the current element of the list to match the
     // search key against.
     LPCLIENTSTRUCT lpCS = (LPCLIENTSTRUCT) pvClientStruct;
 
-    // If the clientSockFd search key equals the value of the CLIENTSTRUCT
-    // instance's nSocket field, then we are golden
-    return AreUUIDsEqual((UUID*) pvClientId, &(lpCS->clientID));
+    // If the connection ID search key equals the value of the CLIENTSTRUCT
+    // instance's nConnectionID field, then we are golden
+    return *((uint64_t*) pvClientId) == lpCS->nConnectionID;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
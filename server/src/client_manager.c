@@ -8,6 +8,7 @@
 #include "client_list_manager.h"
 #include "client_thread_functions.h"
 #include "server_functions.h"
+#include "shutdown.h"
 
 ///////////////////////////////////////////////////////////////////////////////
 // BroadcastToAllClients: Sends the indicated message to all the clients,
@@ -34,7 +35,7 @@ void DoBroadcast(LPCLIENTSTRUCT lpCurrentClient,
 }
 
 int BroadcastToAllClients(const char* pszMessage) {
-	if (g_bShouldTerminateClientThread) {
+	if (IsShutdownRequested()) {
 		return ERROR;
 	}
 
@@ -78,65 +79,50 @@ int BroadcastToAllClients(const char* pszMessage) {
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// BroadcastToAllClientsExceptSender function: Sends a chat message to everyone
-// in the room except the client who sent it.
-//
+// BroadcastBufferToAllClientsExceptSender function
 
-int BroadcastToAllClientsExceptSender(const char* pszMessage,
+int BroadcastBufferToAllClientsExceptSender(LPMESSAGEBUFFER lpMessage,
 		LPCLIENTSTRUCT lpSendingClient) {
 	int nTotalBytesSent = 0;
 
-	if (IsNullOrWhiteSpace(pszMessage)) {
+	if (lpMessage == NULL || IsNullOrWhiteSpace(lpMessage->szData)) {
 		// Chat message to broadcast is blank; nothing to do.
 		return nTotalBytesSent;
 	}
 
-	if (lpSendingClient == NULL) {
-		// The data structure reference for the sending client is NULL;
-		// as this information is necessary to carry out this function's task,
-		// there's nothing to do.
-		return nTotalBytesSent;
-	}
+	// A NULL sending client means that no one is skipped.
 
-	LogInfo(SERVER_DATA_FORMAT, pszMessage);
+	LogInfo(SERVER_DATA_FORMAT, lpMessage->szData);
 
 	if (GetLogFileHandle() != stdout) {
-		fprintf(stdout, SERVER_DATA_FORMAT, pszMessage);
+		fprintf(stdout, SERVER_DATA_FORMAT, lpMessage->szData);
 	}
 
 	LockMutex(GetClientListMutex());
 	{
-		if (GetElementCount(g_pClientList) == 0) {
-			return nTotalBytesSent;	// Nothing to do.
-		}
-
 		POSITION* pos = GetHeadPosition(g_pClientList);
-		if (pos == NULL) {
-			return nTotalBytesSent;
-		}
 
-		do {
+		while (pos != NULL) {
+			LPCLIENTSTRUCT lpCurrentClient = (LPCLIENTSTRUCT) (pos->pvData);
 
-			int nBytesSent = 0;
-
-			LPCLIENTSTRUCT lpCurrentClient
-				= (LPCLIENTSTRUCT)(pos->pvData);
-			if (lpCurrentClient == NULL) {
-				continue;
-			}
+			pos = GetNextPosition(pos);
 
 			// If we have the client list entry for the sender, skip it,
 			// since this function does not broadcast back to the sender.
-			if (AreUUIDsEqual(&(lpSendingClient->clientID),
-					&(lpCurrentClient->clientID))) {
+			if (lpCurrentClient == NULL || (lpSendingClient != NULL
+					&& lpSendingClient->nConnectionID
+							== lpCurrentClient->nConnectionID)) {
 				continue;
 			}
 
-			if ((nBytesSent = SendToClient(lpCurrentClient, pszMessage)) > 0) {
+			/* Every recipient's mailbox takes a reference to the same
+			 * buffer */
+			const int nBytesSent = SendBuffersToClient(lpCurrentClient,
+					&lpMessage, 1);
+			if (nBytesSent > 0) {
 				nTotalBytesSent += nBytesSent;
 			}
-
-		} while ((pos = GetNextPosition(pos)) != NULL);
+		}
 	}
 	UnlockMutex(GetClientListMutex());
 
@@ -144,6 +130,42 @@ int BroadcastToAllClientsExceptSender(const char* pszMessage,
 	return nTotalBytesSent;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// BroadcastBufferToAllClients function
+
+int BroadcastBufferToAllClients(LPMESSAGEBUFFER lpMessage) {
+	return BroadcastBufferToAllClientsExceptSender(lpMessage, NULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BroadcastToAllClientsExceptSender function: Sends a chat message to everyone
+// in the room except the client who sent it.
+//
+
+int BroadcastToAllClientsExceptSender(const char* pszMessage,
+		LPCLIENTSTRUCT lpSendingClient) {
+	if (IsNullOrWhiteSpace(pszMessage)) {
+		// Chat message to broadcast is blank; nothing to do.
+		return 0;
+	}
+
+	if (lpSendingClient == NULL) {
+		return 0;
+	}
+
+	/* The message is copied once, into a buffer that all of the recipients
+	 * share */
+	LPMESSAGEBUFFER lpMessage = CreateMessageBuffer(NULL, pszMessage);
+
+	const int nTotalBytesSent = BroadcastBufferToAllClientsExceptSender(
+			lpMessage, lpSendingClient);
+
+	ReleaseMessageBuffer(lpMessage);
+
+	// Return the total bytes sent to the caller
+	return nTotalBytesSent;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // ForciblyDisconnectClient function - used when the server console's user
 // kills the server, to sever connections with its clients.
@@ -175,7 +197,7 @@ void ForciblyDisconnectClient(LPCLIENTSTRUCT lpCS) {
 	fprintf(stdout, SERVER_DATA_FORMAT, ERROR_FORCED_DISCONNECT);
 
 	/* Forcibly close client connections */
-	Send(lpCS->nSocket, ERROR_FORCED_DISCONNECT);
+	SendToClient(lpCS, ERROR_FORCED_DISCONNECT);
 	CloseSocket(lpCS->nSocket);
 
 	LogInfo(CLIENT_DISCONNECTED, lpCS->szIPAddress, lpCS->nSocket);
@@ -202,11 +224,10 @@ void ForciblyDisconnectClient(LPCLIENTSTRUCT lpCS) {
 int ReplyToClient(LPCLIENTSTRUCT lpCS, const char* pszBuffer) {
 	int nBytesSent = SendToClient(lpCS, pszBuffer);
 	if (nBytesSent <= 0) {
-		FreeSocketMutex();
-
-		CleanupServer(ERROR);
-
-		return -1;
+		/* A client that cannot be written to, whether it has stalled,
+		 * fallen too far behind or hung up, is disconnected by its own
+		 * thread; that is no reason to stop the server */
+		return 0;
 	}
 
 	// Asume buffer terminates in a newline.  Report what the server
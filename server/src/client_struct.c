@@ -6,17 +6,32 @@
 #include "stdafx.h"
 #include "server.h"
 
+#include "acceptor_shards.h"
+#include "admission.h"
 #include "client_struct.h"
 #include "client_thread_functions.h"
+#include "compression.h"
+#include "rate_limiter.h"
 #include "server_functions.h"
 
+///////////////////////////////////////////////////////////////////////////////
+// AddClientRef function
+
+void AddClientRef(LPCLIENTSTRUCT lpClient) {
+	if (lpClient == NULL) {
+		return;
+	}
+
+	atomic_fetch_add(&(lpClient->nRefCount), 1);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // CreateClientStruct - Allocates memory for, and initializes, a new instance
 // of a CLIENTSTRUCT structure with the socket handle and IP address provided.
 //
 
 LPCLIENTSTRUCT CreateClientStruct(int nClientSocket,
-		const char* pszClientIPAddress) {
+		const char* pszClientIPAddress, int nShardIndex) {
 
 	if (!IsSocketValid(nClientSocket)) {
 		// The client socket handle passed is not valid; nothing to do.
@@ -43,12 +58,27 @@ LPCLIENTSTRUCT CreateClientStruct(int nClientSocket,
 	    CleanupServer(ERROR);
 	}
 
-	/* Tag each client with a universally-unique identifier */
-	GenerateNewUUID(&(lpClientStruct->clientID));
+	/* Tag each client with a number that is unique within this process;
+	 * the UUID label is only made up if it is ever asked for */
+	lpClientStruct->nConnectionID = NewConnectionID(nShardIndex);
+	atomic_init(&(lpClientStruct->pszUUIDLabel), NULL);
 
 	// Save the client socket handle into the nSocket field of the structure
 	lpClientStruct->nSocket = nClientSocket;
 
+	/* The acceptor that accepted the client, if any, says which shard it
+	 * belongs to */
+	lpClientStruct->nShardIndex = nShardIndex;
+
+	/* The client's thread runs until the connection is cleaned up */
+	atomic_init(&(lpClientStruct->bStopRequested), FALSE);
+
+	/* The client's own joins and leaves have not been batched yet */
+	atomic_init(&(lpClientStruct->nPresenceBatchID), 0);
+
+	/* The connection counts against its address until it is closed */
+	atomic_init(&(lpClientStruct->bAdmissionReleased), FALSE);
+
 	// Initialize the pszIPAddress string field of the client structure with
 	// the IP address passed to us.
 	strncpy(lpClientStruct->szIPAddress, pszClientIPAddress,
@@ -59,9 +89,57 @@ LPCLIENTSTRUCT CreateClientStruct(int nClientSocket,
 	 * being sent other chatters' messages. */
 	lpClientStruct->bConnected = FALSE;
 
+	/* Clients speak the text protocol unless they say HELO BINARY */
+	lpClientStruct->bBinaryProtocol = FALSE;
+
+	/* ...and are sent uncompressed data unless they say HELO DEFLATE */
+	lpClientStruct->lpDeflateStream = NULL;
+
+	/* Every client starts out able to send a full burst of chat */
+	InitializeClientRateLimits(lpClientStruct);
+
 	/* Initialize the pszNickname value of the CLIENTSTRUCT instance
 	 * to have the NULL value so it's not pointing at some garbaage address */
 	lpClientStruct->pszNickname = NULL;
+	lpClientStruct->nChatPrefixLength = 0;
+
+	/* Clients are placed into a room when they issue the HELO command */
+	lpClientStruct->lpRoom = NULL;
+	lpClientStruct->nRoomSlot = -1;
+
+	/* New clients do not follow any hashtags */
+	lpClientStruct->nFollowedHashtagCount = 0;
+	lpClientStruct->nDeliveryStamp = 0;
+
+	/* The nickname index entry is made when the NICK command is issued */
+	lpClientStruct->lpNicknameEntry = NULL;
+	lpClientStruct->bMuted = FALSE;
+
+	/* Not sending a direct message to anybody yet */
+	memset(lpClientStruct->szDmRecipient, 0, MAX_NICKNAME_LEN + 1);
+	lpClientStruct->nDmRecipientNodeId = 0;
+
+	/* Nor in the middle of a chat message */
+	ResetMessageAssembler(&(lpClientStruct->chatMessage));
+
+	/* The timeouts are armed by the client's thread, on its own wheel */
+	lpClientStruct->lpTimerWheel = NULL;
+	lpClientStruct->nExpiredTimeout = TIMEOUT_KIND_NONE;
+
+	/* Whatever the client is sent waits in its mailbox for its thread */
+	if (!InitializeMailbox(&(lpClientStruct->mailbox))) {
+		fprintf(stderr, FAILED_CREATE_MAILBOX, strerror(errno));
+
+		CleanupServer(ERROR);
+	}
+
+	/* No PINGs have been sent yet */
+	lpClientStruct->nPingSequence = 0;
+	lpClientStruct->nPingSentAt = 0;
+	memset(&(lpClientStruct->rttStats), 0, sizeof(RTTSTATS));
+
+	/* This reference belongs to the list of clients */
+	atomic_init(&(lpClientStruct->nRefCount), 1);
 
 	/* Write the client ID out to the console and log */
 	LogClientID(lpClientStruct);
@@ -69,6 +147,24 @@ LPCLIENTSTRUCT CreateClientStruct(int nClientSocket,
 	return lpClientStruct;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// FormatConnectionID function
+
+char* FormatConnectionID(uint64_t nConnectionID, char* pszBuffer) {
+	if (pszBuffer == NULL) {
+		return NULL;
+	}
+
+	const uint64_t COUNTER_MASK =
+			(((uint64_t) 1) << CONNECTION_ID_COUNTER_BITS) - 1;
+
+	snprintf(pszBuffer, CONNECTION_ID_STRING_SIZE, CONNECTION_ID_FORMAT,
+			(unsigned int) (nConnectionID >> CONNECTION_ID_COUNTER_BITS),
+			(unsigned long long) (nConnectionID & COUNTER_MASK));
+
+	return pszBuffer;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // FreeClient function - Releases operating system resources consumed by the
 // client information structure.
@@ -80,7 +176,40 @@ void FreeClient(void* pvClientStruct) {
 		return;
 	}
 
-	free(pvClientStruct);
+	ReleaseClient((LPCLIENTSTRUCT) pvClientStruct);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetClientUUIDLabel function
+
+const char* GetClientUUIDLabel(LPCLIENTSTRUCT lpCS) {
+	if (lpCS == NULL) {
+		return NULL;
+	}
+
+	char* pszUUIDLabel = atomic_load(&(lpCS->pszUUIDLabel));
+	if (pszUUIDLabel != NULL) {
+		return pszUUIDLabel;
+	}
+
+	UUID uuid;
+	GenerateNewUUID(&uuid);
+
+	char* pszNewLabel = UUIDToString(&uuid);
+	if (pszNewLabel == NULL) {
+		fprintf(stderr, OUT_OF_MEMORY);
+
+		CleanupServer(ERROR);
+	}
+
+	/* If another thread got there first, its label is the one kept */
+	if (!atomic_compare_exchange_strong(&(lpCS->pszUUIDLabel), &pszUUIDLabel,
+			pszNewLabel)) {
+		free(pszNewLabel);
+		return pszUUIDLabel;
+	}
+
+	return pszNewLabel;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -94,3 +223,58 @@ BOOL IsClientConnected(void* pvClientStruct) {
 	LPCLIENTSTRUCT lpCS = (LPCLIENTSTRUCT)pvClientStruct;
 	return lpCS->bConnected;
 }
+
+///////////////////////////////////////////////////////////////////////////////
+// ReleaseClientAdmission function
+
+void ReleaseClientAdmission(LPCLIENTSTRUCT lpClient) {
+	if (lpClient == NULL) {
+		return;
+	}
+
+	if (!atomic_exchange(&(lpClient->bAdmissionReleased), TRUE)) {
+		ReleaseAdmission(lpClient->szIPAddress);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReleaseClient function
+
+void ReleaseClient(LPCLIENTSTRUCT lpClient) {
+	if (lpClient == NULL) {
+		return;
+	}
+
+	if (atomic_fetch_sub(&(lpClient->nRefCount), 1) == 1) {
+		DestroyMailbox(&(lpClient->mailbox));
+
+		FreeDeflateStream(lpClient->lpDeflateStream);
+		lpClient->lpDeflateStream = NULL;
+
+		/* Make room for another connection from the same address, if
+		 * closing the connection has not already */
+		ReleaseClientAdmission(lpClient);
+
+		free(atomic_load(&(lpClient->pszUUIDLabel)));
+
+		free(lpClient);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetClientUUIDLabel function
+
+void SetClientUUIDLabel(LPCLIENTSTRUCT lpCS, const char* pszUUIDLabel) {
+	if (lpCS == NULL || IsNullOrWhiteSpace(pszUUIDLabel)) {
+		return;
+	}
+
+	char* pszCopy = strdup(pszUUIDLabel);
+	if (pszCopy == NULL) {
+		fprintf(stderr, OUT_OF_MEMORY);
+
+		CleanupServer(ERROR);
+	}
+
+	free(atomic_exchange(&(lpCS->pszUUIDLabel), pszCopy));
+}
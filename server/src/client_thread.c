@@ -6,13 +6,19 @@
 #include "server.h"
 
 #include "mat.h"
+#include "acceptor_shards.h"
+#include "binary_protocol.h"
 #include "client_manager.h"
 #include "client_struct.h"
 #include "client_thread.h"
 #include "client_thread_functions.h"
 #include "client_list_manager.h"
+#include "client_timeouts.h"
+#include "heartbeat.h"
+#include "hot_restart.h"
 
 #include "server_functions.h"
+#include "shutdown.h"
 
 ///////////////////////////////////////////////////////////////////////////////
 // ClientThread thread procedure
@@ -21,17 +27,34 @@ void *ClientThread(void* pData) {
 	SetThreadCancelState(PTHREAD_CANCEL_ENABLE);
 	SetThreadCancelType(PTHREAD_CANCEL_DEFERRED);
 
-	/* Be sure to register the termination semaphore so we can be
-	 * signalled to stop if necessary */
-	RegisterEvent(TerminateClientThread);
+	/* A shutdown waits for this thread to say goodbye to the client */
+	BeginStoppableThread();
 
 	/* Valid user state data consisting of a reference to the CLIENTSTRUCT
 	 * instance giving information for this client must be passed. */
 	LPCLIENTSTRUCT lpSendingClient = GetSendingClientInfo(pData);
 
+	/* Run next to the acceptor shard that owns the client */
+	PinThreadToShard(lpSendingClient->nShardIndex);
+
 	lpSendingClient->nBytesReceived =
 	ZERO_BYTES_TOTAL_RECEIVED;
 
+	/* Hold on to the client structure until this thread is done with it,
+	 * even once the client has been taken out of the list of clients */
+	AddClientRef(lpSendingClient);
+
+	/* The client's timeouts live on this thread's own timing wheel, so
+	 * that it is the thread that owns the connection that acts on them */
+	TIMERWHEEL wheel;
+	InitializeTimerWheel(&wheel);
+	StartClientTimeouts(&wheel, lpSendingClient);
+	StartClientHeartbeat(lpSendingClient);
+
+	/* This thread is the only one that writes to the client; the others
+	 * post what they have for it to its mailbox */
+	ClaimMailbox(&(lpSendingClient->mailbox));
+
 	while (1) {
 		/* Check whether the client's socket endpoint is valid. */
 		if (!IsSocketValid(lpSendingClient->nSocket)) {
@@ -39,11 +62,81 @@ void *ClientThread(void* pData) {
 			break;
 		}
 
+		/* Stop if the server is shutting down, or if the connection has
+		 * been cleaned up; either one wakes up the wait below */
+		if (ShouldClientThreadStop(lpSendingClient)) {
+			break;
+		}
+
+		/* Write out whatever the other threads have sent the client. */
+		DeliverClientMailbox(lpSendingClient);
+
+		/* Act on any of the client's timeouts that have expired. */
+		RunTimerWheel(&wheel);
+		if (lpSendingClient->nExpiredTimeout != TIMEOUT_KIND_NONE) {
+			HandleClientTimeout(lpSendingClient);
+			break;
+		}
+
+		/* Wait for the client to send something, for something to be
+		 * posted to its mailbox, or for a shutdown, but only for as long as
+		 * one tick of the wheel.  During a hot restart this thread stops
+		 * here, and the new server process takes over reading from the
+		 * client. */
+		if (!WaitForSocketInput(lpSendingClient->nSocket,
+				lpSendingClient->mailbox.nWakeFd, TIMER_WHEEL_TICK_MS)) {
+			continue;
+		}
+
 		// Receive all the lines of text that the client wants to send,
 		// and put them all into a buffer.
 		char* pszData = NULL;
 		int nBytesReceived = 0;
 
+		/* A client that said HELO BINARY sends frames instead; the opcode
+		 * of each tells us what to do with it without looking at the
+		 * text. */
+		if (lpSendingClient->bBinaryProtocol) {
+			int nOpcode = 0;
+
+			/* Nothing is received only if the client hung up, or cut a
+			 * frame off partway; the socket was readable, so waiting for
+			 * more would only spin */
+			if ((nBytesReceived = ReceiveFrameFromClient(lpSendingClient,
+					&nOpcode, &pszData)) <= 0) {
+				if (!ShouldClientThreadStop(lpSendingClient)) {
+					LogDebug(DISCONNECTED_CLIENT_DETECTED);
+
+					AbortChatSession(lpSendingClient, NULL);
+				}
+
+				break;
+			}
+
+			HandleBinaryFrame(lpSendingClient, nOpcode, pszData);
+
+			FreeBuffer((void**) &pszData);
+
+			/* Answering a PING does not make a client any less idle */
+			if (nOpcode != BINARY_OP_PONG) {
+				NoteClientInput(lpSendingClient);
+			}
+
+			if (ShouldClientThreadStop(lpSendingClient)) {
+				break;
+			}
+
+			if (lpSendingClient->bConnected == FALSE
+					|| !IsSocketValid(lpSendingClient->nSocket)) {
+
+				LogDebug(DISCONNECTED_CLIENT_DETECTED);
+
+				break;
+			}
+
+			continue;
+		}
+
 		if ((nBytesReceived = ReceiveFromClient(lpSendingClient, &pszData))
 				> 0) {
 
@@ -51,25 +144,34 @@ void *ClientThread(void* pData) {
 			 * next loop. We know if this is a protocol command rather than a
 			 * chat message because the HandleProtocolCommand returns a value
 			 * of TRUE in this case. */
-			if (HandleProtocolCommand(lpSendingClient, pszData))
+			const BOOL IS_HEARTBEAT_REPLY = IsHeartbeatReply(pszData);
+
+			if (HandleProtocolCommand(lpSendingClient, pszData)) {
+				/* Answering a PING does not make a client any less idle */
+				if (!IS_HEARTBEAT_REPLY) {
+					NoteClientInput(lpSendingClient);
+				}
 				continue;
+			}
 
 			/* IF we are here, then the pszData was not found to contain a protocol-
-			 * required command string; rather, this is simply text.  We prepend the
-			 * 'chat handle' of the person who sent the message and then send it to
-			 * all the chatters except the person who sent the message.
+			 * required command string; rather, this is simply text.  It is a line
+			 * of a chat message, which is kept until the dot that ends the message
+			 * comes in.  Then we prepend the 'chat handle' of the person who sent
+			 * the message and send it to all the chatters except that person.
 			 */
-			BroadcastChatMessage(pszData, lpSendingClient);
+			AddChatMessageLine(lpSendingClient, pszData);
 
 			/* TODO: Add other protocol handling here */
 
 			/* Free the received data so it does not leak memory */
 			FreeBuffer((void**) &pszData);
 
-			/* Check if the termination semaphore has been signalled, and
-			 * stop this loop if so. */
-			if (g_bShouldTerminateClientThread) {
-				g_bShouldTerminateClientThread = FALSE;
+			NoteClientInput(lpSendingClient);
+
+			/* Check if this thread has been told to stop, and stop this
+			 * loop if so. */
+			if (ShouldClientThreadStop(lpSendingClient)) {
 				break;
 			}
 
@@ -82,16 +184,38 @@ void *ClientThread(void* pData) {
 
 				break;
 			}
+		} else if (nBytesReceived == 0) {
+			/* Likewise, the socket was readable but nothing came, so the
+			 * client has hung up */
+			if (!ShouldClientThreadStop(lpSendingClient)) {
+				LogDebug(DISCONNECTED_CLIENT_DETECTED);
+
+				AbortChatSession(lpSendingClient, NULL);
+			}
+
+			break;
 		}
 	}
 
-	// reset the termination semaphore
-	if (g_bShouldTerminateClientThread) {
-		g_bShouldTerminateClientThread = FALSE;
+	/* If the server is shutting down, say goodbye to the client from here,
+	 * while this thread still owns its mailbox and so writes it out at once */
+	if (IsShutdownRequested()) {
+		ForciblyDisconnectClient(lpSendingClient);
 	}
 
+	/* The wheel goes away with this thread, so no timer may be left on it */
+	StopClientHeartbeat(lpSendingClient);
+	StopClientTimeouts(lpSendingClient);
+	lpSendingClient->lpTimerWheel = NULL;
+
+	ClaimMailbox(NULL);
+
+	ReleaseClient(lpSendingClient);
+
 	fprintf(stdout, CLIENT_THREAD_ENDING);
 
+	EndStoppableThread();
+
 	// done
 	return NULL;
 }
@@ -16,32 +16,282 @@
 #include "server.h"
 
 #include "mat.h"
+#include "binary_protocol.h"
 #include "client_manager.h"
 #include "client_list_manager.h"
 #include "client_thread.h"
 #include "client_thread_functions.h"
+#include "client_timeouts.h"
+#include "compression.h"
+#include "heartbeat.h"
+#include "rate_limiter.h"
+#include "dm_manager.h"
+#include "federation.h"
+#include "hashtag_manager.h"
 #include "nickname_manager.h"
+#include "presence.h"
+#include "room_manager.h"
+#include "roster.h"
 #include "server_functions.h"
+#include "shutdown.h"
 
 ///////////////////////////////////////////////////////////////////////////////
-// Global variables
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// AnnounceDeparture function - Tells everyone that a client is leaving, and
+// takes it out of its room, its hashtags and the pool of nicknames.
+//
+
+void AnnounceDeparture(LPCLIENTSTRUCT lpSendingClient) {
+	//char* pszID = UUIDToString(lpSendingClient->clientID);
+
+	//fprintf(stdout, "Ending chat session with client '{%s}'...\n", pszID);
 
-BOOL g_bShouldTerminateClientThread = FALSE;
+	if (!IsNullOrWhiteSpace(lpSendingClient->pszNickname)) {
+		//fprintf(stdout, "Informing other clients that @%s has left"
+		//      " the chat room...\n", lpSendingClient->pszNickname);
+		/* Give ALL connected clients the heads up that this particular chatter
+		 * is leaving the chat room (i.e., Elvis has left the building) */
+		AnnouncePresence(lpSendingClient->pszNickname, FALSE, lpSendingClient);
+
+		PublishRoomEvent(PEER_EVENT_LEAVE, NULL,
+				lpSendingClient->pszNickname, NULL);
+	}
+
+	/* Take the client out of its chat room so that it does not receive
+	 * any further room broadcasts */
+	LeaveCurrentRoom(lpSendingClient);
+
+	/* Likewise, stop delivering tagged messages to it */
+	UnfollowAllHashtags(lpSendingClient);
+
+	/* Put the nickname back into the pool of available nicknames */
+	ReleaseNickname(lpSendingClient);
+}
 
 ///////////////////////////////////////////////////////////////////////////////
-// Internal-use-only functions
+// CloseChatSession function - Marks a client that has left as not connected,
+// closes its connection and takes it out of the list of clients.
+//
 
-void SendMultilineDataTerminator(LPCLIENTSTRUCT lpSendingClient) {
-	if (lpSendingClient == NULL) {
+void CloseChatSession(LPCLIENTSTRUCT lpSendingClient) {
+	//fprintf(stdout, "Marking client as not connected...\n");
+
+	// Mark this client as no longer being connected.
+	lpSendingClient->bConnected = FALSE;
+
+	// If storage has been allocated for this client's nickname, blank
+	// the value out so that the server does not get confused about a nickname
+	// already being used.
+	if (lpSendingClient->pszNickname != NULL) {
+		memset((char*) (lpSendingClient->pszNickname), 0,
+				MAX_NICKNAME_LEN + 1);
+
+		free(lpSendingClient->pszNickname);
+		lpSendingClient->pszNickname = NULL;
+	}
+
+	CleanupClientConnection(lpSendingClient);
+
+	ReportClientSessionStats(lpSendingClient);
+
+	LockMutex(GetClientListMutex());
+	{
+		LPPOSITION pos = FindElement(g_pClientList,
+				&(lpSendingClient->nConnectionID), FindClientByID);
+		if (pos != NULL) {
+			g_pClientList = pos;
+			RemoveElement(&g_pClientList, FreeClient);
+		}
+	}
+	UnlockMutex(GetClientListMutex());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WriteBuffersToClient function - Writes a batch of text messages from the
+// client's mailbox to its socket.  Hands all the messages to writev() at once,
+// and carries on from where it left off if only some of them are written.
+//
+
+int WriteBuffersToClient(LPCLIENTSTRUCT lpCurrentClient,
+		LPMESSAGEBUFFER* lpBuffers, int nCount) {
+	if (lpCurrentClient == NULL || lpBuffers == NULL) {
+		return ERROR;
+	}
+
+	if (nCount <= 0 || nCount > IOV_MAX) {
+		return ERROR;
+	}
+
+	if (!IsSocketValid(lpCurrentClient->nSocket)) {
+		return ERROR;
+	}
+
+	if (lpCurrentClient->bConnected == FALSE) {
+		return ERROR;
+	}
+
+	if (lpCurrentClient->bBinaryProtocol) {
+		return SendFramedBuffersToClient(lpCurrentClient->nSocket, lpBuffers,
+				nCount);
+	}
+
+	struct iovec iov[nCount];
+
+	for (int i = 0; i < nCount; i++) {
+		iov[i].iov_base = lpBuffers[i]->szData;
+		iov[i].iov_len = lpBuffers[i]->nLength;
+	}
+
+	int nTotalBytesSent = 0;
+	struct iovec* pIov = iov;
+	int nIovCount = nCount;
+
+	while (nIovCount > 0) {
+		ssize_t nBytesSent = writev(lpCurrentClient->nSocket, pIov,
+				nIovCount);
+		if (nBytesSent < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (nBytesSent <= 0) {
+			return ERROR;
+		}
+
+		nTotalBytesSent += (int) nBytesSent;
+
+		/* Skip over the messages that were written in full, and the part of
+		 * the next one that was written, if any */
+		while (nIovCount > 0 && (size_t) nBytesSent >= pIov->iov_len) {
+			nBytesSent -= pIov->iov_len;
+			pIov++;
+			nIovCount--;
+		}
+
+		if (nIovCount > 0) {
+			pIov->iov_base = (char*) pIov->iov_base + nBytesSent;
+			pIov->iov_len -= nBytesSent;
+		}
+	}
+
+	return nTotalBytesSent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WriteEncodedToClient function - Writes a message from the client's mailbox
+// that is already in its wire form, such as compressed output, to its socket.
+//
+
+int WriteEncodedToClient(LPCLIENTSTRUCT lpCurrentClient,
+		LPMESSAGEBUFFER lpBuffer) {
+	if (!IsSocketValid(lpCurrentClient->nSocket)) {
+		return ERROR;
+	}
+
+	const char* pchData = lpBuffer->szData;
+	int nBytesLeft = lpBuffer->nLength;
+
+	while (nBytesLeft > 0) {
+		ssize_t nBytesWritten = write(lpCurrentClient->nSocket, pchData,
+				nBytesLeft);
+		if (nBytesWritten < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (nBytesWritten <= 0) {
+			return ERROR;
+		}
+
+		pchData += nBytesWritten;
+		nBytesLeft -= (int) nBytesWritten;
+	}
+
+	return lpBuffer->nLength;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DeliverIfOwnThread function - Finishes a send to a client.  Messages that
+// the client's own thread sends it are written out straight away, so that they
+// keep their place relative to anything the thread then writes to the socket
+// itself; messages from other threads wait for the client's thread to wake up.
+//
+
+int DeliverIfOwnThread(LPCLIENTSTRUCT lpCurrentClient, int nBytesPosted) {
+	if (IsMailboxOwner(&(lpCurrentClient->mailbox))
+			&& DeliverClientMailbox(lpCurrentClient) < 0) {
+		return ERROR;
+	}
+
+	return nBytesPosted;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendRosterReply function - Sends a client a reply to LIST or LIST SINCE,
+// which is kept whole in a shared buffer.  Text clients are sent the buffer
+// itself, in one write; binary clients are sent each line of it as a frame
+// of its own, as they would be any other multi-line reply.
+//
+
+void SendRosterReply(LPCLIENTSTRUCT lpSendingClient, LPMESSAGEBUFFER lpReply) {
+	if (!lpSendingClient->bBinaryProtocol) {
+		const int nBytesSent = SendBuffersToClient(lpSendingClient, &lpReply,
+				1);
+		if (nBytesSent > 0) {
+			lpSendingClient->nBytesSent += nBytesSent;
+		}
 		return;
 	}
 
-	lpSendingClient->nBytesSent +=
-			ReplyToClient(lpSendingClient, ".\n");// end of data
+	char szLine[BUFLEN];
+
+	const char* pchLine = lpReply->szData;
+	while (*pchLine != '\0') {
+		const char* pchNewline = strchr(pchLine, '\n');
+
+		const int LINE_LENGTH = pchNewline == NULL ? (int) strlen(pchLine)
+				: (int) (pchNewline - pchLine) + 1;
+
+		const int COPY_LENGTH = MinimumOf(LINE_LENGTH, BUFLEN - 1);
+
+		memcpy(szLine, pchLine, COPY_LENGTH);
+		szLine[COPY_LENGTH] = '\0';
+
+		lpSendingClient->nBytesSent += ReplyToClient(lpSendingClient, szLine);
+
+		pchLine += LINE_LENGTH;
+	}
 }
+
 ///////////////////////////////////////////////////////////////////////////////
 // Publicly-exposed functions
 
+///////////////////////////////////////////////////////////////////////////////
+// AddChatMessageLine function
+
+void AddChatMessageLine(LPCLIENTSTRUCT lpSendingClient, const char* pszLine) {
+	if (lpSendingClient == NULL || pszLine == NULL) {
+		return;
+	}
+
+	/* Nothing a client says before it is connected, and has a nickname, is
+	 * ever broadcast, so it is not kept either */
+	if (lpSendingClient->bConnected == FALSE
+			|| IsNullOrWhiteSpace(lpSendingClient->pszNickname)) {
+		return;
+	}
+
+	LPMESSAGEASSEMBLER lpAssembler = &(lpSendingClient->chatMessage);
+
+	/* Blank lines are kept inside a message, but do not start one */
+	if (IsNullOrWhiteSpace(pszLine)
+			&& !IsMessageBeingAssembled(lpAssembler)) {
+		return;
+	}
+
+	AddLineToMessage(lpAssembler, pszLine);
+}
+
 BOOL AreTooManyClientsConnected() {
 	return GetConnectedClientCount() > MAX_ALLOWED_CONNECTIONS;
 }
@@ -67,40 +317,70 @@ void BroadcastChatMessage(const char* pszChatMessage,
 		return;
 	}
 
-	// Compute the size of a buffer for holding the prefix to a server-emitted
-	// chat message (that we are broadcasting to all clients.  The prefix is
-	// as follows: "!<nickname>: ".  We need a buffer that contains all the
-	// chars of the nickname itself, plus a bang ('!'), a colon (':'), a
-	// space (' ') character, and don't forget the null-terminator
-	const int NICKNAME_PREFIX_SIZE = strlen(lpSendingClient->pszNickname) + 4;
+	/* A client that is sending too fast is dealt with here, before any work
+	 * is done on its message, so that a flood costs as little as possible */
+	if (!AdmitChatMessage(lpSendingClient, strlen(pszChatMessage))) {
+		return;
+	}
 
-	if (NICKNAME_PREFIX_SIZE == MIN_NICKNAME_PREFIX_SIZE) {
+	// The prefix to a server-emitted chat message (that we are broadcasting
+	// to all clients) is as follows: "!<nickname>: ".  Clients look for
+	// strings prefixed with a bang (!) and strip the bang and do not show an
+	// "S: " before it in their UIs.  It was built when the nickname was
+	// registered.
+	if (lpSendingClient->nChatPrefixLength < MIN_NICKNAME_PREFIX_SIZE) {
 		return; // Nickname is blank, but we can't work with that
 		// since we need a value here.
 	}
 
-	// Make a buffer for putting a bang, the nickname, a colon, and then
-	// a space into.  Clients look for strings prefixed with a bang (!) and
-	// strip the bang and do not show an "S: " before it in their UIs.
-	char szNicknamePrefix[NICKNAME_PREFIX_SIZE];
+	/* Build the message once, straight into the buffer that is sent to
+	 * every recipient and kept in the history of the room.  Each of its lines
+	 * gets the prefix, so that clients, which read a line at a time, can
+	 * tell who sent every one of them. */
+	const int MESSAGE_LENGTH = strlen(pszChatMessage);
 
-	sprintf(szNicknamePrefix, "!%s: ", lpSendingClient->pszNickname);
+	int nLineCount = 0;
+	for (int i = 0; i < MESSAGE_LENGTH; i++) {
+		if (pszChatMessage[i] == '\n' || i == MESSAGE_LENGTH - 1) {
+			nLineCount++;
+		}
+	}
 
-	char *pszMessageToBroadcast = NULL;
+	MESSAGEBUILDER builder;
+	BeginMessage(&builder, nLineCount * lpSendingClient->nChatPrefixLength
+			+ MESSAGE_LENGTH);
 
-	PrependTo(&pszMessageToBroadcast, szNicknamePrefix, pszChatMessage);
+	const char* pchLine = pszChatMessage;
+	while (*pchLine != '\0') {
+		const char* pchNewline = strchr(pchLine, '\n');
 
-	if (pszMessageToBroadcast != NULL) {
-		// Send the message to be broadcast to all the connected
-		// clients except for the sender (per the requirements)
-		BroadcastToAllClientsExceptSender(pszMessageToBroadcast,
-				lpSendingClient);
+		const int LINE_LENGTH = pchNewline == NULL ? (int) strlen(pchLine)
+				: (int) (pchNewline - pchLine) + 1;
 
-		/* the block of memory referenced by pszMessageToBroadcast is
-		 * dynamically-allocated.  Free it. */
-		free(pszMessageToBroadcast);
-		pszMessageToBroadcast = NULL;
+		AppendToMessage(&builder, lpSendingClient->szChatPrefix,
+				lpSendingClient->nChatPrefixLength);
+		AppendToMessage(&builder, pchLine, LINE_LENGTH);
+
+		pchLine += LINE_LENGTH;
 	}
+
+	LPMESSAGEBUFFER lpMessage = EndMessage(&builder);
+
+	// Send the message to be broadcast to all the other members of
+	// the sender's room (per the requirements)
+	BroadcastChatToRoom(lpSendingClient->lpRoom, lpMessage, lpSendingClient);
+
+	/* Also send it to those in other rooms who follow any of the
+	 * hashtags that it contains, and let anyone it mentions who did
+	 * not just see it know about it */
+	MESSAGETOKENS tokens;
+	ScanMessageTokens(pszChatMessage, &tokens);
+
+	DeliverToHashtagFollowers(&tokens, lpMessage->szData, lpSendingClient);
+
+	DeliverMentionNotifications(&tokens, pszChatMessage, lpSendingClient);
+
+	ReleaseMessageBuffer(lpMessage);
 }
 
 void CleanupClientConnection(LPCLIENTSTRUCT lpSendingClient) {
@@ -145,79 +425,196 @@ void CleanupClientConnection(LPCLIENTSTRUCT lpSendingClient) {
 
 	lpSendingClient->nSocket = INVALID_SOCKET_VALUE;
 
+	/* A client that is turned away, such as at HELO, stays on the list of
+	 * clients, so its address is given its admission back now, rather than
+	 * when the structure is freed */
+	ReleaseClientAdmission(lpSendingClient);
+
 	fprintf(stdout, "server: Shutting down communications...\n");
 
-	KillThread(hClientThread);
+	/* The client's thread sees its stop token the next time round its loop,
+	 * or straight away if it is this thread */
+	StopClientThread(lpSendingClient);
 
 	/* Release system resources occupied by the thread */
 	DestroyThread(hClientThread);
 
 	fprintf(stdout, "server: Client connection closed.\n");
-
-	sleep(1);   // force CPU context switch to trigger semaphore
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// EndChatSession function
+// AbortChatSession function
 
-BOOL EndChatSession(LPCLIENTSTRUCT lpSendingClient) {
+void AbortChatSession(LPCLIENTSTRUCT lpSendingClient, const char* pszReason) {
 	if (lpSendingClient == NULL) {
-		return FALSE;
+		return;
 	}
 
-	char szReplyBuffer[BUFLEN];
-	memset(szReplyBuffer, 0, BUFLEN);
+	/* The client may not have said HELO yet, and may not be reading any
+	 * more, so, unlike the goodbye, the reason is sent on a best-effort
+	 * basis */
+	if (!IsNullOrWhiteSpace(pszReason)) {
+		const int nBytesSent = lpSendingClient->bConnected
+				? SendToClient(lpSendingClient, pszReason)
+				: Send(lpSendingClient->nSocket, pszReason);
+		if (nBytesSent > 0) {
+			lpSendingClient->nBytesSent += nBytesSent;
+		}
+	}
 
-	//char* pszID = UUIDToString(lpSendingClient->clientID);
+	AnnounceDeparture(lpSendingClient);
 
-	//fprintf(stdout, "Ending chat session with client '{%s}'...\n", pszID);
+	CloseChatSession(lpSendingClient);
+}
 
-	if (!IsNullOrWhiteSpace(lpSendingClient->pszNickname)) {
-		sprintf(szReplyBuffer, NEW_CHATTER_LEFT, lpSendingClient->pszNickname);
+///////////////////////////////////////////////////////////////////////////////
+// DeliverClientMailbox function
 
-		//fprintf(stdout, "Informing other clients that @%s has left"
-		//      " the chat room...\n", lpSendingClient->pszNickname);
-		/* Give ALL connected clients the heads up that this particular chatter
-		 * is leaving the chat room (i.e., Elvis has left the building) */
-		BroadcastToAllClientsExceptSender(szReplyBuffer, lpSendingClient);
+int DeliverClientMailbox(LPCLIENTSTRUCT lpCurrentClient) {
+	if (lpCurrentClient == NULL) {
+		return ERROR;
 	}
 
+	LPMAILBOX lpMailbox = &(lpCurrentClient->mailbox);
+
+	/* Cleared first, so that whatever is posted from here on wakes the
+	 * thread up again */
+	ClearMailboxWakeup(lpMailbox);
+
+	/* Only a write that fails should leave errno set, for
+	 * NoteClientWriteFailed to look at */
+	errno = 0;
+
+	if (IsMailboxOverflowed(lpMailbox)) {
+		NoteClientFellBehind(lpCurrentClient);
+	}
+
+	LPMESSAGEBUFFER lpBatch[MAILBOX_DRAIN_BATCH_SIZE];
+	int nBatchCount = 0;
+
+	BOOL bFailed = FALSE;
+	int nTotalBytesSent = 0;
+
+	LPMAILBOXITEM lpItem = NULL;
+
+	do {
+		lpItem = bFailed ? NULL : TakeFromMailbox(lpMailbox);
+
+		/* Text messages are gathered up and written with one writev();
+		 * the batch goes out when it is full, when an encoded message has
+		 * to go after it, or when the mailbox is empty */
+		if (nBatchCount > 0 && (lpItem == NULL || lpItem->bEncoded
+				|| nBatchCount == MAILBOX_DRAIN_BATCH_SIZE)) {
+			const int nBytesSent = WriteBuffersToClient(lpCurrentClient,
+					lpBatch, nBatchCount);
+			if (nBytesSent < 0) {
+				bFailed = TRUE;
+			} else {
+				nTotalBytesSent += nBytesSent;
+			}
+
+			for (int i = 0; i < nBatchCount; i++) {
+				ReleaseMessageBuffer(lpBatch[i]);
+			}
+
+			nBatchCount = 0;
+		}
+
+		if (lpItem == NULL) {
+			continue;
+		}
+
+		if (bFailed) {
+			FreeMailboxItem(lpItem);
+		} else if (lpItem->bEncoded) {
+			const int nBytesSent = WriteEncodedToClient(lpCurrentClient,
+					lpItem->lpBuffer);
+			if (nBytesSent < 0) {
+				bFailed = TRUE;
+			} else {
+				nTotalBytesSent += nBytesSent;
+			}
+
+			FreeMailboxItem(lpItem);
+		} else {
+			/* The batch takes over the item's reference to the message */
+			lpBatch[nBatchCount++] = lpItem->lpBuffer;
+			lpItem->lpBuffer = NULL;
+
+			FreeMailboxItem(lpItem);
+		}
+	} while (lpItem != NULL);
+
+	if (bFailed) {
+		NoteClientWriteFailed(lpCurrentClient);
+
+		/* Nothing more can be written to the client, so what is still
+		 * waiting is thrown away */
+		while ((lpItem = TakeFromMailbox(lpMailbox)) != NULL) {
+			FreeMailboxItem(lpItem);
+		}
+
+		return ERROR;
+	}
+
+	return nTotalBytesSent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// EndChatSession function
+
+BOOL EndChatSession(LPCLIENTSTRUCT lpSendingClient) {
+	if (lpSendingClient == NULL) {
+		return FALSE;
+	}
+
+	AnnounceDeparture(lpSendingClient);
+
 	/* Tell the client who told us they want to quit,
 	 * "Good bye sucka!" */
 	lpSendingClient->nBytesSent += ReplyToClient(lpSendingClient, OK_GOODBYE);
 
-	//fprintf(stdout, "Marking client as not connected...\n");
+	CloseChatSession(lpSendingClient);
 
-	// Mark this client as no longer being connected.
-	lpSendingClient->bConnected = FALSE;
+	return TRUE;
+}
 
-	// If storage has been allocated for this client's nickname, blank
-	// the value out so that the server does not get confused about a nickname
-	// already being used.
-	if (lpSendingClient->pszNickname != NULL) {
-		memset((char*) (lpSendingClient->pszNickname), 0,
-				MAX_NICKNAME_LEN + 1);
+///////////////////////////////////////////////////////////////////////////////
+// FinishChatMessage function
 
-		free(lpSendingClient->pszNickname);
-		lpSendingClient->pszNickname = NULL;
+BOOL FinishChatMessage(LPCLIENTSTRUCT lpSendingClient) {
+	if (lpSendingClient == NULL) {
+		return FALSE;
 	}
 
-	CleanupClientConnection(lpSendingClient);
+	LPMESSAGEASSEMBLER lpAssembler = &(lpSendingClient->chatMessage);
 
-	ReportClientSessionStats(lpSendingClient);
+	if (!IsMessageBeingAssembled(lpAssembler)) {
+		return TRUE;	/* a dot by itself is an empty message */
+	}
 
-	LockMutex(GetClientListMutex());
-	{
-		LPPOSITION pos = FindElement(g_pClientList,
-				&(lpSendingClient->clientID), FindClientByID);
-		if (pos != NULL) {
-			g_pClientList = pos;
-			RemoveElement(&g_pClientList, FreeClient);
-		}
+	switch (GetMessageAssemblyFault(lpAssembler)) {
+	case MESSAGE_ASSEMBLY_LINE_TOO_LONG:
+		lpSendingClient->nBytesSent += ReplyToClient(lpSendingClient,
+				ERROR_CHAT_LINE_TOO_LONG);
+		break;
+
+	case MESSAGE_ASSEMBLY_TOO_LONG:
+		lpSendingClient->nBytesSent += ReplyToClient(lpSendingClient,
+				ERROR_CHAT_MESSAGE_TOO_LONG);
+		break;
+
+	default:
+		/* The whole message goes out as one broadcast, and one entry in the
+		 * history of the room */
+		BroadcastChatMessage(GetAssembledMessage(lpAssembler),
+				lpSendingClient);
+		break;
 	}
-	UnlockMutex(GetClientListMutex());
 
-	return TRUE;
+	ResetMessageAssembler(lpAssembler);
+
+	return TRUE;	/* end of the chat message */
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -245,21 +642,41 @@ LPCLIENTSTRUCT GetSendingClientInfo(void* pvClientThreadUserState) {
 //
 
 BOOL HandleProtocolCommand(LPCLIENTSTRUCT lpSendingClient, char* pszBuffer) {
-	if (g_bShouldTerminateClientThread) {
-		return TRUE;    // Means, "yes this protocol command got handled"
-	}
-
 	if (lpSendingClient == NULL) {
 		// We do not have info referring to who sent this command, so stop.
 		return FALSE;
 	}
 
+	if (ShouldClientThreadStop(lpSendingClient)) {
+		return TRUE;    // Means, "yes this protocol command got handled"
+	}
+
 	if (IsNullOrWhiteSpace(pszBuffer)) {
 		// Buffer containing the command we are handling is blank.
 		// Nothing to do.
 		return FALSE;
 	}
 
+	/* per protocol, HELO BINARY command is HELO, but also switches the
+	 * connection over to binary frames from the next line on. */
+	if (EqualsNoCase(pszBuffer, PROTOCOL_HELO_BINARY_COMMAND)) {
+		if (!lpSendingClient->bConnected) {
+			ProcessHeloBinaryCommand(lpSendingClient);
+		}
+
+		return TRUE; /* command successfully handled */
+	}
+
+	/* per protocol, HELO DEFLATE command is HELO, but also has everything
+	 * the server sends from the next line on compressed. */
+	if (EqualsNoCase(pszBuffer, PROTOCOL_HELO_DEFLATE_COMMAND)) {
+		if (!lpSendingClient->bConnected) {
+			ProcessHeloDeflateCommand(lpSendingClient);
+		}
+
+		return TRUE; /* command successfully handled */
+	}
+
 	/* per protocol, HELO command is client saying hello to the server.
 	 * It does not matter whether a client socket has connected; that socket
 	 * has to say HELO first, so that then that client is marked as being
@@ -290,11 +707,23 @@ BOOL HandleProtocolCommand(LPCLIENTSTRUCT lpSendingClient, char* pszBuffer) {
 		return FALSE;
 	}
 
+	/* per protocol, PONG answers the server's PING.  It may come at any
+	 * time, even in the middle of a direct message, so it is looked for
+	 * first. */
+	if (IsHeartbeatReply(pszBuffer)) {
+		return ProcessPongCommand(lpSendingClient, pszBuffer);
+	}
+
+	/* per protocol, after the DM command, every line up to and including
+	 * the terminating dot belongs to the direct message. */
+	if (!IsNullOrWhiteSpace(lpSendingClient->szDmRecipient)) {
+		return ProcessDirectMessageLine(lpSendingClient, pszBuffer);
+	}
+
+	/* per protocol, a chat message is ended by a dot on a line by itself;
+	 * the lines before it are broadcast together. */
 	if (EqualsNoCase(pszBuffer, MSG_TERMINATOR)) {
-		/* Signal for end of multi-line input received.  However, we
-		 * do not define this for the chat server (chat messages can only be one
-		 * line). */
-		return FALSE;
+		return FinishChatMessage(lpSendingClient);
 	}
 
 	/* per protocol, LIST command is client requesting a list of the nicknames
@@ -305,35 +734,68 @@ BOOL HandleProtocolCommand(LPCLIENTSTRUCT lpSendingClient, char* pszBuffer) {
 		return TRUE; /* command successfully handled */
 	}
 
+	/* per protocol, LIST SINCE command asks for just the chatters who have
+	 * come and gone since a version of the list that the client has. */
+	if (StartsWith(pszBuffer, PROTOCOL_LIST_SINCE_COMMAND)) {
+		return ProcessListSinceCommand(lpSendingClient, pszBuffer);
+	}
+
 	// StartsWith function is declared/defined in utils.h/.c
 	if (StartsWith(pszBuffer, PROTOCOL_NICK_COMMAND)) {
 		return RegisterClientNickname(lpSendingClient, pszBuffer);
 	}
 
-	//char szReplyBuffer[BUFLEN];
+	/* per protocol, HISTORY command asks for the most recent lines of the
+	 * log of the client's room, such as after reconnecting. */
+	if (StartsWith(pszBuffer, PROTOCOL_HISTORY_COMMAND)) {
+		return ProcessHistoryCommand(lpSendingClient, pszBuffer);
+	}
 
-	return FALSE;
-}
+	/* per protocol, JOIN command moves the client into another chat room,
+	 * and the PART command moves the client back to the default room. */
+	if (StartsWith(pszBuffer, PROTOCOL_JOIN_COMMAND)) {
+		return ProcessJoinCommand(lpSendingClient, pszBuffer);
+	}
 
-///////////////////////////////////////////////////////////////////////////////
-// KillClientThread function - A callback that is run for each element in the
-// client list in order to kill each client's thread.
-//
+	if (EqualsNoCase(pszBuffer, PROTOCOL_PART_COMMAND)) {
+		ProcessPartCommand(lpSendingClient);
 
-void KillClientThread(void* pClientStruct) {
-	if (pClientStruct == NULL) {
-		return;
+		return TRUE; /* command successfully handled */
 	}
 
-	LPCLIENTSTRUCT lpCS = (LPCLIENTSTRUCT) pClientStruct;
+	/* per protocol, FOLLOW and UNFOLLOW commands start and stop delivery of
+	 * the chat messages, from any room, that are tagged with a hashtag. */
+	if (StartsWith(pszBuffer, PROTOCOL_FOLLOW_COMMAND)) {
+		return ProcessFollowCommand(lpSendingClient, pszBuffer);
+	}
 
-	if (lpCS->hClientThread == INVALID_HANDLE_VALUE) {
-		return;
+	if (StartsWith(pszBuffer, PROTOCOL_UNFOLLOW_COMMAND)) {
+		return ProcessUnfollowCommand(lpSendingClient, pszBuffer);
 	}
 
-	KillThread(lpCS->hClientThread);
+	/* per protocol, MUTE and UNMUTE commands stop and restart delivery of
+	 * the chat messages of the other members of the client's room. */
+	if (EqualsNoCase(pszBuffer, PROTOCOL_MUTE_COMMAND)) {
+		ProcessMuteCommand(lpSendingClient, TRUE);
+
+		return TRUE; /* command successfully handled */
+	}
+
+	if (EqualsNoCase(pszBuffer, PROTOCOL_UNMUTE_COMMAND)) {
+		ProcessMuteCommand(lpSendingClient, FALSE);
+
+		return TRUE; /* command successfully handled */
+	}
+
+	/* per protocol, DM command starts a message that only the chatter with
+	 * the nickname given is sent. */
+	if (StartsWith(pszBuffer, PROTOCOL_DM_COMMAND)) {
+		return ProcessDmCommand(lpSendingClient, pszBuffer);
+	}
+
+	//char szReplyBuffer[BUFLEN];
 
-	sleep(1); /* force a CPU context switch so the semaphore can work */
+	return FALSE;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -367,8 +829,7 @@ void LogClientID(LPCLIENTSTRUCT lpCS) {
 		return;
 	}
 
-	char* pszClientID = UUIDToString(&(lpCS->clientID));
-	if (IsNullOrWhiteSpace(pszClientID)) {
+	if (lpCS->nConnectionID == 0) {
 		fprintf(stderr, "Client ID has not been initialized.\n");
 		CleanupServer(ERROR);
 	}
@@ -383,15 +844,82 @@ void LogClientID(LPCLIENTSTRUCT lpCS) {
 		CleanupServer(ERROR);
 	}
 
-	LogInfo(CLIENT_ID_FORMAT, lpCS->szIPAddress, lpCS->nSocket, pszClientID);
+	char szClientID[CONNECTION_ID_STRING_SIZE];
+	FormatConnectionID(lpCS->nConnectionID, szClientID);
+
+	LogInfo(CLIENT_ID_FORMAT, lpCS->szIPAddress, lpCS->nSocket, szClientID);
 
 	if (GetLogFileHandle() != stdout) {
 		fprintf(stdout,
-		CLIENT_ID_FORMAT, lpCS->szIPAddress, lpCS->nSocket, pszClientID);
+		CLIENT_ID_FORMAT, lpCS->szIPAddress, lpCS->nSocket, szClientID);
+	}
+
+	/* Only in diagnostic mode is the client given a UUID as well, so that
+	 * it can be followed in the logs of other systems */
+	if (IsDiagnosticMode()) {
+		LogInfo(CLIENT_UUID_LABEL_FORMAT, lpCS->szIPAddress, lpCS->nSocket,
+				GetClientUUIDLabel(lpCS));
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ProcessHeloBinaryCommand function
+
+void ProcessHeloBinaryCommand(LPCLIENTSTRUCT lpSendingClient) {
+	if (NULL == lpSendingClient) {
+		return;
+	}
+
+	/* The confirmation is the last line of text the client gets.  It is
+	 * sent before the client is marked as connected, so that no broadcast
+	 * can reach the client between it and the switch. */
+	const int nBytesSent = Send(lpSendingClient->nSocket, OK_BINARY_MODE);
+	if (nBytesSent <= 0) {
+		return;
 	}
 
-	free(pszClientID);
-	pszClientID = NULL;
+	lpSendingClient->nBytesSent += nBytesSent;
+
+	fprintf(stdout, SERVER_DATA_FORMAT, OK_BINARY_MODE);
+
+	if (GetLogFileHandle() != stdout) {
+		LogInfo(SERVER_DATA_FORMAT, OK_BINARY_MODE);
+	}
+
+	lpSendingClient->bBinaryProtocol = TRUE;
+
+	/* From here on, the reply to HELO, and everything else, is framed */
+	ProcessHeloCommand(lpSendingClient);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ProcessHeloDeflateCommand function
+
+void ProcessHeloDeflateCommand(LPCLIENTSTRUCT lpSendingClient) {
+	if (NULL == lpSendingClient) {
+		return;
+	}
+
+	/* Like the switch to binary frames, the confirmation is sent before
+	 * the client is marked as connected, and is the last uncompressed line
+	 * the client gets. */
+	const int nBytesSent = Send(lpSendingClient->nSocket, OK_DEFLATE_MODE);
+	if (nBytesSent <= 0) {
+		return;
+	}
+
+	lpSendingClient->nBytesSent += nBytesSent;
+
+	fprintf(stdout, SERVER_DATA_FORMAT, OK_DEFLATE_MODE);
+
+	if (GetLogFileHandle() != stdout) {
+		LogInfo(SERVER_DATA_FORMAT, OK_DEFLATE_MODE);
+	}
+
+	lpSendingClient->lpDeflateStream = CreateDeflateStream();
+
+	/* From here on, the reply to HELO, and everything else, is compressed */
+	ProcessHeloCommand(lpSendingClient);
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -411,6 +939,9 @@ void ProcessHeloCommand(LPCLIENTSTRUCT lpSendingClient) {
 	if (!AreTooManyClientsConnected()) {
 		lpSendingClient->nBytesSent += ReplyToClient(lpSendingClient,
 		OK_FOLLOW_WITH_NICK_REPLY);
+
+		/* Everyone starts out chatting in the default room */
+		JoinRoom(lpSendingClient, DEFAULT_ROOM_NAME);
 	} else {
 		TellClientTooManyPeopleChatting(lpSendingClient);
 	}
@@ -424,47 +955,60 @@ void ProcessListCommand(LPCLIENTSTRUCT lpSendingClient) {
 		return;
 	}
 
-	lpSendingClient->nBytesSent += ReplyToClient(lpSendingClient,
-			OK_LIST_FOLLOWS);
+	/* The whole reply is kept ready, and every client that asks for it is
+	 * sent the same buffer until the roster changes */
+	LPMESSAGEBUFFER lpRoster = GetRosterSnapshot();
+	if (lpRoster == NULL) {
+		return;
+	}
 
-	char szReplyBuffer[MAX_NICKNAME_LEN + 4];
-	memset(szReplyBuffer, 0, MAX_NICKNAME_LEN + 4);
+	SendRosterReply(lpSendingClient, lpRoster);
 
-	LPPOSITION pos = GetHeadPosition(g_pClientList);
-	if (pos == NULL) {
-		SendMultilineDataTerminator(lpSendingClient);
-		return;
+	ReleaseMessageBuffer(lpRoster);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ProcessListSinceCommand function
+
+BOOL ProcessListSinceCommand(LPCLIENTSTRUCT lpSendingClient,
+		char* pszBuffer) {
+	if (NULL == lpSendingClient) {
+		return FALSE;
 	}
 
-	/* Iterate through the clients in the list, skipping the
-	 * client who sent the command in the first place.  List out
-	 * the nicknames of all the other clients and then send the terminating
-	 * dot-on-a-line-by-itself per protocol. */
+	if (IsNullOrWhiteSpace(pszBuffer)) {
+		return FALSE;
+	}
 
-	LockMutex(GetClientListMutex());
-	{
-		do {
-			LPCLIENTSTRUCT lpCS = (LPCLIENTSTRUCT) (pos->pvData);
-			if (lpCS == NULL) {
-				continue;
-			}
+	const int BUFFER_SIZE = strlen(pszBuffer) + 1;
 
-			if (AreUUIDsEqual(&(lpSendingClient->clientID),
-					&(lpCS->clientID))) {
-				continue;
-			}
+	char szVersion[BUFFER_SIZE];
+	memset(szVersion, 0, BUFFER_SIZE);
 
-			sprintf(szReplyBuffer, "!@%s\n", lpCS->pszNickname);
+	Trim(szVersion, BUFFER_SIZE,
+			pszBuffer + strlen(PROTOCOL_LIST_SINCE_COMMAND));
 
-			lpSendingClient->nBytesSent += ReplyToClient(lpSendingClient,
-					szReplyBuffer);
+	long lVersion = 0;
+	const int nResult = StringToLong(szVersion, &lVersion);
+	if ((nResult != OK && nResult != EXACTLY_CORRECT) || lVersion < 0) {
+		lpSendingClient->nBytesSent += ReplyToClient(lpSendingClient,
+				ERROR_LIST_VERSION_INVALID);
+		return TRUE;	// command handled but error occurred
+	}
 
-			memset(szReplyBuffer, 0, MAX_NICKNAME_LEN + 4);
-		} while ((pos = GetNextPosition(pos)) != NULL);
+	/* A client whose version is too old, or that is not one this server
+	 * has had, gets the whole roster; the 203 reply tells it so */
+	LPMESSAGEBUFFER lpReply = GetRosterChangesSince((uint64_t) lVersion);
+	if (lpReply == NULL) {
+		ProcessListCommand(lpSendingClient);
+		return TRUE;
 	}
-	UnlockMutex(GetClientListMutex());
 
-	SendMultilineDataTerminator(lpSendingClient);
+	SendRosterReply(lpSendingClient, lpReply);
+
+	ReleaseMessageBuffer(lpReply);
+
+	return TRUE;	// command handled successfully
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -538,7 +1082,9 @@ void ReportClientSessionStats(LPCLIENTSTRUCT lpSendingClient) {
 		return;
 	}
 
-	char *pszClientID = UUIDToString(&(lpSendingClient->clientID));
+	char szClientID[CONNECTION_ID_STRING_SIZE];
+	char* pszClientID = FormatConnectionID(lpSendingClient->nConnectionID,
+			szClientID);
 
 	fprintf(stdout,
 	CLIENT_SESSION_STATS, pszClientID, lpSendingClient->nBytesReceived,
@@ -550,10 +1096,71 @@ void ReportClientSessionStats(LPCLIENTSTRUCT lpSendingClient) {
 				lpSendingClient->nBytesSent);
 	}
 
-	free(pszClientID);
-	pszClientID = NULL;
+	ReportDeflateStreamStats(lpSendingClient, pszClientID);
+
+	ReportRateLimitStats(lpSendingClient, pszClientID);
+
+	ReportRttStats(lpSendingClient, pszClientID);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendMultilineDataTerminator function
+
+void SendMultilineDataTerminator(LPCLIENTSTRUCT lpSendingClient) {
+	if (lpSendingClient == NULL) {
+		return;
+	}
+
+	lpSendingClient->nBytesSent +=
+			ReplyToClient(lpSendingClient, ".\n");// end of data
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// SendBuffersToClient function
+
+int SendBuffersToClient(LPCLIENTSTRUCT lpCurrentClient,
+		LPMESSAGEBUFFER* lpBuffers, int nCount) {
+	if (lpCurrentClient == NULL || lpBuffers == NULL || nCount <= 0) {
+		return ERROR;
+	}
+
+	if (!IsSocketValid(lpCurrentClient->nSocket)) {
+		return ERROR;
+	}
+
+	if (lpCurrentClient->bConnected == FALSE) {
+		return ERROR;
+	}
+
+	int nBytesPosted = 0;
+
+	if (lpCurrentClient->lpDeflateStream != NULL) {
+		struct iovec iov[nCount];
+
+		for (int i = 0; i < nCount; i++) {
+			iov[i].iov_base = lpBuffers[i]->szData;
+			iov[i].iov_len = lpBuffers[i]->nLength;
+		}
+
+		/* The messages are a batch, so the stream is flushed once, after
+		 * all of them */
+		nBytesPosted = SendCompressedToClient(lpCurrentClient, iov, nCount);
+	} else {
+		/* The buffers are shared, not copied; each mailbox item holds a
+		 * reference of its own */
+		for (int i = 0; i < nCount && nBytesPosted >= 0; i++) {
+			nBytesPosted = PostToMailbox(&(lpCurrentClient->mailbox),
+					lpBuffers[i], FALSE)
+					? nBytesPosted + lpBuffers[i]->nLength : ERROR;
+		}
+	}
+
+	return DeliverIfOwnThread(lpCurrentClient, nBytesPosted);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendToClient function
+
 int SendToClient(LPCLIENTSTRUCT lpCurrentClient, const char* pszMessage) {
 	if (lpCurrentClient == NULL) {
 		return ERROR;
@@ -573,7 +1180,54 @@ int SendToClient(LPCLIENTSTRUCT lpCurrentClient, const char* pszMessage) {
 		return ERROR;
 	}
 
-	return Send(lpCurrentClient->nSocket, pszMessage);
+	int nBytesPosted = ERROR;
+
+	if (lpCurrentClient->lpDeflateStream != NULL) {
+		struct iovec iov;
+		iov.iov_base = (void*) pszMessage;
+		iov.iov_len = strlen(pszMessage);
+
+		nBytesPosted = SendCompressedToClient(lpCurrentClient, &iov, 1);
+	} else {
+		LPMESSAGEBUFFER lpMessage = CreateMessageBuffer(NULL, pszMessage);
+
+		if (PostToMailbox(&(lpCurrentClient->mailbox), lpMessage, FALSE)) {
+			nBytesPosted = lpMessage->nLength;
+		}
+
+		ReleaseMessageBuffer(lpMessage);
+	}
+
+	return DeliverIfOwnThread(lpCurrentClient, nBytesPosted);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ShouldClientThreadStop function
+
+BOOL ShouldClientThreadStop(LPCLIENTSTRUCT lpSendingClient) {
+	if (IsShutdownRequested()) {
+		return TRUE;
+	}
+
+	return lpSendingClient != NULL
+			&& atomic_load(&(lpSendingClient->bStopRequested));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StopClientThread function
+
+void StopClientThread(LPCLIENTSTRUCT lpSendingClient) {
+	if (lpSendingClient == NULL) {
+		return;
+	}
+
+	if (atomic_exchange(&(lpSendingClient->bStopRequested), TRUE)) {
+		return;	// already asked to stop
+	}
+
+	/* The thread polls the eventfd of its mailbox, so this wakes it up if
+	 * it is waiting for input */
+	WakeMailboxOwner(&(lpSendingClient->mailbox));
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -621,18 +1275,3 @@ void TellClientTooManyPeopleChatting(LPCLIENTSTRUCT lpSendingClient) {
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-// TerminateClientThread function
-
-void TerminateClientThread(int signum) {
-// If signum is not equal to SIGSEGV, then ignore this semaphore
-	if (SIGSEGV != signum) {
-		return;
-	}
-
-	g_bShouldTerminateClientThread = TRUE;
-
-	/* Re-associate this function with the signal */
-	RegisterEvent(TerminateClientThread);
-}
-
-///////////////////////////////////////////////////////////////////////////////
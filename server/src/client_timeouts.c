@@ -0,0 +1,224 @@
+// client_timeouts.c - Implementation of the deadlines that each client
+// connection is held to
+//
+// Only the client's own thread writes to its socket, so the write-stall
+// timeout is left to the kernel, as the socket's send timeout: a write that
+// makes no progress for that long fails with EAGAIN.  Other threads cannot get
+// stuck behind such a client at all; their messages wait in its mailbox, and
+// a client that lets its mailbox fill up is treated the same way.
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "client_struct.h"
+#include "client_thread_functions.h"
+#include "client_timeouts.h"
+#include "server_functions.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Global variables (used in this file only)
+
+/**
+ * @brief Counts of the clients that were disconnected by each timeout.
+ */
+atomic_ullong g_nHandshakeTimeoutCount = 0;
+atomic_ullong g_nIdleTimeoutCount = 0;
+atomic_ullong g_nWriteStallTimeoutCount = 0;
+atomic_ullong g_nHeartbeatTimeoutCount = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// OnHandshakeTimeout function - Timer routine for a client that did not say
+// HELO in time.
+//
+
+void OnHandshakeTimeout(LPTIMER lpTimer, void* pvClient) {
+	LPCLIENTSTRUCT lpClient = (LPCLIENTSTRUCT) pvClient;
+
+	if (!lpClient->bConnected) {
+		lpClient->nExpiredTimeout = TIMEOUT_KIND_HANDSHAKE;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// OnIdleTimeout function - Timer routine for a client that has sent nothing
+// for too long.
+//
+
+void OnIdleTimeout(LPTIMER lpTimer, void* pvClient) {
+	((LPCLIENTSTRUCT) pvClient)->nExpiredTimeout = TIMEOUT_KIND_IDLE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// HandleClientTimeout function
+
+void HandleClientTimeout(LPCLIENTSTRUCT lpClient) {
+	if (lpClient == NULL) {
+		return;
+	}
+
+	const int TIMEOUT_KIND = lpClient->nExpiredTimeout;
+
+	const char* pszWhat = NULL;
+	const char* pszReason = NULL;
+
+	switch (TIMEOUT_KIND) {
+	case TIMEOUT_KIND_HANDSHAKE:
+		atomic_fetch_add(&g_nHandshakeTimeoutCount, 1);
+		pszWhat = "waiting for HELO";
+		pszReason = ERROR_HANDSHAKE_TIMEOUT;
+		break;
+
+	case TIMEOUT_KIND_IDLE:
+		atomic_fetch_add(&g_nIdleTimeoutCount, 1);
+		pszWhat = "while idle";
+		pszReason = ERROR_IDLE_TIMEOUT;
+		break;
+
+	case TIMEOUT_KIND_WRITE_STALL:
+		atomic_fetch_add(&g_nWriteStallTimeoutCount, 1);
+		pszWhat = "with a write stalled";
+		break;
+
+	case TIMEOUT_KIND_HEARTBEAT:
+		atomic_fetch_add(&g_nHeartbeatTimeoutCount, 1);
+		pszWhat = "without answering PING";
+		pszReason = ERROR_HEARTBEAT_TIMEOUT;
+		break;
+
+	default:
+		return;
+	}
+
+	LogInfo(CLIENT_TIMED_OUT, lpClient->szIPAddress, lpClient->nSocket,
+			pszWhat);
+
+	if (GetLogFileHandle() != stdout) {
+		fprintf(stdout, CLIENT_TIMED_OUT, lpClient->szIPAddress,
+				lpClient->nSocket, pszWhat);
+	}
+
+	StopClientTimeouts(lpClient);
+
+	AbortChatSession(lpClient, pszReason);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// NoteClientFellBehind function
+
+void NoteClientFellBehind(LPCLIENTSTRUCT lpClient) {
+	if (lpClient == NULL) {
+		return;
+	}
+
+	if (lpClient->nExpiredTimeout == TIMEOUT_KIND_NONE) {
+		lpClient->nExpiredTimeout = TIMEOUT_KIND_WRITE_STALL;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// NoteClientInput function
+
+void NoteClientInput(LPCLIENTSTRUCT lpClient) {
+	if (lpClient == NULL || lpClient->lpTimerWheel == NULL) {
+		return;
+	}
+
+	if (!lpClient->bConnected) {
+		return;	// still has to say HELO, in the time it was first given
+	}
+
+	CancelTimer(&(lpClient->handshakeTimer));
+
+	ArmTimer(lpClient->lpTimerWheel, &(lpClient->idleTimer), TIMEOUT_IDLE_MS,
+			OnIdleTimeout, lpClient);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// NoteClientWriteFailed function
+
+void NoteClientWriteFailed(LPCLIENTSTRUCT lpClient) {
+	if (lpClient == NULL) {
+		return;
+	}
+
+	/* Any other failure means the connection is gone.  Shutting the socket
+	 * down makes the client's thread read its end the next time round its
+	 * loop, and so end the chat session, even if the peer never hangs up */
+	if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		if (IsSocketValid(lpClient->nSocket)) {
+			shutdown(lpClient->nSocket, SHUT_RDWR);
+		}
+		return;
+	}
+
+	if (lpClient->nExpiredTimeout == TIMEOUT_KIND_NONE) {
+		lpClient->nExpiredTimeout = TIMEOUT_KIND_WRITE_STALL;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReportTimeoutStats function
+
+void ReportTimeoutStats() {
+	const unsigned long long HANDSHAKE = atomic_load(
+			&g_nHandshakeTimeoutCount);
+	const unsigned long long IDLE = atomic_load(&g_nIdleTimeoutCount);
+	const unsigned long long WRITE_STALL = atomic_load(
+			&g_nWriteStallTimeoutCount);
+	const unsigned long long HEARTBEAT = atomic_load(
+			&g_nHeartbeatTimeoutCount);
+
+	fprintf(stdout, TIMEOUT_STATS, HANDSHAKE, IDLE, WRITE_STALL, HEARTBEAT);
+
+	if (GetLogFileHandle() != stdout) {
+		LogInfo(TIMEOUT_STATS, HANDSHAKE, IDLE, WRITE_STALL, HEARTBEAT);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StartClientTimeouts function
+
+void StartClientTimeouts(LPTIMERWHEEL lpWheel, LPCLIENTSTRUCT lpClient) {
+	if (lpWheel == NULL || lpClient == NULL) {
+		return;
+	}
+
+	lpClient->lpTimerWheel = lpWheel;
+	lpClient->nExpiredTimeout = TIMEOUT_KIND_NONE;
+
+	if (lpClient->bConnected) {
+		ArmTimer(lpWheel, &(lpClient->idleTimer), TIMEOUT_IDLE_MS,
+				OnIdleTimeout, lpClient);
+	} else {
+		ArmTimer(lpWheel, &(lpClient->handshakeTimer), TIMEOUT_HANDSHAKE_MS,
+				OnHandshakeTimeout, lpClient);
+	}
+
+	struct timeval sendTimeout;
+	sendTimeout.tv_sec = TIMEOUT_WRITE_STALL_MS / 1000;
+	sendTimeout.tv_usec = (TIMEOUT_WRITE_STALL_MS % 1000) * 1000;
+
+	if (setsockopt(lpClient->nSocket, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout,
+			sizeof(sendTimeout)) < 0) {
+		LogError(FAILED_SET_SEND_TIMEOUT, lpClient->nSocket, strerror(errno));
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StopClientTimeouts function
+
+void StopClientTimeouts(LPCLIENTSTRUCT lpClient) {
+	if (lpClient == NULL) {
+		return;
+	}
+
+	CancelTimer(&(lpClient->handshakeTimer));
+	CancelTimer(&(lpClient->idleTimer));
+}
@@ -0,0 +1,571 @@
+// compression.c - Implementation of the compression of what the server sends
+// to clients that said HELO DEFLATE.
+//
+// The deflate streams are raw (no zlib header or trailer), so a client sees a
+// single stream however many deflaters its bytes came from.  That works as
+// long as every deflater's output ends on a byte boundary, which each flush
+// sees to, and as long as no deflater refers back to data that the client got
+// from another one.  A client's own stream is therefore reset whenever it
+// takes over from a group, and a client only starts taking a group's output
+// when the group's history is empty: when the group is new, or right after it
+// has been reset with a full flush.
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "client_struct.h"
+#include "client_thread_functions.h"
+#include "compression.h"
+#include "server_functions.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Global variables (used in this file only)
+
+/**
+ * @brief Totals, across all compressed clients, of the bytes that were
+ * compressed, what they came to, and the CPU time it took.
+ */
+static atomic_ullong g_nTotalBytesIn = 0;
+static atomic_ullong g_nTotalBytesOut = 0;
+static atomic_ullong g_nTotalCpuNanoseconds = 0;
+
+/**
+ * @brief Count of room messages that were compressed once by a group, and of
+ * the members they were then sent to.
+ */
+static atomic_ullong g_nGroupBatchCount = 0;
+static atomic_ullong g_nGroupRecipientCount = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// GetThreadCpuNanoseconds function - Gets the CPU time used so far by the
+// calling thread.
+//
+
+uint64_t GetThreadCpuNanoseconds() {
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) < 0) {
+		return 0;
+	}
+
+	return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// InitializeDeflate function - Sets up a raw deflate stream.
+//
+
+void InitializeDeflate(z_stream* pStream) {
+	memset(pStream, 0, sizeof(z_stream));
+
+	if (deflateInit2(pStream, COMPRESSION_LEVEL, Z_DEFLATED,
+			-COMPRESSION_WINDOW_BITS, COMPRESSION_MEM_LEVEL,
+			Z_DEFAULT_STRATEGY) != Z_OK) {
+		fprintf(stderr, OUT_OF_MEMORY);
+
+		CleanupServer(ERROR);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AppendToDeflateOutput function - Adds compressed bytes to the output that
+// is being collected.
+//
+
+BOOL AppendToDeflateOutput(void* pvOutput, const unsigned char* pData,
+		size_t nLength) {
+	LPDEFLATEOUTPUT lpOutput = (LPDEFLATEOUTPUT) pvOutput;
+
+	if (lpOutput->nLength + nLength > lpOutput->nCapacity) {
+		size_t nNewCapacity = lpOutput->nCapacity == 0
+				? COMPRESSION_OUTPUT_CHUNK_SIZE : lpOutput->nCapacity;
+		while (nNewCapacity < lpOutput->nLength + nLength) {
+			nNewCapacity *= 2;
+		}
+
+		unsigned char* pNewData = (unsigned char*) realloc(lpOutput->pData,
+				nNewCapacity);
+		if (pNewData == NULL) {
+			fprintf(stderr, OUT_OF_MEMORY);
+
+			CleanupServer(ERROR);
+		}
+
+		lpOutput->pData = pNewData;
+		lpOutput->nCapacity = nNewCapacity;
+	}
+
+	memcpy(lpOutput->pData + lpOutput->nLength, pData, nLength);
+	lpOutput->nLength += nLength;
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DeflatePieces function - Compresses the pieces of a batch, and then flushes
+// the stream in the way given, handing the output to the routine given a
+// chunk at a time.  Returns FALSE if the routine fails.
+//
+
+BOOL DeflatePieces(z_stream* pStream, const struct iovec* pIov, int nIovCount,
+		int nFlush, BOOL (*lpfnOutputRoutine)(void*, const unsigned char*,
+				size_t), void* pvUserState) {
+	unsigned char output[COMPRESSION_OUTPUT_CHUNK_SIZE];
+
+	for (int i = 0; i <= nIovCount; i++) {
+		/* The last pass has no input; it only does the flush */
+		const BOOL IS_FLUSH = i == nIovCount;
+
+		pStream->next_in = IS_FLUSH ? NULL : (Bytef*) pIov[i].iov_base;
+		pStream->avail_in = IS_FLUSH ? 0 : (uInt) pIov[i].iov_len;
+
+		do {
+			pStream->next_out = output;
+			pStream->avail_out = COMPRESSION_OUTPUT_CHUNK_SIZE;
+
+			deflate(pStream, IS_FLUSH ? nFlush : Z_NO_FLUSH);
+
+			const size_t OUTPUT_LENGTH = COMPRESSION_OUTPUT_CHUNK_SIZE
+					- pStream->avail_out;
+
+			if (OUTPUT_LENGTH > 0
+					&& !lpfnOutputRoutine(pvUserState, output,
+							OUTPUT_LENGTH)) {
+				return FALSE;
+			}
+		} while (pStream->avail_out == 0 || pStream->avail_in > 0);
+	}
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CompressForClient function - Compresses a batch with a client's own stream
+// and posts it to the client's mailbox.  The caller must hold the client's
+// stream mutex.
+//
+
+int CompressForClient(LPCLIENTSTRUCT lpClient, const struct iovec* pIov,
+		int nIovCount) {
+	LPDEFLATESTREAM lpStream = lpClient->lpDeflateStream;
+
+	/* What the client's own stream compresses next must not refer back to
+	 * anything it compressed before the client started taking other
+	 * output */
+	if (lpStream->lpGroup != NULL || lpStream->bStale) {
+		deflateReset(&(lpStream->stream));
+
+		lpStream->lpGroup = NULL;
+		lpStream->bStale = FALSE;
+	}
+
+	const uLong TOTAL_IN_BEFORE = lpStream->stream.total_in;
+	const uLong TOTAL_OUT_BEFORE = lpStream->stream.total_out;
+	const uint64_t CPU_BEFORE = GetThreadCpuNanoseconds();
+
+	lpStream->output.nLength = 0;
+
+	DeflatePieces(&(lpStream->stream), pIov, nIovCount, Z_SYNC_FLUSH,
+			AppendToDeflateOutput, &(lpStream->output));
+
+	const uint64_t CPU_USED = GetThreadCpuNanoseconds() - CPU_BEFORE;
+	const long BYTES_IN = (long) (lpStream->stream.total_in - TOTAL_IN_BEFORE);
+	const long BYTES_OUT = (long) (lpStream->stream.total_out
+			- TOTAL_OUT_BEFORE);
+
+	lpStream->nBytesIn += BYTES_IN;
+	lpStream->nBytesOut += BYTES_OUT;
+	lpStream->nCpuNanoseconds += CPU_USED;
+
+	atomic_fetch_add(&g_nTotalBytesIn, (unsigned long long) BYTES_IN);
+	atomic_fetch_add(&g_nTotalBytesOut, (unsigned long long) BYTES_OUT);
+	atomic_fetch_add(&g_nTotalCpuNanoseconds, CPU_USED);
+
+	LPMESSAGEBUFFER lpOutput = CreateMessageBufferFromBytes(
+			lpStream->output.pData, (int) lpStream->output.nLength);
+
+	const BOOL POSTED = PostToMailbox(&(lpClient->mailbox), lpOutput, TRUE);
+
+	ReleaseMessageBuffer(lpOutput);
+
+	return POSTED ? (int) BYTES_OUT : ERROR;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CompressGroupBatch function - Makes the group's compressed copy of the
+// message that is being delivered.  The caller must hold the member mutex of
+// the group's room.
+//
+
+void CompressGroupBatch(LPDEFLATEGROUP lpGroup, const char* pszMessage) {
+	if (!lpGroup->bInitialized) {
+		InitializeDeflate(&(lpGroup->stream));
+
+		lpGroup->bInitialized = TRUE;
+		lpGroup->bAtBoundary = TRUE;
+		lpGroup->nBatchesSinceReset = 0;
+	}
+
+	/* While some members are out of step, the history is emptied every so
+	 * often, so that they can get back in step.  That costs some of the
+	 * compression of the messages that follow, so it is not done more
+	 * often than that. */
+	const int FLUSH = lpGroup->nLastPrivateCount > 0
+			&& lpGroup->nBatchesSinceReset + 1 >= COMPRESSION_RESYNC_INTERVAL
+			? Z_FULL_FLUSH : Z_SYNC_FLUSH;
+
+	struct iovec iov;
+	iov.iov_base = (void*) pszMessage;
+	iov.iov_len = strlen(pszMessage);
+
+	const uLong TOTAL_OUT_BEFORE = lpGroup->stream.total_out;
+	const uint64_t CPU_BEFORE = GetThreadCpuNanoseconds();
+
+	lpGroup->output.nLength = 0;
+
+	DeflatePieces(&(lpGroup->stream), &iov, 1, FLUSH, AppendToDeflateOutput,
+			&(lpGroup->output));
+
+	const uint64_t CPU_USED = GetThreadCpuNanoseconds() - CPU_BEFORE;
+
+	/* Every member that is in step is posted this same buffer */
+	lpGroup->lpBatchOutput = CreateMessageBufferFromBytes(
+			lpGroup->output.pData, (int) lpGroup->output.nLength);
+
+	lpGroup->bBatchFromBoundary = lpGroup->bAtBoundary;
+	lpGroup->bAtBoundary = FLUSH == Z_FULL_FLUSH;
+	lpGroup->nBatchesSinceReset = FLUSH == Z_FULL_FLUSH
+			? 0 : lpGroup->nBatchesSinceReset + 1;
+	lpGroup->bBatchCompressed = TRUE;
+
+	atomic_fetch_add(&g_nTotalBytesIn, (unsigned long long) iov.iov_len);
+	atomic_fetch_add(&g_nTotalBytesOut,
+			(unsigned long long) (lpGroup->stream.total_out
+					- TOTAL_OUT_BEFORE));
+	atomic_fetch_add(&g_nTotalCpuNanoseconds, CPU_USED);
+	atomic_fetch_add(&g_nGroupBatchCount, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// BeginDeflateGroupBatch function
+
+void BeginDeflateGroupBatch(LPDEFLATEGROUP lpGroup) {
+	if (lpGroup == NULL) {
+		return;
+	}
+
+	lpGroup->bBatchCompressed = FALSE;
+	lpGroup->nBatchPrivateCount = 0;
+	lpGroup->lpBatchOutput = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CompressLogDataToClient function
+
+long CompressLogDataToClient(void* pvClient, const char* pchData,
+		size_t nLength) {
+	LPCLIENTSTRUCT lpClient = (LPCLIENTSTRUCT) pvClient;
+
+	struct iovec iov;
+	iov.iov_base = (void*) pchData;
+	iov.iov_len = nLength;
+
+	const int nBytesSent = SendCompressedToClient(lpClient, &iov, 1);
+	if (nBytesSent < 0) {
+		return -1;
+	}
+
+	/* Written out straight away, so that a long history does not pile up
+	 * in the mailbox */
+	if (DeliverClientMailbox(lpClient) < 0) {
+		return -1;
+	}
+
+	return nBytesSent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateDeflateGroup function
+
+LPDEFLATEGROUP CreateDeflateGroup() {
+	LPDEFLATEGROUP lpGroup = (LPDEFLATEGROUP) malloc(1 * sizeof(DEFLATEGROUP));
+	if (lpGroup == NULL) {
+		fprintf(stderr, OUT_OF_MEMORY);
+
+		CleanupServer(ERROR);
+	}
+
+	memset(lpGroup, 0, 1 * sizeof(DEFLATEGROUP));
+
+	/* A new stream has no history, so every member can take its output */
+	lpGroup->bInitialized = FALSE;
+	lpGroup->bAtBoundary = TRUE;
+
+	lpGroup->output.pData = NULL;
+	lpGroup->output.nLength = 0;
+	lpGroup->output.nCapacity = 0;
+	lpGroup->lpBatchOutput = NULL;
+
+	return lpGroup;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateDeflateStream function
+
+LPDEFLATESTREAM CreateDeflateStream() {
+	LPDEFLATESTREAM lpStream = (LPDEFLATESTREAM) malloc(
+			1 * sizeof(DEFLATESTREAM));
+	if (lpStream == NULL) {
+		fprintf(stderr, OUT_OF_MEMORY);
+
+		CleanupServer(ERROR);
+	}
+
+	memset(lpStream, 0, 1 * sizeof(DEFLATESTREAM));
+
+	InitializeDeflate(&(lpStream->stream));
+
+	lpStream->hMutex = CreateMutex();
+	if (INVALID_HANDLE_VALUE == lpStream->hMutex) {
+		CleanupServer(ERROR);
+	}
+
+	/* Clients start out compressed on their own, until the first time
+	 * their room's group can take them */
+	lpStream->lpGroup = NULL;
+	lpStream->bStale = FALSE;
+
+	return lpStream;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// EndDeflateGroupBatch function
+
+void EndDeflateGroupBatch(LPDEFLATEGROUP lpGroup) {
+	if (lpGroup == NULL) {
+		return;
+	}
+
+	/* The members' mailboxes hold references of their own */
+	ReleaseMessageBuffer(lpGroup->lpBatchOutput);
+	lpGroup->lpBatchOutput = NULL;
+
+	if (!lpGroup->bBatchCompressed && lpGroup->nBatchPrivateCount == 0) {
+		return;	// no compressed member was sent the message
+	}
+
+	lpGroup->nLastPrivateCount = lpGroup->nBatchPrivateCount;
+
+	/* If no member at all is in step any more, there is no reason to wait
+	 * for the next reset; the history can be emptied right away */
+	if (!lpGroup->bBatchCompressed && lpGroup->bInitialized
+			&& !lpGroup->bAtBoundary) {
+		deflateReset(&(lpGroup->stream));
+
+		lpGroup->bAtBoundary = TRUE;
+		lpGroup->nBatchesSinceReset = 0;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FreeDeflateGroup function
+
+void FreeDeflateGroup(LPDEFLATEGROUP lpGroup) {
+	if (lpGroup == NULL) {
+		return;
+	}
+
+	if (lpGroup->bInitialized) {
+		deflateEnd(&(lpGroup->stream));
+	}
+
+	if (lpGroup->output.pData != NULL) {
+		free(lpGroup->output.pData);
+		lpGroup->output.pData = NULL;
+	}
+
+	ReleaseMessageBuffer(lpGroup->lpBatchOutput);
+	lpGroup->lpBatchOutput = NULL;
+
+	free(lpGroup);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FreeDeflateStream function
+
+void FreeDeflateStream(LPDEFLATESTREAM lpStream) {
+	if (lpStream == NULL) {
+		return;
+	}
+
+	deflateEnd(&(lpStream->stream));
+
+	if (lpStream->output.pData != NULL) {
+		free(lpStream->output.pData);
+		lpStream->output.pData = NULL;
+	}
+
+	if (INVALID_HANDLE_VALUE != lpStream->hMutex) {
+		DestroyMutex(lpStream->hMutex);
+		lpStream->hMutex = INVALID_HANDLE_VALUE;
+	}
+
+	free(lpStream);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LeaveDeflateGroup function
+
+void LeaveDeflateGroup(LPCLIENTSTRUCT lpClient) {
+	if (lpClient == NULL || lpClient->lpDeflateStream == NULL) {
+		return;
+	}
+
+	LPDEFLATESTREAM lpStream = lpClient->lpDeflateStream;
+
+	LockMutex(lpStream->hMutex);
+	{
+		if (lpStream->lpGroup != NULL) {
+			lpStream->lpGroup = NULL;
+			lpStream->bStale = TRUE;
+		}
+	}
+	UnlockMutex(lpStream->hMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReportCompressionStats function
+
+void ReportCompressionStats() {
+	const unsigned long long BYTES_IN = atomic_load(&g_nTotalBytesIn);
+	if (BYTES_IN == 0) {
+		return;	// Nobody asked for compression.
+	}
+
+	const unsigned long long BYTES_OUT = atomic_load(&g_nTotalBytesOut);
+	const double RATIO = BYTES_OUT == 0 ? 0.0
+			: (double) BYTES_IN / (double) BYTES_OUT;
+	const double CPU_MS = atomic_load(&g_nTotalCpuNanoseconds) / 1000000.0;
+	const unsigned long long BATCHES = atomic_load(&g_nGroupBatchCount);
+	const unsigned long long RECIPIENTS = atomic_load(
+			&g_nGroupRecipientCount);
+
+	LogInfo(COMPRESSION_STATS, BYTES_IN, BYTES_OUT, RATIO, CPU_MS, BATCHES,
+			RECIPIENTS);
+
+	if (GetLogFileHandle() != stdout) {
+		fprintf(stdout, COMPRESSION_STATS, BYTES_IN, BYTES_OUT, RATIO,
+				CPU_MS, BATCHES, RECIPIENTS);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReportDeflateStreamStats function
+
+void ReportDeflateStreamStats(LPCLIENTSTRUCT lpClient,
+		const char* pszClientID) {
+	if (lpClient == NULL || lpClient->lpDeflateStream == NULL) {
+		return;
+	}
+
+	LPDEFLATESTREAM lpStream = lpClient->lpDeflateStream;
+
+	const double RATIO = lpStream->nBytesOut == 0 ? 0.0
+			: (double) lpStream->nBytesIn / (double) lpStream->nBytesOut;
+	const double CPU_MS = lpStream->nCpuNanoseconds / 1000000.0;
+
+	fprintf(stdout, COMPRESSION_SESSION_STATS, pszClientID,
+			lpStream->nBytesIn, lpStream->nBytesOut, RATIO, CPU_MS);
+
+	if (GetLogFileHandle() != stdout) {
+		LogInfo(COMPRESSION_SESSION_STATS, pszClientID, lpStream->nBytesIn,
+				lpStream->nBytesOut, RATIO, CPU_MS);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendCompressedToClient function
+
+int SendCompressedToClient(LPCLIENTSTRUCT lpClient, const struct iovec* pIov,
+		int nIovCount) {
+	if (lpClient == NULL || lpClient->lpDeflateStream == NULL
+			|| pIov == NULL || nIovCount <= 0) {
+		return ERROR;
+	}
+
+	int nBytesSent = ERROR;
+
+	LockMutex(lpClient->lpDeflateStream->hMutex);
+	{
+		nBytesSent = CompressForClient(lpClient, pIov, nIovCount);
+	}
+	UnlockMutex(lpClient->lpDeflateStream->hMutex);
+
+	return nBytesSent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendGroupMessageToClient function
+
+int SendGroupMessageToClient(LPDEFLATEGROUP lpGroup, LPCLIENTSTRUCT lpClient,
+		const char* pszMessage) {
+	if (lpGroup == NULL || lpClient == NULL
+			|| IsNullOrWhiteSpace(pszMessage)) {
+		return ERROR;
+	}
+
+	if (lpClient->lpDeflateStream == NULL) {
+		return SendToClient(lpClient, pszMessage);
+	}
+
+	if (!IsSocketValid(lpClient->nSocket) || lpClient->bConnected == FALSE) {
+		return ERROR;
+	}
+
+	LPDEFLATESTREAM lpStream = lpClient->lpDeflateStream;
+
+	int nBytesSent = ERROR;
+
+	LockMutex(lpStream->hMutex);
+	{
+		/* Whether the group's copy of this message will start from an empty
+		 * history, in which case any member can start taking it */
+		const BOOL FROM_BOUNDARY = lpGroup->bBatchCompressed
+				? lpGroup->bBatchFromBoundary : lpGroup->bAtBoundary;
+
+		if (lpStream->lpGroup == lpGroup || FROM_BOUNDARY) {
+			if (!lpGroup->bBatchCompressed) {
+				CompressGroupBatch(lpGroup, pszMessage);
+			}
+
+			if (PostToMailbox(&(lpClient->mailbox), lpGroup->lpBatchOutput,
+					TRUE)) {
+				lpStream->lpGroup = lpGroup;
+				lpStream->nBytesIn += (long) strlen(pszMessage);
+				lpStream->nBytesOut += (long) lpGroup->lpBatchOutput->nLength;
+
+				nBytesSent = lpGroup->lpBatchOutput->nLength;
+
+				atomic_fetch_add(&g_nGroupRecipientCount, 1);
+			}
+		} else {
+			struct iovec iov;
+			iov.iov_base = (void*) pszMessage;
+			iov.iov_len = strlen(pszMessage);
+
+			nBytesSent = CompressForClient(lpClient, &iov, 1);
+
+			lpGroup->nBatchPrivateCount++;
+		}
+	}
+	UnlockMutex(lpStream->hMutex);
+
+	return nBytesSent;
+}
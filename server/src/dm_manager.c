@@ -0,0 +1,174 @@
+// dm_manager.c - Implementations of the functions that deliver direct
+// messages (DMs) from one chatter to another.
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "client_manager.h"
+#include "client_thread_functions.h"
+#include "dm_manager.h"
+#include "federation.h"
+#include "message_log.h"
+#include "nickname_manager.h"
+#include "nickname_ring.h"
+#include "server_functions.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// EndDirectMessage function - Takes the client out of the mode in which the
+// lines it sends are delivered to a single recipient.
+//
+
+void EndDirectMessage(LPCLIENTSTRUCT lpSendingClient) {
+	memset(lpSendingClient->szDmRecipient, 0, MAX_NICKNAME_LEN + 1);
+	lpSendingClient->nDmRecipientNodeId = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// ProcessDmCommand function
+
+BOOL ProcessDmCommand(LPCLIENTSTRUCT lpSendingClient, char* pszBuffer) {
+	if (lpSendingClient == NULL) {
+		ThrowNullReferenceException();
+	}
+
+	if (IsNullOrWhiteSpace(pszBuffer)) {
+		ThrowNullReferenceException();
+	}
+
+	if (IsNullOrWhiteSpace(lpSendingClient->pszNickname)) {
+		// Per protocol, chatters have to say who they are first
+		lpSendingClient->nBytesSent +=
+				ReplyToClient(lpSendingClient, ERROR_NO_NICK_RECEIVED);
+		return TRUE;	// command handled but error occurred
+	}
+
+	const int BUFFER_SIZE = strlen(pszBuffer) + 1;
+
+	char szNickname[BUFFER_SIZE];
+	memset(szNickname, 0, BUFFER_SIZE);
+
+	Trim(szNickname, BUFFER_SIZE, pszBuffer + strlen(PROTOCOL_DM_COMMAND));
+
+	if (Equals(szNickname, lpSendingClient->pszNickname)) {
+		lpSendingClient->nBytesSent +=
+				ReplyToClient(lpSendingClient, ERROR_DM_TO_SELF);
+		return TRUE;	// command handled but error occurred
+	}
+
+	uint32_t nRecipientNodeId = 0;
+
+	LPCLIENTSTRUCT lpRecipient = GetClientByNickname(szNickname);
+	if (lpRecipient != NULL) {
+		ReleaseClient(lpRecipient);
+	} else {
+		/* The recipient may be connected to another server in the cluster;
+		 * the owner of the nickname knows which */
+		nRecipientNodeId = ResolveClusterNickname(szNickname);
+	}
+
+	if (lpRecipient == NULL && (nRecipientNodeId == 0
+			|| nRecipientNodeId == GetLocalNodeId())) {
+		lpSendingClient->nBytesSent +=
+				ReplyToClient(lpSendingClient, ERROR_DM_RECIPIENT_NOT_FOUND);
+		return TRUE;	// command handled but error occurred
+	}
+
+	lpSendingClient->nDmRecipientNodeId = nRecipientNodeId;
+
+	/* Nicknames in the index are never longer than MAX_NICKNAME_LEN */
+	strcpy(lpSendingClient->szDmRecipient, szNickname);
+
+	char szReplyBuffer[BUFLEN];
+	memset(szReplyBuffer, 0, BUFLEN);
+
+	sprintf(szReplyBuffer, OK_DM_READY, szNickname);
+
+	lpSendingClient->nBytesSent +=
+			ReplyToClient(lpSendingClient, szReplyBuffer);
+
+	return TRUE;	// command handled successfully
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ProcessDirectMessageLine function
+
+BOOL ProcessDirectMessageLine(LPCLIENTSTRUCT lpSendingClient,
+		char* pszBuffer) {
+	if (lpSendingClient == NULL) {
+		ThrowNullReferenceException();
+	}
+
+	if (IsNullOrWhiteSpace(pszBuffer)) {
+		return TRUE;	// blank lines are not delivered
+	}
+
+	if (EqualsNoCase(pszBuffer, MSG_TERMINATOR)) {
+		EndDirectMessage(lpSendingClient);
+		return TRUE;	// end of the direct message
+	}
+
+	/* Look the recipient up again for each line, so that a recipient who
+	 * has disconnected in the meantime is detected.  A recipient on another
+	 * server is only looked up by that server, which drops the line if the
+	 * recipient is gone. */
+	LPCLIENTSTRUCT lpRecipient = NULL;
+	if (lpSendingClient->nDmRecipientNodeId == 0) {
+		lpRecipient = GetClientByNickname(lpSendingClient->szDmRecipient);
+	}
+
+	if (lpRecipient == NULL && lpSendingClient->nDmRecipientNodeId == 0) {
+		EndDirectMessage(lpSendingClient);
+
+		lpSendingClient->nBytesSent +=
+				ReplyToClient(lpSendingClient, ERROR_DM_RECIPIENT_NOT_FOUND);
+		return TRUE;	// line handled but error occurred
+	}
+
+	char szPrefix[BUFLEN];
+	memset(szPrefix, 0, BUFLEN);
+
+	sprintf(szPrefix, DM_MESSAGE_PREFIX, lpSendingClient->pszNickname);
+
+	char* pszMessage = NULL;
+
+	PrependTo(&pszMessage, szPrefix, pszBuffer);
+
+	if (pszMessage != NULL) {
+		if (lpRecipient != NULL) {
+			SendToClient(lpRecipient, pszMessage);
+		} else if (!SendToPeerNode(lpSendingClient->nDmRecipientNodeId,
+				PEER_EVENT_DIRECT_MESSAGE, 0, lpSendingClient->szDmRecipient,
+				pszMessage)) {
+			/* The link to the recipient's server is down */
+			EndDirectMessage(lpSendingClient);
+
+			lpSendingClient->nBytesSent += ReplyToClient(lpSendingClient,
+					ERROR_DM_RECIPIENT_NOT_FOUND);
+
+			free(pszMessage);
+			return TRUE;	// line handled but error occurred
+		}
+
+		/* Log the line with the nickname of its recipient ahead of it */
+		char szLogHeader[MAX_NICKNAME_LEN + 3];
+		memset(szLogHeader, 0, MAX_NICKNAME_LEN + 3);
+
+		sprintf(szLogHeader, "@%s ", lpSendingClient->szDmRecipient);
+
+		AppendToMessageLog(GetDirectMessageLog(), szLogHeader, pszMessage);
+
+		free(pszMessage);
+		pszMessage = NULL;
+	}
+
+	ReleaseClient(lpRecipient);
+
+	return TRUE;	// line handled successfully
+}
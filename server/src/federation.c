@@ -0,0 +1,1426 @@
+// federation.c - Implementation of the links between chattr servers.
+//
+// Each server (node) has an ID that is unique within the cluster.  Servers
+// link to one another over TCP, in any topology; each link is used in both
+// directions.  When a chatter says something in a room, joins it or leaves
+// it, the server queues an event, numbered in increasing order, on every one
+// of its links.  A server that receives an event delivers it to its own
+// members of the room and relays it over all its other links.  An event is
+// dropped if it comes back to the server it started on, if it has already
+// been seen (it can arrive by more than one path), or if it has been relayed
+// FEDERATION_MAX_HOPS times.
+//
+// Events are sent in binary frames.  A frame is a FEDERATION_FRAME_HEADER_SIZE
+// header followed by the events, each of which is a
+// FEDERATION_EVENT_HEADER_SIZE header followed by the room name, nickname and
+// text.  The first event on every link is PEER_EVENT_HELLO, which tells the
+// other end the node ID of this one.
+//
+// Every event also carries the incarnation of the process that it started on.
+// The node ID stays the same when a server restarts, but its sequence numbers
+// start over, so the events seen from a node are forgotten whenever it shows
+// up with a newer incarnation; otherwise they would all be taken for
+// duplicates of the ones its previous process sent.
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "acceptor_shards.h"
+#include "client_manager.h"
+#include "federation.h"
+#include "heartbeat.h"
+#include "nickname_ring.h"
+#include "presence.h"
+#include "rate_limiter.h"
+#include "room_manager.h"
+#include "server_functions.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Global variables (used in this file only)
+
+/**
+ * @brief ID of this server's node.
+ */
+uint32_t g_nLocalNodeId = 0;
+
+/**
+ * @brief Port on which links from peer servers are accepted, or zero if they
+ * are not.
+ */
+int g_nPeerPort = 0;
+
+/**
+ * @brief Host names of the peer servers named on the command line.
+ */
+char g_szPeerHosts[FEDERATION_MAX_PEERS][NI_MAXHOST];
+
+/**
+ * @brief Peer ports of the peer servers named on the command line.
+ */
+int g_nPeerPorts[FEDERATION_MAX_PEERS];
+
+/**
+ * @brief Count of peer servers named on the command line.
+ */
+int g_nPeerCount = 0;
+
+/**
+ * @brief Flag that is set while events are being published to the peers.
+ */
+atomic_int g_bFederationRunning = 0;
+
+/**
+ * @brief Flag that tells the federation threads to stop.
+ */
+atomic_int g_bShouldStopFederation = 0;
+
+/**
+ * @brief Incarnation of this server's process, set when federation starts.
+ */
+uint64_t g_nLocalIncarnation = 0;
+
+/**
+ * @brief Sequence number to give the next event this server publishes.
+ */
+atomic_ullong g_nNextEventSequence = 0;
+
+/**
+ * @brief File descriptor of the socket on which links from peer servers are
+ * accepted, or -1.
+ */
+atomic_int g_nPeerListenSocket = -1;
+
+/**
+ * @brief List of the peer links that are up.
+ */
+POSITION* g_pPeerLinkList = NULL;
+
+/**
+ * @brief Handle to the mutex that guards the list of peer links.
+ */
+HMUTEX g_hPeerLinkListMutex = INVALID_HANDLE_VALUE;
+
+/**
+ * @brief Table of the events seen from each node.
+ */
+PEERORIGIN g_peerOrigins[FEDERATION_MAX_NODES];
+
+/**
+ * @brief Count of entries of g_peerOrigins that are in use.
+ */
+int g_nPeerOriginCount = 0;
+
+/**
+ * @brief Handle to the mutex that guards the table of events seen.
+ */
+HMUTEX g_hPeerOriginMutex = INVALID_HANDLE_VALUE;
+
+/**
+ * @brief Handle to the thread that sends the events queued for the links.
+ */
+HTHREAD g_hFederationFlusherThread = INVALID_HANDLE_VALUE;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// PutUInt16 / PutUInt32 / PutUInt64 functions - Write big-endian integers.
+//
+
+void PutUInt16(unsigned char* pDest, uint16_t nValue) {
+	pDest[0] = (unsigned char) (nValue >> 8);
+	pDest[1] = (unsigned char) nValue;
+}
+
+void PutUInt32(unsigned char* pDest, uint32_t nValue) {
+	PutUInt16(pDest, (uint16_t) (nValue >> 16));
+	PutUInt16(pDest + 2, (uint16_t) nValue);
+}
+
+void PutUInt64(unsigned char* pDest, uint64_t nValue) {
+	PutUInt32(pDest, (uint32_t) (nValue >> 32));
+	PutUInt32(pDest + 4, (uint32_t) nValue);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetUInt16 / GetUInt32 / GetUInt64 functions - Read big-endian integers.
+//
+
+uint16_t GetUInt16(const unsigned char* pSource) {
+	return (uint16_t) ((pSource[0] << 8) | pSource[1]);
+}
+
+uint32_t GetUInt32(const unsigned char* pSource) {
+	return ((uint32_t) GetUInt16(pSource) << 16) | GetUInt16(pSource + 2);
+}
+
+uint64_t GetUInt64(const unsigned char* pSource) {
+	return ((uint64_t) GetUInt32(pSource) << 32) | GetUInt32(pSource + 4);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SleepUnlessStopping function - Sleeps for the time specified, in
+// FEDERATION_FLUSH_INTERVAL_MS steps, returning early if the federation
+// threads are told to stop.
+//
+
+void SleepUnlessStopping(int nMilliseconds) {
+	for (int nSlept = 0; nSlept < nMilliseconds
+			&& !atomic_load(&g_bShouldStopFederation);
+			nSlept += FEDERATION_FLUSH_INTERVAL_MS) {
+		usleep(FEDERATION_FLUSH_INTERVAL_MS * 1000);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReadFully function - Reads exactly nSize bytes from a socket.  Returns FALSE
+// if the link fails or is closed first.
+//
+
+BOOL ReadFully(int nSocket, void* pvBuffer, size_t nSize) {
+	size_t nTotalRead = 0;
+
+	while (nTotalRead < nSize) {
+		ssize_t nRead = read(nSocket, (char*) pvBuffer + nTotalRead,
+				nSize - nTotalRead);
+		if (nRead < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (nRead <= 0) {
+			return FALSE;
+		}
+
+		nTotalRead += (size_t) nRead;
+	}
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendFrame function - Sends a frame header and its payload with as few
+// system calls as it takes.  Returns FALSE if the link fails, or the send
+// blocks for longer than FEDERATION_SEND_TIMEOUT_MS.  A peer that has gone
+// away fails the send with EPIPE rather than raising SIGPIPE, so that only
+// the link is lost.
+//
+
+BOOL SendFrame(int nSocket, unsigned char* pHeader, char* pPayload,
+		size_t nPayloadLength) {
+	struct iovec vectors[2];
+	vectors[0].iov_base = pHeader;
+	vectors[0].iov_len = FEDERATION_FRAME_HEADER_SIZE;
+	vectors[1].iov_base = pPayload;
+	vectors[1].iov_len = nPayloadLength;
+
+	struct iovec* pVector = vectors;
+	int nVectorCount = 2;
+
+	while (nVectorCount > 0) {
+		struct msghdr message;
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = pVector;
+		message.msg_iovlen = nVectorCount;
+
+		ssize_t nWritten = sendmsg(nSocket, &message, MSG_NOSIGNAL);
+		if (nWritten < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (nWritten <= 0) {
+			return FALSE;
+		}
+
+		while (nVectorCount > 0 && (size_t) nWritten >= pVector->iov_len) {
+			nWritten -= pVector->iov_len;
+			pVector++;
+			nVectorCount--;
+		}
+
+		if (nVectorCount > 0) {
+			pVector->iov_base = (char*) pVector->iov_base + nWritten;
+			pVector->iov_len -= nWritten;
+		}
+	}
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ClosePeerLink function - Marks a link as failed and shuts its socket down,
+// which makes the thread that reads it remove it.  Must be called with the
+// link's mutex held.
+//
+
+void ClosePeerLink(LPPEERLINK lpLink) {
+	if (lpLink->bClosed) {
+		return;
+	}
+
+	lpLink->bClosed = TRUE;
+
+	shutdown(lpLink->nSocket, SHUT_RDWR);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AppendEventToLink function - Encodes an event onto the end of the buffer of
+// events waiting to be sent over a link.  A link that has fallen so far
+// behind that its buffer would outgrow a frame is closed.
+//
+
+void AppendEventToLink(LPPEERLINK lpLink, LPPEEREVENT lpEvent) {
+	const size_t EVENT_SIZE = FEDERATION_EVENT_HEADER_SIZE
+			+ lpEvent->nRoomNameLength + lpEvent->nNicknameLength
+			+ lpEvent->nTextLength;
+
+	LockMutex(lpLink->hMutex);
+	{
+		if (lpLink->bClosed) {
+			UnlockMutex(lpLink->hMutex);
+			return;
+		}
+
+		if (lpLink->nBufferLength + EVENT_SIZE > FEDERATION_MAX_FRAME_SIZE
+				|| lpLink->nEventCount == UINT16_MAX) {
+			ClosePeerLink(lpLink);
+
+			UnlockMutex(lpLink->hMutex);
+			return;
+		}
+
+		if (lpLink->nBufferLength + EVENT_SIZE > lpLink->nBufferCapacity) {
+			size_t nNewCapacity = lpLink->nBufferCapacity == 0
+					? BUFLEN : lpLink->nBufferCapacity;
+			while (nNewCapacity < lpLink->nBufferLength + EVENT_SIZE) {
+				nNewCapacity *= 2;
+			}
+
+			char* pNewBuffer = (char*) realloc(lpLink->pBuffer, nNewCapacity);
+			if (pNewBuffer == NULL) {
+				ClosePeerLink(lpLink);
+
+				UnlockMutex(lpLink->hMutex);
+				return;
+			}
+
+			lpLink->pBuffer = pNewBuffer;
+			lpLink->nBufferCapacity = nNewCapacity;
+		}
+
+		unsigned char* pDest =
+				(unsigned char*) lpLink->pBuffer + lpLink->nBufferLength;
+
+		pDest[0] = (unsigned char) lpEvent->nType;
+		pDest[1] = (unsigned char) lpEvent->nHops;
+		PutUInt16(pDest + 2, (uint16_t) lpEvent->nRoomNameLength);
+		PutUInt32(pDest + 4, lpEvent->nOriginNodeId);
+		PutUInt64(pDest + 8, lpEvent->nOriginIncarnation);
+		PutUInt64(pDest + 16, lpEvent->nSequence);
+		PutUInt16(pDest + 24, (uint16_t) lpEvent->nNicknameLength);
+		PutUInt16(pDest + 26, (uint16_t) lpEvent->nTextLength);
+		pDest += FEDERATION_EVENT_HEADER_SIZE;
+
+		memcpy(pDest, lpEvent->pchRoomName, lpEvent->nRoomNameLength);
+		pDest += lpEvent->nRoomNameLength;
+		memcpy(pDest, lpEvent->pchNickname, lpEvent->nNicknameLength);
+		pDest += lpEvent->nNicknameLength;
+		memcpy(pDest, lpEvent->pchText, lpEvent->nTextLength);
+
+		lpLink->nBufferLength += EVENT_SIZE;
+		lpLink->nEventCount++;
+	}
+	UnlockMutex(lpLink->hMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RelayEvent function - Queues an event on every link except the one it came
+// in on, and the one that leads back to the server it started on.
+//
+
+void RelayEvent(LPPEEREVENT lpEvent, LPPEERLINK lpSourceLink) {
+	LockMutex(g_hPeerLinkListMutex);
+	{
+		LPPOSITION pos = GetHeadPosition(g_pPeerLinkList);
+		while (pos != NULL) {
+			LPPEERLINK lpLink = (LPPEERLINK) (pos->pvData);
+
+			if (lpLink != lpSourceLink
+					&& lpLink->nRemoteNodeId != lpEvent->nOriginNodeId) {
+				AppendEventToLink(lpLink, lpEvent);
+			}
+
+			pos = GetNextPosition(pos);
+		}
+	}
+	UnlockMutex(g_hPeerLinkListMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FindPeerOrigin function - Finds the entry for a node in the table of events
+// seen, or returns NULL if there is none.  The caller must hold the mutex that
+// guards the table.
+//
+
+LPPEERORIGIN FindPeerOrigin(uint32_t nNodeId) {
+	for (int i = 0; i < g_nPeerOriginCount; i++) {
+		if (g_peerOrigins[i].nNodeId == nNodeId) {
+			return &(g_peerOrigins[i]);
+		}
+	}
+
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RestartPeerOrigin function - Forgets the events seen from a node, because
+// it has restarted and so numbers its events from zero again.  The caller must
+// hold the mutex that guards the table of events seen.
+//
+
+void RestartPeerOrigin(LPPEERORIGIN lpOrigin, uint64_t nIncarnation) {
+	lpOrigin->nIncarnation = nIncarnation;
+	lpOrigin->nHighestSequence = 0;
+	lpOrigin->nSeenMask = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// NotePeerIncarnation function - Forgets the events seen from a node if it
+// says hello with a newer incarnation than they came from.
+//
+
+void NotePeerIncarnation(uint32_t nNodeId, uint64_t nIncarnation) {
+	LockMutex(g_hPeerOriginMutex);
+	{
+		LPPEERORIGIN lpOrigin = FindPeerOrigin(nNodeId);
+
+		if (lpOrigin != NULL && nIncarnation > lpOrigin->nIncarnation) {
+			RestartPeerOrigin(lpOrigin, nIncarnation);
+		}
+	}
+	UnlockMutex(g_hPeerOriginMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsEventNew function - Records an event as seen, and says whether it had not
+// been seen before.  Keeps a sliding window of the last 64 sequence numbers
+// per node, so that events reordered by taking different paths through the
+// cluster are still delivered exactly once.  Events from an older incarnation
+// of a node than the latest one seen are taken as seen.
+//
+
+BOOL IsEventNew(uint32_t nNodeId, uint64_t nIncarnation, uint64_t nSequence) {
+	BOOL bResult = TRUE;
+
+	LockMutex(g_hPeerOriginMutex);
+	{
+		LPPEERORIGIN lpOrigin = FindPeerOrigin(nNodeId);
+
+		if (lpOrigin == NULL && g_nPeerOriginCount < FEDERATION_MAX_NODES) {
+			lpOrigin = &(g_peerOrigins[g_nPeerOriginCount++]);
+			lpOrigin->nNodeId = nNodeId;
+
+			RestartPeerOrigin(lpOrigin, nIncarnation);
+		}
+
+		if (lpOrigin == NULL) {
+			/* If the table is full, the hop limit keeps the event from
+			 * circling forever */
+		} else if (nIncarnation < lpOrigin->nIncarnation) {
+			bResult = FALSE;	// sent before the node restarted
+		} else {
+			if (nIncarnation > lpOrigin->nIncarnation) {
+				RestartPeerOrigin(lpOrigin, nIncarnation);
+			}
+
+			if (nSequence > lpOrigin->nHighestSequence) {
+				const uint64_t SHIFT = nSequence - lpOrigin->nHighestSequence;
+
+				lpOrigin->nSeenMask =
+						SHIFT >= 64 ? 0 : lpOrigin->nSeenMask << SHIFT;
+				lpOrigin->nSeenMask |= 1;
+				lpOrigin->nHighestSequence = nSequence;
+			} else {
+				const uint64_t AGE = lpOrigin->nHighestSequence - nSequence;
+
+				if (AGE >= 64
+						|| (lpOrigin->nSeenMask & (1ULL << AGE)) != 0) {
+					bResult = FALSE;
+				} else {
+					lpOrigin->nSeenMask |= 1ULL << AGE;
+				}
+			}
+		}
+	}
+	UnlockMutex(g_hPeerOriginMutex);
+
+	return bResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CopyEventString function - Copies a string of an event into a
+// null-terminated buffer.  Returns FALSE if it does not fit.
+//
+
+BOOL CopyEventString(char* pszDest, int nDestSize, const char* pchSource,
+		int nLength) {
+	if (nLength >= nDestSize) {
+		return FALSE;
+	}
+
+	memcpy(pszDest, pchSource, nLength);
+	pszDest[nLength] = '\0';
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DeliverPeerEvent function - Shows an event that happened on another server
+// to the chatters on this one, just as if it had happened here.
+//
+
+void DeliverPeerEvent(LPPEEREVENT lpEvent) {
+	char szRoomName[MAX_ROOM_NAME_LEN + 1];
+	char szNickname[MAX_NICKNAME_LEN + 1];
+
+	if (!CopyEventString(szRoomName, sizeof(szRoomName),
+			lpEvent->pchRoomName, lpEvent->nRoomNameLength)
+			|| !CopyEventString(szNickname, sizeof(szNickname),
+					lpEvent->pchNickname, lpEvent->nNicknameLength)) {
+		return;	// not something that can be a room or nickname here
+	}
+
+	if (lpEvent->nType == PEER_EVENT_CHAT) {
+		char* pszText = (char*) malloc(lpEvent->nTextLength + 1);
+		if (pszText == NULL) {
+			return;
+		}
+
+		CopyEventString(pszText, lpEvent->nTextLength + 1, lpEvent->pchText,
+				lpEvent->nTextLength);
+
+		DeliverPeerChatToRoom(szRoomName, pszText);
+
+		free(pszText);
+		return;
+	}
+
+	if (IsNullOrWhiteSpace(szNickname)) {
+		return;
+	}
+
+	const BOOL IS_JOIN = lpEvent->nType == PEER_EVENT_JOIN;
+
+	/* An event with no room is about the chat as a whole, and is announced
+	 * like the joins and leaves on this server, batched during storms */
+	if (IsNullOrWhiteSpace(szRoomName)) {
+		AnnouncePresence(szNickname, IS_JOIN, NULL);
+		return;
+	}
+
+	char szNotice[BUFLEN];
+	memset(szNotice, 0, BUFLEN);
+
+	sprintf(szNotice, IS_JOIN ? ROOM_CHATTER_JOINED : ROOM_CHATTER_LEFT,
+			szNickname, szRoomName);
+
+	DeliverPeerNoticeToRoom(szRoomName, szNotice);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HandlePeerEvent function - Acts on an event received over a link.  Returns
+// FALSE if the link should be closed.
+//
+
+BOOL HandlePeerEvent(LPPEERLINK lpLink, LPPEEREVENT lpEvent) {
+	if (lpEvent->nType == PEER_EVENT_HELLO) {
+		if (lpEvent->nOriginNodeId == g_nLocalNodeId) {
+			return FALSE;	// we have linked to ourselves
+		}
+
+		lpLink->nRemoteNodeId = lpEvent->nOriginNodeId;
+
+		/* If the peer has restarted, the events seen from its previous
+		 * process say nothing about the ones it is going to send */
+		NotePeerIncarnation(lpEvent->nOriginNodeId,
+				lpEvent->nOriginIncarnation);
+
+		LogInfo(PEER_LINK_UP, lpLink->nRemoteNodeId, lpLink->szAddress);
+
+		if (GetLogFileHandle() != stdout) {
+			fprintf(stdout, PEER_LINK_UP, lpLink->nRemoteNodeId,
+					lpLink->szAddress);
+		}
+
+		RebuildNicknameRing();
+
+		return TRUE;
+	}
+
+	if (lpLink->nRemoteNodeId == 0) {
+		return FALSE;	// the peer has to say who it is first
+	}
+
+	if (IsNicknameEvent(lpEvent->nType)) {
+		/* Sent to this server alone; never relayed */
+		HandleNicknameEvent(lpLink->nRemoteNodeId, lpEvent);
+		return TRUE;
+	}
+
+	if (lpEvent->nType != PEER_EVENT_CHAT && lpEvent->nType != PEER_EVENT_JOIN
+			&& lpEvent->nType != PEER_EVENT_LEAVE) {
+		return TRUE;	// from a newer server; skip it
+	}
+
+	if (lpEvent->nOriginNodeId == g_nLocalNodeId
+			|| lpEvent->nHops >= FEDERATION_MAX_HOPS
+			|| !IsEventNew(lpEvent->nOriginNodeId,
+					lpEvent->nOriginIncarnation, lpEvent->nSequence)) {
+		return TRUE;
+	}
+
+	/* Pass it on before delivering it here, so that the servers further
+	 * away are not held up by our clients */
+	lpEvent->nHops++;
+	RelayEvent(lpEvent, lpLink);
+
+	DeliverPeerEvent(lpEvent);
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DecodeFrame function - Decodes the events in the payload of a frame and
+// handles each of them.  Returns FALSE if the frame is malformed, or the link
+// should be closed.
+//
+
+BOOL DecodeFrame(LPPEERLINK lpLink, const unsigned char* pPayload,
+		size_t nLength, int nEventCount) {
+	size_t nOffset = 0;
+
+	for (int i = 0; i < nEventCount; i++) {
+		if (nLength - nOffset < FEDERATION_EVENT_HEADER_SIZE) {
+			return FALSE;
+		}
+
+		const unsigned char* pHeader = pPayload + nOffset;
+
+		PEEREVENT event;
+		event.nType = pHeader[0];
+		event.nHops = pHeader[1];
+		event.nRoomNameLength = GetUInt16(pHeader + 2);
+		event.nOriginNodeId = GetUInt32(pHeader + 4);
+		event.nOriginIncarnation = GetUInt64(pHeader + 8);
+		event.nSequence = GetUInt64(pHeader + 16);
+		event.nNicknameLength = GetUInt16(pHeader + 24);
+		event.nTextLength = GetUInt16(pHeader + 26);
+		nOffset += FEDERATION_EVENT_HEADER_SIZE;
+
+		const size_t STRINGS_LENGTH = (size_t) event.nRoomNameLength
+				+ event.nNicknameLength + event.nTextLength;
+		if (nLength - nOffset < STRINGS_LENGTH) {
+			return FALSE;
+		}
+
+		event.pchRoomName = (const char*) pPayload + nOffset;
+		event.pchNickname = event.pchRoomName + event.nRoomNameLength;
+		event.pchText = event.pchNickname + event.nNicknameLength;
+		nOffset += STRINGS_LENGTH;
+
+		if (!HandlePeerEvent(lpLink, &event)) {
+			return FALSE;
+		}
+	}
+
+	return nOffset == nLength;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FindPeerLink function - Compares list entries by address.
+//
+
+BOOL FindPeerLink(void* pvLink, void* pvData) {
+	return pvLink != NULL && pvLink == pvData;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReleasePeerLink function - Gives up a reference to a link, freeing it once
+// nobody is using it any longer.
+//
+
+void ReleasePeerLink(void* pvLink) {
+	if (pvLink == NULL) {
+		return;
+	}
+
+	LPPEERLINK lpLink = (LPPEERLINK) pvLink;
+
+	if (atomic_fetch_sub(&(lpLink->nRefCount), 1) != 1) {
+		return;
+	}
+
+	close(lpLink->nSocket);
+
+	DestroyMutex(lpLink->hMutex);
+
+	free(lpLink->pBuffer);
+	free(lpLink->pSpareBuffer);
+	free(lpLink);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreatePeerLink function - Sets up a link over a socket that has just been
+// connected, queues the HELLO event on it, and adds it to the list.  The link
+// returned holds a reference for the caller, which is to serve it.
+//
+
+LPPEERLINK CreatePeerLink(int nSocket, const char* pszAddress) {
+	LPPEERLINK lpLink = (LPPEERLINK) calloc(1, sizeof(PEERLINK));
+	if (lpLink == NULL) {
+		close(nSocket);
+		return NULL;
+	}
+
+	lpLink->nSocket = nSocket;
+	strncpy(lpLink->szAddress, pszAddress, sizeof(lpLink->szAddress) - 1);
+
+	lpLink->hMutex = CreateMutex();
+	if (INVALID_HANDLE_VALUE == lpLink->hMutex) {
+		close(nSocket);
+		free(lpLink);
+		return NULL;
+	}
+
+	/* One reference for the list, one for the caller */
+	atomic_init(&(lpLink->nRefCount), 2);
+
+	/* Frames are already batched, so there is nothing to gain from Nagle;
+	 * and a peer that stops reading must not stall the flusher thread */
+	const int ON = 1;
+	setsockopt(nSocket, IPPROTO_TCP, TCP_NODELAY, &ON, sizeof(ON));
+
+	struct timeval timeout;
+	timeout.tv_sec = FEDERATION_SEND_TIMEOUT_MS / 1000;
+	timeout.tv_usec = (FEDERATION_SEND_TIMEOUT_MS % 1000) * 1000;
+	setsockopt(nSocket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	PEEREVENT hello;
+	memset(&hello, 0, sizeof(PEEREVENT));
+	hello.nType = PEER_EVENT_HELLO;
+	hello.nOriginNodeId = g_nLocalNodeId;
+	hello.nOriginIncarnation = g_nLocalIncarnation;
+	hello.pchRoomName = hello.pchNickname = hello.pchText = "";
+
+	AppendEventToLink(lpLink, &hello);
+
+	BOOL bAdded = FALSE;
+
+	LockMutex(g_hPeerLinkListMutex);
+	{
+		if (!atomic_load(&g_bShouldStopFederation)
+				&& GetElementCount(g_pPeerLinkList) < FEDERATION_MAX_LINKS) {
+			AddElementToTail(&g_pPeerLinkList, lpLink);
+			bAdded = TRUE;
+		}
+	}
+	UnlockMutex(g_hPeerLinkListMutex);
+
+	if (!bAdded) {
+		atomic_store(&(lpLink->nRefCount), 1);
+		ReleasePeerLink(lpLink);
+		return NULL;
+	}
+
+	return lpLink;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RemovePeerLink function - Takes a link out of the list, so that no more
+// events are queued on it.
+//
+
+void RemovePeerLink(LPPEERLINK lpLink) {
+	LockMutex(lpLink->hMutex);
+	{
+		ClosePeerLink(lpLink);
+	}
+	UnlockMutex(lpLink->hMutex);
+
+	LockMutex(g_hPeerLinkListMutex);
+	{
+		LPPOSITION pos = FindElement(g_pPeerLinkList, lpLink, FindPeerLink);
+		if (pos != NULL) {
+			g_pPeerLinkList = pos;
+			RemoveElement(&g_pPeerLinkList, ReleasePeerLink);
+		}
+	}
+	UnlockMutex(g_hPeerLinkListMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ServePeerLink function - Reads frames from a link until it fails, then
+// removes it and gives up the caller's reference to it.
+//
+
+void ServePeerLink(LPPEERLINK lpLink) {
+	unsigned char* pPayload = NULL;
+	size_t nPayloadCapacity = 0;
+
+	unsigned char header[FEDERATION_FRAME_HEADER_SIZE];
+
+	while (ReadFully(lpLink->nSocket, header, FEDERATION_FRAME_HEADER_SIZE)) {
+		const size_t PAYLOAD_LENGTH = GetUInt32(header);
+		const int EVENT_COUNT = GetUInt16(header + 4);
+
+		if (PAYLOAD_LENGTH > FEDERATION_MAX_FRAME_SIZE) {
+			break;
+		}
+
+		if (PAYLOAD_LENGTH > nPayloadCapacity) {
+			unsigned char* pNewPayload =
+					(unsigned char*) realloc(pPayload, PAYLOAD_LENGTH);
+			if (pNewPayload == NULL) {
+				break;
+			}
+
+			pPayload = pNewPayload;
+			nPayloadCapacity = PAYLOAD_LENGTH;
+		}
+
+		if (!ReadFully(lpLink->nSocket, pPayload, PAYLOAD_LENGTH)
+				|| !DecodeFrame(lpLink, pPayload, PAYLOAD_LENGTH,
+						EVENT_COUNT)) {
+			break;
+		}
+	}
+
+	free(pPayload);
+
+	RemovePeerLink(lpLink);
+
+	if (lpLink->nRemoteNodeId != 0) {
+		LogInfo(PEER_LINK_DOWN, lpLink->nRemoteNodeId, lpLink->szAddress);
+
+		if (GetLogFileHandle() != stdout) {
+			fprintf(stdout, PEER_LINK_DOWN, lpLink->nRemoteNodeId,
+					lpLink->szAddress);
+		}
+
+		/* The nicknames of that server's chatters are free again, and the
+		 * nicknames it owned are owned by the servers that are left */
+		ForgetNodeNicknames(lpLink->nRemoteNodeId);
+		RebuildNicknameRing();
+	}
+
+	ReleasePeerLink(lpLink);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PeerLinkThread function - Serves a link that a peer server made to us.
+//
+
+void* PeerLinkThread(void* pvData) {
+	ServePeerLink((LPPEERLINK) pvData);
+
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ListenForPeers function - Binds and listens on the peer port.  Returns the
+// socket, or -1 if the port cannot be bound yet.
+//
+
+int ListenForPeers() {
+	int nSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (nSocket < 0) {
+		return -1;
+	}
+
+	const int ON = 1;
+	setsockopt(nSocket, SOL_SOCKET, SO_REUSEADDR, &ON, sizeof(ON));
+
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons((uint16_t) g_nPeerPort);
+
+	if (bind(nSocket, (struct sockaddr*) &address, sizeof(address)) < 0
+			|| listen(nSocket, FEDERATION_MAX_LINKS) < 0) {
+		close(nSocket);
+		return -1;
+	}
+
+	return nSocket;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PeerAcceptorThread function - Accepts links from peer servers.  Keeps
+// trying to bind the peer port, since after a hot restart the previous server
+// process holds it until it exits.
+//
+
+void* PeerAcceptorThread(void* pvData) {
+	int nListenSocket = -1;
+
+	while (!atomic_load(&g_bShouldStopFederation)) {
+		nListenSocket = ListenForPeers();
+		if (nListenSocket >= 0) {
+			break;
+		}
+
+		SleepUnlessStopping(FEDERATION_RETRY_INTERVAL_MS);
+	}
+
+	if (nListenSocket < 0) {
+		return NULL;
+	}
+
+	atomic_store(&g_nPeerListenSocket, nListenSocket);
+
+	LogInfo(FEDERATION_LISTENING_ON_PORT, g_nLocalNodeId, g_nPeerPort);
+
+	if (GetLogFileHandle() != stdout) {
+		fprintf(stdout, FEDERATION_LISTENING_ON_PORT, g_nLocalNodeId,
+				g_nPeerPort);
+	}
+
+	while (!atomic_load(&g_bShouldStopFederation)) {
+		struct sockaddr_in address;
+		socklen_t nAddressLength = sizeof(address);
+
+		int nSocket = accept4(nListenSocket, (struct sockaddr*) &address,
+				&nAddressLength, SOCK_CLOEXEC);
+		if (nSocket < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			break;	// the socket was shut down by StopFederation
+		}
+
+		char szAddress[NI_MAXHOST + 8];
+		sprintf(szAddress, "%s:%d", inet_ntoa(address.sin_addr),
+				(int) ntohs(address.sin_port));
+
+		LPPEERLINK lpLink = CreatePeerLink(nSocket, szAddress);
+		if (lpLink == NULL) {
+			continue;
+		}
+
+		HTHREAD hLinkThread = CreateThreadEx(PeerLinkThread, lpLink);
+		if (INVALID_HANDLE_VALUE == hLinkThread) {
+			fprintf(stderr, FAILED_LAUNCH_FEDERATION_THREAD);
+
+			RemovePeerLink(lpLink);
+			ReleasePeerLink(lpLink);
+		}
+	}
+
+	/* The socket is left for StopFederation, which shut it down, so that it
+	 * is not closed while that function may still be using it */
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ConnectToPeer function - Connects to the peer port of a peer server.
+// Returns the socket, or -1 if the peer cannot be reached.
+//
+
+int ConnectToPeer(const char* pszHost, int nPort) {
+	char szPort[16];
+	sprintf(szPort, "%d", nPort);
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo* pResults = NULL;
+	if (getaddrinfo(pszHost, szPort, &hints, &pResults) != 0) {
+		return -1;
+	}
+
+	int nSocket = -1;
+
+	for (struct addrinfo* pResult = pResults; pResult != NULL;
+			pResult = pResult->ai_next) {
+		nSocket = socket(pResult->ai_family,
+				pResult->ai_socktype | SOCK_CLOEXEC, pResult->ai_protocol);
+		if (nSocket < 0) {
+			continue;
+		}
+
+		if (connect(nSocket, pResult->ai_addr, pResult->ai_addrlen) == 0) {
+			break;
+		}
+
+		close(nSocket);
+		nSocket = -1;
+	}
+
+	freeaddrinfo(pResults);
+
+	return nSocket;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PeerConnectorThread function - Keeps a link open to one of the peer servers
+// named on the command line, reconnecting whenever it goes down.
+//
+
+void* PeerConnectorThread(void* pvData) {
+	const int PEER_INDEX = (int) (intptr_t) pvData;
+
+	const char* pszHost = g_szPeerHosts[PEER_INDEX];
+	const int PORT = g_nPeerPorts[PEER_INDEX];
+
+	char szAddress[NI_MAXHOST + 8];
+	sprintf(szAddress, "%s:%d", pszHost, PORT);
+
+	while (!atomic_load(&g_bShouldStopFederation)) {
+		int nSocket = ConnectToPeer(pszHost, PORT);
+		if (nSocket >= 0) {
+			LPPEERLINK lpLink = CreatePeerLink(nSocket, szAddress);
+			if (lpLink != NULL) {
+				ServePeerLink(lpLink);
+			}
+		}
+
+		SleepUnlessStopping(FEDERATION_RETRY_INTERVAL_MS);
+	}
+
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FlushPeerLinks function - Sends each link the events queued on it since the
+// last time, as one frame.  The buffer is swapped out under the link's mutex,
+// so publishers are never held up by the network.
+//
+
+void FlushPeerLinks() {
+	LPPEERLINK lpLinks[FEDERATION_MAX_LINKS];
+	int nLinkCount = 0;
+
+	LockMutex(g_hPeerLinkListMutex);
+	{
+		LPPOSITION pos = GetHeadPosition(g_pPeerLinkList);
+		while (pos != NULL && nLinkCount < FEDERATION_MAX_LINKS) {
+			LPPEERLINK lpLink = (LPPEERLINK) (pos->pvData);
+
+			atomic_fetch_add(&(lpLink->nRefCount), 1);
+			lpLinks[nLinkCount++] = lpLink;
+
+			pos = GetNextPosition(pos);
+		}
+	}
+	UnlockMutex(g_hPeerLinkListMutex);
+
+	for (int i = 0; i < nLinkCount; i++) {
+		LPPEERLINK lpLink = lpLinks[i];
+
+		size_t nLength = 0;
+		int nEventCount = 0;
+
+		LockMutex(lpLink->hMutex);
+		{
+			if (!lpLink->bClosed && lpLink->nBufferLength > 0) {
+				char* pBuffer = lpLink->pBuffer;
+				const size_t CAPACITY = lpLink->nBufferCapacity;
+
+				lpLink->pBuffer = lpLink->pSpareBuffer;
+				lpLink->nBufferCapacity = lpLink->nSpareCapacity;
+				lpLink->pSpareBuffer = pBuffer;
+				lpLink->nSpareCapacity = CAPACITY;
+
+				nLength = lpLink->nBufferLength;
+				nEventCount = lpLink->nEventCount;
+
+				lpLink->nBufferLength = 0;
+				lpLink->nEventCount = 0;
+			}
+		}
+		UnlockMutex(lpLink->hMutex);
+
+		if (nLength > 0) {
+			unsigned char header[FEDERATION_FRAME_HEADER_SIZE];
+			PutUInt32(header, (uint32_t) nLength);
+			PutUInt16(header + 4, (uint16_t) nEventCount);
+			PutUInt16(header + 6, 0);
+
+			if (!SendFrame(lpLink->nSocket, header, lpLink->pSpareBuffer,
+					nLength)) {
+				LockMutex(lpLink->hMutex);
+				{
+					ClosePeerLink(lpLink);
+				}
+				UnlockMutex(lpLink->hMutex);
+			}
+		}
+
+		ReleasePeerLink(lpLink);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FederationFlusherThread function - Sends the queued events every
+// FEDERATION_FLUSH_INTERVAL_MS until federation is stopped.
+//
+
+void* FederationFlusherThread(void* pvData) {
+	while (!atomic_load(&g_bShouldStopFederation)) {
+		usleep(FEDERATION_FLUSH_INTERVAL_MS * 1000);
+
+		FlushPeerLinks();
+	}
+
+	/* Send whatever was said right before we stopped */
+	FlushPeerLinks();
+
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ParsePeerAddress function - Splits <host>:<port> into its parts.
+//
+
+BOOL ParsePeerAddress(const char* pszValue, char* pszHost, int* pnPort) {
+	const char* pchColon = strrchr(pszValue, ':');
+	if (pchColon == NULL || pchColon == pszValue
+			|| pchColon - pszValue >= NI_MAXHOST) {
+		return FALSE;
+	}
+
+	long lPort = 0;
+	int nResult = StringToLong(pchColon + 1, &lPort);
+	if ((nResult != OK && nResult != EXACTLY_CORRECT)
+			|| !IsUserPortNumberValid((int) lPort)) {
+		return FALSE;
+	}
+
+	memcpy(pszHost, pszValue, pchColon - pszValue);
+	pszHost[pchColon - pszValue] = '\0';
+	*pnPort = (int) lPort;
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// ConfigureFederation function
+
+BOOL ConfigureFederation(int argc, char* argv[]) {
+	if (argc < MIN_NUM_ARGS || argv == NULL) {
+		return FALSE;
+	}
+
+	long lValue = 0;
+
+	/* Unless told otherwise, the node ID is the client port, which is unique
+	 * among servers running on the same host */
+	int nResult = StringToLong(argv[1], &lValue);
+	if (nResult != OK && nResult != EXACTLY_CORRECT) {
+		return FALSE;
+	}
+	g_nLocalNodeId = (uint32_t) lValue;
+
+	for (int i = 2; i < argc; i++) {
+		if (EqualsNoCase(argv[i], "-v")) {
+			continue;	// handled by ParseCommandLine
+		}
+
+		if (IsRateLimitOption(argv[i])) {
+			i++;
+			continue;	// handled by ConfigureRateLimits
+		}
+
+		if (IsHeartbeatOption(argv[i])) {
+			i++;
+			continue;	// handled by ConfigureHeartbeat
+		}
+
+		if (IsAcceptorShardOption(argv[i])) {
+			i++;
+			continue;	// handled by ConfigureAcceptorShards
+		}
+
+		if (i + 1 >= argc) {
+			return FALSE;	// every other option takes a value
+		}
+
+		const char* pszValue = argv[++i];
+
+		if (EqualsNoCase(argv[i - 1], FEDERATION_NODE_OPTION)) {
+			nResult = StringToLong(pszValue, &lValue);
+			if ((nResult != OK && nResult != EXACTLY_CORRECT) || lValue <= 0
+					|| lValue > UINT32_MAX) {
+				return FALSE;
+			}
+			g_nLocalNodeId = (uint32_t) lValue;
+		} else if (EqualsNoCase(argv[i - 1], FEDERATION_PEER_PORT_OPTION)) {
+			nResult = StringToLong(pszValue, &lValue);
+			if ((nResult != OK && nResult != EXACTLY_CORRECT)
+					|| !IsUserPortNumberValid((int) lValue)) {
+				return FALSE;
+			}
+			g_nPeerPort = (int) lValue;
+		} else if (EqualsNoCase(argv[i - 1], FEDERATION_PEER_OPTION)) {
+			if (g_nPeerCount == FEDERATION_MAX_PEERS
+					|| !ParsePeerAddress(pszValue,
+							g_szPeerHosts[g_nPeerCount],
+							&(g_nPeerPorts[g_nPeerCount]))) {
+				return FALSE;
+			}
+			g_nPeerCount++;
+		} else {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetLinkedNodeIds function
+
+int GetLinkedNodeIds(uint32_t* pnNodeIds, int nMaxCount) {
+	int nCount = 0;
+
+	if (pnNodeIds == NULL || !atomic_load(&g_bFederationRunning)) {
+		return nCount;
+	}
+
+	LockMutex(g_hPeerLinkListMutex);
+	{
+		LPPOSITION pos = GetHeadPosition(g_pPeerLinkList);
+		while (pos != NULL && nCount < nMaxCount) {
+			LPPEERLINK lpLink = (LPPEERLINK) (pos->pvData);
+
+			BOOL bIsDuplicate = lpLink->bClosed || lpLink->nRemoteNodeId == 0;
+			for (int i = 0; i < nCount && !bIsDuplicate; i++) {
+				bIsDuplicate = pnNodeIds[i] == lpLink->nRemoteNodeId;
+			}
+
+			if (!bIsDuplicate) {
+				pnNodeIds[nCount++] = lpLink->nRemoteNodeId;
+			}
+
+			pos = GetNextPosition(pos);
+		}
+	}
+	UnlockMutex(g_hPeerLinkListMutex);
+
+	return nCount;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetLocalNodeId function
+
+uint32_t GetLocalNodeId() {
+	return g_nLocalNodeId;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsFederationRunning function
+
+BOOL IsFederationRunning() {
+	return atomic_load(&g_bFederationRunning) ? TRUE : FALSE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PublishRoomEvent function
+
+void PublishRoomEvent(int nType, const char* pszRoomName,
+		const char* pszNickname, const char* pszText) {
+	if (!atomic_load(&g_bFederationRunning)) {
+		return;
+	}
+
+	PEEREVENT event;
+	event.nType = nType;
+	event.nHops = 0;
+	event.nOriginNodeId = g_nLocalNodeId;
+	event.nOriginIncarnation = g_nLocalIncarnation;
+	event.pchRoomName = pszRoomName == NULL ? "" : pszRoomName;
+	event.pchNickname = pszNickname == NULL ? "" : pszNickname;
+	event.pchText = pszText == NULL ? "" : pszText;
+
+	const size_t ROOM_NAME_LENGTH = strlen(event.pchRoomName);
+	const size_t NICKNAME_LENGTH = strlen(event.pchNickname);
+	const size_t TEXT_LENGTH = strlen(event.pchText);
+
+	if (ROOM_NAME_LENGTH > UINT16_MAX || NICKNAME_LENGTH > UINT16_MAX
+			|| TEXT_LENGTH > UINT16_MAX) {
+		return;	// cannot be encoded
+	}
+
+	event.nRoomNameLength = (int) ROOM_NAME_LENGTH;
+	event.nNicknameLength = (int) NICKNAME_LENGTH;
+	event.nTextLength = (int) TEXT_LENGTH;
+
+	event.nSequence = atomic_fetch_add(&g_nNextEventSequence, 1);
+
+	RelayEvent(&event, NULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendToPeerNode function
+
+BOOL SendToPeerNode(uint32_t nNodeId, int nType, uint64_t nRequestId,
+		const char* pszNickname, const char* pszText) {
+	if (!atomic_load(&g_bFederationRunning)) {
+		return FALSE;
+	}
+
+	PEEREVENT event;
+	event.nType = nType;
+	event.nHops = 0;
+	event.nOriginNodeId = g_nLocalNodeId;
+	event.nOriginIncarnation = g_nLocalIncarnation;
+	event.nSequence = nRequestId;
+	event.pchRoomName = "";
+	event.nRoomNameLength = 0;
+	event.pchNickname = pszNickname == NULL ? "" : pszNickname;
+	event.pchText = pszText == NULL ? "" : pszText;
+
+	const size_t NICKNAME_LENGTH = strlen(event.pchNickname);
+	const size_t TEXT_LENGTH = strlen(event.pchText);
+
+	if (NICKNAME_LENGTH > UINT16_MAX || TEXT_LENGTH > UINT16_MAX) {
+		return FALSE;	// cannot be encoded
+	}
+
+	event.nNicknameLength = (int) NICKNAME_LENGTH;
+	event.nTextLength = (int) TEXT_LENGTH;
+
+	BOOL bQueued = FALSE;
+
+	LockMutex(g_hPeerLinkListMutex);
+	{
+		LPPOSITION pos = GetHeadPosition(g_pPeerLinkList);
+		while (pos != NULL && !bQueued) {
+			LPPEERLINK lpLink = (LPPEERLINK) (pos->pvData);
+
+			if (lpLink->nRemoteNodeId == nNodeId && !lpLink->bClosed) {
+				AppendEventToLink(lpLink, &event);
+				bQueued = TRUE;
+			}
+
+			pos = GetNextPosition(pos);
+		}
+	}
+	UnlockMutex(g_hPeerLinkListMutex);
+
+	return bQueued;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StartFederation function
+
+void StartFederation() {
+	if (g_nPeerPort == 0 && g_nPeerCount == 0) {
+		return;	// running on our own
+	}
+
+	if (INVALID_HANDLE_VALUE != g_hPeerLinkListMutex) {
+		return;	// already started
+	}
+
+	g_hPeerLinkListMutex = CreateMutex();
+	g_hPeerOriginMutex = CreateMutex();
+	if (INVALID_HANDLE_VALUE == g_hPeerLinkListMutex
+			|| INVALID_HANDLE_VALUE == g_hPeerOriginMutex) {
+		CleanupServer(ERROR);
+	}
+
+	/* A process that starts later, such as the one a hot restart hands
+	 * over to, has a newer incarnation, so the peers forget the sequence
+	 * numbers of this one's events when they see it */
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	g_nLocalIncarnation = (uint64_t) now.tv_sec * 1000000ULL
+			+ (uint64_t) now.tv_nsec / 1000ULL;
+
+	atomic_store(&g_nNextEventSequence, 0);
+
+	atomic_store(&g_bShouldStopFederation, 0);
+
+	CreateNicknameRing();
+
+	g_hFederationFlusherThread = CreateThread(FederationFlusherThread);
+	if (INVALID_HANDLE_VALUE == g_hFederationFlusherThread) {
+		fprintf(stderr, FAILED_LAUNCH_FEDERATION_THREAD);
+
+		CleanupServer(ERROR);
+	}
+
+	if (g_nPeerPort != 0
+			&& INVALID_HANDLE_VALUE == CreateThread(PeerAcceptorThread)) {
+		fprintf(stderr, FAILED_LAUNCH_FEDERATION_THREAD);
+
+		CleanupServer(ERROR);
+	}
+
+	for (int i = 0; i < g_nPeerCount; i++) {
+		if (INVALID_HANDLE_VALUE == CreateThreadEx(PeerConnectorThread,
+				(void*) (intptr_t) i)) {
+			fprintf(stderr, FAILED_LAUNCH_FEDERATION_THREAD);
+
+			CleanupServer(ERROR);
+		}
+	}
+
+	atomic_store(&g_bFederationRunning, 1);
+
+	/* Nicknames registered before now (for instance, by the clients taken
+	 * over in a hot restart) go on the ring too */
+	RebuildNicknameRing();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StopFederation function
+
+void StopFederation() {
+	if (INVALID_HANDLE_VALUE == g_hFederationFlusherThread) {
+		return;
+	}
+
+	atomic_store(&g_bFederationRunning, 0);
+	atomic_store(&g_bShouldStopFederation, 1);
+
+	/* The flusher thread sends what is left in the buffers on its way out */
+	WaitThread(g_hFederationFlusherThread);
+	DestroyThread(g_hFederationFlusherThread);
+
+	g_hFederationFlusherThread = INVALID_HANDLE_VALUE;
+
+	const int LISTEN_SOCKET = atomic_exchange(&g_nPeerListenSocket, -1);
+	if (LISTEN_SOCKET >= 0) {
+		shutdown(LISTEN_SOCKET, SHUT_RDWR);	// wakes the acceptor thread
+		close(LISTEN_SOCKET);
+	}
+
+	/* Shutting the sockets down wakes the threads that read them; each frees
+	 * its link when it is done with it */
+	LockMutex(g_hPeerLinkListMutex);
+	{
+		LPPOSITION pos = GetHeadPosition(g_pPeerLinkList);
+		while (pos != NULL) {
+			LPPEERLINK lpLink = (LPPEERLINK) (pos->pvData);
+
+			LockMutex(lpLink->hMutex);
+			{
+				ClosePeerLink(lpLink);
+			}
+			UnlockMutex(lpLink->hMutex);
+
+			pos = GetNextPosition(pos);
+		}
+
+		ClearList(&g_pPeerLinkList, ReleasePeerLink);
+	}
+	UnlockMutex(g_hPeerLinkListMutex);
+}
@@ -0,0 +1,487 @@
+// hashtag_manager.c - Implementations of the functions that keep track of
+// which chatters follow which hashtags, and that deliver tagged chat messages
+// to their followers.
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "client_manager.h"
+#include "client_thread_functions.h"
+#include "hashtag_manager.h"
+#include "message_scanner.h"
+#include "server_functions.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Global variables (used in this file only)
+
+/**
+ * @brief Buckets of the hashtag index.  Each bucket is a singly-linked chain
+ * of HASHTAGENTRY instances.
+ */
+LPHASHTAGENTRY g_apHashtagBuckets[HASHTAG_INDEX_BUCKET_COUNT];
+
+/**
+ * @brief Count of the entries currently in the hashtag index.
+ */
+int g_nHashtagEntryCount = 0;
+
+/**
+ * @brief Handle to the mutex that guards the hashtag index, the followed
+ * hashtags of each client, and the delivery stamps.
+ */
+HMUTEX g_hHashtagIndexMutex = INVALID_HANDLE_VALUE;
+
+/**
+ * @brief Stamp of the most recent fan-out of a message to followers.
+ */
+unsigned int g_nDeliveryStamp = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// GetHashtagBucket function
+
+unsigned int GetHashtagBucket(const char* pszHashtag) {
+	return GetStringHash(pszHashtag) & (HASHTAG_INDEX_BUCKET_COUNT - 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FindHashtagEntry function - The caller must hold the index mutex.
+
+LPHASHTAGENTRY FindHashtagEntry(const char* pszHashtag) {
+	LPHASHTAGENTRY lpEntry = g_apHashtagBuckets[GetHashtagBucket(pszHashtag)];
+
+	while (lpEntry != NULL && !Equals(lpEntry->szHashtag, pszHashtag)) {
+		lpEntry = lpEntry->pNext;
+	}
+
+	return lpEntry;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FreeHashtagEntry function
+
+void FreeHashtagEntry(LPHASHTAGENTRY lpEntry) {
+	if (lpEntry == NULL) {
+		return;
+	}
+
+	if (lpEntry->ppFollowers != NULL) {
+		free(lpEntry->ppFollowers);
+		lpEntry->ppFollowers = NULL;
+	}
+
+	free(lpEntry);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AddHashtagEntry function - Creates a new, empty entry for the hashtag and
+// links it into the index.  Returns NULL if the index is full.  The caller
+// must hold the index mutex.
+//
+
+LPHASHTAGENTRY AddHashtagEntry(const char* pszHashtag) {
+	if (g_nHashtagEntryCount == MAX_HASHTAG_COUNT) {
+		return NULL;
+	}
+
+	LPHASHTAGENTRY lpEntry = (LPHASHTAGENTRY) malloc(1 * sizeof(HASHTAGENTRY));
+	if (lpEntry == NULL) {
+		fprintf(stderr, OUT_OF_MEMORY);
+		return NULL;
+	}
+
+	memset(lpEntry, 0, 1 * sizeof(HASHTAGENTRY));
+	strcpy(lpEntry->szHashtag, pszHashtag);
+
+	const unsigned int nBucket = GetHashtagBucket(pszHashtag);
+
+	lpEntry->pNext = g_apHashtagBuckets[nBucket];
+	g_apHashtagBuckets[nBucket] = lpEntry;
+
+	g_nHashtagEntryCount++;
+
+	return lpEntry;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RemoveHashtagEntry function - Unlinks the entry from the index and frees
+// it.  The caller must hold the index mutex.
+//
+
+void RemoveHashtagEntry(LPHASHTAGENTRY lpEntry) {
+	LPHASHTAGENTRY* ppLink =
+			&g_apHashtagBuckets[GetHashtagBucket(lpEntry->szHashtag)];
+
+	while (*ppLink != NULL && *ppLink != lpEntry) {
+		ppLink = &((*ppLink)->pNext);
+	}
+
+	if (*ppLink == NULL) {
+		return;	// not in the index
+	}
+
+	*ppLink = lpEntry->pNext;
+	g_nHashtagEntryCount--;
+
+	FreeHashtagEntry(lpEntry);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AddFollower function - The caller must hold the index mutex.
+
+BOOL AddFollower(LPHASHTAGENTRY lpEntry, LPCLIENTSTRUCT lpClient) {
+	if (lpEntry->nFollowerCount == lpEntry->nFollowerCapacity) {
+		int nNewCapacity = lpEntry->nFollowerCapacity == 0
+				? HASHTAG_INITIAL_FOLLOWER_CAPACITY
+				: 2 * lpEntry->nFollowerCapacity;
+
+		LPCLIENTSTRUCT* ppNewFollowers = (LPCLIENTSTRUCT*) realloc(
+				lpEntry->ppFollowers, nNewCapacity * sizeof(LPCLIENTSTRUCT));
+		if (ppNewFollowers == NULL) {
+			fprintf(stderr, OUT_OF_MEMORY);
+			return FALSE;
+		}
+
+		lpEntry->ppFollowers = ppNewFollowers;
+		lpEntry->nFollowerCapacity = nNewCapacity;
+	}
+
+	lpEntry->ppFollowers[lpEntry->nFollowerCount++] = lpClient;
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RemoveFollowedHashtag function - Takes the client out of the followers of
+// the hashtag at index nIndex of its followed hashtags, and removes the entry
+// from the index if nobody follows it anymore.  The caller must hold the
+// index mutex.
+//
+
+void RemoveFollowedHashtag(LPCLIENTSTRUCT lpClient, int nIndex) {
+	LPHASHTAGENTRY lpEntry = lpClient->lpFollowedHashtags[nIndex];
+
+	for (int i = 0; i < lpEntry->nFollowerCount; i++) {
+		if (lpEntry->ppFollowers[i] == lpClient) {
+			lpEntry->ppFollowers[i] =
+					lpEntry->ppFollowers[--lpEntry->nFollowerCount];
+			break;
+		}
+	}
+
+	lpClient->lpFollowedHashtags[nIndex] =
+			lpClient->lpFollowedHashtags[--lpClient->nFollowedHashtagCount];
+	lpClient->lpFollowedHashtags[lpClient->nFollowedHashtagCount] = NULL;
+
+	if (lpEntry->nFollowerCount == 0) {
+		RemoveHashtagEntry(lpEntry);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FindFollowedHashtag function - Returns the index of the hashtag among the
+// hashtags the client follows, or -1 if the client does not follow it.  The
+// caller must hold the index mutex.
+//
+
+int FindFollowedHashtag(LPCLIENTSTRUCT lpClient, const char* pszHashtag) {
+	for (int i = 0; i < lpClient->nFollowedHashtagCount; i++) {
+		if (Equals(lpClient->lpFollowedHashtags[i]->szHashtag, pszHashtag)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetHashtagFromCommand function - Parses the hashtag that follows the
+// command and puts it in canonical form.  Replies to the client and returns
+// FALSE if the command can't be carried out.
+//
+
+BOOL GetHashtagFromCommand(LPCLIENTSTRUCT lpSendingClient, char* pszBuffer,
+		int nCommandLength, char* pszHashtag) {
+	if (IsNullOrWhiteSpace(lpSendingClient->pszNickname)) {
+		// Per protocol, chatters have to say who they are first
+		lpSendingClient->nBytesSent +=
+				ReplyToClient(lpSendingClient, ERROR_NO_NICK_RECEIVED);
+		return FALSE;
+	}
+
+	const int BUFFER_SIZE = strlen(pszBuffer) + 1;
+
+	char szArgument[BUFFER_SIZE];
+	memset(szArgument, 0, BUFFER_SIZE);
+
+	Trim(szArgument, BUFFER_SIZE, pszBuffer + nCommandLength);
+
+	if (!NormalizeHashtag(pszHashtag, szArgument)) {
+		lpSendingClient->nBytesSent +=
+				ReplyToClient(lpSendingClient, ERROR_HASHTAG_INVALID);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AddFollowedHashtag function - Adds the client to the followers of the
+// hashtag, which must already be in canonical form.  Returns NULL if this
+// worked (or if the client already follows it), or else the error reply to be
+// sent to the client.
+//
+
+const char* AddFollowedHashtag(LPCLIENTSTRUCT lpClient,
+		const char* pszHashtag) {
+	const char* pszErrorReply = NULL;
+
+	LockMutex(g_hHashtagIndexMutex);
+	{
+		LPHASHTAGENTRY lpEntry = NULL;
+
+		if (FindFollowedHashtag(lpClient, pszHashtag) >= 0) {
+			// Already following it; nothing to do.
+		} else if (lpClient->nFollowedHashtagCount == MAX_FOLLOWED_HASHTAGS) {
+			pszErrorReply = ERROR_TOO_MANY_FOLLOWED_HASHTAGS;
+		} else if ((lpEntry = FindHashtagEntry(pszHashtag)) == NULL
+				&& (lpEntry = AddHashtagEntry(pszHashtag)) == NULL) {
+			pszErrorReply = ERROR_HASHTAG_LIMIT_REACHED;
+		} else if (!AddFollower(lpEntry, lpClient)) {
+			if (lpEntry->nFollowerCount == 0) {
+				RemoveHashtagEntry(lpEntry);
+			}
+
+			pszErrorReply = ERROR_HASHTAG_LIMIT_REACHED;
+		} else {
+			lpClient->lpFollowedHashtags[
+					lpClient->nFollowedHashtagCount++] = lpEntry;
+		}
+	}
+	UnlockMutex(g_hHashtagIndexMutex);
+
+	return pszErrorReply;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateHashtagIndex function
+
+void CreateHashtagIndex() {
+	if (INVALID_HANDLE_VALUE != g_hHashtagIndexMutex) {
+		return;
+	}
+
+	memset(g_apHashtagBuckets, 0, sizeof(g_apHashtagBuckets));
+	g_nHashtagEntryCount = 0;
+
+	g_hHashtagIndexMutex = CreateMutex();
+	if (INVALID_HANDLE_VALUE == g_hHashtagIndexMutex) {
+		CleanupServer(ERROR);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DeliverToHashtagFollowers function
+
+int DeliverToHashtagFollowers(LPMESSAGETOKENS lpTokens,
+		const char* pszMessage, LPCLIENTSTRUCT lpSendingClient) {
+	int nTotalBytesSent = 0;
+
+	if (lpTokens == NULL || lpTokens->nHashtagCount == 0) {
+		return nTotalBytesSent;	// No hashtags; nothing to do.
+	}
+
+	if (IsNullOrWhiteSpace(pszMessage) || lpSendingClient == NULL) {
+		return nTotalBytesSent;
+	}
+
+	LockMutex(g_hHashtagIndexMutex);
+	{
+		/* Followers are stamped as they are sent the message, so that those
+		 * who follow more than one of its hashtags only get it once. */
+		if (++g_nDeliveryStamp == 0) {
+			++g_nDeliveryStamp;
+		}
+
+		for (int i = 0; i < lpTokens->nHashtagCount; i++) {
+			LPHASHTAGENTRY lpEntry = FindHashtagEntry(lpTokens->szHashtags[i]);
+			if (lpEntry == NULL) {
+				continue;	// nobody follows this hashtag
+			}
+
+			for (int j = 0; j < lpEntry->nFollowerCount; j++) {
+				LPCLIENTSTRUCT lpFollower = lpEntry->ppFollowers[j];
+
+				// Members of the sender's room have gotten it already.
+				if (lpFollower == lpSendingClient
+						|| lpFollower->lpRoom == lpSendingClient->lpRoom
+						|| lpFollower->nDeliveryStamp == g_nDeliveryStamp) {
+					continue;
+				}
+
+				lpFollower->nDeliveryStamp = g_nDeliveryStamp;
+
+				int nBytesSent = 0;
+
+				if ((nBytesSent = SendToClient(lpFollower, pszMessage)) > 0) {
+					nTotalBytesSent += nBytesSent;
+				}
+			}
+		}
+	}
+	UnlockMutex(g_hHashtagIndexMutex);
+
+	return nTotalBytesSent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DestroyHashtagIndex function
+
+void DestroyHashtagIndex() {
+	if (INVALID_HANDLE_VALUE == g_hHashtagIndexMutex) {
+		return;
+	}
+
+	LockMutex(g_hHashtagIndexMutex);
+	{
+		for (int i = 0; i < HASHTAG_INDEX_BUCKET_COUNT; i++) {
+			while (g_apHashtagBuckets[i] != NULL) {
+				LPHASHTAGENTRY lpEntry = g_apHashtagBuckets[i];
+				g_apHashtagBuckets[i] = lpEntry->pNext;
+
+				FreeHashtagEntry(lpEntry);
+			}
+		}
+
+		g_nHashtagEntryCount = 0;
+	}
+	UnlockMutex(g_hHashtagIndexMutex);
+
+	DestroyMutex(g_hHashtagIndexMutex);
+	g_hHashtagIndexMutex = INVALID_HANDLE_VALUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FollowHashtag function
+
+BOOL FollowHashtag(LPCLIENTSTRUCT lpClient, const char* pszHashtag) {
+	char szHashtag[MAX_HASHTAG_LEN + 1];
+	memset(szHashtag, 0, MAX_HASHTAG_LEN + 1);
+
+	if (lpClient == NULL || !NormalizeHashtag(szHashtag, pszHashtag)) {
+		return FALSE;
+	}
+
+	return AddFollowedHashtag(lpClient, szHashtag) == NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ProcessFollowCommand function
+
+BOOL ProcessFollowCommand(LPCLIENTSTRUCT lpSendingClient, char* pszBuffer) {
+	if (lpSendingClient == NULL) {
+		ThrowNullReferenceException();
+	}
+
+	if (IsNullOrWhiteSpace(pszBuffer)) {
+		ThrowNullReferenceException();
+	}
+
+	char szHashtag[MAX_HASHTAG_LEN + 1];
+	memset(szHashtag, 0, MAX_HASHTAG_LEN + 1);
+
+	if (!GetHashtagFromCommand(lpSendingClient, pszBuffer,
+			strlen(PROTOCOL_FOLLOW_COMMAND), szHashtag)) {
+		return TRUE;	// command handled but error occurred
+	}
+
+	const char* pszErrorReply = AddFollowedHashtag(lpSendingClient, szHashtag);
+	if (pszErrorReply != NULL) {
+		lpSendingClient->nBytesSent +=
+				ReplyToClient(lpSendingClient, pszErrorReply);
+		return TRUE;	// command handled but error occurred
+	}
+
+	char szReplyBuffer[BUFLEN];
+	memset(szReplyBuffer, 0, BUFLEN);
+
+	sprintf(szReplyBuffer, OK_HASHTAG_FOLLOWED, szHashtag);
+
+	lpSendingClient->nBytesSent +=
+			ReplyToClient(lpSendingClient, szReplyBuffer);
+
+	return TRUE;	// command handled successfully
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ProcessUnfollowCommand function
+
+BOOL ProcessUnfollowCommand(LPCLIENTSTRUCT lpSendingClient, char* pszBuffer) {
+	if (lpSendingClient == NULL) {
+		ThrowNullReferenceException();
+	}
+
+	if (IsNullOrWhiteSpace(pszBuffer)) {
+		ThrowNullReferenceException();
+	}
+
+	char szHashtag[MAX_HASHTAG_LEN + 1];
+	memset(szHashtag, 0, MAX_HASHTAG_LEN + 1);
+
+	if (!GetHashtagFromCommand(lpSendingClient, pszBuffer,
+			strlen(PROTOCOL_UNFOLLOW_COMMAND), szHashtag)) {
+		return TRUE;	// command handled but error occurred
+	}
+
+	BOOL bWasFollowing = FALSE;
+
+	LockMutex(g_hHashtagIndexMutex);
+	{
+		int nIndex = FindFollowedHashtag(lpSendingClient, szHashtag);
+		if (nIndex >= 0) {
+			RemoveFollowedHashtag(lpSendingClient, nIndex);
+			bWasFollowing = TRUE;
+		}
+	}
+	UnlockMutex(g_hHashtagIndexMutex);
+
+	if (!bWasFollowing) {
+		lpSendingClient->nBytesSent +=
+				ReplyToClient(lpSendingClient, ERROR_NOT_FOLLOWING_HASHTAG);
+		return TRUE;	// command handled but error occurred
+	}
+
+	char szReplyBuffer[BUFLEN];
+	memset(szReplyBuffer, 0, BUFLEN);
+
+	sprintf(szReplyBuffer, OK_HASHTAG_UNFOLLOWED, szHashtag);
+
+	lpSendingClient->nBytesSent +=
+			ReplyToClient(lpSendingClient, szReplyBuffer);
+
+	return TRUE;	// command handled successfully
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// UnfollowAllHashtags function
+
+void UnfollowAllHashtags(LPCLIENTSTRUCT lpClient) {
+	if (lpClient == NULL || lpClient->nFollowedHashtagCount == 0) {
+		return;
+	}
+
+	LockMutex(g_hHashtagIndexMutex);
+	{
+		while (lpClient->nFollowedHashtagCount > 0) {
+			RemoveFollowedHashtag(lpClient,
+					lpClient->nFollowedHashtagCount - 1);
+		}
+	}
+	UnlockMutex(g_hHashtagIndexMutex);
+}
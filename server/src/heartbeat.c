@@ -0,0 +1,388 @@
+// heartbeat.c - Implementation of the PING/PONG heartbeat
+//
+// The heartbeat timer of a client is on the timing wheel of the client's
+// thread, alongside its timeouts.  Each time it expires with no PING
+// outstanding, a PING is sent and the timer is armed for the heartbeat
+// timeout; the PONG, which is handled on the same thread, re-arms it for the
+// next PING.  If the timer expires with the PING still outstanding, the
+// client's thread disconnects it, as for any of its other timeouts.
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "binary_protocol.h"
+#include "client_struct.h"
+#include "client_thread_functions.h"
+#include "heartbeat.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Global variables (used in this file only)
+
+/**
+ * @brief Time between PINGs, and time a client has to answer one, in
+ * milliseconds.  Set from the command line before any client connects, and
+ * only read after that.
+ */
+static long g_nPingIntervalMs = HEARTBEAT_DEFAULT_INTERVAL_SECONDS * 1000L;
+static long g_nPingTimeoutMs = HEARTBEAT_DEFAULT_TIMEOUT_SECONDS * 1000L;
+
+/**
+ * @brief Counts of the PINGs sent to, and answered by, all of the clients.
+ */
+atomic_ullong g_nPingsSentCount = 0;
+atomic_ullong g_nPongsReceivedCount = 0;
+
+/**
+ * @brief Histogram of the round-trip times of all of the clients.
+ */
+atomic_ullong g_anRttBuckets[HEARTBEAT_RTT_BUCKET_COUNT];
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// GetMonotonicMicroseconds function - Gets the time on a clock that is not
+// affected by changes to the wall-clock time.  Round trips on a LAN take well
+// under a millisecond, so they are timed in microseconds.
+//
+
+uint64_t GetMonotonicMicroseconds() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000ULL
+			+ (uint64_t) now.tv_nsec / 1000ULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetRttBucket function - Works out which bucket of a histogram counts a
+// round-trip time.
+//
+
+int GetRttBucket(uint64_t nRttMicroseconds) {
+	uint64_t nMilliseconds = nRttMicroseconds / 1000ULL;
+
+	int nBucket = 0;
+
+	while (nMilliseconds > 0 && nBucket < HEARTBEAT_RTT_BUCKET_COUNT - 1) {
+		nMilliseconds >>= 1;
+		nBucket++;
+	}
+
+	return nBucket;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FormatRttHistogram function - Writes out the buckets of a histogram that
+// are not empty, as " <1ms:12 <2ms:3 >=16384ms:1", into a buffer.
+//
+
+void FormatRttHistogram(const unsigned long long* pnBuckets, char* pszBuffer,
+		size_t nBufferSize) {
+	size_t nLength = 0;
+
+	pszBuffer[0] = '\0';
+
+	for (int i = 0; i < HEARTBEAT_RTT_BUCKET_COUNT && nLength < nBufferSize;
+			i++) {
+		if (pnBuckets[i] == 0) {
+			continue;
+		}
+
+		int nWritten = 0;
+
+		if (i < HEARTBEAT_RTT_BUCKET_COUNT - 1) {
+			nWritten = snprintf(pszBuffer + nLength, nBufferSize - nLength,
+					" <%lums:%llu", 1UL << i, pnBuckets[i]);
+		} else {
+			nWritten = snprintf(pszBuffer + nLength, nBufferSize - nLength,
+					" >=%lums:%llu", 1UL << (i - 1), pnBuckets[i]);
+		}
+
+		if (nWritten < 0) {
+			break;
+		}
+
+		nLength += (size_t) nWritten;
+	}
+
+	if (nLength == 0) {
+		snprintf(pszBuffer, nBufferSize, " none");
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RecordRoundTrip function - Adds a round-trip time to a client's statistics
+// and to the histogram of all the clients.
+//
+
+void RecordRoundTrip(LPRTTSTATS lpStats, uint64_t nRttMicroseconds) {
+	const double RTT_MS = (double) nRttMicroseconds / 1000.0;
+
+	if (lpStats->nSampleCount == 0) {
+		lpStats->dSmoothedMs = RTT_MS;
+		lpStats->dMinimumMs = RTT_MS;
+		lpStats->dMaximumMs = RTT_MS;
+	} else {
+		lpStats->dSmoothedMs += HEARTBEAT_RTT_EWMA_WEIGHT
+				* (RTT_MS - lpStats->dSmoothedMs);
+
+		if (RTT_MS < lpStats->dMinimumMs) {
+			lpStats->dMinimumMs = RTT_MS;
+		}
+
+		if (RTT_MS > lpStats->dMaximumMs) {
+			lpStats->dMaximumMs = RTT_MS;
+		}
+	}
+
+	lpStats->nSampleCount++;
+
+	const int BUCKET = GetRttBucket(nRttMicroseconds);
+
+	lpStats->anBuckets[BUCKET]++;
+
+	atomic_fetch_add(&g_anRttBuckets[BUCKET], 1);
+	atomic_fetch_add(&g_nPongsReceivedCount, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendPing function - Sends a client the next PING.  Clients that speak the
+// binary protocol get it as a frame of its own.
+//
+
+void SendPing(LPCLIENTSTRUCT lpClient) {
+	lpClient->nPingSequence++;
+
+	int nBytesSent = 0;
+
+	if (lpClient->bBinaryProtocol) {
+		char szSequence[16];
+		snprintf(szSequence, sizeof(szSequence), "%u",
+				lpClient->nPingSequence);
+
+		/* This is the client's own thread, so it may write to the socket
+		 * itself */
+		nBytesSent = SendFrameToClient(lpClient->nSocket, BINARY_OP_PING,
+				szSequence);
+	} else {
+		char szPing[32];
+		snprintf(szPing, sizeof(szPing), PROTOCOL_PING_FORMAT,
+				lpClient->nPingSequence);
+
+		nBytesSent = SendToClient(lpClient, szPing);
+	}
+
+	/* A failed send is not acted on here; if the client has gone, the PING
+	 * goes unanswered, and the client is disconnected for that */
+	if (nBytesSent > 0) {
+		lpClient->nBytesSent += nBytesSent;
+	}
+
+	lpClient->nPingSentAt = GetMonotonicMicroseconds();
+
+	atomic_fetch_add(&g_nPingsSentCount, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// OnHeartbeatTimer function - Timer routine that sends a client its next
+// PING, or, if the last one has not been answered, has it disconnected.
+//
+
+void OnHeartbeatTimer(LPTIMER lpTimer, void* pvClient) {
+	LPCLIENTSTRUCT lpClient = (LPCLIENTSTRUCT) pvClient;
+
+	if (lpClient->nPingSentAt != 0) {
+		lpClient->nExpiredTimeout = TIMEOUT_KIND_HEARTBEAT;
+		return;
+	}
+
+	if (!lpClient->bConnected) {
+		/* Nothing is sent to a client before it says HELO; the handshake
+		 * timeout looks after the ones that never do */
+		ArmTimer(lpClient->lpTimerWheel, lpTimer, g_nPingIntervalMs,
+				OnHeartbeatTimer, lpClient);
+		return;
+	}
+
+	SendPing(lpClient);
+
+	ArmTimer(lpClient->lpTimerWheel, lpTimer, g_nPingTimeoutMs,
+			OnHeartbeatTimer, lpClient);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// ConfigureHeartbeat function
+
+BOOL ConfigureHeartbeat(int argc, char* argv[]) {
+	if (argc < MIN_NUM_ARGS || argv == NULL) {
+		return FALSE;
+	}
+
+	for (int i = 2; i < argc; i++) {
+		if (!IsHeartbeatOption(argv[i])) {
+			continue;	// checked by the other parsers
+		}
+
+		if (i + 1 >= argc) {
+			return FALSE;
+		}
+
+		const char* pszOption = argv[i];
+
+		long lValue = 0;
+		int nResult = StringToLong(argv[++i], &lValue);
+		if ((nResult != OK && nResult != EXACTLY_CORRECT) || lValue < 0) {
+			return FALSE;
+		}
+
+		if (EqualsNoCase(pszOption, HEARTBEAT_INTERVAL_OPTION)) {
+			g_nPingIntervalMs = lValue * 1000L;
+		} else if (lValue > 0) {
+			g_nPingTimeoutMs = lValue * 1000L;
+		} else {
+			return FALSE;	// no client could ever answer in time
+		}
+	}
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsHeartbeatOption function
+
+BOOL IsHeartbeatOption(const char* pszOption) {
+	return EqualsNoCase(pszOption, HEARTBEAT_INTERVAL_OPTION)
+			|| EqualsNoCase(pszOption, HEARTBEAT_TIMEOUT_OPTION);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsHeartbeatReply function
+
+BOOL IsHeartbeatReply(const char* pszBuffer) {
+	return !IsNullOrWhiteSpace(pszBuffer)
+			&& StartsWith(pszBuffer, PROTOCOL_PONG_COMMAND);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ProcessPongCommand function
+
+BOOL ProcessPongCommand(LPCLIENTSTRUCT lpSendingClient,
+		const char* pszBuffer) {
+	if (lpSendingClient == NULL || IsNullOrWhiteSpace(pszBuffer)) {
+		return TRUE;
+	}
+
+	if (lpSendingClient->nPingSentAt == 0) {
+		return TRUE;	// no PING is outstanding; nothing to do
+	}
+
+	const char* pszSequence = pszBuffer + strlen(PROTOCOL_PONG_COMMAND);
+
+	char* pszEnd = NULL;
+	const unsigned long SEQUENCE = strtoul(pszSequence, &pszEnd, 10);
+
+	/* An answer to a PING before the last one is late, and says nothing
+	 * about whether the client is still there now */
+	if (pszEnd == pszSequence
+			|| SEQUENCE != (unsigned long) lpSendingClient->nPingSequence) {
+		return TRUE;
+	}
+
+	const uint64_t NOW = GetMonotonicMicroseconds();
+
+	RecordRoundTrip(&(lpSendingClient->rttStats),
+			NOW > lpSendingClient->nPingSentAt
+					? NOW - lpSendingClient->nPingSentAt : 0);
+
+	lpSendingClient->nPingSentAt = 0;
+
+	if (lpSendingClient->lpTimerWheel != NULL) {
+		ArmTimer(lpSendingClient->lpTimerWheel,
+				&(lpSendingClient->heartbeatTimer), g_nPingIntervalMs,
+				OnHeartbeatTimer, lpSendingClient);
+	}
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReportHeartbeatStats function
+
+void ReportHeartbeatStats() {
+	unsigned long long anBuckets[HEARTBEAT_RTT_BUCKET_COUNT];
+
+	for (int i = 0; i < HEARTBEAT_RTT_BUCKET_COUNT; i++) {
+		anBuckets[i] = atomic_load(&g_anRttBuckets[i]);
+	}
+
+	char szHistogram[BUFLEN];
+	FormatRttHistogram(anBuckets, szHistogram, sizeof(szHistogram));
+
+	const unsigned long long SENT = atomic_load(&g_nPingsSentCount);
+	const unsigned long long ANSWERED = atomic_load(&g_nPongsReceivedCount);
+
+	fprintf(stdout, HEARTBEAT_STATS, SENT, ANSWERED, szHistogram);
+
+	if (GetLogFileHandle() != stdout) {
+		LogInfo(HEARTBEAT_STATS, SENT, ANSWERED, szHistogram);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReportRttStats function
+
+void ReportRttStats(LPCLIENTSTRUCT lpClient, const char* pszClientID) {
+	if (lpClient == NULL || lpClient->rttStats.nSampleCount == 0) {
+		return;
+	}
+
+	const LPRTTSTATS lpStats = &(lpClient->rttStats);
+
+	char szHistogram[BUFLEN];
+	FormatRttHistogram(lpStats->anBuckets, szHistogram, sizeof(szHistogram));
+
+	fprintf(stdout, HEARTBEAT_SESSION_STATS, pszClientID,
+			lpStats->dSmoothedMs, lpStats->dMinimumMs, lpStats->dMaximumMs,
+			lpStats->nSampleCount, szHistogram);
+
+	if (GetLogFileHandle() != stdout) {
+		LogInfo(HEARTBEAT_SESSION_STATS, pszClientID, lpStats->dSmoothedMs,
+				lpStats->dMinimumMs, lpStats->dMaximumMs,
+				lpStats->nSampleCount, szHistogram);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StartClientHeartbeat function
+
+void StartClientHeartbeat(LPCLIENTSTRUCT lpClient) {
+	if (lpClient == NULL || lpClient->lpTimerWheel == NULL) {
+		return;
+	}
+
+	if (g_nPingIntervalMs <= 0) {
+		return;	// the heartbeat is turned off
+	}
+
+	lpClient->nPingSentAt = 0;
+
+	ArmTimer(lpClient->lpTimerWheel, &(lpClient->heartbeatTimer),
+			g_nPingIntervalMs, OnHeartbeatTimer, lpClient);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StopClientHeartbeat function
+
+void StopClientHeartbeat(LPCLIENTSTRUCT lpClient) {
+	if (lpClient == NULL) {
+		return;
+	}
+
+	CancelTimer(&(lpClient->heartbeatTimer));
+}
@@ -0,0 +1,113 @@
+// history_ring.c - Provides implementations of functions that manipulate a
+// HISTORYRING instance (HISTORYRING is a structure that keeps the most recent
+// chat messages of a room).
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "history_ring.h"
+#include "message_buffer.h"
+#include "server_functions.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// AddToHistoryRing function
+
+void AddToHistoryRing(LPHISTORYRING lpRing, LPMESSAGEBUFFER lpBuffer) {
+	if (lpRing == NULL || lpBuffer == NULL) {
+		return;
+	}
+
+	AddMessageBufferRef(lpBuffer);
+
+	LPMESSAGEBUFFER lpOldestBuffer = NULL;
+
+	LockMutex(lpRing->hMutex);
+	{
+		lpOldestBuffer = lpRing->lpEntries[lpRing->nNext];
+
+		lpRing->lpEntries[lpRing->nNext] = lpBuffer;
+		lpRing->nNext = (lpRing->nNext + 1) % HISTORY_RING_CAPACITY;
+
+		if (lpRing->nCount < HISTORY_RING_CAPACITY) {
+			lpRing->nCount++;
+		}
+	}
+	UnlockMutex(lpRing->hMutex);
+
+	/* Release the message that was pushed out (if any) outside of the lock,
+	 * since this may free it. */
+	ReleaseMessageBuffer(lpOldestBuffer);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DestroyHistoryRing function
+
+void DestroyHistoryRing(LPHISTORYRING lpRing) {
+	if (lpRing == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < HISTORY_RING_CAPACITY; i++) {
+		ReleaseMessageBuffer(lpRing->lpEntries[i]);
+		lpRing->lpEntries[i] = NULL;
+	}
+
+	lpRing->nNext = 0;
+	lpRing->nCount = 0;
+
+	if (INVALID_HANDLE_VALUE != lpRing->hMutex) {
+		DestroyMutex(lpRing->hMutex);
+		lpRing->hMutex = INVALID_HANDLE_VALUE;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetRecentHistory function
+
+int GetRecentHistory(LPHISTORYRING lpRing, LPMESSAGEBUFFER* lpBuffers,
+		int nMaxCount) {
+	if (lpRing == NULL || lpBuffers == NULL || nMaxCount <= 0) {
+		return 0;
+	}
+
+	int nCount = 0;
+
+	LockMutex(lpRing->hMutex);
+	{
+		nCount = MinimumOf(lpRing->nCount, nMaxCount);
+
+		/* The oldest message we want is nCount entries behind the next
+		 * free entry. */
+		int nIndex = (lpRing->nNext - nCount + HISTORY_RING_CAPACITY)
+				% HISTORY_RING_CAPACITY;
+
+		for (int i = 0; i < nCount; i++) {
+			lpBuffers[i] = lpRing->lpEntries[nIndex];
+			AddMessageBufferRef(lpBuffers[i]);
+
+			nIndex = (nIndex + 1) % HISTORY_RING_CAPACITY;
+		}
+	}
+	UnlockMutex(lpRing->hMutex);
+
+	return nCount;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// InitializeHistoryRing function
+
+void InitializeHistoryRing(LPHISTORYRING lpRing) {
+	if (lpRing == NULL) {
+		return;
+	}
+
+	memset(lpRing->lpEntries, 0, sizeof(lpRing->lpEntries));
+	lpRing->nNext = 0;
+	lpRing->nCount = 0;
+
+	lpRing->hMutex = CreateMutex();
+	if (INVALID_HANDLE_VALUE == lpRing->hMutex) {
+		CleanupServer(ERROR);
+	}
+}
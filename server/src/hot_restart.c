@@ -0,0 +1,820 @@
+// hot_restart.c - Implementation of hot restarts, in which the running server
+// hands its listening socket and its clients over to a newly exec'd server
+// process.
+//
+// The old process stops every thread from reading its socket, closes its
+// message logs, and starts the new process with one end of a Unix socket
+// pair.  It then sends the listening socket and, for each client, the socket
+// and serialized state over the pair (the sockets travel as SCM_RIGHTS
+// ancillary data).  Once the new process says it has taken everything over,
+// the old one exits without saying goodbye to anybody; since the new process
+// holds its own descriptors for the sockets, no connection is closed.
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "acceptor_shards.h"
+#include "admission.h"
+#include "client_thread_functions.h"
+#include "compression.h"
+#include "hashtag_manager.h"
+#include "hot_restart.h"
+#include "mat_functions.h"
+#include "message_log.h"
+#include "nickname_manager.h"
+#include "room_manager.h"
+#include "server_functions.h"
+#include "shutdown.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Global variables (used in this file only)
+
+/**
+ * @brief Path to this program's executable, as of when it was started.
+ */
+char g_szExecutablePath[PATH_MAX] = "";
+
+/**
+ * @brief The command-line arguments this process was started with.
+ */
+char** g_ppszArguments = NULL;
+
+/**
+ * @brief Pipe to which the SIGUSR2 handler writes a byte, to wake up the hot
+ * restart thread.
+ */
+int g_nHotRestartSignalPipe[2] = { -1, -1 };
+
+/**
+ * @brief Pipe that has a byte in it while the threads are to stop reading
+ * their sockets.  The threads poll its read end along with their sockets.
+ */
+int g_nQuiescePipe[2] = { -1, -1 };
+
+/**
+ * @brief Flag that is set while the threads are to stay stopped.
+ */
+atomic_int g_bThreadsQuiesced = 0;
+
+/**
+ * @brief Count of threads that have stopped reading their sockets.
+ */
+atomic_int g_nParkedThreadCount = 0;
+
+/**
+ * @brief Handle to the thread that carries out hot restarts.
+ */
+HTHREAD g_hHotRestartThread = INVALID_HANDLE_VALUE;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// HotRestartSignalHandler function - Called when the process is sent
+// SIGUSR2.  Only wakes the hot restart thread, since hardly anything else is
+// safe to do inside a signal handler.
+//
+
+void HotRestartSignalHandler(int signum) {
+	const int nSavedErrno = errno;
+
+	const char chSignal = (char) signum;
+	if (write(g_nHotRestartSignalPipe[1], &chSignal, 1) < 0) {
+		// Nothing can be done about it here.
+	}
+
+	errno = nSavedErrno;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsClientHandedOff function - Callback that determines whether a client on
+// the list of clients still has its connection and a thread reading it.  Only
+// those clients park, and are handed off; one that was turned away, such as
+// at HELO, has had its socket closed and its thread stopped, but may not
+// have been taken off the list yet.
+//
+
+BOOL IsClientHandedOff(void* pvClientStruct) {
+	LPCLIENTSTRUCT lpClient = (LPCLIENTSTRUCT) pvClientStruct;
+
+	return lpClient != NULL && IsSocketValid(lpClient->nSocket)
+			&& !atomic_load(&(lpClient->bStopRequested));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ParkThread function - Holds the calling thread until the threads are no
+// longer quiesced.  If the hot restart succeeds, the process exits while the
+// thread is still held here.
+//
+
+void ParkThread() {
+	atomic_fetch_add(&g_nParkedThreadCount, 1);
+
+	while (atomic_load(&g_bThreadsQuiesced)) {
+		usleep(HOT_RESTART_POLL_INTERVAL_MS * 1000);
+	}
+
+	atomic_fetch_sub(&g_nParkedThreadCount, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetThreadCountToPark function - Gets how many threads must park before a
+// hot restart can go on.  Every client that is still connected has a thread
+// that reads its socket...
+//
+
+int GetThreadCountToPark() {
+	int nCount = 0;
+
+	LockMutex(GetClientListMutex());
+	{
+		nCount = GetElementCountWhere(g_pClientList, IsClientHandedOff);
+	}
+	UnlockMutex(GetClientListMutex());
+
+	/* ...as does each acceptor shard, the first of which is the master
+	 * acceptor thread */
+	if (INVALID_HANDLE_VALUE != GetMasterThreadHandle()) {
+		nCount += GetAcceptorShardCount();
+	}
+
+	return nCount;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// QuiesceThreads function - Tells every thread to stop reading its socket,
+// and waits until they all have.  Returns FALSE if some of them had not after
+// HOT_RESTART_QUIESCE_TIMEOUT_MS.
+//
+
+BOOL QuiesceThreads() {
+	atomic_store(&g_bThreadsQuiesced, 1);
+
+	const char chQuiesce = 1;
+	if (write(g_nQuiescePipe[1], &chQuiesce, 1) < 0) {
+		return FALSE;
+	}
+
+	for (int nWaited = 0; nWaited < HOT_RESTART_QUIESCE_TIMEOUT_MS;
+			nWaited += HOT_RESTART_POLL_INTERVAL_MS) {
+		if (atomic_load(&g_nParkedThreadCount) >= GetThreadCountToPark()) {
+			return TRUE;
+		}
+
+		usleep(HOT_RESTART_POLL_INTERVAL_MS * 1000);
+	}
+
+	return FALSE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ResumeThreads function - Lets the threads go back to reading their sockets.
+// The pipe is drained before the flag is cleared, so that a thread never
+// finds the flag cleared but the pipe still readable and spins.
+//
+
+void ResumeThreads() {
+	char chQuiesce = 0;
+	while (read(g_nQuiescePipe[0], &chQuiesce, 1) > 0) {
+		// drain the pipe; its read end is non-blocking
+	}
+
+	atomic_store(&g_bThreadsQuiesced, 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SetCloseOnExec function - Keeps the new server process from inheriting a
+// descriptor; it gets its own over the handoff channel instead.
+//
+
+void SetCloseOnExec(int nFd) {
+	const int nFlags = fcntl(nFd, F_GETFD);
+	if (nFlags >= 0) {
+		fcntl(nFd, F_SETFD, nFlags | FD_CLOEXEC);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendHandoffMessage function - Sends one message over the handoff channel,
+// with the file descriptor nFd attached to it as SCM_RIGHTS ancillary data.
+//
+
+BOOL SendHandoffMessage(int nChannel, const void* pvData, size_t nSize,
+		int nFd) {
+	struct iovec iov;
+	iov.iov_base = (void*) pvData;
+	iov.iov_len = nSize;
+
+	char controlBuffer[CMSG_SPACE(sizeof(int))];
+	memset(controlBuffer, 0, sizeof(controlBuffer));
+
+	struct msghdr message;
+	memset(&message, 0, sizeof(struct msghdr));
+
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = controlBuffer;
+	message.msg_controllen = sizeof(controlBuffer);
+
+	struct cmsghdr* pControl = CMSG_FIRSTHDR(&message);
+	pControl->cmsg_level = SOL_SOCKET;
+	pControl->cmsg_type = SCM_RIGHTS;
+	pControl->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(pControl), &nFd, sizeof(int));
+
+	ssize_t nBytesSent = 0;
+	do {
+		nBytesSent = sendmsg(nChannel, &message, MSG_NOSIGNAL);
+	} while (nBytesSent < 0 && errno == EINTR);
+
+	return nBytesSent == (ssize_t) nSize;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReceiveHandoffMessage function - Receives one message, of exactly nSize
+// bytes, from the handoff channel, along with the file descriptor attached to
+// it.
+//
+
+BOOL ReceiveHandoffMessage(int nChannel, void* pvData, size_t nSize,
+		int* pnFd) {
+	struct iovec iov;
+	iov.iov_base = pvData;
+	iov.iov_len = nSize;
+
+	char controlBuffer[CMSG_SPACE(sizeof(int))];
+	memset(controlBuffer, 0, sizeof(controlBuffer));
+
+	struct msghdr message;
+	memset(&message, 0, sizeof(struct msghdr));
+
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = controlBuffer;
+	message.msg_controllen = sizeof(controlBuffer);
+
+	ssize_t nBytesReceived = 0;
+	do {
+		nBytesReceived = recvmsg(nChannel, &message, MSG_CMSG_CLOEXEC);
+	} while (nBytesReceived < 0 && errno == EINTR);
+
+	if (nBytesReceived != (ssize_t) nSize
+			|| (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0) {
+		return FALSE;
+	}
+
+	struct cmsghdr* pControl = CMSG_FIRSTHDR(&message);
+	if (pControl == NULL || pControl->cmsg_level != SOL_SOCKET
+			|| pControl->cmsg_type != SCM_RIGHTS) {
+		return FALSE;
+	}
+
+	/* MSG_CMSG_CLOEXEC has already kept the descriptor from leaking into
+	 * the process started by a later hot restart, which is sent its own */
+	memcpy(pnFd, CMSG_DATA(pControl), sizeof(int));
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SerializeClient function - Fills in the handoff record for a client.  The
+// client's thread is parked, so its state cannot change underneath us.
+//
+
+void SerializeClient(LPCLIENTSTRUCT lpClient, LPHOTRESTARTCLIENT lpRecord) {
+	memset(lpRecord, 0, sizeof(HOTRESTARTCLIENT));
+
+	/* Connection IDs are only unique within a process, so the new process
+	 * hands out its own; the UUID label, if the client has one, goes along */
+	const char* pszUUIDLabel = atomic_load(&(lpClient->pszUUIDLabel));
+	if (pszUUIDLabel != NULL) {
+		strncpy(lpRecord->szUUIDLabel, pszUUIDLabel,
+				CLIENT_UUID_LABEL_SIZE - 1);
+	}
+
+	strncpy(lpRecord->szIPAddress, lpClient->szIPAddress, IPADDRLEN - 1);
+
+	if (!IsNullOrWhiteSpace(lpClient->pszNickname)) {
+		strncpy(lpRecord->szNickname, lpClient->pszNickname,
+				MAX_NICKNAME_LEN);
+	}
+
+	if (lpClient->lpRoom != NULL) {
+		strncpy(lpRecord->szRoomName, lpClient->lpRoom->szName,
+				MAX_ROOM_NAME_LEN);
+	}
+
+	strncpy(lpRecord->szDmRecipient, lpClient->szDmRecipient,
+			MAX_NICKNAME_LEN);
+
+	strncpy(lpRecord->szChatMessage,
+			GetAssembledMessage(&(lpClient->chatMessage)),
+			CHAT_MESSAGE_MAX_LENGTH);
+	lpRecord->nChatMessageFault =
+			GetMessageAssemblyFault(&(lpClient->chatMessage));
+
+	for (int i = 0; i < lpClient->nFollowedHashtagCount; i++) {
+		strncpy(lpRecord->szFollowedHashtags[i],
+				lpClient->lpFollowedHashtags[i]->szHashtag, MAX_HASHTAG_LEN);
+	}
+
+	lpRecord->nFollowedHashtagCount = lpClient->nFollowedHashtagCount;
+	lpRecord->nBytesReceived = lpClient->nBytesReceived;
+	lpRecord->nBytesSent = lpClient->nBytesSent;
+	lpRecord->bConnected = lpClient->bConnected;
+	lpRecord->bMuted = lpClient->bMuted;
+	lpRecord->bBinaryProtocol = lpClient->bBinaryProtocol;
+	lpRecord->bDeflate = (lpClient->lpDeflateStream != NULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DeserializeClient function - Makes a client out of a handoff record and
+// the socket that came with it, putting it back into its room and restoring
+// its nickname and hashtags.  Nothing is sent to anybody.
+//
+
+LPCLIENTSTRUCT DeserializeClient(LPHOTRESTARTCLIENT lpRecord, int nSocket) {
+	lpRecord->szIPAddress[IPADDRLEN - 1] = '\0';
+
+	LPCLIENTSTRUCT lpClient = CreateClientStruct(nSocket,
+			lpRecord->szIPAddress, -1);
+
+	CountAdmittedConnection(lpRecord->szIPAddress);
+
+	lpRecord->szUUIDLabel[CLIENT_UUID_LABEL_SIZE - 1] = '\0';
+	SetClientUUIDLabel(lpClient, lpRecord->szUUIDLabel);
+
+	lpClient->nBytesReceived = lpRecord->nBytesReceived;
+	lpClient->nBytesSent = lpRecord->nBytesSent;
+	lpClient->bConnected = lpRecord->bConnected ? TRUE : FALSE;
+	lpClient->bMuted = lpRecord->bMuted ? TRUE : FALSE;
+	lpClient->bBinaryProtocol = lpRecord->bBinaryProtocol ? TRUE : FALSE;
+
+	if (lpRecord->bDeflate) {
+		lpClient->lpDeflateStream = CreateDeflateStream();
+	}
+
+	if (!IsNullOrWhiteSpace(lpRecord->szNickname)) {
+		AssignClientNickname(lpClient, lpRecord->szNickname);
+	}
+
+	if (!IsNullOrWhiteSpace(lpRecord->szRoomName)) {
+		JoinRoom(lpClient, lpRecord->szRoomName);
+	}
+
+	strncpy(lpClient->szDmRecipient, lpRecord->szDmRecipient,
+			MAX_NICKNAME_LEN);
+
+	lpRecord->szChatMessage[CHAT_MESSAGE_MAX_LENGTH] = '\0';
+	RestoreMessageAssembler(&(lpClient->chatMessage),
+			lpRecord->szChatMessage, lpRecord->nChatMessageFault);
+
+	const int HASHTAG_COUNT = MinimumOf(lpRecord->nFollowedHashtagCount,
+			MAX_FOLLOWED_HASHTAGS);
+
+	for (int i = 0; i < HASHTAG_COUNT; i++) {
+		FollowHashtag(lpClient, lpRecord->szFollowedHashtags[i]);
+	}
+
+	return lpClient;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HandOffClients function - Sends the listening socket, and then each client,
+// over the handoff channel.  Returns FALSE if anything could not be sent.
+//
+
+BOOL HandOffClients(int nChannel, int* pnClientCount) {
+	BOOL bResult = TRUE;
+
+	LockMutex(GetClientListMutex());
+	{
+		HOTRESTARTHEADER header;
+		memset(&header, 0, sizeof(HOTRESTARTHEADER));
+
+		header.nMagic = HOT_RESTART_MAGIC;
+		header.nVersion = HOT_RESTART_VERSION;
+		/* Only the clients that are sent count; the header must agree with
+		 * the records that follow it */
+		header.nClientCount = GetElementCountWhere(g_pClientList,
+				IsClientHandedOff);
+
+		*pnClientCount = header.nClientCount;
+
+		bResult = SendHandoffMessage(nChannel, &header,
+				sizeof(HOTRESTARTHEADER), GetServerSocket());
+
+		HOTRESTARTCLIENT record;
+
+		LPPOSITION pos = GetHeadPosition(g_pClientList);
+		while (bResult && pos != NULL) {
+			LPCLIENTSTRUCT lpClient = (LPCLIENTSTRUCT) (pos->pvData);
+
+			pos = GetNextPosition(pos);
+
+			if (!IsClientHandedOff(lpClient)) {
+				continue;	// there is no connection left to hand off
+			}
+
+			SerializeClient(lpClient, &record);
+
+			bResult = SendHandoffMessage(nChannel, &record,
+					sizeof(HOTRESTARTCLIENT), lpClient->nSocket);
+		}
+	}
+	UnlockMutex(GetClientListMutex());
+
+	return bResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StartNewServerProcess function - Forks, and execs this program's executable
+// in the child, telling it (through the environment) which descriptor is its
+// end of the handoff channel.  Returns the child's process ID, or -1.
+//
+
+pid_t StartNewServerProcess(int nChildChannel) {
+	char szChannel[16];
+	memset(szChannel, 0, sizeof(szChannel));
+
+	sprintf(szChannel, "%d", nChildChannel);
+
+	/* setenv() is not safe to call between fork() and exec() in a process
+	 * that has threads, so it is done (and undone) here in the parent */
+	setenv(HOT_RESTART_FD_VARIABLE, szChannel, 1);
+
+	pid_t nPid = fork();
+	if (nPid == 0) {
+		execv(g_szExecutablePath, g_ppszArguments);
+		_exit(ERROR);
+	}
+
+	unsetenv(HOT_RESTART_FD_VARIABLE);
+
+	return nPid;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WaitForHandoffAck function - Waits for the new server process to say that
+// it has taken over.
+//
+
+BOOL WaitForHandoffAck(int nChannel) {
+	struct pollfd pfd;
+	pfd.fd = nChannel;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	int nResult = 0;
+	do {
+		nResult = poll(&pfd, 1, HOT_RESTART_ACK_TIMEOUT_MS);
+	} while (nResult < 0 && errno == EINTR);
+
+	if (nResult <= 0) {
+		return FALSE;
+	}
+
+	char chAck = 0;
+	return read(nChannel, &chAck, 1) == 1 && chAck == 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AbortHotRestart function - Puts everything back the way it was before the
+// hot restart was attempted, so that this server carries on.
+//
+
+void AbortHotRestart(const char* pszReason, pid_t nChildPid, int nChannel) {
+	if (nChannel >= 0) {
+		close(nChannel);
+	}
+
+	if (nChildPid > 0) {
+		kill(nChildPid, SIGKILL);
+		waitpid(nChildPid, NULL, 0);
+	}
+
+	StartMessageLogging();
+	OpenAllRoomLogs();
+
+	ResumeThreads();
+
+	LogError(HOT_RESTART_FAILED, pszReason);
+
+	if (GetErrorLogFileHandle() != stderr) {
+		fprintf(stderr, HOT_RESTART_FAILED, pszReason);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PerformHotRestart function - Hands this server over to a new server
+// process and exits.  Only returns if the hot restart failed.
+//
+
+void PerformHotRestart() {
+	LogInfo(HOT_RESTART_STARTING);
+
+	if (GetLogFileHandle() != stdout) {
+		fprintf(stdout, HOT_RESTART_STARTING);
+	}
+
+	if (!QuiesceThreads()) {
+		/* Some thread is busy (e.g., sending to a slow client); nothing
+		 * has been touched yet, so it is enough to let the others go */
+		ResumeThreads();
+
+		LogError(HOT_RESTART_FAILED, "threads did not stop in time");
+		return;
+	}
+
+	/* Nothing can be broadcast while the threads are parked, so the logs
+	 * can be closed, and then opened by the new process without the two
+	 * of them ever writing to the same segment */
+	CloseAllRoomLogs();
+	StopMessageLogging();
+
+	int nChannels[2] = { -1, -1 };
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, nChannels) < 0) {
+		AbortHotRestart(strerror(errno), -1, -1);
+		return;
+	}
+
+	SetCloseOnExec(nChannels[0]);
+
+	/* Only the handoff channel may be inherited by the new process; the
+	 * sockets go over it, so that it does not hold stray copies of them */
+	SetCloseOnExec(GetServerSocket());
+
+	LockMutex(GetClientListMutex());
+	{
+		LPPOSITION pos = GetHeadPosition(g_pClientList);
+		while (pos != NULL) {
+			LPCLIENTSTRUCT lpClient = (LPCLIENTSTRUCT) (pos->pvData);
+
+			if (IsClientHandedOff(lpClient)) {
+				SetCloseOnExec(lpClient->nSocket);
+			}
+
+			pos = GetNextPosition(pos);
+		}
+	}
+	UnlockMutex(GetClientListMutex());
+
+	pid_t nChildPid = StartNewServerProcess(nChannels[1]);
+
+	close(nChannels[1]);
+
+	if (nChildPid < 0) {
+		AbortHotRestart(strerror(errno), -1, nChannels[0]);
+		return;
+	}
+
+	int nClientCount = 0;
+
+	if (!HandOffClients(nChannels[0], &nClientCount)) {
+		AbortHotRestart("could not send the sockets", nChildPid,
+				nChannels[0]);
+		return;
+	}
+
+	if (!WaitForHandoffAck(nChannels[0])) {
+		AbortHotRestart("the new process did not take over", nChildPid,
+				nChannels[0]);
+		return;
+	}
+
+	close(nChannels[0]);
+
+	LogInfo(HOT_RESTART_COMPLETE, nClientCount, (int) nChildPid);
+
+	if (GetLogFileHandle() != stdout) {
+		fprintf(stdout, HOT_RESTART_COMPLETE, nClientCount, (int) nChildPid);
+	}
+
+	/* Unlike CleanupServer, nobody is told goodbye and no socket is shut
+	 * down; the new process has its own descriptors for all of them */
+	CloseLogFileHandles();
+
+	exit(OK);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HotRestartThread thread procedure - Waits to be woken by the SIGUSR2
+// handler, and then carries out the hot restart.
+//
+
+void* HotRestartThread(void* pThreadData) {
+	while (1) {
+		char chSignal = 0;
+
+		const ssize_t nBytesRead = read(g_nHotRestartSignalPipe[0],
+				&chSignal, 1);
+		if (nBytesRead < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (nBytesRead <= 0) {
+			break;
+		}
+
+		PerformHotRestart();
+	}
+
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// InstallHotRestartHandler function
+
+void InstallHotRestartHandler(char* argv[]) {
+	if (INVALID_HANDLE_VALUE != g_hHotRestartThread) {
+		return;
+	}
+
+	g_ppszArguments = argv;
+
+	if (readlink("/proc/self/exe", g_szExecutablePath, PATH_MAX - 1) < 0) {
+		strncpy(g_szExecutablePath, argv[0], PATH_MAX - 1);
+	}
+
+	if (pipe2(g_nHotRestartSignalPipe, O_CLOEXEC) < 0
+			|| pipe2(g_nQuiescePipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+		perror("InstallHotRestartHandler");
+
+		CleanupServer(ERROR);
+	}
+
+	g_hHotRestartThread = CreateThread(HotRestartThread);
+	if (INVALID_HANDLE_VALUE == g_hHotRestartThread) {
+		fprintf(stderr, FAILED_LAUNCH_HOT_RESTART_THREAD);
+
+		CleanupServer(ERROR);
+	}
+
+	struct sigaction hotRestartHandler;
+
+	hotRestartHandler.sa_handler = HotRestartSignalHandler;
+	sigemptyset(&hotRestartHandler.sa_mask);
+	hotRestartHandler.sa_flags = SA_RESTART;
+
+	if (OK != sigaction(SIGUSR2, &hotRestartHandler, NULL)) {
+		perror("server[sigaction]");
+
+		CleanupServer(ERROR);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsHotRestartPending function
+
+BOOL IsHotRestartPending() {
+	return getenv(HOT_RESTART_FD_VARIABLE) != NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TakeOverFromPreviousServer function
+
+void TakeOverFromPreviousServer() {
+	const char* pszChannel = getenv(HOT_RESTART_FD_VARIABLE);
+	if (IsNullOrWhiteSpace(pszChannel)) {
+		return;
+	}
+
+	const int nChannel = atoi(pszChannel);
+
+	/* Servers that this one starts must not think they are taking over */
+	unsetenv(HOT_RESTART_FD_VARIABLE);
+
+	SetCloseOnExec(nChannel);
+
+	HOTRESTARTHEADER header;
+	memset(&header, 0, sizeof(HOTRESTARTHEADER));
+
+	int nServerSocket = INVALID_SOCKET_VALUE;
+
+	if (!ReceiveHandoffMessage(nChannel, &header, sizeof(HOTRESTARTHEADER),
+			&nServerSocket) || header.nMagic != HOT_RESTART_MAGIC
+			|| header.nVersion != HOT_RESTART_VERSION
+			|| header.nClientCount < 0
+			|| header.nClientCount > MAX_CLIENT_LIST_ENTRIES) {
+		fprintf(stderr, HOT_RESTART_TAKEOVER_FAILED);
+
+		/* No client has been touched, so the previous process, which sees
+		 * the channel close, carries on */
+		CleanupServer(ERROR);
+	}
+
+	SetServerSocket(nServerSocket);
+
+	/* Receive everything before reading from any of the sockets, so that
+	 * if the handoff breaks off, the previous process can carry on */
+	HOTRESTARTCLIENT* pRecords = NULL;
+	int* pnSockets = NULL;
+
+	if (header.nClientCount > 0) {
+		pRecords = (HOTRESTARTCLIENT*) malloc(
+				header.nClientCount * sizeof(HOTRESTARTCLIENT));
+		pnSockets = (int*) malloc(header.nClientCount * sizeof(int));
+
+		if (pRecords == NULL || pnSockets == NULL) {
+			fprintf(stderr, OUT_OF_MEMORY);
+
+			CleanupServer(ERROR);
+		}
+	}
+
+	for (int i = 0; i < header.nClientCount; i++) {
+		if (!ReceiveHandoffMessage(nChannel, &(pRecords[i]),
+				sizeof(HOTRESTARTCLIENT), &(pnSockets[i]))) {
+			fprintf(stderr, HOT_RESTART_TAKEOVER_FAILED);
+
+			CleanupServer(ERROR);
+		}
+	}
+
+	for (int i = 0; i < header.nClientCount; i++) {
+		LPCLIENTSTRUCT lpClient = DeserializeClient(&(pRecords[i]),
+				pnSockets[i]);
+
+		AddNewlyConnectedClientToList(lpClient);
+
+		LaunchNewClientThread(lpClient);
+	}
+
+	free(pRecords);
+	free(pnSockets);
+
+	/* Tell the previous process it may exit now */
+	const char chAck = 1;
+	if (write(nChannel, &chAck, 1) < 0) {
+		perror("TakeOverFromPreviousServer");
+	}
+
+	close(nChannel);
+
+	LogInfo(HOT_RESTART_TAKEN_OVER, header.nClientCount);
+
+	if (GetLogFileHandle() != stdout) {
+		fprintf(stdout, HOT_RESTART_TAKEN_OVER, header.nClientCount);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WaitForSocketInput function
+
+BOOL WaitForSocketInput(int nSocket, int nWakeFd, int nTimeoutMs) {
+	struct pollfd pfds[4];
+
+	pfds[0].fd = nSocket;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = g_nQuiescePipe[0];	/* poll() skips it if it is -1 */
+	pfds[1].events = POLLIN;
+	pfds[2].fd = nWakeFd;			/* ...and this one, likewise */
+	pfds[2].events = POLLIN;
+	pfds[3].fd = GetShutdownEventFd();	/* ...and this one */
+	pfds[3].events = POLLIN;
+
+	while (1) {
+		pfds[0].revents = 0;
+		pfds[1].revents = 0;
+		pfds[2].revents = 0;
+		pfds[3].revents = 0;
+
+		const int nReadyCount = poll(pfds, 4, nTimeoutMs);
+		if (nReadyCount < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return TRUE;	// let the read report the error
+		}
+
+		if (nReadyCount == 0) {
+			return FALSE;	// timed out
+		}
+
+		/* Stopping for a shutdown comes first, even if there is data
+		 * waiting; nobody is going to read it */
+		if (pfds[3].revents != 0) {
+			return FALSE;
+		}
+
+		/* ...then stopping for a hot restart, for which the new process
+		 * will read it */
+		if (pfds[1].revents & POLLIN) {
+			ParkThread();
+			return FALSE;
+		}
+
+		if (pfds[0].revents != 0) {
+			return TRUE;
+		}
+
+		if (pfds[2].revents != 0) {
+			return FALSE;	// woken up to write
+		}
+	}
+}
@@ -0,0 +1,290 @@
+// mailbox.c - Provides implementations of the functions that post messages to,
+// and take messages off, a MAILBOX instance (MAILBOX is a lock-free queue of
+// the messages that are waiting to be written to a client).
+//
+// Posting swaps the new item in as the head, and then links the old head to
+// it.  Between the two, the item is in the mailbox but cannot be reached from
+// the tail yet; the owner thread waits the few instructions that takes rather
+// than miss it, so that a message it posts to itself is always written before
+// it goes on to anything else.
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "mailbox.h"
+#include "server_functions.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Global variables (used in this file only)
+
+/**
+ * @brief Mailbox owned by the calling thread, if any.
+ */
+static __thread LPMAILBOX g_lpOwnedMailbox = NULL;
+
+/**
+ * @brief Counts of the messages posted to all of the mailboxes, of the times
+ * an owner thread had to be woken up for them, and of the messages that could
+ * not be posted because a mailbox was full.
+ */
+atomic_ullong g_nPostedCount = 0;
+atomic_ullong g_nWakeupCount = 0;
+atomic_ullong g_nOverflowCount = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// LinkMailboxItem function - Makes an item the head of a mailbox, and links
+// the old head to it.
+//
+
+void LinkMailboxItem(LPMAILBOX lpMailbox, LPMAILBOXITEM lpItem) {
+	atomic_store_explicit(&(lpItem->lpNext), NULL, memory_order_relaxed);
+
+	LPMAILBOXITEM lpPrev = atomic_exchange_explicit(&(lpMailbox->lpHead),
+			lpItem, memory_order_acq_rel);
+
+	atomic_store_explicit(&(lpPrev->lpNext), lpItem, memory_order_release);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WaitForMailboxLink function - Waits for the thread that is posting the item
+// after the one given to link it in, and returns it.  Returns NULL if the item
+// given is the head, that is, if nothing is being posted after it.
+//
+
+LPMAILBOXITEM WaitForMailboxLink(LPMAILBOX lpMailbox, LPMAILBOXITEM lpItem) {
+	LPMAILBOXITEM lpNext = atomic_load_explicit(&(lpItem->lpNext),
+			memory_order_acquire);
+
+	while (lpNext == NULL) {
+		if (atomic_load_explicit(&(lpMailbox->lpHead), memory_order_acquire)
+				== lpItem) {
+			return NULL;
+		}
+
+		sched_yield();
+
+		lpNext = atomic_load_explicit(&(lpItem->lpNext),
+				memory_order_acquire);
+	}
+
+	return lpNext;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// ClaimMailbox function
+
+void ClaimMailbox(LPMAILBOX lpMailbox) {
+	g_lpOwnedMailbox = lpMailbox;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ClearMailboxWakeup function
+
+void ClearMailboxWakeup(LPMAILBOX lpMailbox) {
+	if (lpMailbox == NULL) {
+		return;
+	}
+
+	if (atomic_exchange(&(lpMailbox->bWakePending), FALSE)) {
+		uint64_t nCount = 0;
+
+		if (read(lpMailbox->nWakeFd, &nCount, sizeof(nCount)) < 0) {
+			/* Nothing to do; the eventfd was already cleared */
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DestroyMailbox function
+
+void DestroyMailbox(LPMAILBOX lpMailbox) {
+	if (lpMailbox == NULL) {
+		return;
+	}
+
+	LPMAILBOXITEM lpItem = NULL;
+
+	while ((lpItem = TakeFromMailbox(lpMailbox)) != NULL) {
+		FreeMailboxItem(lpItem);
+	}
+
+	if (lpMailbox->nWakeFd >= 0) {
+		close(lpMailbox->nWakeFd);
+		lpMailbox->nWakeFd = -1;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FreeMailboxItem function
+
+void FreeMailboxItem(LPMAILBOXITEM lpItem) {
+	if (lpItem == NULL) {
+		return;
+	}
+
+	ReleaseMessageBuffer(lpItem->lpBuffer);
+	lpItem->lpBuffer = NULL;
+
+	free(lpItem);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// InitializeMailbox function
+
+BOOL InitializeMailbox(LPMAILBOX lpMailbox) {
+	if (lpMailbox == NULL) {
+		return FALSE;
+	}
+
+	atomic_init(&(lpMailbox->stub.lpNext), NULL);
+	lpMailbox->stub.lpBuffer = NULL;
+	lpMailbox->stub.bEncoded = FALSE;
+
+	atomic_init(&(lpMailbox->lpHead), &(lpMailbox->stub));
+	lpMailbox->lpTail = &(lpMailbox->stub);
+
+	atomic_init(&(lpMailbox->bWakePending), FALSE);
+	atomic_init(&(lpMailbox->nItemCount), 0);
+	atomic_init(&(lpMailbox->bOverflowed), FALSE);
+
+	lpMailbox->nWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	return lpMailbox->nWakeFd >= 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsMailboxOwner function
+
+BOOL IsMailboxOwner(LPMAILBOX lpMailbox) {
+	return lpMailbox != NULL && g_lpOwnedMailbox == lpMailbox;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsMailboxOverflowed function
+
+BOOL IsMailboxOverflowed(LPMAILBOX lpMailbox) {
+	return lpMailbox != NULL && atomic_load(&(lpMailbox->bOverflowed));
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PostToMailbox function
+
+BOOL PostToMailbox(LPMAILBOX lpMailbox, LPMESSAGEBUFFER lpBuffer,
+		BOOL bEncoded) {
+	if (lpMailbox == NULL || lpBuffer == NULL) {
+		return FALSE;
+	}
+
+	if (atomic_fetch_add(&(lpMailbox->nItemCount), 1)
+			>= MAILBOX_MAX_ITEM_COUNT) {
+		atomic_fetch_sub(&(lpMailbox->nItemCount), 1);
+
+		if (!atomic_exchange(&(lpMailbox->bOverflowed), TRUE)) {
+			atomic_fetch_add(&g_nOverflowCount, 1);
+		}
+
+		return FALSE;
+	}
+
+	LPMAILBOXITEM lpItem = (LPMAILBOXITEM) malloc(sizeof(MAILBOXITEM));
+	if (lpItem == NULL) {
+		fprintf(stderr, OUT_OF_MEMORY);
+
+		CleanupServer(ERROR);
+	}
+
+	AddMessageBufferRef(lpBuffer);
+
+	lpItem->lpBuffer = lpBuffer;
+	lpItem->bEncoded = bEncoded;
+
+	LinkMailboxItem(lpMailbox, lpItem);
+
+	atomic_fetch_add(&g_nPostedCount, 1);
+
+	/* Only the first message since the owner last looked wakes it up; the
+	 * flag is only tested once the message has been linked in, so the owner
+	 * cannot clear it and then miss the message */
+	WakeMailboxOwner(lpMailbox);
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReportMailboxStats function
+
+void ReportMailboxStats() {
+	const unsigned long long POSTED = atomic_load(&g_nPostedCount);
+	const unsigned long long WAKEUPS = atomic_load(&g_nWakeupCount);
+	const unsigned long long OVERFLOWS = atomic_load(&g_nOverflowCount);
+
+	fprintf(stdout, MAILBOX_STATS, POSTED, WAKEUPS, OVERFLOWS);
+
+	if (GetLogFileHandle() != stdout) {
+		LogInfo(MAILBOX_STATS, POSTED, WAKEUPS, OVERFLOWS);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TakeFromMailbox function
+
+LPMAILBOXITEM TakeFromMailbox(LPMAILBOX lpMailbox) {
+	if (lpMailbox == NULL) {
+		return NULL;
+	}
+
+	LPMAILBOXITEM lpTail = lpMailbox->lpTail;
+	LPMAILBOXITEM lpNext = WaitForMailboxLink(lpMailbox, lpTail);
+
+	/* The stub is skipped over; it is not a message */
+	if (lpTail == &(lpMailbox->stub)) {
+		if (lpNext == NULL) {
+			return NULL;	// empty
+		}
+
+		lpMailbox->lpTail = lpNext;
+		lpTail = lpNext;
+		lpNext = WaitForMailboxLink(lpMailbox, lpTail);
+	}
+
+	/* The last message cannot be taken off while it is still the head, since
+	 * the next thread to post links to it; so the stub goes back on behind
+	 * it first */
+	if (lpNext == NULL) {
+		LinkMailboxItem(lpMailbox, &(lpMailbox->stub));
+
+		lpNext = WaitForMailboxLink(lpMailbox, lpTail);
+	}
+
+	lpMailbox->lpTail = lpNext;
+
+	atomic_fetch_sub(&(lpMailbox->nItemCount), 1);
+
+	return lpTail;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WakeMailboxOwner function
+
+void WakeMailboxOwner(LPMAILBOX lpMailbox) {
+	if (lpMailbox == NULL) {
+		return;
+	}
+
+	if (!atomic_exchange(&(lpMailbox->bWakePending), TRUE)) {
+		const uint64_t ONE = 1;
+
+		if (write(lpMailbox->nWakeFd, &ONE, sizeof(ONE)) < 0) {
+			/* Nothing to do; the eventfd is already set */
+		}
+
+		atomic_fetch_add(&g_nWakeupCount, 1);
+	}
+}
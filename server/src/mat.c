@@ -13,29 +13,20 @@
 #include "stdafx.h"
 #include "server.h"
 
+#include "acceptor_shards.h"
 #include "client_thread_functions.h"
+#include "hot_restart.h"
 #include "mat.h"
 #include "mat_functions.h"
 #include "server_functions.h"
-
-BOOL g_bShouldTerminateMasterThread = FALSE;
+#include "shutdown.h"
 
 ///////////////////////////////////////////////////////////////////////////////
-// MasterAcceptorThread thread procedure
-
-void* MasterAcceptorThread(void* pThreadData) {
-    SetThreadCancelState(PTHREAD_CANCEL_ENABLE);
-    SetThreadCancelType(PTHREAD_CANCEL_DEFERRED);
-
-    RegisterEvent(TerminateMasterThread);
-
-    // Extract the file descriptor of the server's TCP endpoint from
-    // the user state passed to this thread.  The GetServerSocketFileDescriptor
-    // function's return value is guaranteed to be valid.
-    int nServerSocket = GetServerSocketFileDescriptor(pThreadData);
+// AcceptClientConnections function
 
-    // This thread procedure runs an infinite loop which runs while the server
-    // socket is listening for new connections.  This thread's sole mission in
+void AcceptClientConnections(int nServerSocket, int nShardIndex) {
+    // This function runs an infinite loop which runs while the server
+    // socket is listening for new connections.  Its sole mission in
     // life is to wait for incoming client connections, accept them as they come
     // in, and then go back to waiting for more incoming client connections.
 
@@ -44,26 +35,38 @@ void* MasterAcceptorThread(void* pThreadData) {
             break;
         }
 
-        // If we have been signaled to stop, then abort
-        if (g_bShouldTerminateMasterThread) {
+        // If the server is shutting down, then abort
+        if (IsShutdownRequested()) {
             break;
         }
 
         MakeServerEndpointReusable(nServerSocket);
 
+        /* During a hot restart, stop accepting here; the new server process
+         * accepts the connections that are waiting.  A shutdown also ends the
+         * wait, and is seen at the top of the loop. */
+        if (!WaitForSocketInput(nServerSocket, -1, -1)) {
+            continue;
+        }
+
         // We now call the accept function.  This function holds us up
         // until a new client connection comes in, whereupon it returns
         // a file descriptor that represents the socket on our side that
         // is connected to the client.  The output of the function called
         // below is guaranteed to be valid.
-        LPCLIENTSTRUCT lpCS = WaitForNewClientConnection(nServerSocket);
-        if (g_bShouldTerminateMasterThread) {
+        LPCLIENTSTRUCT lpCS = WaitForNewClientConnection(nServerSocket,
+                nShardIndex);
+        if (IsShutdownRequested()) {
             break;
         }
 	if (lpCS == NULL) {
 	    continue;
 	}
 
+        /* The client belongs to the shard that accepted it, and its thread
+         * runs on the same CPU */
+        NoteShardAccept(nShardIndex);
+
         // Add the info for the newly connected client to the list we maintain
         AddNewlyConnectedClientToList(lpCS);
 
@@ -74,8 +77,32 @@ void* MasterAcceptorThread(void* pThreadData) {
             break;   // No more clients are connected
         }
     }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MasterAcceptorThread thread procedure
+
+void* MasterAcceptorThread(void* pThreadData) {
+    SetThreadCancelState(PTHREAD_CANCEL_ENABLE);
+    SetThreadCancelType(PTHREAD_CANCEL_DEFERRED);
+
+    /* A shutdown waits for this thread to stop accepting */
+    BeginStoppableThread();
+
+    // Extract the file descriptor of the server's TCP endpoint from
+    // the user state passed to this thread.  The GetServerSocketFileDescriptor
+    // function's return value is guaranteed to be valid.
+    int nServerSocket = GetServerSocketFileDescriptor(pThreadData);
+
+    /* This thread is acceptor shard 0; the other shards, if any, have
+     * sockets and threads of their own */
+    PinThreadToShard(0);
+
+    AcceptClientConnections(nServerSocket, 0);
 
     fprintf(stdout, "Master thread ending.\n");
 
+    EndStoppableThread();
+
     return NULL;
 }
@@ -7,6 +7,7 @@
 #include "server.h"
 #include "server_functions.h"
 
+#include "admission.h"
 #include "mat.h"
 #include "mat_functions.h"
 
@@ -175,51 +176,6 @@ void MakeServerEndpointReusable(int nServerSocket) {
 	// again and again by multiple clients
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// TerminateMasterThread function - Semaphore callback that is signaled when the
-// server is shutting down, in order to make the MAT shut down in an orderly
-// fashion.
-//
-
-void TerminateMasterThread(int signum) {
-	if (g_bShouldTerminateMasterThread) {
-		return;
-	}
-
-	// If signum is not equal to SIGSEGV, then ignore this semaphore
-	if (SIGSEGV != signum) {
-		return;
-	}
-
-	/* Mark the master thread for termination so it will shut down
-	 * the next time it loops */
-	g_bShouldTerminateMasterThread = TRUE;
-
-	/* Close the server socket handle to release operating system
-	 * resources. */
-	CloseSocket(GetServerSocket());
-
-	LockMutex(GetClientListMutex());
-	{
-		// If there are no clients connected, then we're done
-		if (0 == GetElementCount(g_pClientList)) {
-			// Re-register this semaphore
-			RegisterEvent(TerminateMasterThread);
-			UnlockMutex(GetClientListMutex());
-			return;
-		}
-
-		// Go through the list of connected clients, one by one, and
-		// send signals to each client's thread to die
-		DoForEach(g_pClientList, KillClientThread);
-		sleep(1);
-	}
-	UnlockMutex(GetClientListMutex());
-
-	// Re-register this semaphore
-	RegisterEvent(TerminateMasterThread);
-}
-
 ///////////////////////////////////////////////////////////////////////////////
 // WaitForNewClientConnection function
 
@@ -227,6 +183,8 @@ void TerminateMasterThread(int signum) {
  * @brief Waits until a client connects, and then provides information about
  * the connection.
  * @param nServerSocket Socket file descriptor of the listening server endpoint.
+ * @param nShardIndex Number of the acceptor shard that the endpoint belongs
+ * to, which the client then belongs to as well.
  * @remarks Blocks the calling thread until a new client connects. When a new
  * client connection is received and is represented by a valid socket file
  * descriptor, a CLIENTSTRUCT structure instance is filled with the client's
@@ -234,7 +192,8 @@ void TerminateMasterThread(int signum) {
  * structure is returned.  Be sure to free the structure instance when you're
  * done with it.
  */
-LPCLIENTSTRUCT WaitForNewClientConnection(int nServerSocket) {
+LPCLIENTSTRUCT WaitForNewClientConnection(int nServerSocket,
+		int nShardIndex) {
 	// Each time a client connection comes in, its IP address where it's coming
 	// from is read, and its IP address, file descriptor, and individual thread
 	// handle are all bundled up into the CLIENTSTRUCT structure which then is
@@ -265,6 +224,12 @@ LPCLIENTSTRUCT WaitForNewClientConnection(int nServerSocket) {
 		}
 	}
 
+	/* Turn the connection away now if there are too many, before anything
+	 * is allocated, formatted or logged for it */
+	if (!AdmitConnection(nClientSocket, &(clientAddress.sin_addr))) {
+		return NULL;
+	}
+
 	char* pszClientIPAddress = inet_ntoa(clientAddress.sin_addr);
 
 	/* Echo a message to the screen that a client connected. */
@@ -275,7 +240,8 @@ LPCLIENTSTRUCT WaitForNewClientConnection(int nServerSocket) {
 	}
 
 	// if we are here then we have a brand-new client connection
-	LPCLIENTSTRUCT lpCS = CreateClientStruct(nClientSocket, pszClientIPAddress);
+	LPCLIENTSTRUCT lpCS = CreateClientStruct(nClientSocket, pszClientIPAddress,
+			nShardIndex);
 	if (NULL == lpCS) {
 		fprintf(stderr, FAILED_CREATE_NEW_CLIENT);
 
@@ -0,0 +1,171 @@
+// message_assembler.c - Implementation of the putting together of the lines
+// of multi-line chat messages
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "message_assembler.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// GetLineContentLength function - Gets the length of a line without the
+// newline, or carriage return and newline, at its end.
+//
+
+int GetLineContentLength(const char* pszLine) {
+	int nLength = strlen(pszLine);
+
+	while (nLength > 0 && (pszLine[nLength - 1] == '\n'
+			|| pszLine[nLength - 1] == '\r')) {
+		nLength--;
+	}
+
+	return nLength;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// AddLineToMessage function
+
+int AddLineToMessage(LPMESSAGEASSEMBLER lpAssembler, const char* pszLine) {
+	if (lpAssembler == NULL) {
+		ThrowNullReferenceException();
+	}
+
+	if (pszLine == NULL) {
+		return lpAssembler->nFault;
+	}
+
+	/* Lines that come after a fault are only counted, so that the dot is
+	 * still recognized as ending the message */
+	lpAssembler->nLineCount++;
+
+	if (lpAssembler->nFault != MESSAGE_ASSEMBLY_OK) {
+		return lpAssembler->nFault;
+	}
+
+	const int LINE_LENGTH = GetLineContentLength(pszLine);
+
+	if (LINE_LENGTH > CHAT_MESSAGE_MAX_LINE_LENGTH) {
+		lpAssembler->nFault = MESSAGE_ASSEMBLY_LINE_TOO_LONG;
+		return lpAssembler->nFault;
+	}
+
+	/* The line goes into the arena with a newline of its own */
+	if (lpAssembler->nLength + LINE_LENGTH + 1 > CHAT_MESSAGE_MAX_LENGTH) {
+		lpAssembler->nFault = MESSAGE_ASSEMBLY_TOO_LONG;
+		return lpAssembler->nFault;
+	}
+
+	char* pchEnd = lpAssembler->szArena + lpAssembler->nLength;
+
+	memcpy(pchEnd, pszLine, LINE_LENGTH);
+	pchEnd[LINE_LENGTH] = '\n';
+	pchEnd[LINE_LENGTH + 1] = '\0';
+
+	lpAssembler->nLength += LINE_LENGTH + 1;
+
+	return MESSAGE_ASSEMBLY_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetAssembledMessage function
+
+const char* GetAssembledMessage(LPMESSAGEASSEMBLER lpAssembler) {
+	if (lpAssembler == NULL) {
+		ThrowNullReferenceException();
+	}
+
+	return lpAssembler->szArena;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetAssembledMessageLength function
+
+int GetAssembledMessageLength(LPMESSAGEASSEMBLER lpAssembler) {
+	if (lpAssembler == NULL) {
+		ThrowNullReferenceException();
+	}
+
+	return lpAssembler->nLength;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetMessageAssemblyFault function
+
+int GetMessageAssemblyFault(LPMESSAGEASSEMBLER lpAssembler) {
+	if (lpAssembler == NULL) {
+		ThrowNullReferenceException();
+	}
+
+	return lpAssembler->nFault;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsMessageBeingAssembled function
+
+BOOL IsMessageBeingAssembled(LPMESSAGEASSEMBLER lpAssembler) {
+	if (lpAssembler == NULL) {
+		return FALSE;
+	}
+
+	return lpAssembler->nLineCount > 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ResetMessageAssembler function
+
+void ResetMessageAssembler(LPMESSAGEASSEMBLER lpAssembler) {
+	if (lpAssembler == NULL) {
+		return;
+	}
+
+	/* Only the first byte of the arena needs clearing; the rest is written
+	 * before it is read */
+	lpAssembler->szArena[0] = '\0';
+	lpAssembler->nLength = 0;
+	lpAssembler->nLineCount = 0;
+	lpAssembler->nFault = MESSAGE_ASSEMBLY_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RestoreMessageAssembler function
+
+void RestoreMessageAssembler(LPMESSAGEASSEMBLER lpAssembler,
+		const char* pszMessage, int nFault) {
+	if (lpAssembler == NULL) {
+		return;
+	}
+
+	ResetMessageAssembler(lpAssembler);
+
+	if (pszMessage != NULL) {
+		const int LENGTH = MinimumOf(strlen(pszMessage),
+				CHAT_MESSAGE_MAX_LENGTH);
+
+		memcpy(lpAssembler->szArena, pszMessage, LENGTH);
+		lpAssembler->szArena[LENGTH] = '\0';
+		lpAssembler->nLength = LENGTH;
+
+		for (int i = 0; i < LENGTH; i++) {
+			if (pszMessage[i] == '\n') {
+				lpAssembler->nLineCount++;
+			}
+		}
+	}
+
+	if (nFault != MESSAGE_ASSEMBLY_OK) {
+		lpAssembler->nFault = nFault;
+
+		/* The lines of a faulty message are not kept, but the message is
+		 * still being put together until its dot comes */
+		if (lpAssembler->nLineCount == 0) {
+			lpAssembler->nLineCount = 1;
+		}
+	}
+}
@@ -0,0 +1,187 @@
+// message_buffer.c - Provides implementations of the functions that create
+// and share MESSAGEBUFFER instances (a MESSAGEBUFFER holds a fully-formatted
+// message that is ready to be sent to clients).
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "message_buffer.h"
+#include "server_functions.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// AddMessageBufferRef function
+
+void AddMessageBufferRef(LPMESSAGEBUFFER lpBuffer) {
+	if (lpBuffer == NULL) {
+		return;
+	}
+
+	atomic_fetch_add(&(lpBuffer->nRefCount), 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AppendToMessage function
+
+void AppendToMessage(LPMESSAGEBUILDER lpBuilder, const char* pchText,
+		int nLength) {
+	if (lpBuilder == NULL || lpBuilder->lpBuffer == NULL || pchText == NULL
+			|| nLength <= 0) {
+		return;
+	}
+
+	LPMESSAGEBUFFER lpBuffer = lpBuilder->lpBuffer;
+
+	const int ROOM_LEFT = lpBuilder->nCapacity - lpBuffer->nLength;
+	if (nLength > ROOM_LEFT) {
+		nLength = ROOM_LEFT;
+	}
+
+	memcpy(lpBuffer->szData + lpBuffer->nLength, pchText, nLength);
+	lpBuffer->nLength += nLength;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BeginMessage function - Allocates the structure and the text of the message
+// in a single block.
+//
+
+void BeginMessage(LPMESSAGEBUILDER lpBuilder, int nCapacity) {
+	if (lpBuilder == NULL) {
+		ThrowNullReferenceException();
+	}
+
+	if (nCapacity < 0) {
+		nCapacity = 0;
+	}
+
+	LPMESSAGEBUFFER lpBuffer = (LPMESSAGEBUFFER) malloc(
+			sizeof(MESSAGEBUFFER) + nCapacity + 1);
+	if (lpBuffer == NULL) {
+		fprintf(stderr, OUT_OF_MEMORY);
+
+		CleanupServer(ERROR);
+	}
+
+	atomic_init(&(lpBuffer->nRefCount), 1);
+	lpBuffer->nLength = 0;
+
+	lpBuilder->lpBuffer = lpBuffer;
+	lpBuilder->nCapacity = nCapacity;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateMessageBuffer function
+
+LPMESSAGEBUFFER CreateMessageBuffer(const char* pszPrefix,
+		const char* pszText) {
+	if (pszText == NULL) {
+		ThrowNullReferenceException();
+	}
+
+	const int PREFIX_LENGTH = pszPrefix == NULL ? 0 : strlen(pszPrefix);
+	const int TEXT_LENGTH = strlen(pszText);
+
+	MESSAGEBUILDER builder;
+	BeginMessage(&builder, PREFIX_LENGTH + TEXT_LENGTH);
+
+	AppendToMessage(&builder, pszPrefix, PREFIX_LENGTH);
+	AppendToMessage(&builder, pszText, TEXT_LENGTH);
+
+	return EndMessage(&builder);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateMessageBufferFromBytes function
+
+LPMESSAGEBUFFER CreateMessageBufferFromBytes(const void* pvData, int nLength) {
+	if (pvData == NULL && nLength > 0) {
+		ThrowNullReferenceException();
+	}
+
+	if (nLength < 0) {
+		nLength = 0;
+	}
+
+	LPMESSAGEBUFFER lpBuffer = (LPMESSAGEBUFFER) malloc(
+			sizeof(MESSAGEBUFFER) + nLength + 1);
+	if (lpBuffer == NULL) {
+		fprintf(stderr, OUT_OF_MEMORY);
+
+		CleanupServer(ERROR);
+	}
+
+	atomic_init(&(lpBuffer->nRefCount), 1);
+	lpBuffer->nLength = nLength;
+
+	if (nLength > 0) {
+		memcpy(lpBuffer->szData, pvData, nLength);
+	}
+
+	lpBuffer->szData[nLength] = '\0';
+
+	return lpBuffer;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateMessageFromTemplate function
+
+LPMESSAGEBUFFER CreateMessageFromTemplate(const char* pszTemplate,
+		const char* pszValue) {
+	if (pszTemplate == NULL) {
+		ThrowNullReferenceException();
+	}
+
+	if (pszValue == NULL) {
+		pszValue = "";
+	}
+
+	const char* pchPlaceholder = strstr(pszTemplate, "%s");
+	if (pchPlaceholder == NULL) {
+		return CreateMessageBuffer(NULL, pszTemplate);
+	}
+
+	const int HEAD_LENGTH = pchPlaceholder - pszTemplate;
+	const int VALUE_LENGTH = strlen(pszValue);
+	const int TAIL_LENGTH = strlen(pchPlaceholder + 2);
+
+	MESSAGEBUILDER builder;
+	BeginMessage(&builder, HEAD_LENGTH + VALUE_LENGTH + TAIL_LENGTH);
+
+	AppendToMessage(&builder, pszTemplate, HEAD_LENGTH);
+	AppendToMessage(&builder, pszValue, VALUE_LENGTH);
+	AppendToMessage(&builder, pchPlaceholder + 2, TAIL_LENGTH);
+
+	return EndMessage(&builder);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// EndMessage function
+
+LPMESSAGEBUFFER EndMessage(LPMESSAGEBUILDER lpBuilder) {
+	if (lpBuilder == NULL || lpBuilder->lpBuffer == NULL) {
+		return NULL;
+	}
+
+	LPMESSAGEBUFFER lpBuffer = lpBuilder->lpBuffer;
+
+	lpBuffer->szData[lpBuffer->nLength] = '\0';
+
+	lpBuilder->lpBuffer = NULL;
+	lpBuilder->nCapacity = 0;
+
+	return lpBuffer;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReleaseMessageBuffer function
+
+void ReleaseMessageBuffer(LPMESSAGEBUFFER lpBuffer) {
+	if (lpBuffer == NULL) {
+		return;
+	}
+
+	if (atomic_fetch_sub(&(lpBuffer->nRefCount), 1) == 1) {
+		free(lpBuffer);
+	}
+}
@@ -0,0 +1,1044 @@
+// message_log.c - Implementation of the durable, append-only log in which the
+// chat messages of each room, and the direct messages, are kept.
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "binary_protocol.h"
+#include "message_log.h"
+#include "server_functions.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Global variables (used in this file only)
+
+/**
+ * @brief List of the message logs that are open, which the log flusher
+ * thread walks to sync them.
+ */
+POSITION* g_pMessageLogList = NULL;
+
+/**
+ * @brief Handle to the mutex that guards the list of open message logs.
+ */
+HMUTEX g_hMessageLogListMutex = INVALID_HANDLE_VALUE;
+
+/**
+ * @brief Reference to the log in which direct messages are kept.
+ */
+LPMESSAGELOG g_lpDirectMessageLog = NULL;
+
+/**
+ * @brief Handle to the thread that syncs the message logs to disk.
+ */
+HTHREAD g_hLogFlusherThread = INVALID_HANDLE_VALUE;
+
+/**
+ * @brief Flag that tells the log flusher thread to stop.
+ */
+BOOL g_bShouldTerminateLogFlusher = FALSE;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// GetCurrentTimeMillis function - Gets the wall-clock time, in milliseconds
+// since the epoch, for the timestamps in the index.
+//
+
+int64_t GetCurrentTimeMillis() {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MakeDirectories function - Creates the directory with the path given, and
+// any of its parents that do not exist yet.
+//
+
+BOOL MakeDirectories(const char* pszPath) {
+	char szPath[PATH_MAX];
+	memset(szPath, 0, PATH_MAX);
+
+	strncpy(szPath, pszPath, PATH_MAX - 1);
+
+	for (char* pch = szPath + 1; *pch != '\0'; pch++) {
+		if (*pch != '/') {
+			continue;
+		}
+
+		*pch = '\0';
+		if (mkdir(szPath, 0755) < 0 && errno != EEXIST) {
+			return FALSE;
+		}
+		*pch = '/';
+	}
+
+	return mkdir(szPath, 0755) == 0 || errno == EEXIST;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetSegmentPath function - Builds the path of the segment (or of its index,
+// depending on the extension given) whose first line has the sequence number
+// nBaseSequence.
+//
+
+void GetSegmentPath(char* pszDest, LPMESSAGELOG lpLog,
+		uint64_t nBaseSequence, const char* pszExtension) {
+	snprintf(pszDest, PATH_MAX, LOG_SEGMENT_NAME_FORMAT, lpLog->szDirectory,
+			(unsigned long long) nBaseSequence, pszExtension);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WriteIndexEntry function - Appends an entry for the line about to be
+// written to the index of the newest segment.  The caller must hold the log
+// mutex.
+//
+
+void WriteIndexEntry(LPMESSAGELOG lpLog) {
+	LOGINDEXENTRY entry;
+	memset(&entry, 0, sizeof(LOGINDEXENTRY));
+
+	entry.nSequence = lpLog->nNextSequence;
+	entry.nPosition = lpLog->nWritePosition;
+	entry.nTimestamp = GetCurrentTimeMillis();
+
+	/* The index is opened for appending, and the entry is tiny; this only
+	 * copies it into the page cache. */
+	if (write(lpLog->nIndexFd, &entry, sizeof(LOGINDEXENTRY))
+			!= sizeof(LOGINDEXENTRY)) {
+		fprintf(stderr, MESSAGE_LOG_WRITE_FAILED, lpLog->szDirectory,
+				strerror(errno));
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateSegment function - Creates a new, empty segment whose first line will
+// have the sequence number nBaseSequence, and maps it into memory.
+//
+
+BOOL CreateSegment(LPMESSAGELOG lpLog, uint64_t nBaseSequence) {
+	char szPath[PATH_MAX];
+
+	GetSegmentPath(szPath, lpLog, nBaseSequence, LOG_SEGMENT_EXTENSION);
+
+	int nSegmentFd = open(szPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (nSegmentFd < 0) {
+		return FALSE;
+	}
+
+	/* The file is sized up front, so appending never has to grow it; the
+	 * part that has not been written yet reads as zeroes. */
+	if (ftruncate(nSegmentFd, LOG_SEGMENT_SIZE) < 0) {
+		close(nSegmentFd);
+		return FALSE;
+	}
+
+	char* pSegmentData = (char*) mmap(NULL, LOG_SEGMENT_SIZE,
+			PROT_READ | PROT_WRITE, MAP_SHARED, nSegmentFd, 0);
+	if (pSegmentData == MAP_FAILED) {
+		close(nSegmentFd);
+		return FALSE;
+	}
+
+	GetSegmentPath(szPath, lpLog, nBaseSequence, LOG_INDEX_EXTENSION);
+
+	int nIndexFd = open(szPath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+			0644);
+	if (nIndexFd < 0) {
+		munmap(pSegmentData, LOG_SEGMENT_SIZE);
+		close(nSegmentFd);
+		return FALSE;
+	}
+
+	lpLog->nSegmentFd = nSegmentFd;
+	lpLog->pSegmentData = pSegmentData;
+	lpLog->nIndexFd = nIndexFd;
+	lpLog->nWritePosition = 0;
+	lpLog->nBaseSequence = nBaseSequence;
+	lpLog->nNextSequence = nBaseSequence;
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SealSegment function - Trims the newest segment to the length of the lines
+// in it and unmaps it.  Its file descriptors are left open.  The caller must
+// hold the log mutex.
+//
+
+void SealSegment(LPMESSAGELOG lpLog) {
+	if (lpLog->pSegmentData == NULL) {
+		return;
+	}
+
+	munmap(lpLog->pSegmentData, LOG_SEGMENT_SIZE);
+	lpLog->pSegmentData = NULL;
+
+	if (ftruncate(lpLog->nSegmentFd, lpLog->nWritePosition) < 0) {
+		fprintf(stderr, MESSAGE_LOG_WRITE_FAILED, lpLog->szDirectory,
+				strerror(errno));
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RollSegment function - Seals the newest segment, hands it to the log
+// flusher thread, and starts a new one.  The caller must hold the log mutex.
+//
+
+BOOL RollSegment(LPMESSAGELOG lpLog) {
+	SealSegment(lpLog);
+
+	/* If the log flusher thread has not gotten to the segment retired last
+	 * time yet (the segment filled up within one sync interval), then it
+	 * has to be synced here instead. */
+	if (lpLog->nRetiredSegmentFd >= 0) {
+		fdatasync(lpLog->nRetiredSegmentFd);
+		close(lpLog->nRetiredSegmentFd);
+
+		fdatasync(lpLog->nRetiredIndexFd);
+		close(lpLog->nRetiredIndexFd);
+	}
+
+	lpLog->nRetiredSegmentFd = lpLog->nSegmentFd;
+	lpLog->nRetiredIndexFd = lpLog->nIndexFd;
+
+	lpLog->nSegmentFd = -1;
+	lpLog->nIndexFd = -1;
+
+	return CreateSegment(lpLog, lpLog->nNextSequence);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FindNewestSegment function - Finds the highest base sequence number among
+// the segments in the log directory.  Returns FALSE if there are none.
+//
+
+BOOL FindNewestSegment(LPMESSAGELOG lpLog, uint64_t* pnBaseSequence) {
+	DIR* pDir = opendir(lpLog->szDirectory);
+	if (pDir == NULL) {
+		return FALSE;
+	}
+
+	BOOL bFound = FALSE;
+	struct dirent* pEntry = NULL;
+
+	while ((pEntry = readdir(pDir)) != NULL) {
+		char* pszExtension = strrchr(pEntry->d_name, '.');
+		if (pszExtension == NULL
+				|| !Equals(pszExtension, LOG_SEGMENT_EXTENSION)) {
+			continue;
+		}
+
+		uint64_t nBaseSequence = strtoull(pEntry->d_name, NULL, 10);
+		if (!bFound || nBaseSequence > *pnBaseSequence) {
+			*pnBaseSequence = nBaseSequence;
+			bFound = TRUE;
+		}
+	}
+
+	closedir(pDir);
+
+	return bFound;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RecoverSegment function - Reopens the newest segment of a log that already
+// exists, works out how many complete lines it has, and either carries on
+// appending to it or, if it was sealed, starts a new segment after it.
+//
+// The index is only a hint here: its last entry that points inside the data
+// saves scanning the whole segment for newlines.  Anything after the last
+// complete line (which a crash may have left behind) is wiped out.
+//
+
+BOOL RecoverSegment(LPMESSAGELOG lpLog, uint64_t nBaseSequence) {
+	char szPath[PATH_MAX];
+
+	GetSegmentPath(szPath, lpLog, nBaseSequence, LOG_SEGMENT_EXTENSION);
+
+	int nSegmentFd = open(szPath, O_RDWR);
+	if (nSegmentFd < 0) {
+		return FALSE;
+	}
+
+	struct stat segmentStat;
+	if (fstat(nSegmentFd, &segmentStat) < 0 || segmentStat.st_size == 0) {
+		close(nSegmentFd);
+		return CreateSegment(lpLog, nBaseSequence);
+	}
+
+	const size_t SEGMENT_SIZE = (size_t) segmentStat.st_size;
+
+	char* pSegmentData = (char*) mmap(NULL, SEGMENT_SIZE,
+			PROT_READ | PROT_WRITE, MAP_SHARED, nSegmentFd, 0);
+	if (pSegmentData == MAP_FAILED) {
+		close(nSegmentFd);
+		return FALSE;
+	}
+
+	GetSegmentPath(szPath, lpLog, nBaseSequence, LOG_INDEX_EXTENSION);
+
+	int nIndexFd = open(szPath, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (nIndexFd < 0) {
+		munmap(pSegmentData, SEGMENT_SIZE);
+		close(nSegmentFd);
+		return FALSE;
+	}
+
+	/* Find the last index entry that points inside the segment */
+	struct stat indexStat;
+	int nEntryCount = fstat(nIndexFd, &indexStat) < 0
+			? 0 : (int) (indexStat.st_size / sizeof(LOGINDEXENTRY));
+
+	LOGINDEXENTRY entry;
+	memset(&entry, 0, sizeof(LOGINDEXENTRY));
+	entry.nSequence = nBaseSequence;
+
+	while (nEntryCount > 0) {
+		if (pread(nIndexFd, &entry, sizeof(LOGINDEXENTRY),
+				(off_t) (nEntryCount - 1) * sizeof(LOGINDEXENTRY))
+				== sizeof(LOGINDEXENTRY)
+				&& entry.nPosition < SEGMENT_SIZE) {
+			break;
+		}
+
+		nEntryCount--;
+		memset(&entry, 0, sizeof(LOGINDEXENTRY));
+		entry.nSequence = nBaseSequence;
+	}
+
+	/* Index entries past the data that survived are of no use */
+	if (ftruncate(nIndexFd, (off_t) nEntryCount * sizeof(LOGINDEXENTRY)) < 0) {
+		fprintf(stderr, MESSAGE_LOG_WRITE_FAILED, lpLog->szDirectory,
+				strerror(errno));
+	}
+
+	/* Lines never contain a null char, so the first one marks the end of
+	 * the data; then back up to the end of the last complete line. */
+	char* pchStart = pSegmentData + entry.nPosition;
+	char* pchEnd = (char*) memchr(pchStart, '\0',
+			SEGMENT_SIZE - entry.nPosition);
+	if (pchEnd == NULL) {
+		pchEnd = pSegmentData + SEGMENT_SIZE;
+	}
+
+	char* pchLastNewline = (char*) memrchr(pSegmentData, '\n',
+			pchEnd - pSegmentData);
+	char* pchUsedEnd = pchLastNewline == NULL
+			? pSegmentData : pchLastNewline + 1;
+
+	memset(pchUsedEnd, 0, pchEnd - pchUsedEnd);
+
+	uint64_t nNextSequence = entry.nSequence;
+	for (char* pch = pchStart; pch < pchUsedEnd; pch++) {
+		if (*pch == '\n') {
+			nNextSequence++;
+		}
+	}
+
+	lpLog->nSegmentFd = nSegmentFd;
+	lpLog->pSegmentData = pSegmentData;
+	lpLog->nIndexFd = nIndexFd;
+	lpLog->nWritePosition = pchUsedEnd - pSegmentData;
+	lpLog->nBaseSequence = nBaseSequence;
+	lpLog->nNextSequence = nNextSequence;
+
+	if (SEGMENT_SIZE == LOG_SEGMENT_SIZE
+			&& lpLog->nWritePosition < LOG_SEGMENT_SIZE) {
+		return TRUE;	// still room in this segment; carry on with it
+	}
+
+	/* This segment was sealed when the log was closed; trim it, in case
+	 * its tail was wiped out above, and start a new one. */
+	munmap(pSegmentData, SEGMENT_SIZE);
+	lpLog->pSegmentData = NULL;
+
+	if (ftruncate(nSegmentFd, lpLog->nWritePosition) < 0) {
+		fprintf(stderr, MESSAGE_LOG_WRITE_FAILED, lpLog->szDirectory,
+				strerror(errno));
+	}
+
+	close(nSegmentFd);
+	close(nIndexFd);
+
+	return CreateSegment(lpLog, nNextSequence);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SyncMessageLog function - Writes the lines appended to a log since the last
+// time to disk.  Called for each open log by the log flusher thread, which
+// holds the list mutex so that the log cannot be closed meanwhile.
+//
+// The log mutex is only held long enough to take over the retired segment
+// and to duplicate the file descriptors of the newest one, so appending is
+// never held up by the disk.
+//
+
+void SyncMessageLog(void* pvLog) {
+	LPMESSAGELOG lpLog = (LPMESSAGELOG) pvLog;
+	if (lpLog == NULL) {
+		return;
+	}
+
+	int nRetiredSegmentFd = -1;
+	int nRetiredIndexFd = -1;
+	int nSegmentFd = -1;
+	int nIndexFd = -1;
+
+	LockMutex(lpLog->hMutex);
+	{
+		nRetiredSegmentFd = lpLog->nRetiredSegmentFd;
+		nRetiredIndexFd = lpLog->nRetiredIndexFd;
+
+		lpLog->nRetiredSegmentFd = -1;
+		lpLog->nRetiredIndexFd = -1;
+
+		if (lpLog->bSyncPending && lpLog->nSegmentFd >= 0) {
+			nSegmentFd = dup(lpLog->nSegmentFd);
+			nIndexFd = dup(lpLog->nIndexFd);
+
+			lpLog->bSyncPending = FALSE;
+		}
+	}
+	UnlockMutex(lpLog->hMutex);
+
+	/* Segments go to disk before their indices, so that an index entry is
+	 * never durable while the line it points to is not. */
+	if (nRetiredSegmentFd >= 0) {
+		fdatasync(nRetiredSegmentFd);
+		close(nRetiredSegmentFd);
+
+		fdatasync(nRetiredIndexFd);
+		close(nRetiredIndexFd);
+	}
+
+	if (nSegmentFd >= 0) {
+		fdatasync(nSegmentFd);
+		close(nSegmentFd);
+	}
+
+	if (nIndexFd >= 0) {
+		fdatasync(nIndexFd);
+		close(nIndexFd);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FreeMessageLog function - Syncs and seals a log and frees it.  Used as the
+// deallocation routine of the list of open logs.
+//
+
+void FreeMessageLog(void* pvLog) {
+	LPMESSAGELOG lpLog = (LPMESSAGELOG) pvLog;
+	if (lpLog == NULL) {
+		return;
+	}
+
+	/* Make sure a sync is done, even if nothing is pending, so that the
+	 * retired segment (if any) gets closed */
+	lpLog->bSyncPending = TRUE;
+
+	SyncMessageLog(lpLog);
+
+	if (lpLog->nSegmentFd >= 0) {
+		SealSegment(lpLog);
+
+		fdatasync(lpLog->nSegmentFd);
+		close(lpLog->nSegmentFd);
+		lpLog->nSegmentFd = -1;
+
+		close(lpLog->nIndexFd);
+		lpLog->nIndexFd = -1;
+	}
+
+	if (INVALID_HANDLE_VALUE != lpLog->hMutex) {
+		DestroyMutex(lpLog->hMutex);
+		lpLog->hMutex = INVALID_HANDLE_VALUE;
+	}
+
+	free(lpLog);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FindMessageLog function - Compares a log to the one being searched for.
+
+BOOL FindMessageLog(void* pvSearchLog, void* pvLog) {
+	return pvSearchLog != NULL && pvSearchLog == pvLog;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LogFlusherThread thread procedure - Syncs every log that has changed, once
+// per sync interval, so that the cost of each fdatasync() is shared by all
+// the lines appended during the interval.
+//
+
+void* LogFlusherThread(void* pvData) {
+	while (!g_bShouldTerminateLogFlusher) {
+		usleep(LOG_SYNC_INTERVAL_MS * 1000);
+
+		LockMutex(g_hMessageLogListMutex);
+		{
+			if (g_pMessageLogList != NULL) {
+				DoForEach(g_pMessageLogList, SyncMessageLog);
+			}
+		}
+		UnlockMutex(g_hMessageLogListMutex);
+	}
+
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CompareSequences function - Orders sequence numbers for qsort().
+
+int CompareSequences(const void* pvFirst, const void* pvSecond) {
+	const uint64_t nFirst = *((const uint64_t*) pvFirst);
+	const uint64_t nSecond = *((const uint64_t*) pvSecond);
+
+	return nFirst < nSecond ? -1 : (nFirst > nSecond ? 1 : 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ListSegments function - Gets the base sequence numbers of all the segments
+// in the log directory, in ascending order.  Returns the count of segments;
+// the caller must free the array that is returned in *ppnBaseSequences.
+//
+
+int ListSegments(LPMESSAGELOG lpLog, uint64_t** ppnBaseSequences) {
+	*ppnBaseSequences = NULL;
+
+	DIR* pDir = opendir(lpLog->szDirectory);
+	if (pDir == NULL) {
+		return 0;
+	}
+
+	int nCount = 0;
+	int nCapacity = 0;
+	struct dirent* pEntry = NULL;
+
+	while ((pEntry = readdir(pDir)) != NULL) {
+		char* pszExtension = strrchr(pEntry->d_name, '.');
+		if (pszExtension == NULL
+				|| !Equals(pszExtension, LOG_SEGMENT_EXTENSION)) {
+			continue;
+		}
+
+		if (nCount == nCapacity) {
+			nCapacity = nCapacity == 0 ? 16 : 2 * nCapacity;
+
+			uint64_t* pnNewBaseSequences = (uint64_t*) realloc(
+					*ppnBaseSequences, nCapacity * sizeof(uint64_t));
+			if (pnNewBaseSequences == NULL) {
+				break;
+			}
+
+			*ppnBaseSequences = pnNewBaseSequences;
+		}
+
+		(*ppnBaseSequences)[nCount++] = strtoull(pEntry->d_name, NULL, 10);
+	}
+
+	closedir(pDir);
+
+	if (nCount > 0) {
+		qsort(*ppnBaseSequences, nCount, sizeof(uint64_t), CompareSequences);
+	}
+
+	return nCount;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FindLinePosition function - Finds the offset of the line with the sequence
+// number nSequence within the segment whose base sequence number is
+// nBaseSequence.  A binary search of the index gives the nearest entry at or
+// before the line; the rest of the way is found by counting newlines in the
+// mapped segment.
+//
+
+off_t FindLinePosition(LPMESSAGELOG lpLog, uint64_t nBaseSequence,
+		int nSegmentFd, size_t nSegmentLength, uint64_t nSequence) {
+	LOGINDEXENTRY entry;
+	memset(&entry, 0, sizeof(LOGINDEXENTRY));
+	entry.nSequence = nBaseSequence;
+
+	char szPath[PATH_MAX];
+
+	GetSegmentPath(szPath, lpLog, nBaseSequence, LOG_INDEX_EXTENSION);
+
+	int nIndexFd = open(szPath, O_RDONLY);
+	if (nIndexFd >= 0) {
+		struct stat indexStat;
+
+		int nLow = 0;
+		int nHigh = fstat(nIndexFd, &indexStat) < 0
+				? -1 : (int) (indexStat.st_size / sizeof(LOGINDEXENTRY)) - 1;
+
+		while (nLow <= nHigh) {
+			const int nMiddle = nLow + (nHigh - nLow) / 2;
+
+			LOGINDEXENTRY middleEntry;
+			if (pread(nIndexFd, &middleEntry, sizeof(LOGINDEXENTRY),
+					(off_t) nMiddle * sizeof(LOGINDEXENTRY))
+					!= sizeof(LOGINDEXENTRY)) {
+				break;
+			}
+
+			if (middleEntry.nSequence <= nSequence
+					&& middleEntry.nPosition <= nSegmentLength) {
+				entry = middleEntry;
+				nLow = nMiddle + 1;
+			} else {
+				nHigh = nMiddle - 1;
+			}
+		}
+
+		close(nIndexFd);
+	}
+
+	if (entry.nSequence == nSequence || nSegmentLength == 0) {
+		return (off_t) entry.nPosition;
+	}
+
+	char* pSegmentData = (char*) mmap(NULL, nSegmentLength, PROT_READ,
+			MAP_SHARED, nSegmentFd, 0);
+	if (pSegmentData == MAP_FAILED) {
+		return (off_t) entry.nPosition;	// send a few more lines than asked
+	}
+
+	char* pch = pSegmentData + entry.nPosition;
+	char* pchEnd = pSegmentData + nSegmentLength;
+
+	for (uint64_t i = entry.nSequence; i < nSequence && pch < pchEnd; i++) {
+		char* pchNewline = (char*) memchr(pch, '\n', pchEnd - pch);
+		pch = pchNewline == NULL ? pchEnd : pchNewline + 1;
+	}
+
+	off_t nPosition = (off_t) (pch - pSegmentData);
+
+	munmap(pSegmentData, nSegmentLength);
+
+	return nPosition;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ForEachLogTailRange function - Finds the byte ranges of the segment files
+// that hold the most recent nLineCount lines of a log, and hands each of them
+// to a routine that sends it somewhere.  Returns the total of what the
+// routine returned, or -1 if it failed.
+//
+
+long ForEachLogTailRange(LPMESSAGELOG lpLog, int nLineCount,
+		long (*lpfnRangeRoutine)(int, off_t, size_t, void*),
+		void* pvUserState) {
+	/* Take a snapshot of where the log ends; lines appended after this are
+	 * not sent */
+	uint64_t nNewestBaseSequence = 0;
+	uint64_t nNextSequence = 0;
+	size_t nNewestLength = 0;
+
+	LockMutex(lpLog->hMutex);
+	{
+		nNewestBaseSequence = lpLog->nBaseSequence;
+		nNextSequence = lpLog->nNextSequence;
+		nNewestLength = lpLog->nWritePosition;
+	}
+	UnlockMutex(lpLog->hMutex);
+
+	if (nNextSequence == 0) {
+		return 0;	// Nothing has been logged yet.
+	}
+
+	const uint64_t START_SEQUENCE = nNextSequence > (uint64_t) nLineCount
+			? nNextSequence - nLineCount : 0;
+
+	uint64_t* pnBaseSequences = NULL;
+
+	const int SEGMENT_COUNT = ListSegments(lpLog, &pnBaseSequences);
+
+	/* Find the segment that holds the first line to be sent */
+	int nFirstSegment = 0;
+	for (int i = 0; i < SEGMENT_COUNT; i++) {
+		if (pnBaseSequences[i] <= START_SEQUENCE) {
+			nFirstSegment = i;
+		}
+	}
+
+	long nTotalBytesSent = 0;
+
+	for (int i = nFirstSegment; i < SEGMENT_COUNT; i++) {
+		if (pnBaseSequences[i] > nNewestBaseSequence) {
+			break;	// the log rolled over after the snapshot was taken
+		}
+
+		char szPath[PATH_MAX];
+
+		GetSegmentPath(szPath, lpLog, pnBaseSequences[i],
+				LOG_SEGMENT_EXTENSION);
+
+		int nSegmentFd = open(szPath, O_RDONLY);
+		if (nSegmentFd < 0) {
+			continue;
+		}
+
+		/* Segments other than the newest have been trimmed to the length
+		 * of their lines.  The newest is only valid up to the snapshot. */
+		struct stat segmentStat;
+		size_t nLength = nNewestLength;
+
+		if (pnBaseSequences[i] != nNewestBaseSequence) {
+			nLength = fstat(nSegmentFd, &segmentStat) < 0
+					? 0 : (size_t) segmentStat.st_size;
+		}
+
+		off_t nOffset = 0;
+		if (i == nFirstSegment && pnBaseSequences[i] < START_SEQUENCE) {
+			nOffset = FindLinePosition(lpLog, pnBaseSequences[i],
+					nSegmentFd, nLength, START_SEQUENCE);
+		}
+
+		const long nBytesSent = lpfnRangeRoutine(nSegmentFd, nOffset,
+				nLength - (size_t) nOffset, pvUserState);
+		if (nBytesSent < 0) {
+			close(nSegmentFd);
+			free(pnBaseSequences);
+			return -1;
+		}
+
+		nTotalBytesSent += nBytesSent;
+
+		close(nSegmentFd);
+	}
+
+	free(pnBaseSequences);
+
+	return nTotalBytesSent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendLogRange function - Sends a range of a segment file straight to a
+// socket with sendfile(), in binary protocol data frames if the socket's
+// client asked for them.
+//
+
+long SendLogRange(int nSegmentFd, off_t nOffset, size_t nLength,
+		void* pvUserState) {
+	const LPLOGTAILTARGET lpTarget = (LPLOGTAILTARGET) pvUserState;
+
+	const size_t END_OFFSET = (size_t) nOffset + nLength;
+
+	long nTotalBytesSent = 0;
+
+	while ((size_t) nOffset < END_OFFSET) {
+		/* A binary client gets the lines in data frames, each with a
+		 * header in front of as much of the segment as fits in it */
+		size_t nChunkEnd = END_OFFSET;
+
+		if (lpTarget->bFramed) {
+			if (END_OFFSET - (size_t) nOffset > BINARY_MAX_PAYLOAD_LEN) {
+				nChunkEnd = (size_t) nOffset + BINARY_MAX_PAYLOAD_LEN;
+			}
+
+			if (!SendFrameHeader(lpTarget->nSocket, BINARY_OP_DATA,
+					nChunkEnd - (size_t) nOffset)) {
+				return -1;
+			}
+
+			nTotalBytesSent += BINARY_FRAME_HEADER_SIZE;
+		}
+
+		while ((size_t) nOffset < nChunkEnd) {
+			ssize_t nBytesSent = sendfile(lpTarget->nSocket, nSegmentFd,
+					&nOffset, nChunkEnd - (size_t) nOffset);
+			if (nBytesSent < 0 && errno == EINTR) {
+				continue;
+			}
+
+			if (nBytesSent <= 0) {
+				return -1;
+			}
+
+			nTotalBytesSent += nBytesSent;
+		}
+	}
+
+	return nTotalBytesSent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CopyLogRange function - Reads a range of a segment file a chunk at a time,
+// and hands each chunk to the caller's routine.
+//
+
+long CopyLogRange(int nSegmentFd, off_t nOffset, size_t nLength,
+		void* pvUserState) {
+	const LPLOGTAILTARGET lpTarget = (LPLOGTAILTARGET) pvUserState;
+
+	char chunk[LOG_COPY_CHUNK_SIZE];
+
+	const size_t END_OFFSET = (size_t) nOffset + nLength;
+
+	long nTotalBytesSent = 0;
+
+	while ((size_t) nOffset < END_OFFSET) {
+		size_t nChunkLength = END_OFFSET - (size_t) nOffset;
+		if (nChunkLength > LOG_COPY_CHUNK_SIZE) {
+			nChunkLength = LOG_COPY_CHUNK_SIZE;
+		}
+
+		ssize_t nBytesRead = pread(nSegmentFd, chunk, nChunkLength, nOffset);
+		if (nBytesRead < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (nBytesRead <= 0) {
+			return -1;
+		}
+
+		const long nBytesSent = lpTarget->lpfnDataRoutine(
+				lpTarget->pvUserState, chunk, (size_t) nBytesRead);
+		if (nBytesSent < 0) {
+			return -1;
+		}
+
+		nOffset += nBytesRead;
+		nTotalBytesSent += nBytesSent;
+	}
+
+	return nTotalBytesSent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// AppendToMessageLog function
+
+BOOL AppendToMessageLog(LPMESSAGELOG lpLog, const char* pszHeader,
+		const char* pszLine) {
+	if (lpLog == NULL || IsNullOrWhiteSpace(pszLine)) {
+		return FALSE;
+	}
+
+	const size_t HEADER_LENGTH = pszHeader == NULL ? 0 : strlen(pszHeader);
+	const size_t LINE_LENGTH = strlen(pszLine);
+	const BOOL NEEDS_NEWLINE = pszLine[LINE_LENGTH - 1] != '\n';
+	const size_t RECORD_LENGTH = HEADER_LENGTH + LINE_LENGTH
+			+ (NEEDS_NEWLINE ? 1 : 0);
+
+	if (RECORD_LENGTH > LOG_SEGMENT_SIZE) {
+		return FALSE;
+	}
+
+	BOOL bResult = FALSE;
+
+	LockMutex(lpLog->hMutex);
+	{
+		if (lpLog->pSegmentData != NULL
+				&& (lpLog->nWritePosition + RECORD_LENGTH <= LOG_SEGMENT_SIZE
+						|| RollSegment(lpLog))) {
+			if (lpLog->nNextSequence == lpLog->nBaseSequence
+					|| (lpLog->nNextSequence - lpLog->nBaseSequence)
+							% LOG_INDEX_INTERVAL == 0) {
+				WriteIndexEntry(lpLog);
+			}
+
+			char* pchDest = lpLog->pSegmentData + lpLog->nWritePosition;
+
+			memcpy(pchDest, pszHeader, HEADER_LENGTH);
+			memcpy(pchDest + HEADER_LENGTH, pszLine, LINE_LENGTH);
+			if (NEEDS_NEWLINE) {
+				pchDest[RECORD_LENGTH - 1] = '\n';
+			}
+
+			/* Sequence numbers count lines, which is what recovery counts */
+			for (size_t i = 0; i < RECORD_LENGTH; i++) {
+				if (pchDest[i] == '\n') {
+					lpLog->nNextSequence++;
+				}
+			}
+
+			lpLog->nWritePosition += RECORD_LENGTH;
+			lpLog->bSyncPending = TRUE;
+
+			bResult = TRUE;
+		}
+	}
+	UnlockMutex(lpLog->hMutex);
+
+	return bResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CloseMessageLog function
+
+void CloseMessageLog(LPMESSAGELOG lpLog) {
+	if (lpLog == NULL || INVALID_HANDLE_VALUE == g_hMessageLogListMutex) {
+		return;
+	}
+
+	LockMutex(g_hMessageLogListMutex);
+	{
+		LPPOSITION pos = FindElement(g_pMessageLogList, lpLog,
+				FindMessageLog);
+		if (pos != NULL) {
+			g_pMessageLogList = pos;
+			RemoveElement(&g_pMessageLogList, FreeMessageLog);
+		}
+	}
+	UnlockMutex(g_hMessageLogListMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CopyMessageLogTail function
+
+long CopyMessageLogTail(LPMESSAGELOG lpLog, int nLineCount,
+		LPLOG_DATA_ROUTINE lpfnDataRoutine, void* pvUserState) {
+	if (lpLog == NULL || lpfnDataRoutine == NULL || nLineCount <= 0) {
+		return -1;
+	}
+
+	LOGTAILTARGET target;
+	memset(&target, 0, sizeof(LOGTAILTARGET));
+
+	target.lpfnDataRoutine = lpfnDataRoutine;
+	target.pvUserState = pvUserState;
+
+	return ForEachLogTailRange(lpLog, nLineCount, CopyLogRange, &target);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetDirectMessageLog function
+
+LPMESSAGELOG GetDirectMessageLog() {
+	return g_lpDirectMessageLog;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// OpenMessageLog function
+
+LPMESSAGELOG OpenMessageLog(const char* pszName) {
+	if (IsNullOrWhiteSpace(pszName)
+			|| INVALID_HANDLE_VALUE == g_hMessageLogListMutex) {
+		return NULL;	// message logging is not running
+	}
+
+	LPMESSAGELOG lpLog = (LPMESSAGELOG) malloc(1 * sizeof(MESSAGELOG));
+	if (lpLog == NULL) {
+		fprintf(stderr, OUT_OF_MEMORY);
+
+		CleanupServer(ERROR);
+	}
+
+	memset(lpLog, 0, 1 * sizeof(MESSAGELOG));
+
+	snprintf(lpLog->szDirectory, PATH_MAX, "%s/%s", LOG_DIRECTORY_PATH,
+			pszName);
+
+	lpLog->nSegmentFd = -1;
+	lpLog->nIndexFd = -1;
+	lpLog->nRetiredSegmentFd = -1;
+	lpLog->nRetiredIndexFd = -1;
+
+	uint64_t nBaseSequence = 0;
+
+	if (!MakeDirectories(lpLog->szDirectory)
+			|| !(FindNewestSegment(lpLog, &nBaseSequence)
+					? RecoverSegment(lpLog, nBaseSequence)
+					: CreateSegment(lpLog, 0))) {
+		fprintf(stderr, MESSAGE_LOG_OPEN_FAILED, lpLog->szDirectory,
+				strerror(errno));
+
+		free(lpLog);
+		return NULL;
+	}
+
+	lpLog->hMutex = CreateMutex();
+	if (INVALID_HANDLE_VALUE == lpLog->hMutex) {
+		CleanupServer(ERROR);
+	}
+
+	LockMutex(g_hMessageLogListMutex);
+	{
+		AddElementToTail(&g_pMessageLogList, lpLog);
+	}
+	UnlockMutex(g_hMessageLogListMutex);
+
+	return lpLog;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendMessageLogTail function
+
+long SendMessageLogTail(LPMESSAGELOG lpLog, int nSocket, int nLineCount,
+		BOOL bFramed) {
+	if (lpLog == NULL || !IsSocketValid(nSocket) || nLineCount <= 0) {
+		return -1;
+	}
+
+	LOGTAILTARGET target;
+	memset(&target, 0, sizeof(LOGTAILTARGET));
+
+	target.nSocket = nSocket;
+	target.bFramed = bFramed;
+
+	return ForEachLogTailRange(lpLog, nLineCount, SendLogRange, &target);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StartMessageLogging function
+
+void StartMessageLogging() {
+	if (INVALID_HANDLE_VALUE != g_hMessageLogListMutex) {
+		return;
+	}
+
+	g_hMessageLogListMutex = CreateMutex();
+	if (INVALID_HANDLE_VALUE == g_hMessageLogListMutex) {
+		CleanupServer(ERROR);
+	}
+
+	g_lpDirectMessageLog = OpenMessageLog(LOG_DM_NAME);
+
+	g_bShouldTerminateLogFlusher = FALSE;
+
+	g_hLogFlusherThread = CreateThread(LogFlusherThread);
+	if (INVALID_HANDLE_VALUE == g_hLogFlusherThread) {
+		fprintf(stderr, FAILED_LAUNCH_LOG_FLUSHER_THREAD);
+
+		CleanupServer(ERROR);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StopMessageLogging function
+
+void StopMessageLogging() {
+	if (INVALID_HANDLE_VALUE == g_hMessageLogListMutex) {
+		return;
+	}
+
+	if (INVALID_HANDLE_VALUE != g_hLogFlusherThread) {
+		g_bShouldTerminateLogFlusher = TRUE;
+
+		WaitThread(g_hLogFlusherThread);
+		DestroyThread(g_hLogFlusherThread);
+
+		g_hLogFlusherThread = INVALID_HANDLE_VALUE;
+	}
+
+	/* Any logs that are still open (such as the direct message log) are
+	 * synced and closed now */
+	LockMutex(g_hMessageLogListMutex);
+	{
+		ClearList(&g_pMessageLogList, FreeMessageLog);
+	}
+	UnlockMutex(g_hMessageLogListMutex);
+
+	g_lpDirectMessageLog = NULL;
+
+	DestroyMutex(g_hMessageLogListMutex);
+	g_hMessageLogListMutex = INVALID_HANDLE_VALUE;
+}
@@ -0,0 +1,168 @@
+// message_scanner.c - Implementation of the scanner that picks the hashtags
+// and at-mentions out of the text of a chat message.
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "message_scanner.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// IsTokenChar function - Per protocol, hashtags can be any phrase with no
+// spaces and no '@' char.  Nicknames follow the same rules.
+//
+
+BOOL IsTokenChar(char ch) {
+	return ch != '\0' && ch != '@' && ch != '#'
+			&& !isspace((unsigned char) ch);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CopyToken function - Copies the nLength chars at pchStart into pszDest,
+// leaving off any trailing punctuation, and converting them to lowercase if
+// bToLower is TRUE.  Returns FALSE if nothing is left or if the result is
+// longer than nMaxLength chars.
+//
+
+BOOL CopyToken(char* pszDest, const char* pchStart, int nLength,
+		int nMaxLength, BOOL bToLower) {
+	while (nLength > 0 && ispunct((unsigned char) pchStart[nLength - 1])
+			&& pchStart[nLength - 1] != '_') {
+		nLength--;	// e.g., "#toofunny." is the hashtag "toofunny"
+	}
+
+	if (nLength <= 0 || nLength > nMaxLength) {
+		return FALSE;
+	}
+
+	for (int i = 0; i < nLength; i++) {
+		pszDest[i] = bToLower
+				? (char) tolower((unsigned char) pchStart[i]) : pchStart[i];
+	}
+	pszDest[nLength] = '\0';
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AddHashtag function - Adds a hashtag to the tokens found so far, unless it
+// is invalid, it is a duplicate, or there is no more room.
+//
+
+void AddHashtag(LPMESSAGETOKENS lpTokens, const char* pchStart, int nLength) {
+	if (lpTokens->nHashtagCount == MAX_HASHTAGS_PER_MESSAGE) {
+		return;
+	}
+
+	char* pszHashtag = lpTokens->szHashtags[lpTokens->nHashtagCount];
+	if (!CopyToken(pszHashtag, pchStart, nLength, MAX_HASHTAG_LEN, TRUE)) {
+		return;
+	}
+
+	for (int i = 0; i < lpTokens->nHashtagCount; i++) {
+		if (Equals(lpTokens->szHashtags[i], pszHashtag)) {
+			return;	// duplicate
+		}
+	}
+
+	lpTokens->nHashtagCount++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AddMention function - Adds a mentioned nickname to the tokens found so far,
+// unless it is invalid, it is a duplicate, or there is no more room.
+//
+
+void AddMention(LPMESSAGETOKENS lpTokens, const char* pchStart, int nLength) {
+	if (lpTokens->nMentionCount == MAX_MENTIONS_PER_MESSAGE) {
+		return;
+	}
+
+	char* pszNickname = lpTokens->szMentions[lpTokens->nMentionCount];
+	if (!CopyToken(pszNickname, pchStart, nLength, MAX_NICKNAME_LEN, FALSE)) {
+		return;
+	}
+
+	for (int i = 0; i < lpTokens->nMentionCount; i++) {
+		if (Equals(lpTokens->szMentions[i], pszNickname)) {
+			return;	// duplicate
+		}
+	}
+
+	lpTokens->nMentionCount++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// NormalizeHashtag function
+
+BOOL NormalizeHashtag(char* pszDest, const char* pszSource) {
+	if (pszDest == NULL || IsNullOrWhiteSpace(pszSource)) {
+		return FALSE;
+	}
+
+	if (*pszSource == '#') {
+		pszSource++;
+	}
+
+	int nLength = 0;
+	while (IsTokenChar(pszSource[nLength])) {
+		nLength++;
+	}
+
+	if (pszSource[nLength] != '\0') {
+		return FALSE;	// hashtags cannot have spaces or '@' chars in them
+	}
+
+	return CopyToken(pszDest, pszSource, nLength, MAX_HASHTAG_LEN, TRUE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ScanMessageTokens function - Walks the message exactly once.  A '#' or '@'
+// char starts a token unless it directly follows a letter or a number (so
+// that, e.g., e-mail addresses are not taken to be mentions).
+//
+
+void ScanMessageTokens(const char* pszMessage, LPMESSAGETOKENS lpTokens) {
+	if (lpTokens == NULL) {
+		return;
+	}
+
+	lpTokens->nHashtagCount = 0;
+	lpTokens->nMentionCount = 0;
+
+	if (IsNullOrWhiteSpace(pszMessage)) {
+		return;
+	}
+
+	const char* pch = pszMessage;
+	char chPrevious = ' ';
+
+	while (*pch != '\0') {
+		if ((*pch != '#' && *pch != '@')
+				|| isalnum((unsigned char) chPrevious)) {
+			chPrevious = *pch++;
+			continue;
+		}
+
+		const char chMarker = *pch;
+
+		const char* pchStart = ++pch;
+		while (IsTokenChar(*pch)) {
+			pch++;
+		}
+
+		if (chMarker == '#') {
+			AddHashtag(lpTokens, pchStart, (int) (pch - pchStart));
+		} else {
+			AddMention(lpTokens, pchStart, (int) (pch - pchStart));
+		}
+
+		chPrevious = pch[-1];
+	}
+}
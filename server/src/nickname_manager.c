@@ -8,15 +8,292 @@
 #include "client_list_manager.h"
 #include "client_manager.h"
 #include "client_struct.h"
+#include "client_thread_functions.h"
+#include "federation.h"
 #include "server_functions.h"
 #include "nickname_manager.h"
+#include "nickname_ring.h"
+#include "presence.h"
+#include "room_manager.h"
+#include "roster.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Global variables (used in this file only)
+
+/**
+ * @brief Buckets of the nickname index.  Each bucket is a singly-linked chain
+ * of NICKNAMEENTRY instances.
+ */
+LPNICKNAMEENTRY g_apNicknameBuckets[NICKNAME_INDEX_BUCKET_COUNT];
+
+/**
+ * @brief Handle to the mutex that guards the nickname index.
+ */
+HMUTEX g_hNicknameIndexMutex = INVALID_HANDLE_VALUE;
 
 ///////////////////////////////////////////////////////////////////////////////
 // Internally-used functions
 
+///////////////////////////////////////////////////////////////////////////////
+// GetNicknameBucket function
+
+unsigned int GetNicknameBucket(const char* pszNickname) {
+    return GetStringHash(pszNickname) & (NICKNAME_INDEX_BUCKET_COUNT - 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FindNicknameEntry function - Looks up a nickname in the index.  Does a
+// case-sensitive comparison, the same as FindClientByNickname.  The caller
+// must hold the index mutex.
+//
+
+LPNICKNAMEENTRY FindNicknameEntry(const char* pszNickname) {
+    LPNICKNAMEENTRY lpEntry =
+            g_apNicknameBuckets[GetNicknameBucket(pszNickname)];
+
+    while (lpEntry != NULL && !Equals(lpEntry->szNickname, pszNickname)) {
+        lpEntry = lpEntry->pNext;
+    }
+
+    return lpEntry;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ClaimNickname function - Adds the nickname to the index on behalf of the
+// client, unless another client has already claimed it.  Checking for and
+// claiming the nickname happen under the same lock, so two clients can never
+// both register the same nickname.
+//
+
+BOOL ClaimNickname(LPCLIENTSTRUCT lpClient, const char* pszNickname) {
+    LPNICKNAMEENTRY lpEntry =
+            (LPNICKNAMEENTRY) malloc(1 * sizeof(NICKNAMEENTRY));
+    if (lpEntry == NULL) {
+        fprintf(stderr, OUT_OF_MEMORY);
+        CleanupServer(ERROR);
+    }
+
+    memset(lpEntry, 0, 1 * sizeof(NICKNAMEENTRY));
+    strcpy(lpEntry->szNickname, pszNickname);
+    lpEntry->lpClient = lpClient;
+
+    BOOL bClaimed = FALSE;
+
+    LockMutex(g_hNicknameIndexMutex);
+    {
+        if (FindNicknameEntry(pszNickname) == NULL) {
+            const unsigned int nBucket = GetNicknameBucket(pszNickname);
+
+            lpEntry->pNext = g_apNicknameBuckets[nBucket];
+            g_apNicknameBuckets[nBucket] = lpEntry;
+
+            lpClient->lpNicknameEntry = lpEntry;
+            bClaimed = TRUE;
+
+            AddToRoster(pszNickname);
+        }
+    }
+    UnlockMutex(g_hNicknameIndexMutex);
+
+    if (!bClaimed) {
+        free(lpEntry);
+    }
+
+    return bClaimed;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // Externally-exposed functions
 
+///////////////////////////////////////////////////////////////////////////////
+// AssignClientNickname function
+
+BOOL AssignClientNickname(LPCLIENTSTRUCT lpClient, const char* pszNickname) {
+    if (lpClient == NULL || IsNullOrWhiteSpace(pszNickname)) {
+        return FALSE;
+    }
+
+    const int NICKNAME_LENGTH = strlen(pszNickname);
+    if (NICKNAME_LENGTH > MAX_NICKNAME_LEN) {
+        return FALSE;
+    }
+
+    if (!ClaimNickname(lpClient, pszNickname)) {
+        return FALSE;
+    }
+
+    // Allocate a buffer to hold the nickname and make sure to leave
+    // room for the null terminator
+    lpClient->pszNickname = (char*) malloc(
+            (NICKNAME_LENGTH + 1)* sizeof(char));
+    if (lpClient->pszNickname == NULL) {
+        fprintf(stderr, OUT_OF_MEMORY);
+        CleanupServer(ERROR);
+    }
+
+    memset(lpClient->pszNickname, 0, (NICKNAME_LENGTH + 1)*sizeof(char));
+
+    strcpy(lpClient->pszNickname, pszNickname);
+
+    /* Build the prefix of the client's chat messages now, so that it does
+     * not have to be formatted for each one of them */
+    lpClient->szChatPrefix[0] = '!';
+    memcpy(lpClient->szChatPrefix + 1, pszNickname, NICKNAME_LENGTH);
+    memcpy(lpClient->szChatPrefix + 1 + NICKNAME_LENGTH, ": ", 3);
+    lpClient->nChatPrefixLength = NICKNAME_LENGTH + 3;
+
+    return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateNicknameIndex function
+
+void CreateNicknameIndex() {
+    if (INVALID_HANDLE_VALUE != g_hNicknameIndexMutex) {
+        return;
+    }
+
+    memset(g_apNicknameBuckets, 0, sizeof(g_apNicknameBuckets));
+
+    g_hNicknameIndexMutex = CreateMutex();
+    if (INVALID_HANDLE_VALUE == g_hNicknameIndexMutex) {
+        CleanupServer(ERROR);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DeliverMentionNotifications function
+
+int DeliverMentionNotifications(LPMESSAGETOKENS lpTokens,
+        const char* pszChatMessage, LPCLIENTSTRUCT lpSendingClient) {
+    int nTotalBytesSent = 0;
+
+    if (lpTokens == NULL || lpTokens->nMentionCount == 0) {
+        return nTotalBytesSent;	// Nobody mentioned; nothing to do.
+    }
+
+    if (IsNullOrWhiteSpace(pszChatMessage) || lpSendingClient == NULL
+            || lpSendingClient->lpRoom == NULL) {
+        return nTotalBytesSent;
+    }
+
+    char szPrefix[BUFLEN];
+    memset(szPrefix, 0, BUFLEN);
+
+    sprintf(szPrefix, MENTION_NOTIFICATION_PREFIX,
+            lpSendingClient->pszNickname, lpSendingClient->lpRoom->szName);
+
+    char* pszNotification = NULL;
+
+    PrependTo(&pszNotification, szPrefix, pszChatMessage);
+
+    if (pszNotification == NULL) {
+        return nTotalBytesSent;
+    }
+
+    LockMutex(g_hNicknameIndexMutex);
+    {
+        for (int i = 0; i < lpTokens->nMentionCount; i++) {
+            LPNICKNAMEENTRY lpEntry =
+                    FindNicknameEntry(lpTokens->szMentions[i]);
+            if (lpEntry == NULL) {
+                continue;	// no such chatter
+            }
+
+            LPCLIENTSTRUCT lpMentionedClient = lpEntry->lpClient;
+
+            /* Chatters in the sender's room who have not muted it see the
+             * message itself, so they need no notification. */
+            if (lpMentionedClient == lpSendingClient
+                    || (lpMentionedClient->lpRoom == lpSendingClient->lpRoom
+                            && !lpMentionedClient->bMuted)) {
+                continue;
+            }
+
+            int nBytesSent = 0;
+
+            if ((nBytesSent = SendToClient(lpMentionedClient,
+                    pszNotification)) > 0) {
+                nTotalBytesSent += nBytesSent;
+            }
+        }
+    }
+    UnlockMutex(g_hNicknameIndexMutex);
+
+    free(pszNotification);
+    pszNotification = NULL;
+
+    return nTotalBytesSent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DestroyNicknameIndex function
+
+void DestroyNicknameIndex() {
+    if (INVALID_HANDLE_VALUE == g_hNicknameIndexMutex) {
+        return;
+    }
+
+    LockMutex(g_hNicknameIndexMutex);
+    {
+        for (int i = 0; i < NICKNAME_INDEX_BUCKET_COUNT; i++) {
+            while (g_apNicknameBuckets[i] != NULL) {
+                LPNICKNAMEENTRY lpEntry = g_apNicknameBuckets[i];
+                g_apNicknameBuckets[i] = lpEntry->pNext;
+
+                free(lpEntry);
+            }
+        }
+    }
+    UnlockMutex(g_hNicknameIndexMutex);
+
+    DestroyMutex(g_hNicknameIndexMutex);
+    g_hNicknameIndexMutex = INVALID_HANDLE_VALUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ForEachNickname function
+
+void ForEachNickname(void (*lpfnAction)(const char*)) {
+    if (lpfnAction == NULL || INVALID_HANDLE_VALUE == g_hNicknameIndexMutex) {
+        return;
+    }
+
+    LockMutex(g_hNicknameIndexMutex);
+    {
+        for (int i = 0; i < NICKNAME_INDEX_BUCKET_COUNT; i++) {
+            for (LPNICKNAMEENTRY lpEntry = g_apNicknameBuckets[i];
+                    lpEntry != NULL; lpEntry = lpEntry->pNext) {
+                lpfnAction(lpEntry->szNickname);
+            }
+        }
+    }
+    UnlockMutex(g_hNicknameIndexMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetClientByNickname function
+
+LPCLIENTSTRUCT GetClientByNickname(const char* pszNickname) {
+    if (IsNullOrWhiteSpace(pszNickname)) {
+        return NULL;
+    }
+
+    LPCLIENTSTRUCT lpClient = NULL;
+
+    LockMutex(g_hNicknameIndexMutex);
+    {
+        LPNICKNAMEENTRY lpEntry = FindNicknameEntry(pszNickname);
+        if (lpEntry != NULL) {
+            lpClient = lpEntry->lpClient;
+            AddClientRef(lpClient);
+        }
+    }
+    UnlockMutex(g_hNicknameIndexMutex);
+
+    return lpClient;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // GetNicknameFromClient function
 
@@ -102,24 +379,26 @@ BOOL RegisterClientNickname(LPCLIENTSTRUCT lpSendingClient, char* pszBuffer) {
         return TRUE;   // command handled but error occurred
     }
 
-    // Check to ensure the requested nickname isn't already taken
-    if (NULL !=
-            FindElement(g_pClientList, szNickname, FindClientByNickname)) {
+    // Check to ensure the requested nickname isn't already taken, and if
+    // it isn't, reserve it for this client
+    if (!AssignClientNickname(lpSendingClient, szNickname)) {
     	lpSendingClient->nBytesSent +=
     			ReplyToClient(lpSendingClient, ERROR_NICKNAME_IN_USE);
         return TRUE; // command handled but error occurred
     }
 
-    // Allocate a buffer to hold the nickname and make sure to leave
-    // room for the null terminator
-    lpSendingClient->pszNickname = (char*) malloc(
-            (NICKNAME_LENGTH + 1)* sizeof(char));
-    memset(lpSendingClient->pszNickname, 0,
-            (NICKNAME_LENGTH + 1)*sizeof(char));
+    // If we are part of a cluster, the nickname's owner has to agree that no
+    // chatter on another server has it
+    if (!ClaimClusterNickname(szNickname)) {
+    	ReleaseNickname(lpSendingClient);
 
-    // Copy the contents of the buffer referenced by pszNickname to that
-    // referenced by lpClientStruct->pszNickname
-    strcpy(lpSendingClient->pszNickname, szNickname);
+    	free(lpSendingClient->pszNickname);
+    	lpSendingClient->pszNickname = NULL;
+
+    	lpSendingClient->nBytesSent +=
+    			ReplyToClient(lpSendingClient, ERROR_NICKNAME_IN_USE);
+        return TRUE; // command handled but error occurred
+    }
 
     // Now send the user a reply telling them OK your nickname is <bla>
     sprintf(szReplyBuffer, OK_NICK_REGISTERED,
@@ -128,16 +407,61 @@ BOOL RegisterClientNickname(LPCLIENTSTRUCT lpSendingClient, char* pszBuffer) {
     lpSendingClient->nBytesSent +=
     		ReplyToClient(lpSendingClient, szReplyBuffer);
 
+    /* Catch the new chatter up on what was said before they arrived */
+    ReplayRoomHistory(lpSendingClient);
+
     /* Now, tell everyone (except the new guy)
      * that a new chatter has joined! Yay!! */
 
-    sprintf(szReplyBuffer, NEW_CHATTER_JOINED, lpSendingClient->pszNickname);
-
     /** Tell ALL connected clients (except the one that just
      * joined) that there's a new connected client. */
-    BroadcastToAllClientsExceptSender(szReplyBuffer, lpSendingClient);
+    AnnouncePresence(lpSendingClient->pszNickname, TRUE, lpSendingClient);
+
+    /* ...including the ones connected to the other servers */
+    PublishRoomEvent(PEER_EVENT_JOIN, NULL, lpSendingClient->pszNickname,
+    		NULL);
 
     return TRUE;    // command handled successfully
 }
 
 ///////////////////////////////////////////////////////////////////////////////
+// ReleaseNickname function
+
+void ReleaseNickname(LPCLIENTSTRUCT lpClient) {
+    if (lpClient == NULL || lpClient->lpNicknameEntry == NULL) {
+        return;
+    }
+
+    char szNickname[MAX_NICKNAME_LEN + 1];
+    memset(szNickname, 0, MAX_NICKNAME_LEN + 1);
+
+    LockMutex(g_hNicknameIndexMutex);
+    {
+        LPNICKNAMEENTRY lpEntry = lpClient->lpNicknameEntry;
+
+        strcpy(szNickname, lpEntry->szNickname);
+
+        LPNICKNAMEENTRY* ppLink =
+                &g_apNicknameBuckets[GetNicknameBucket(lpEntry->szNickname)];
+
+        while (*ppLink != NULL && *ppLink != lpEntry) {
+            ppLink = &((*ppLink)->pNext);
+        }
+
+        if (*ppLink != NULL) {
+            *ppLink = lpEntry->pNext;
+        }
+
+        lpClient->lpNicknameEntry = NULL;
+
+        RemoveFromRoster(szNickname);
+
+        free(lpEntry);
+    }
+    UnlockMutex(g_hNicknameIndexMutex);
+
+    /* Let the chatters on the other servers have it, too */
+    ReleaseClusterNickname(szNickname);
+}
+
+///////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,633 @@
+// nickname_ring.c - Implementation of the consistent-hash ring that spreads
+// the job of keeping nicknames unique over the servers of a cluster.
+//
+// Each node has NICKNAME_RING_VIRTUAL_NODES points on a 64-bit ring.  The
+// owner of a nickname is the node of the first point at or after the hash of
+// the nickname.  Only the owner is asked whether a nickname is free, so
+// registering a nickname, or finding the server a DM recipient is on, takes
+// one round trip however many servers there are; and when a server joins or
+// leaves, only the nicknames next to its points change owners.
+//
+// The ring is made of this server and the servers it is linked to directly,
+// so every server must be linked to every other (a full mesh) for them all to
+// agree on the owners.  Whenever the ring changes, each server claims the
+// nicknames of its chatters again from their (possibly new) owners.
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "client_manager.h"
+#include "client_thread_functions.h"
+#include "federation.h"
+#include "nickname_manager.h"
+#include "nickname_ring.h"
+#include "server_functions.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Global variables (used in this file only)
+
+/**
+ * @brief Points of the ring, sorted by hash.
+ */
+NICKNAMERINGPOINT g_ringPoints[(FEDERATION_MAX_LINKS + 1)
+		* NICKNAME_RING_VIRTUAL_NODES];
+
+/**
+ * @brief Count of points on the ring.
+ */
+int g_nRingPointCount = 0;
+
+/**
+ * @brief Handle to the mutex that guards the ring.
+ */
+HMUTEX g_hNicknameRingMutex = INVALID_HANDLE_VALUE;
+
+/**
+ * @brief Buckets of the table of claims on the nicknames this server owns.
+ */
+LPNICKNAMECLAIM g_apNicknameClaimBuckets[NICKNAME_INDEX_BUCKET_COUNT];
+
+/**
+ * @brief Handle to the mutex that guards the table of claims.
+ */
+HMUTEX g_hNicknameClaimMutex = INVALID_HANDLE_VALUE;
+
+/**
+ * @brief Claims and lookups that are waiting for their answers.
+ */
+NICKNAMEREQUEST g_nicknameRequests[NICKNAME_MAX_PENDING_REQUESTS];
+
+/**
+ * @brief ID of the most recent claim or lookup.
+ */
+uint64_t g_nLastNicknameRequestId = 0;
+
+/**
+ * @brief Handle to the mutex that guards the requests.
+ */
+HMUTEX g_hNicknameRequestMutex = INVALID_HANDLE_VALUE;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// MixHash function - Scrambles the bits of a 64-bit value (the SplitMix64
+// finalizer), so that points of nodes whose IDs are close together are not
+// bunched up on the ring.
+//
+
+uint64_t MixHash(uint64_t nValue) {
+	nValue ^= nValue >> 30;
+	nValue *= 0xbf58476d1ce4e5b9ULL;
+	nValue ^= nValue >> 27;
+	nValue *= 0x94d049bb133111ebULL;
+	nValue ^= nValue >> 31;
+
+	return nValue;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetNicknameHash function - FNV-1a hash of a nickname, mixed.
+//
+
+uint64_t GetNicknameHash(const char* pszNickname) {
+	uint64_t nHash = 0xcbf29ce484222325ULL;
+
+	for (const char* pch = pszNickname; *pch != '\0'; pch++) {
+		nHash ^= (unsigned char) *pch;
+		nHash *= 0x100000001b3ULL;
+	}
+
+	return MixHash(nHash);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ComparePoints function - Orders the points of the ring by hash, for qsort.
+//
+
+int ComparePoints(const void* pvLeft, const void* pvRight) {
+	const LPNICKNAMERINGPOINT lpLeft = (const LPNICKNAMERINGPOINT) pvLeft;
+	const LPNICKNAMERINGPOINT lpRight = (const LPNICKNAMERINGPOINT) pvRight;
+
+	if (lpLeft->nHash != lpRight->nHash) {
+		return lpLeft->nHash < lpRight->nHash ? -1 : 1;
+	}
+
+	/* On the off chance of a tie, every server must break it the same way */
+	if (lpLeft->nNodeId != lpRight->nNodeId) {
+		return lpLeft->nNodeId < lpRight->nNodeId ? -1 : 1;
+	}
+
+	return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetClaimBucket function
+
+unsigned int GetClaimBucket(const char* pszNickname) {
+	return GetStringHash(pszNickname) & (NICKNAME_INDEX_BUCKET_COUNT - 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RecordNicknameClaim function - Records a nickname as taken by a chatter on
+// the node specified.  Returns FALSE if a chatter on another node has it.
+//
+
+BOOL RecordNicknameClaim(const char* pszNickname, uint32_t nNodeId) {
+	BOOL bResult = FALSE;
+
+	LockMutex(g_hNicknameClaimMutex);
+	{
+		const unsigned int nBucket = GetClaimBucket(pszNickname);
+
+		LPNICKNAMECLAIM lpClaim = g_apNicknameClaimBuckets[nBucket];
+		while (lpClaim != NULL && !Equals(lpClaim->szNickname, pszNickname)) {
+			lpClaim = lpClaim->pNext;
+		}
+
+		if (lpClaim != NULL) {
+			bResult = lpClaim->nHolderNodeId == nNodeId;
+		} else {
+			lpClaim = (LPNICKNAMECLAIM) malloc(1 * sizeof(NICKNAMECLAIM));
+			if (lpClaim != NULL) {
+				memset(lpClaim, 0, 1 * sizeof(NICKNAMECLAIM));
+				strcpy(lpClaim->szNickname, pszNickname);
+				lpClaim->nHolderNodeId = nNodeId;
+
+				lpClaim->pNext = g_apNicknameClaimBuckets[nBucket];
+				g_apNicknameClaimBuckets[nBucket] = lpClaim;
+
+				bResult = TRUE;
+			}
+		}
+	}
+	UnlockMutex(g_hNicknameClaimMutex);
+
+	return bResult;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RemoveNicknameClaims function - Removes the claims that match a nickname
+// (or any nickname, if pszNickname is NULL) and a holder (or any holder, if
+// nNodeId is zero) and, if bForeignOnly is TRUE, that this server does not
+// own any longer.
+//
+
+void RemoveNicknameClaims(const char* pszNickname, uint32_t nNodeId,
+		BOOL bForeignOnly) {
+	LockMutex(g_hNicknameClaimMutex);
+	{
+		for (int i = 0; i < NICKNAME_INDEX_BUCKET_COUNT; i++) {
+			if (pszNickname != NULL && (unsigned int) i
+					!= GetClaimBucket(pszNickname)) {
+				continue;
+			}
+
+			LPNICKNAMECLAIM* ppLink = &g_apNicknameClaimBuckets[i];
+			while (*ppLink != NULL) {
+				LPNICKNAMECLAIM lpClaim = *ppLink;
+
+				if ((pszNickname == NULL
+						|| Equals(lpClaim->szNickname, pszNickname))
+						&& (nNodeId == 0 || lpClaim->nHolderNodeId == nNodeId)
+						&& (!bForeignOnly || GetNicknameOwner(
+								lpClaim->szNickname) != GetLocalNodeId())) {
+					*ppLink = lpClaim->pNext;
+					free(lpClaim);
+				} else {
+					ppLink = &(lpClaim->pNext);
+				}
+			}
+		}
+	}
+	UnlockMutex(g_hNicknameClaimMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetNicknameHolder function - Gets the node ID of the server whose chatter
+// has a nickname this server owns, or zero if nobody has it.
+//
+
+uint32_t GetNicknameHolder(const char* pszNickname) {
+	uint32_t nHolderNodeId = 0;
+
+	LockMutex(g_hNicknameClaimMutex);
+	{
+		LPNICKNAMECLAIM lpClaim =
+				g_apNicknameClaimBuckets[GetClaimBucket(pszNickname)];
+		while (lpClaim != NULL && !Equals(lpClaim->szNickname, pszNickname)) {
+			lpClaim = lpClaim->pNext;
+		}
+
+		if (lpClaim != NULL) {
+			nHolderNodeId = lpClaim->nHolderNodeId;
+		}
+	}
+	UnlockMutex(g_hNicknameClaimMutex);
+
+	return nHolderNodeId;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendNicknameRequest function - Sends a claim or lookup to the owner of a
+// nickname and waits for the answer.  Returns FALSE if none came within
+// NICKNAME_REQUEST_TIMEOUT_MS.
+//
+
+BOOL SendNicknameRequest(uint32_t nOwnerNodeId, int nType,
+		const char* pszNickname, uint32_t* pnResult) {
+	LPNICKNAMEREQUEST lpRequest = NULL;
+	uint64_t nRequestId = 0;
+
+	LockMutex(g_hNicknameRequestMutex);
+	{
+		for (int i = 0; i < NICKNAME_MAX_PENDING_REQUESTS; i++) {
+			if (g_nicknameRequests[i].nRequestId == 0) {
+				lpRequest = &(g_nicknameRequests[i]);
+
+				nRequestId = ++g_nLastNicknameRequestId;
+
+				lpRequest->nRequestId = nRequestId;
+				lpRequest->nResult = 0;
+				atomic_store(&(lpRequest->bAnswered), 0);
+				break;
+			}
+		}
+	}
+	UnlockMutex(g_hNicknameRequestMutex);
+
+	if (lpRequest == NULL) {
+		return FALSE;	// too many chatters are waiting already
+	}
+
+	BOOL bAnswered = FALSE;
+
+	if (SendToPeerNode(nOwnerNodeId, nType, nRequestId, pszNickname, NULL)) {
+		for (int nWaited = 0; nWaited < NICKNAME_REQUEST_TIMEOUT_MS;
+				nWaited += NICKNAME_REQUEST_POLL_INTERVAL_MS) {
+			if (atomic_load(&(lpRequest->bAnswered))) {
+				break;
+			}
+
+			usleep(NICKNAME_REQUEST_POLL_INTERVAL_MS * 1000);
+		}
+	}
+
+	LockMutex(g_hNicknameRequestMutex);
+	{
+		bAnswered = atomic_load(&(lpRequest->bAnswered)) ? TRUE : FALSE;
+		*pnResult = lpRequest->nResult;
+
+		lpRequest->nRequestId = 0;
+	}
+	UnlockMutex(g_hNicknameRequestMutex);
+
+	return bAnswered;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CompleteNicknameRequest function - Hands the result of a reply to the
+// thread that is waiting for it.
+//
+
+void CompleteNicknameRequest(uint64_t nRequestId, uint32_t nResult) {
+	LockMutex(g_hNicknameRequestMutex);
+	{
+		for (int i = 0; i < NICKNAME_MAX_PENDING_REQUESTS; i++) {
+			if (g_nicknameRequests[i].nRequestId == nRequestId) {
+				g_nicknameRequests[i].nResult = nResult;
+				atomic_store(&(g_nicknameRequests[i].bAnswered), 1);
+				break;
+			}
+		}
+	}
+	UnlockMutex(g_hNicknameRequestMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendNicknameReply function
+
+void SendNicknameReply(uint32_t nNodeId, uint64_t nRequestId,
+		uint32_t nResult) {
+	char szResult[NICKNAME_REPLY_MAX_LEN + 1];
+	sprintf(szResult, "%u", nResult);
+
+	SendToPeerNode(nNodeId, PEER_EVENT_NICKNAME_REPLY, nRequestId, NULL,
+			szResult);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// AnnounceNickname function - Claims the nickname of one of this server's
+// chatters from its owner.  Used after the ring has changed; no answer is
+// waited for.
+//
+
+void AnnounceNickname(const char* pszNickname) {
+	const uint32_t OWNER_NODE_ID = GetNicknameOwner(pszNickname);
+
+	if (OWNER_NODE_ID == GetLocalNodeId()) {
+		RecordNicknameClaim(pszNickname, OWNER_NODE_ID);
+		return;
+	}
+
+	SendToPeerNode(OWNER_NODE_ID, PEER_EVENT_NICKNAME_CLAIM, 0, pszNickname,
+			NULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DeliverRemoteDirectMessage function - Sends a line of a direct message that
+// came from a chatter on another server to its recipient here.
+//
+
+void DeliverRemoteDirectMessage(const char* pszRecipient, LPPEEREVENT lpEvent) {
+	if (lpEvent->nTextLength == 0) {
+		return;
+	}
+
+	LPCLIENTSTRUCT lpRecipient = GetClientByNickname(pszRecipient);
+	if (lpRecipient == NULL) {
+		return;	// disconnected since the sender looked it up
+	}
+
+	char* pszMessage = (char*) malloc(lpEvent->nTextLength + 1);
+	if (pszMessage != NULL) {
+		memcpy(pszMessage, lpEvent->pchText, lpEvent->nTextLength);
+		pszMessage[lpEvent->nTextLength] = '\0';
+
+		SendToClient(lpRecipient, pszMessage);
+
+		free(pszMessage);
+	}
+
+	ReleaseClient(lpRecipient);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// ClaimClusterNickname function
+
+BOOL ClaimClusterNickname(const char* pszNickname) {
+	if (!IsFederationRunning() || IsNullOrWhiteSpace(pszNickname)) {
+		return TRUE;	// the local nickname index has the final say
+	}
+
+	const uint32_t OWNER_NODE_ID = GetNicknameOwner(pszNickname);
+
+	if (OWNER_NODE_ID == GetLocalNodeId()) {
+		return RecordNicknameClaim(pszNickname, OWNER_NODE_ID);
+	}
+
+	uint32_t nResult = 0;
+	if (!SendNicknameRequest(OWNER_NODE_ID, PEER_EVENT_NICKNAME_CLAIM,
+			pszNickname, &nResult)) {
+		/* The owner is unreachable; it will be told about the nickname when
+		 * the ring is rebuilt without it */
+		return TRUE;
+	}
+
+	return nResult != 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateNicknameRing function
+
+void CreateNicknameRing() {
+	if (INVALID_HANDLE_VALUE != g_hNicknameRingMutex) {
+		return;
+	}
+
+	g_hNicknameRingMutex = CreateMutex();
+	g_hNicknameClaimMutex = CreateMutex();
+	g_hNicknameRequestMutex = CreateMutex();
+	if (INVALID_HANDLE_VALUE == g_hNicknameRingMutex
+			|| INVALID_HANDLE_VALUE == g_hNicknameClaimMutex
+			|| INVALID_HANDLE_VALUE == g_hNicknameRequestMutex) {
+		CleanupServer(ERROR);
+	}
+
+	memset(g_apNicknameClaimBuckets, 0, sizeof(g_apNicknameClaimBuckets));
+	memset(g_nicknameRequests, 0, sizeof(g_nicknameRequests));
+
+	RebuildNicknameRing();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ForgetNodeNicknames function
+
+void ForgetNodeNicknames(uint32_t nNodeId) {
+	if (INVALID_HANDLE_VALUE == g_hNicknameClaimMutex || nNodeId == 0) {
+		return;
+	}
+
+	/* There may be more than one link to the same server */
+	uint32_t nNodeIds[FEDERATION_MAX_LINKS];
+	const int NODE_COUNT = GetLinkedNodeIds(nNodeIds, FEDERATION_MAX_LINKS);
+	for (int i = 0; i < NODE_COUNT; i++) {
+		if (nNodeIds[i] == nNodeId) {
+			return;
+		}
+	}
+
+	RemoveNicknameClaims(NULL, nNodeId, FALSE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetNicknameOwner function - Binary-searches the ring for the first point at
+// or after the hash of the nickname.
+//
+
+uint32_t GetNicknameOwner(const char* pszNickname) {
+	uint32_t nOwnerNodeId = GetLocalNodeId();
+
+	if (INVALID_HANDLE_VALUE == g_hNicknameRingMutex
+			|| IsNullOrWhiteSpace(pszNickname)) {
+		return nOwnerNodeId;
+	}
+
+	const uint64_t HASH = GetNicknameHash(pszNickname);
+
+	LockMutex(g_hNicknameRingMutex);
+	{
+		if (g_nRingPointCount > 0) {
+			int nLow = 0;
+			int nHigh = g_nRingPointCount;
+
+			while (nLow < nHigh) {
+				const int MIDDLE = nLow + (nHigh - nLow) / 2;
+
+				if (g_ringPoints[MIDDLE].nHash < HASH) {
+					nLow = MIDDLE + 1;
+				} else {
+					nHigh = MIDDLE;
+				}
+			}
+
+			/* Past the last point, the ring wraps around to the first */
+			nOwnerNodeId = g_ringPoints[nLow % g_nRingPointCount].nNodeId;
+		}
+	}
+	UnlockMutex(g_hNicknameRingMutex);
+
+	return nOwnerNodeId;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// HandleNicknameEvent function
+
+void HandleNicknameEvent(uint32_t nFromNodeId, LPPEEREVENT lpEvent) {
+	if (lpEvent == NULL || INVALID_HANDLE_VALUE == g_hNicknameClaimMutex) {
+		return;
+	}
+
+	if (lpEvent->nType == PEER_EVENT_NICKNAME_REPLY) {
+		char szResult[NICKNAME_REPLY_MAX_LEN + 1];
+		memset(szResult, 0, NICKNAME_REPLY_MAX_LEN + 1);
+
+		if (lpEvent->nTextLength <= NICKNAME_REPLY_MAX_LEN) {
+			memcpy(szResult, lpEvent->pchText, lpEvent->nTextLength);
+		}
+
+		CompleteNicknameRequest(lpEvent->nSequence,
+				(uint32_t) strtoul(szResult, NULL, 10));
+		return;
+	}
+
+	char szNickname[MAX_NICKNAME_LEN + 1];
+	memset(szNickname, 0, MAX_NICKNAME_LEN + 1);
+
+	const BOOL IS_VALID = lpEvent->nNicknameLength > 0
+			&& lpEvent->nNicknameLength <= MAX_NICKNAME_LEN;
+	if (IS_VALID) {
+		memcpy(szNickname, lpEvent->pchNickname, lpEvent->nNicknameLength);
+	}
+
+	switch (lpEvent->nType) {
+		case PEER_EVENT_NICKNAME_CLAIM: {
+			const BOOL CLAIMED = IS_VALID
+					&& RecordNicknameClaim(szNickname, nFromNodeId);
+
+			if (lpEvent->nSequence != 0) {
+				SendNicknameReply(nFromNodeId, lpEvent->nSequence,
+						CLAIMED ? 1 : 0);
+			}
+			break;
+		}
+
+		case PEER_EVENT_NICKNAME_RELEASE:
+			if (IS_VALID) {
+				RemoveNicknameClaims(szNickname, nFromNodeId, FALSE);
+			}
+			break;
+
+		case PEER_EVENT_NICKNAME_LOOKUP:
+			SendNicknameReply(nFromNodeId, lpEvent->nSequence,
+					IS_VALID ? GetNicknameHolder(szNickname) : 0);
+			break;
+
+		case PEER_EVENT_DIRECT_MESSAGE:
+			if (IS_VALID) {
+				DeliverRemoteDirectMessage(szNickname, lpEvent);
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsNicknameEvent function
+
+BOOL IsNicknameEvent(int nType) {
+	return nType == PEER_EVENT_NICKNAME_CLAIM
+			|| nType == PEER_EVENT_NICKNAME_RELEASE
+			|| nType == PEER_EVENT_NICKNAME_LOOKUP
+			|| nType == PEER_EVENT_NICKNAME_REPLY
+			|| nType == PEER_EVENT_DIRECT_MESSAGE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RebuildNicknameRing function
+
+void RebuildNicknameRing() {
+	if (INVALID_HANDLE_VALUE == g_hNicknameRingMutex) {
+		return;
+	}
+
+	uint32_t nNodeIds[FEDERATION_MAX_LINKS + 1];
+	nNodeIds[0] = GetLocalNodeId();
+
+	const int NODE_COUNT = 1 + GetLinkedNodeIds(nNodeIds + 1,
+			FEDERATION_MAX_LINKS);
+
+	LockMutex(g_hNicknameRingMutex);
+	{
+		g_nRingPointCount = 0;
+
+		for (int i = 0; i < NODE_COUNT; i++) {
+			for (int j = 0; j < NICKNAME_RING_VIRTUAL_NODES; j++) {
+				LPNICKNAMERINGPOINT lpPoint =
+						&(g_ringPoints[g_nRingPointCount++]);
+
+				lpPoint->nNodeId = nNodeIds[i];
+				lpPoint->nHash = MixHash(((uint64_t) nNodeIds[i] << 32)
+						| (uint64_t) j);
+			}
+		}
+
+		qsort(g_ringPoints, g_nRingPointCount, sizeof(NICKNAMERINGPOINT),
+				ComparePoints);
+	}
+	UnlockMutex(g_hNicknameRingMutex);
+
+	/* Claims on nicknames that moved to other owners are theirs to keep now;
+	 * and our chatters' nicknames may have moved, so claim them again */
+	RemoveNicknameClaims(NULL, 0, TRUE);
+
+	ForEachNickname(AnnounceNickname);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReleaseClusterNickname function
+
+void ReleaseClusterNickname(const char* pszNickname) {
+	if (!IsFederationRunning() || IsNullOrWhiteSpace(pszNickname)) {
+		return;
+	}
+
+	const uint32_t OWNER_NODE_ID = GetNicknameOwner(pszNickname);
+
+	if (OWNER_NODE_ID == GetLocalNodeId()) {
+		RemoveNicknameClaims(pszNickname, OWNER_NODE_ID, FALSE);
+		return;
+	}
+
+	SendToPeerNode(OWNER_NODE_ID, PEER_EVENT_NICKNAME_RELEASE, 0, pszNickname,
+			NULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ResolveClusterNickname function
+
+uint32_t ResolveClusterNickname(const char* pszNickname) {
+	if (!IsFederationRunning() || IsNullOrWhiteSpace(pszNickname)) {
+		return 0;
+	}
+
+	const uint32_t OWNER_NODE_ID = GetNicknameOwner(pszNickname);
+
+	if (OWNER_NODE_ID == GetLocalNodeId()) {
+		return GetNicknameHolder(pszNickname);
+	}
+
+	uint32_t nHolderNodeId = 0;
+	if (!SendNicknameRequest(OWNER_NODE_ID, PEER_EVENT_NICKNAME_LOOKUP,
+			pszNickname, &nHolderNodeId)) {
+		return 0;
+	}
+
+	return nHolderNodeId;
+}
@@ -0,0 +1,494 @@
+// presence.c - Implementation of the notices that tell the chatters who has
+// joined and who has left, batched together during storms of joins and leaves
+//
+// The joins and leaves are counted over windows of PRESENCE_RATE_WINDOW_MS.
+// Once a window has PRESENCE_STORM_RATE of them, they are batched, and stay
+// batched for as long as any are waiting or being sent, so that a join or
+// leave is never announced before one that came earlier.  A batch holds the
+// joins and the leaves together, in the order they came in, so that a chatter
+// who joins and then leaves is never shown as having left first.  Only the
+// presence notice thread sends batches.  They are held back for longer the
+// faster the joins and leaves are coming, which caps the count of notices
+// each chatter is sent per second however big the storm.
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "client_list_manager.h"
+#include "client_manager.h"
+#include "client_thread_functions.h"
+#include "message_buffer.h"
+#include "presence.h"
+#include "server_functions.h"
+#include "shutdown.h"
+#include "timer_wheel.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Global variables (used in this file only)
+
+/**
+ * @brief Handle to the mutex that guards the batches and the counts of joins
+ * and leaves.
+ */
+static HMUTEX g_hPresenceMutex = INVALID_HANDLE_VALUE;
+
+/**
+ * @brief Handle to the thread that sends the batched notices.
+ */
+static HTHREAD g_hPresenceThread = INVALID_HANDLE_VALUE;
+
+/**
+ * @brief The joins and leaves that are waiting to be announced.
+ */
+static PRESENCEBATCH g_pendingPresence;
+
+/**
+ * @brief TRUE while the presence notice thread is sending a batch.  The joins
+ * and leaves that come in meanwhile are batched too, so that they are not
+ * announced ahead of it.
+ */
+static BOOL g_bPresenceBatchSending = FALSE;
+
+/**
+ * @brief ID of the last batch that was started.
+ */
+static uint64_t g_nLastPresenceBatchID = 0;
+
+/**
+ * @brief Time, in milliseconds on the monotonic clock, that the first of the
+ * joins or leaves that are waiting came in.
+ */
+static uint64_t g_nPresenceBatchStart = 0;
+
+/**
+ * @brief Time, in milliseconds, that the joins or leaves that are waiting
+ * are held back for.
+ */
+static uint64_t g_nPresenceBatchInterval = PRESENCE_BATCH_MIN_INTERVAL_MS;
+
+/**
+ * @brief Time, in milliseconds on the monotonic clock, that the current rate
+ * window started.
+ */
+static uint64_t g_nPresenceWindowStart = 0;
+
+/**
+ * @brief Counts of the joins and leaves in the current rate window, and in
+ * the one before it.
+ */
+static int g_nPresenceWindowCount = 0;
+static int g_nPresenceLastWindowCount = 0;
+
+/**
+ * @brief Counts of the joins and leaves, of those that were announced by
+ * themselves, of those that were batched, and of the batched notices sent.
+ */
+static atomic_ullong g_nPresenceEventCount = 0;
+static atomic_ullong g_nPresenceDirectCount = 0;
+static atomic_ullong g_nPresenceBatchedCount = 0;
+static atomic_ullong g_nPresenceNoticeCount = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// AddToPresenceBatch function - Adds a join or leave to a batch, naming the
+// chatter in the notice if the batch does not already name enough of them.
+//
+
+void AddToPresenceBatch(LPPRESENCEBATCH lpBatch, const char* pszNickname,
+		BOOL bJoined) {
+	if (lpBatch->nCount < PRESENCE_NAMED_NICKNAME_COUNT) {
+		char* pszEntry = lpBatch->szNicknames[lpBatch->nCount];
+
+		memset(pszEntry, 0, MAX_NICKNAME_LEN + 1);
+		strncpy(pszEntry, pszNickname, MAX_NICKNAME_LEN);
+
+		lpBatch->bNamedJoined[lpBatch->nCount] = bJoined;
+	}
+
+	if (bJoined) {
+		lpBatch->nJoinedCount++;
+	}
+
+	lpBatch->nCount++;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CountPresenceEvent function - Counts a join or leave in the current rate
+// window, starting a new window first if the current one is over.  Returns
+// the churn, which is the bigger of the counts of this window and the one
+// before, so that a storm does not look like it stopped just because a new
+// window started.  The caller must hold the presence mutex.
+//
+
+int CountPresenceEvent(uint64_t nNow) {
+	const uint64_t ELAPSED = nNow - g_nPresenceWindowStart;
+
+	if (ELAPSED >= PRESENCE_RATE_WINDOW_MS) {
+		g_nPresenceLastWindowCount = ELAPSED >= 2 * PRESENCE_RATE_WINDOW_MS ?
+				0 : g_nPresenceWindowCount;
+
+		g_nPresenceWindowCount = 0;
+		g_nPresenceWindowStart = nNow;
+	}
+
+	g_nPresenceWindowCount++;
+
+	return g_nPresenceWindowCount > g_nPresenceLastWindowCount ?
+			g_nPresenceWindowCount : g_nPresenceLastWindowCount;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateMixedPresenceNotice function - Creates the notice for a batch that has
+// both joins and leaves in it, naming them in the order they came in, such as
+// "!@a joined, @b left, 3000 more joined and 1998 more left."
+//
+
+LPMESSAGEBUFFER CreateMixedPresenceNotice(LPPRESENCEBATCH lpBatch) {
+	char szEntries[PRESENCE_NAMED_NICKNAME_COUNT + 2][MAX_NICKNAME_LEN + 32];
+	memset(szEntries, 0, sizeof(szEntries));
+
+	int nEntryCount = 0;
+	int nNamedJoinedCount = 0;
+
+	const int NAMED_COUNT = MinimumOf(lpBatch->nCount,
+			PRESENCE_NAMED_NICKNAME_COUNT);
+
+	for (int i = 0; i < NAMED_COUNT; i++) {
+		if (lpBatch->bNamedJoined[i]) {
+			nNamedJoinedCount++;
+		}
+
+		sprintf(szEntries[nEntryCount++], lpBatch->bNamedJoined[i] ?
+				PRESENCE_MIXED_JOINED_FORMAT : PRESENCE_MIXED_LEFT_FORMAT,
+				lpBatch->szNicknames[i]);
+	}
+
+	const int OTHERS_JOINED = lpBatch->nJoinedCount - nNamedJoinedCount;
+	const int OTHERS_LEFT = lpBatch->nCount - NAMED_COUNT - OTHERS_JOINED;
+
+	if (OTHERS_JOINED > 0) {
+		sprintf(szEntries[nEntryCount++], PRESENCE_MIXED_MORE_JOINED_FORMAT,
+				OTHERS_JOINED);
+	}
+
+	if (OTHERS_LEFT > 0) {
+		sprintf(szEntries[nEntryCount++], PRESENCE_MIXED_MORE_LEFT_FORMAT,
+				OTHERS_LEFT);
+	}
+
+	char szText[sizeof(szEntries) + 16];
+	memset(szText, 0, sizeof(szText));
+
+	for (int i = 0; i < nEntryCount; i++) {
+		if (i > 0) {
+			strcat(szText, i == nEntryCount - 1 ? " and " : ", ");
+		}
+
+		strcat(szText, szEntries[i]);
+	}
+
+	return CreateMessageFromTemplate(PRESENCE_MIXED_NOTICE, szText);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreatePresenceNotice function - Creates the notice for a batch of joins and
+// leaves.  A batch of only joins, or only leaves, gets a notice such as
+// "!@a, @b and 4998 others joined the chat room."
+//
+
+LPMESSAGEBUFFER CreatePresenceNotice(LPPRESENCEBATCH lpBatch) {
+	const BOOL IS_ALL_JOINS = lpBatch->nJoinedCount == lpBatch->nCount;
+
+	if (!IS_ALL_JOINS && lpBatch->nJoinedCount > 0) {
+		return CreateMixedPresenceNotice(lpBatch);
+	}
+
+	/* The first nickname gets its '@' from the template */
+	char szNicknames[PRESENCE_NAMED_NICKNAME_COUNT * (MAX_NICKNAME_LEN + 7)
+			+ 32];
+	memset(szNicknames, 0, sizeof(szNicknames));
+
+	const int NAMED_COUNT = MinimumOf(lpBatch->nCount,
+			PRESENCE_NAMED_NICKNAME_COUNT);
+	const int OTHER_COUNT = lpBatch->nCount - NAMED_COUNT;
+
+	for (int i = 0; i < NAMED_COUNT; i++) {
+		if (i > 0) {
+			strcat(szNicknames, i == NAMED_COUNT - 1 && OTHER_COUNT == 0 ?
+					" and @" : ", @");
+		}
+
+		strcat(szNicknames, lpBatch->szNicknames[i]);
+	}
+
+	if (OTHER_COUNT == 1) {
+		strcat(szNicknames, PRESENCE_ONE_OTHER);
+	} else if (OTHER_COUNT > 1) {
+		sprintf(szNicknames + strlen(szNicknames), PRESENCE_OTHERS_FORMAT,
+				OTHER_COUNT);
+	}
+
+	return CreateMessageFromTemplate(
+			IS_ALL_JOINS ? NEW_CHATTER_JOINED : NEW_CHATTER_LEFT, szNicknames);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetPresenceBatchInterval function - Works out how long to hold back the
+// joins and leaves for, given the churn: the minimum at the storm rate, and
+// longer in proportion as the churn goes up.
+//
+
+uint64_t GetPresenceBatchInterval(int nChurn) {
+	const uint64_t INTERVAL = (uint64_t) PRESENCE_BATCH_MIN_INTERVAL_MS
+			* nChurn / PRESENCE_STORM_RATE;
+
+	if (INTERVAL < PRESENCE_BATCH_MIN_INTERVAL_MS) {
+		return PRESENCE_BATCH_MIN_INTERVAL_MS;
+	}
+
+	if (INTERVAL > PRESENCE_BATCH_MAX_INTERVAL_MS) {
+		return PRESENCE_BATCH_MAX_INTERVAL_MS;
+	}
+
+	return INTERVAL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendPresenceBatch function - Sends the notice for a batch of joins and
+// leaves to all the clients, except those of the chatters in the batch.
+//
+
+void SendPresenceBatch(LPPRESENCEBATCH lpBatch) {
+	if (lpBatch == NULL || lpBatch->nCount <= 0) {
+		return;
+	}
+
+	LPMESSAGEBUFFER lpNotice = CreatePresenceNotice(lpBatch);
+	if (lpNotice == NULL) {
+		return;
+	}
+
+	LogInfo(SERVER_DATA_FORMAT, lpNotice->szData);
+
+	if (GetLogFileHandle() != stdout) {
+		fprintf(stdout, SERVER_DATA_FORMAT, lpNotice->szData);
+	}
+
+	LockMutex(GetClientListMutex());
+	{
+		POSITION* pos = GetHeadPosition(g_pClientList);
+
+		while (pos != NULL) {
+			LPCLIENTSTRUCT lpCurrentClient = (LPCLIENTSTRUCT) (pos->pvData);
+
+			pos = GetNextPosition(pos);
+
+			/* Skip the chatters that the notice is about */
+			if (lpCurrentClient == NULL
+					|| atomic_load(&(lpCurrentClient->nPresenceBatchID))
+							== lpBatch->nBatchID) {
+				continue;
+			}
+
+			SendBuffersToClient(lpCurrentClient, &lpNotice, 1);
+		}
+	}
+	UnlockMutex(GetClientListMutex());
+
+	ReleaseMessageBuffer(lpNotice);
+
+	atomic_fetch_add(&g_nPresenceNoticeCount, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SendDuePresenceBatch function - Sends the batched notice, if the joins and
+// leaves that are waiting have been held back for long enough.
+//
+
+void SendDuePresenceBatch() {
+	PRESENCEBATCH batch;
+
+	LockMutex(g_hPresenceMutex);
+	{
+		const BOOL IS_DUE = g_pendingPresence.nCount > 0
+				&& GetMonotonicMilliseconds() - g_nPresenceBatchStart
+						>= g_nPresenceBatchInterval;
+
+		if (!IS_DUE) {
+			UnlockMutex(g_hPresenceMutex);
+			return;
+		}
+
+		batch = g_pendingPresence;
+
+		memset(&g_pendingPresence, 0, sizeof(PRESENCEBATCH));
+
+		/* Until the batch has gone out, the joins and leaves that come in
+		 * are batched behind it, rather than announced ahead of it */
+		g_bPresenceBatchSending = TRUE;
+	}
+	UnlockMutex(g_hPresenceMutex);
+
+	SendPresenceBatch(&batch);
+
+	LockMutex(g_hPresenceMutex);
+	{
+		g_bPresenceBatchSending = FALSE;
+	}
+	UnlockMutex(g_hPresenceMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PresenceNotifierThread thread procedure - Sends the batched notices when
+// they are due, until the server shuts down.
+//
+
+void* PresenceNotifierThread(void* pvData) {
+	BeginStoppableThread();
+
+	struct pollfd pfd;
+	pfd.fd = GetShutdownEventFd();
+	pfd.events = POLLIN;
+
+	while (!IsShutdownRequested()) {
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, PRESENCE_BATCH_MIN_INTERVAL_MS) < 0
+				&& errno != EINTR) {
+			break;
+		}
+
+		if (IsShutdownRequested()) {
+			break;
+		}
+
+		SendDuePresenceBatch();
+	}
+
+	EndStoppableThread();
+
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// AnnouncePresence function
+
+void AnnouncePresence(const char* pszNickname, BOOL bJoined,
+		LPCLIENTSTRUCT lpClient) {
+	if (IsNullOrWhiteSpace(pszNickname)) {
+		return;
+	}
+
+	atomic_fetch_add(&g_nPresenceEventCount, 1);
+
+	BOOL bBatched = FALSE;
+
+	if (INVALID_HANDLE_VALUE != g_hPresenceMutex) {
+		LockMutex(g_hPresenceMutex);
+		{
+			const uint64_t NOW = GetMonotonicMilliseconds();
+			const int CHURN = CountPresenceEvent(NOW);
+
+			const BOOL IS_WAITING = g_pendingPresence.nCount > 0;
+
+			if (CHURN >= PRESENCE_STORM_RATE || IS_WAITING
+					|| g_bPresenceBatchSending) {
+				if (!IS_WAITING) {
+					g_pendingPresence.nBatchID = ++g_nLastPresenceBatchID;
+
+					g_nPresenceBatchStart = NOW;
+				}
+
+				g_nPresenceBatchInterval = GetPresenceBatchInterval(CHURN);
+
+				AddToPresenceBatch(&g_pendingPresence, pszNickname, bJoined);
+
+				if (lpClient != NULL) {
+					atomic_store(&(lpClient->nPresenceBatchID),
+							g_pendingPresence.nBatchID);
+				}
+
+				bBatched = TRUE;
+			}
+		}
+		UnlockMutex(g_hPresenceMutex);
+	}
+
+	/* The presence notice thread sends the batch when it is due */
+	if (bBatched) {
+		atomic_fetch_add(&g_nPresenceBatchedCount, 1);
+		return;
+	}
+
+	atomic_fetch_add(&g_nPresenceDirectCount, 1);
+
+	LPMESSAGEBUFFER lpNotice = CreateMessageFromTemplate(
+			bJoined ? NEW_CHATTER_JOINED : NEW_CHATTER_LEFT, pszNickname);
+
+	/* Tell ALL connected clients (except the chatter who came or went) */
+	BroadcastBufferToAllClientsExceptSender(lpNotice, lpClient);
+
+	ReleaseMessageBuffer(lpNotice);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReportPresenceStats function
+
+void ReportPresenceStats() {
+	const unsigned long long EVENTS = atomic_load(&g_nPresenceEventCount);
+	const unsigned long long DIRECT = atomic_load(&g_nPresenceDirectCount);
+	const unsigned long long BATCHED = atomic_load(&g_nPresenceBatchedCount);
+	const unsigned long long NOTICES = atomic_load(&g_nPresenceNoticeCount);
+
+	fprintf(stdout, PRESENCE_STATS, EVENTS, DIRECT, BATCHED, NOTICES);
+
+	if (GetLogFileHandle() != stdout) {
+		LogInfo(PRESENCE_STATS, EVENTS, DIRECT, BATCHED, NOTICES);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StartPresenceNotifier function
+
+void StartPresenceNotifier() {
+	if (INVALID_HANDLE_VALUE != g_hPresenceMutex) {
+		return;
+	}
+
+	memset(&g_pendingPresence, 0, sizeof(PRESENCEBATCH));
+
+	g_nPresenceWindowStart = GetMonotonicMilliseconds();
+
+	g_hPresenceMutex = CreateMutex();
+	if (INVALID_HANDLE_VALUE == g_hPresenceMutex) {
+		CleanupServer(ERROR);
+	}
+
+	g_hPresenceThread = CreateThread(PresenceNotifierThread);
+	if (INVALID_HANDLE_VALUE == g_hPresenceThread) {
+		fprintf(stderr, FAILED_LAUNCH_PRESENCE_THREAD);
+
+		CleanupServer(ERROR);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StopPresenceNotifier function
+
+void StopPresenceNotifier() {
+	if (INVALID_HANDLE_VALUE == g_hPresenceThread) {
+		return;
+	}
+
+	/* The thread is woken by the shutdown eventfd, and stops */
+	WaitThread(g_hPresenceThread);
+
+	DestroyThread(g_hPresenceThread);
+	g_hPresenceThread = INVALID_HANDLE_VALUE;
+}
@@ -0,0 +1,348 @@
+// rate_limiter.c - Implementation of the per-client limits on how fast chat
+// messages may be sent
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "client_manager.h"
+#include "client_struct.h"
+#include "client_thread_functions.h"
+#include "mailbox.h"
+#include "rate_limiter.h"
+#include "shutdown.h"
+#include "timer_wheel.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Global variables (used in this file only)
+
+/**
+ * @brief Rates, and burst size, that every client is held to.  Set from the
+ * command line before any client connects, and only read after that.
+ */
+static long g_nMessagesPerSecond = RATE_LIMIT_DEFAULT_MESSAGES_PER_SECOND;
+static long g_nBytesPerSecond = RATE_LIMIT_DEFAULT_BYTES_PER_SECOND;
+static long g_nBurstSeconds = RATE_LIMIT_DEFAULT_BURST_SECONDS;
+
+/**
+ * @brief One of the RATE_LIMIT_POLICY_* values, saying what is done with a
+ * client that sends too fast.
+ */
+static int g_nRateLimitPolicy = RATE_LIMIT_POLICY_QUEUE;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// InitializeTokenBucket function - Sets up a full token bucket.
+//
+
+void InitializeTokenBucket(LPTOKENBUCKET lpBucket, long nRatePerSecond,
+		uint64_t nNow) {
+	lpBucket->dRefillRate = (double) nRatePerSecond;
+	lpBucket->dCapacity = (double) (nRatePerSecond * g_nBurstSeconds);
+	lpBucket->dTokens = lpBucket->dCapacity;
+	lpBucket->nLastRefill = nNow;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RefillTokenBucket function - Adds the tokens that have accrued since the
+// bucket was last refilled, up to its capacity.
+//
+
+void RefillTokenBucket(LPTOKENBUCKET lpBucket, uint64_t nNow) {
+	const double ELAPSED_SECONDS = (double) (nNow - lpBucket->nLastRefill)
+			/ 1e9;
+
+	lpBucket->dTokens += ELAPSED_SECONDS * lpBucket->dRefillRate;
+	if (lpBucket->dTokens > lpBucket->dCapacity) {
+		lpBucket->dTokens = lpBucket->dCapacity;
+	}
+
+	lpBucket->nLastRefill = nNow;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetTokenBucketWait function - Gets how long, in seconds, it will be until a
+// bucket has the tokens given in it.  A request for more than the bucket can
+// hold is treated as a request for a full bucket, so that it is let through
+// eventually; the bucket then goes into debt.
+//
+
+double GetTokenBucketWait(LPTOKENBUCKET lpBucket, double dNeeded) {
+	if (lpBucket->dRefillRate <= 0.0) {
+		return 0.0;	// no limit
+	}
+
+	if (dNeeded > lpBucket->dCapacity) {
+		dNeeded = lpBucket->dCapacity;
+	}
+
+	if (lpBucket->dTokens >= dNeeded) {
+		return 0.0;
+	}
+
+	return (dNeeded - lpBucket->dTokens) / lpBucket->dRefillRate;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WaitForChatTokens function - Holds a client's thread until the time given
+// has gone by, while still writing out its mailbox and running its timing
+// wheel.  Returns FALSE if the wait was cut short because the server is
+// shutting down, the thread is to stop, or one of the client's timeouts
+// expired; the client loop deals with each of those when we return.
+//
+
+BOOL WaitForChatTokens(LPCLIENTSTRUCT lpClient, double dWait) {
+	const uint64_t DEADLINE = GetMonotonicNanoseconds()
+			+ (uint64_t) (dWait * 1e9) + 1;
+
+	struct pollfd pfds[2];
+
+	pfds[0].fd = GetShutdownEventFd();
+	pfds[0].events = POLLIN;
+	pfds[1].fd = lpClient->mailbox.nWakeFd;	/* poll() skips it if it is -1 */
+	pfds[1].events = POLLIN;
+
+	while (1) {
+		if (IsShutdownRequested() || ShouldClientThreadStop(lpClient)) {
+			return FALSE;
+		}
+
+		if (lpClient->lpTimerWheel != NULL) {
+			RunTimerWheel(lpClient->lpTimerWheel);
+		}
+
+		if (lpClient->nExpiredTimeout != TIMEOUT_KIND_NONE) {
+			return FALSE;
+		}
+
+		const uint64_t NOW = GetMonotonicNanoseconds();
+		if (NOW >= DEADLINE) {
+			return TRUE;
+		}
+
+		/* Never longer than one tick, so the wheel is run as often as the
+		 * client loop would run it */
+		int nTimeoutMs = (int) ((DEADLINE - NOW + 999999ULL) / 1000000ULL);
+		if (nTimeoutMs > TIMER_WHEEL_TICK_MS) {
+			nTimeoutMs = TIMER_WHEEL_TICK_MS;
+		}
+
+		pfds[0].revents = 0;
+		pfds[1].revents = 0;
+
+		if (poll(pfds, 2, nTimeoutMs) < 0 && errno != EINTR) {
+			return TRUE;	// fall back to letting the message through
+		}
+
+		if (pfds[0].revents != 0) {
+			return FALSE;
+		}
+
+		/* What the other threads send this client is not held up behind
+		 * its own flood */
+		if (pfds[1].revents & POLLIN) {
+			DeliverClientMailbox(lpClient);
+		}
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ParseRateLimitPolicy function - Turns the name of a policy into one of the
+// RATE_LIMIT_POLICY_* values, or -1 if the name is not known.
+//
+
+int ParseRateLimitPolicy(const char* pszName) {
+	if (EqualsNoCase(pszName, RATE_LIMIT_POLICY_QUEUE_NAME)) {
+		return RATE_LIMIT_POLICY_QUEUE;
+	}
+
+	if (EqualsNoCase(pszName, RATE_LIMIT_POLICY_DROP_NAME)) {
+		return RATE_LIMIT_POLICY_DROP;
+	}
+
+	if (EqualsNoCase(pszName, RATE_LIMIT_POLICY_DISCONNECT_NAME)) {
+		return RATE_LIMIT_POLICY_DISCONNECT;
+	}
+
+	return -1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// AdmitChatMessage function
+
+BOOL AdmitChatMessage(LPCLIENTSTRUCT lpSendingClient, size_t nLength) {
+	if (lpSendingClient == NULL) {
+		return FALSE;
+	}
+
+	LPTOKENBUCKET lpMessages = &(lpSendingClient->messageBucket);
+	LPTOKENBUCKET lpBytes = &(lpSendingClient->byteBucket);
+
+	uint64_t nNow = GetMonotonicNanoseconds();
+
+	RefillTokenBucket(lpMessages, nNow);
+	RefillTokenBucket(lpBytes, nNow);
+
+	double dWait = GetTokenBucketWait(lpMessages, 1.0);
+
+	const double BYTES_WAIT = GetTokenBucketWait(lpBytes, (double) nLength);
+	if (BYTES_WAIT > dWait) {
+		dWait = BYTES_WAIT;
+	}
+
+	if (dWait > 0.0) {
+		switch (g_nRateLimitPolicy) {
+		case RATE_LIMIT_POLICY_DROP:
+			lpSendingClient->nDroppedMessageCount++;
+
+			lpSendingClient->nBytesSent += ReplyToClient(lpSendingClient,
+					ERROR_RATE_LIMITED);
+			return FALSE;
+
+		case RATE_LIMIT_POLICY_DISCONNECT:
+			lpSendingClient->nDroppedMessageCount++;
+
+			lpSendingClient->nBytesSent += ReplyToClient(lpSendingClient,
+					ERROR_FLOOD_DISCONNECT);
+
+			EndChatSession(lpSendingClient);
+			return FALSE;
+
+		default:
+			/* Nothing more is read from the client while we wait, so the
+			 * rest of the flood waits in its socket, and then in its own
+			 * send buffer, rather than in our memory */
+			lpSendingClient->nThrottledMessageCount++;
+
+			if (!WaitForChatTokens(lpSendingClient, dWait)) {
+				return FALSE;
+			}
+
+			nNow = GetMonotonicNanoseconds();
+
+			RefillTokenBucket(lpMessages, nNow);
+			RefillTokenBucket(lpBytes, nNow);
+			break;
+		}
+	}
+
+	if (lpMessages->dRefillRate > 0.0) {
+		lpMessages->dTokens -= 1.0;
+	}
+
+	if (lpBytes->dRefillRate > 0.0) {
+		lpBytes->dTokens -= (double) nLength;
+	}
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ConfigureRateLimits function
+
+BOOL ConfigureRateLimits(int argc, char* argv[]) {
+	if (argc < MIN_NUM_ARGS || argv == NULL) {
+		return FALSE;
+	}
+
+	for (int i = 2; i < argc; i++) {
+		if (!IsRateLimitOption(argv[i])) {
+			continue;	// checked by the other parsers
+		}
+
+		if (i + 1 >= argc) {
+			return FALSE;
+		}
+
+		const char* pszOption = argv[i];
+		const char* pszValue = argv[++i];
+
+		if (EqualsNoCase(pszOption, RATE_LIMIT_POLICY_OPTION)) {
+			if ((g_nRateLimitPolicy = ParseRateLimitPolicy(pszValue)) < 0) {
+				return FALSE;
+			}
+			continue;
+		}
+
+		long lValue = 0;
+		int nResult = StringToLong(pszValue, &lValue);
+		if ((nResult != OK && nResult != EXACTLY_CORRECT) || lValue < 0) {
+			return FALSE;
+		}
+
+		if (EqualsNoCase(pszOption, RATE_LIMIT_MESSAGE_RATE_OPTION)) {
+			g_nMessagesPerSecond = lValue;
+		} else if (EqualsNoCase(pszOption, RATE_LIMIT_BYTE_RATE_OPTION)) {
+			g_nBytesPerSecond = lValue;
+		} else if (lValue > 0) {
+			g_nBurstSeconds = lValue;
+		} else {
+			return FALSE;	// a burst of nothing would let nothing through
+		}
+	}
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetMonotonicNanoseconds function
+
+uint64_t GetMonotonicNanoseconds() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// InitializeClientRateLimits function
+
+void InitializeClientRateLimits(LPCLIENTSTRUCT lpClient) {
+	if (lpClient == NULL) {
+		return;
+	}
+
+	const uint64_t NOW = GetMonotonicNanoseconds();
+
+	InitializeTokenBucket(&(lpClient->messageBucket), g_nMessagesPerSecond,
+			NOW);
+	InitializeTokenBucket(&(lpClient->byteBucket), g_nBytesPerSecond, NOW);
+
+	lpClient->nThrottledMessageCount = 0;
+	lpClient->nDroppedMessageCount = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsRateLimitOption function
+
+BOOL IsRateLimitOption(const char* pszOption) {
+	return EqualsNoCase(pszOption, RATE_LIMIT_MESSAGE_RATE_OPTION)
+			|| EqualsNoCase(pszOption, RATE_LIMIT_BYTE_RATE_OPTION)
+			|| EqualsNoCase(pszOption, RATE_LIMIT_BURST_OPTION)
+			|| EqualsNoCase(pszOption, RATE_LIMIT_POLICY_OPTION);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReportRateLimitStats function
+
+void ReportRateLimitStats(LPCLIENTSTRUCT lpClient, const char* pszClientID) {
+	if (lpClient == NULL || (lpClient->nThrottledMessageCount == 0
+			&& lpClient->nDroppedMessageCount == 0)) {
+		return;
+	}
+
+	fprintf(stdout, RATE_LIMIT_SESSION_STATS, pszClientID,
+			lpClient->nThrottledMessageCount, lpClient->nDroppedMessageCount);
+
+	if (GetLogFileHandle() != stdout) {
+		LogInfo(RATE_LIMIT_SESSION_STATS, pszClientID,
+				lpClient->nThrottledMessageCount,
+				lpClient->nDroppedMessageCount);
+	}
+}
@@ -0,0 +1,218 @@
+// room.c - Provides implementations of functions that create and/or
+// manipulate a ROOM instance (ROOM is a structure that keeps track of which
+// clients are in a particular chat room).
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "client_struct.h"
+#include "room.h"
+#include "server_functions.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// AddRoomMember function - Appends a client to the compact member array of
+// the room, growing the array if it is full.
+//
+
+BOOL AddRoomMember(LPROOM lpRoom, LPCLIENTSTRUCT lpClient) {
+	if (lpRoom == NULL || lpClient == NULL) {
+		return FALSE;	// Required parameter
+	}
+
+	if (lpRoom->nMemberCount == lpRoom->nMemberCapacity) {
+		/* Double the storage for the member array */
+		int nNewCapacity = lpRoom->nMemberCapacity == 0
+				? ROOM_INITIAL_MEMBER_CAPACITY
+				: 2 * lpRoom->nMemberCapacity;
+
+		LPCLIENTSTRUCT* ppNewMembers = (LPCLIENTSTRUCT*) realloc(
+				lpRoom->ppMembers, nNewCapacity * sizeof(LPCLIENTSTRUCT));
+		if (ppNewMembers == NULL) {
+			fprintf(stderr, OUT_OF_MEMORY);
+			return FALSE;
+		}
+
+		lpRoom->ppMembers = ppNewMembers;
+		lpRoom->nMemberCapacity = nNewCapacity;
+	}
+
+	lpClient->nRoomSlot = lpRoom->nMemberCount;
+	lpRoom->ppMembers[lpRoom->nMemberCount++] = lpClient;
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CloseRoomLog function
+
+void CloseRoomLog(void* pvRoom) {
+	if (pvRoom == NULL) {
+		return;
+	}
+
+	LPROOM lpRoom = (LPROOM) pvRoom;
+
+	if (lpRoom->lpLog != NULL) {
+		CloseMessageLog(lpRoom->lpLog);
+		lpRoom->lpLog = NULL;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateRoom function - Allocates memory for, and initializes, a new instance
+// of a ROOM structure having the name provided.
+//
+
+LPROOM CreateRoom(const char* pszName) {
+	if (!IsRoomNameValid(pszName)) {
+		ThrowNullReferenceException();
+	}
+
+	LPROOM lpRoom = (LPROOM) malloc(1 * sizeof(ROOM));
+	if (lpRoom == NULL) {
+		fprintf(stderr, OUT_OF_MEMORY);
+
+		CleanupServer(ERROR);
+	}
+
+	memset(lpRoom, 0, 1 * sizeof(ROOM));
+
+	strncpy(lpRoom->szName, pszName, MAX_ROOM_NAME_LEN);
+
+	/* Members are added to the room as they join it */
+	lpRoom->ppMembers = NULL;
+	lpRoom->nMemberCount = 0;
+	lpRoom->nMemberCapacity = 0;
+
+	lpRoom->hMemberMutex = CreateMutex();
+	if (INVALID_HANDLE_VALUE == lpRoom->hMemberMutex) {
+		CleanupServer(ERROR);
+	}
+
+	/* Nothing has been said in the room yet */
+	InitializeHistoryRing(&(lpRoom->historyRing));
+
+	/* ...since the server started, that is; the log of the room lives on
+	 * after the room is gone, and picks up where it left off */
+	OpenRoomLog(lpRoom);
+
+	/* Compression is only set up once a compressed member is sent something */
+	lpRoom->lpDeflateGroup = CreateDeflateGroup();
+
+	return lpRoom;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FindRoomByName function - Searches the list for a room with the specified
+// name.  Does a case-sensitive comparison, like FindClientByNickname.
+//
+
+BOOL FindRoomByName(void* pvName, void* pvRoom) {
+	if (pvName == NULL || pvRoom == NULL) {
+		return FALSE;	// Required parameter
+	}
+
+	return Equals((const char*) pvName, ((LPROOM) pvRoom)->szName);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// FreeRoom function - Releases operating system resources consumed by the
+// room structure.  Does not free the members themselves.
+//
+
+void FreeRoom(void* pvRoom) {
+	if (pvRoom == NULL) {
+		// Null pointer passed for the thing to be freed; nothing to do.
+		return;
+	}
+
+	LPROOM lpRoom = (LPROOM) pvRoom;
+
+	if (INVALID_HANDLE_VALUE != lpRoom->hMemberMutex) {
+		DestroyMutex(lpRoom->hMemberMutex);
+		lpRoom->hMemberMutex = INVALID_HANDLE_VALUE;
+	}
+
+	if (lpRoom->ppMembers != NULL) {
+		free(lpRoom->ppMembers);
+		lpRoom->ppMembers = NULL;
+	}
+
+	DestroyHistoryRing(&(lpRoom->historyRing));
+
+	CloseRoomLog(lpRoom);
+
+	FreeDeflateGroup(lpRoom->lpDeflateGroup);
+	lpRoom->lpDeflateGroup = NULL;
+
+	free(lpRoom);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsRoomNameValid function
+
+BOOL IsRoomNameValid(const char* pszName) {
+	if (IsNullOrWhiteSpace(pszName)) {
+		return FALSE;
+	}
+
+	int nLength = 0;
+	for (const char* pch = pszName; *pch != '\0'; pch++, nLength++) {
+		if (nLength == MAX_ROOM_NAME_LEN) {
+			return FALSE;	// too long
+		}
+
+		if (!isalnum((unsigned char) *pch)) {
+			return FALSE;	// only letters and numbers are allowed
+		}
+	}
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// OpenRoomLog function
+
+void OpenRoomLog(void* pvRoom) {
+	if (pvRoom == NULL) {
+		return;
+	}
+
+	LPROOM lpRoom = (LPROOM) pvRoom;
+	if (lpRoom->lpLog != NULL) {
+		return;	// already open
+	}
+
+	char szLogName[MAX_ROOM_NAME_LEN + sizeof(LOG_ROOM_NAME_FORMAT)];
+	memset(szLogName, 0, sizeof(szLogName));
+
+	sprintf(szLogName, LOG_ROOM_NAME_FORMAT, lpRoom->szName);
+
+	lpRoom->lpLog = OpenMessageLog(szLogName);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RemoveRoomMember function - Removes a client from the member array of the
+// room in constant time, by moving the last member into the vacated slot.
+//
+
+void RemoveRoomMember(LPROOM lpRoom, LPCLIENTSTRUCT lpClient) {
+	if (lpRoom == NULL || lpClient == NULL) {
+		return;	// Required parameter
+	}
+
+	const int nSlot = lpClient->nRoomSlot;
+	if (nSlot < 0 || nSlot >= lpRoom->nMemberCount
+			|| lpRoom->ppMembers[nSlot] != lpClient) {
+		return;	// not a member of this room
+	}
+
+	LPCLIENTSTRUCT lpLastMember = lpRoom->ppMembers[--lpRoom->nMemberCount];
+
+	lpRoom->ppMembers[nSlot] = lpLastMember;
+	lpLastMember->nRoomSlot = nSlot;
+
+	lpRoom->ppMembers[lpRoom->nMemberCount] = NULL;
+	lpClient->nRoomSlot = -1;
+}
@@ -0,0 +1,586 @@
+// room_manager.c - Implementations of the functions that move clients between
+// chat rooms and deliver messages to the members of a room.
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "client_manager.h"
+#include "client_thread_functions.h"
+#include "compression.h"
+#include "federation.h"
+#include "room.h"
+#include "room_manager.h"
+#include "server_functions.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// DeliverToRoomMembers function - Sends a message to each member of the room
+// except the sender (and, if bSkipMuted is TRUE, except the members that have
+// muted the room).  The caller must hold the member mutex of the room.
+//
+
+int DeliverToRoomMembers(LPROOM lpRoom, const char* pszMessage,
+		LPCLIENTSTRUCT lpSendingClient, BOOL bSkipMuted) {
+	int nTotalBytesSent = 0;
+
+	/* Members who asked for compression are sent the room's compressed
+	 * copy of the message, which is made at most once */
+	BeginDeflateGroupBatch(lpRoom->lpDeflateGroup);
+
+	for (int i = 0; i < lpRoom->nMemberCount; i++) {
+		LPCLIENTSTRUCT lpCurrentClient = lpRoom->ppMembers[i];
+
+		// Skip the sender; this function does not send back to them.
+		if (lpCurrentClient == lpSendingClient) {
+			continue;
+		}
+
+		if (bSkipMuted && lpCurrentClient->bMuted) {
+			continue;
+		}
+
+		int nBytesSent = 0;
+
+		if (lpCurrentClient->lpDeflateStream != NULL) {
+			nBytesSent = SendGroupMessageToClient(lpRoom->lpDeflateGroup,
+					lpCurrentClient, pszMessage);
+		} else {
+			nBytesSent = SendToClient(lpCurrentClient, pszMessage);
+		}
+
+		if (nBytesSent > 0) {
+			nTotalBytesSent += nBytesSent;
+		}
+	}
+
+	EndDeflateGroupBatch(lpRoom->lpDeflateGroup);
+
+	return nTotalBytesSent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RemoveClientFromRoom function - Takes the client out of the member array of
+// its current room, telling the remaining members with the notice provided
+// (if any).  Destroys the room if it is now empty and it is not the default
+// room.  The caller must hold the room-list mutex.
+//
+
+void RemoveClientFromRoom(LPCLIENTSTRUCT lpClient,
+		const char* pszLeaveNotice) {
+	LPROOM lpRoom = lpClient->lpRoom;
+	if (lpRoom == NULL) {
+		return;	// Not in a room; nothing to do.
+	}
+
+	BOOL bIsRoomEmpty = FALSE;
+
+	LockMutex(lpRoom->hMemberMutex);
+	{
+		RemoveRoomMember(lpRoom, lpClient);
+
+		LeaveDeflateGroup(lpClient);
+
+		if (!IsNullOrWhiteSpace(pszLeaveNotice)) {
+			DeliverToRoomMembers(lpRoom, pszLeaveNotice, lpClient, FALSE);
+		}
+
+		bIsRoomEmpty = lpRoom->nMemberCount == 0;
+	}
+	UnlockMutex(lpRoom->hMemberMutex);
+
+	lpClient->lpRoom = NULL;
+
+	if (!bIsRoomEmpty || Equals(lpRoom->szName, DEFAULT_ROOM_NAME)) {
+		return;
+	}
+
+	/* Nobody else can be referring to an empty room, since only a member
+	 * can broadcast to it, and joining requires the room-list mutex that
+	 * we are holding. */
+	LPPOSITION pos = FindElement(g_pRoomList, lpRoom->szName, FindRoomByName);
+	if (pos != NULL) {
+		g_pRoomList = pos;
+		RemoveElement(&g_pRoomList, FreeRoom);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MoveClientToRoom function - Moves the client into the room having the name
+// specified, creating it if necessary.  Leaves the client where it is if the
+// room would need to be created but the maximum count of rooms exists.
+//
+
+LPROOM MoveClientToRoom(LPCLIENTSTRUCT lpClient, const char* pszRoomName,
+		const char* pszLeaveNotice) {
+	LPROOM lpRoom = NULL;
+
+	LockMutex(GetRoomListMutex());
+	{
+		LPPOSITION pos = FindElement(g_pRoomList, (void*) pszRoomName,
+				FindRoomByName);
+		if (pos != NULL) {
+			lpRoom = (LPROOM) (pos->pvData);
+		} else if (GetElementCount(g_pRoomList) < MAX_ROOM_COUNT) {
+			lpRoom = CreateRoom(pszRoomName);
+			AddElementToTail(&g_pRoomList, lpRoom);
+		}
+
+		if (lpRoom != NULL && lpRoom != lpClient->lpRoom) {
+			RemoveClientFromRoom(lpClient, pszLeaveNotice);
+
+			LockMutex(lpRoom->hMemberMutex);
+			{
+				if (AddRoomMember(lpRoom, lpClient)) {
+					lpClient->lpRoom = lpRoom;
+				}
+			}
+			UnlockMutex(lpRoom->hMemberMutex);
+		}
+	}
+	UnlockMutex(GetRoomListMutex());
+
+	return lpClient->lpRoom == lpRoom ? lpRoom : NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BroadcastToRoom function - Logs a message and sends it to the members of a
+// room.
+//
+
+int BroadcastToRoom(LPROOM lpRoom, const char* pszMessage,
+		LPCLIENTSTRUCT lpSendingClient, BOOL bSkipMuted) {
+	int nTotalBytesSent = 0;
+
+	if (lpRoom == NULL) {
+		return nTotalBytesSent;	// Nothing to do.
+	}
+
+	if (IsNullOrWhiteSpace(pszMessage)) {
+		// Message to broadcast is blank; nothing to do.
+		return nTotalBytesSent;
+	}
+
+	LogInfo(SERVER_DATA_FORMAT, pszMessage);
+
+	if (GetLogFileHandle() != stdout) {
+		fprintf(stdout, SERVER_DATA_FORMAT, pszMessage);
+	}
+
+	LockMutex(lpRoom->hMemberMutex);
+	{
+		nTotalBytesSent = DeliverToRoomMembers(lpRoom, pszMessage,
+				lpSendingClient, bSkipMuted);
+	}
+	UnlockMutex(lpRoom->hMemberMutex);
+
+	return nTotalBytesSent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DeliverToRoomByName function - Sends a message that came from a peer server
+// to the members of the room having the name specified, if it has any members
+// on this server.  If bIsChat is TRUE, the message is also kept in the room's
+// history and log, just as if it had been said here.
+//
+
+int DeliverToRoomByName(const char* pszRoomName, const char* pszMessage,
+		BOOL bIsChat) {
+	int nTotalBytesSent = 0;
+
+	if (!IsRoomNameValid(pszRoomName) || IsNullOrWhiteSpace(pszMessage)) {
+		return nTotalBytesSent;	// Nothing to do.
+	}
+
+	/* The room-list mutex is held throughout, so that the room cannot be
+	 * freed by its last member leaving while we deliver to it */
+	LockMutex(GetRoomListMutex());
+	{
+		LPPOSITION pos = FindElement(g_pRoomList, (void*) pszRoomName,
+				FindRoomByName);
+		if (pos != NULL) {
+			LPROOM lpRoom = (LPROOM) (pos->pvData);
+
+			nTotalBytesSent = BroadcastToRoom(lpRoom, pszMessage, NULL,
+					bIsChat);
+
+			if (bIsChat) {
+				LPMESSAGEBUFFER lpMessage = CreateMessageBuffer(NULL,
+						pszMessage);
+
+				AddToHistoryRing(&(lpRoom->historyRing), lpMessage);
+				AppendToMessageLog(lpRoom->lpLog, NULL, lpMessage->szData);
+
+				ReleaseMessageBuffer(lpMessage);
+			}
+		}
+	}
+	UnlockMutex(GetRoomListMutex());
+
+	return nTotalBytesSent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// BroadcastChatToRoom function
+
+int BroadcastChatToRoom(LPROOM lpRoom, LPMESSAGEBUFFER lpMessage,
+		LPCLIENTSTRUCT lpSendingClient) {
+	if (lpRoom == NULL || lpMessage == NULL) {
+		return 0;	// Nothing to do.
+	}
+
+	int nTotalBytesSent = BroadcastToRoom(lpRoom, lpMessage->szData,
+			lpSendingClient, TRUE);
+
+	AddToHistoryRing(&(lpRoom->historyRing), lpMessage);
+
+	/* Logging comes after delivery, and only copies the message into the
+	 * mapped log segment; the disk write happens on the log flusher thread */
+	AppendToMessageLog(lpRoom->lpLog, NULL, lpMessage->szData);
+
+	/* Members of the room who are connected to other servers get it from
+	 * those servers */
+	PublishRoomEvent(PEER_EVENT_CHAT, lpRoom->szName,
+			lpSendingClient == NULL ? NULL : lpSendingClient->pszNickname,
+			lpMessage->szData);
+
+	return nTotalBytesSent;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// BroadcastToRoomExceptSender function
+
+int BroadcastToRoomExceptSender(LPROOM lpRoom, const char* pszMessage,
+		LPCLIENTSTRUCT lpSendingClient) {
+	return BroadcastToRoom(lpRoom, pszMessage, lpSendingClient, FALSE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CloseAllRoomLogs function
+
+void CloseAllRoomLogs() {
+	LockMutex(GetRoomListMutex());
+	{
+		DoForEach(g_pRoomList, CloseRoomLog);
+	}
+	UnlockMutex(GetRoomListMutex());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DeliverPeerChatToRoom function
+
+int DeliverPeerChatToRoom(const char* pszRoomName, const char* pszMessage) {
+	return DeliverToRoomByName(pszRoomName, pszMessage, TRUE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DeliverPeerNoticeToRoom function
+
+int DeliverPeerNoticeToRoom(const char* pszRoomName, const char* pszNotice) {
+	return DeliverToRoomByName(pszRoomName, pszNotice, FALSE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// JoinRoom function
+
+LPROOM JoinRoom(LPCLIENTSTRUCT lpClient, const char* pszRoomName) {
+	if (lpClient == NULL || !IsRoomNameValid(pszRoomName)) {
+		return NULL;
+	}
+
+	return MoveClientToRoom(lpClient, pszRoomName, NULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LeaveCurrentRoom function
+
+void LeaveCurrentRoom(LPCLIENTSTRUCT lpClient) {
+	if (lpClient == NULL || lpClient->lpRoom == NULL) {
+		return;
+	}
+
+	LockMutex(GetRoomListMutex());
+	{
+		RemoveClientFromRoom(lpClient, NULL);
+	}
+	UnlockMutex(GetRoomListMutex());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// OpenAllRoomLogs function
+
+void OpenAllRoomLogs() {
+	LockMutex(GetRoomListMutex());
+	{
+		DoForEach(g_pRoomList, OpenRoomLog);
+	}
+	UnlockMutex(GetRoomListMutex());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ProcessHistoryCommand function
+
+BOOL ProcessHistoryCommand(LPCLIENTSTRUCT lpSendingClient, char* pszBuffer) {
+	if (lpSendingClient == NULL) {
+		ThrowNullReferenceException();
+	}
+
+	if (IsNullOrWhiteSpace(pszBuffer)) {
+		ThrowNullReferenceException();
+	}
+
+	if (IsNullOrWhiteSpace(lpSendingClient->pszNickname)
+			|| lpSendingClient->lpRoom == NULL) {
+		// Per protocol, chatters have to say who they are first
+		lpSendingClient->nBytesSent +=
+				ReplyToClient(lpSendingClient, ERROR_NO_NICK_RECEIVED);
+		return TRUE;	// command handled but error occurred
+	}
+
+	char* pszEnd = NULL;
+	const long nLineCount = strtol(
+			pszBuffer + strlen(PROTOCOL_HISTORY_COMMAND), &pszEnd, 10);
+
+	char szReplyBuffer[BUFLEN];
+	memset(szReplyBuffer, 0, BUFLEN);
+
+	if (pszEnd == NULL || !IsNullOrWhiteSpace(pszEnd)
+			|| nLineCount < 1 || nLineCount > HISTORY_MAX_LINE_COUNT) {
+		sprintf(szReplyBuffer, ERROR_HISTORY_COUNT_INVALID,
+				HISTORY_MAX_LINE_COUNT);
+
+		lpSendingClient->nBytesSent +=
+				ReplyToClient(lpSendingClient, szReplyBuffer);
+		return TRUE;	// command handled but error occurred
+	}
+
+	/* The room cannot be freed while we are in it, and only this client's
+	 * own thread moves it to another room, so its log stays open. */
+	LPROOM lpRoom = lpSendingClient->lpRoom;
+	if (lpRoom->lpLog == NULL) {
+		lpSendingClient->nBytesSent +=
+				ReplyToClient(lpSendingClient, ERROR_HISTORY_UNAVAILABLE);
+		return TRUE;	// command handled but error occurred
+	}
+
+	sprintf(szReplyBuffer, OK_HISTORY_FOLLOWS, lpRoom->szName);
+
+	lpSendingClient->nBytesSent +=
+			ReplyToClient(lpSendingClient, szReplyBuffer);
+
+	/* The lines go from the log segments to the socket without being copied
+	 * into this process; only the reply and the terminator are formatted.
+	 * Compressed clients are the exception, since the lines have to pass
+	 * through the compressor on their way. */
+	long nBytesSent = 0;
+
+	if (lpSendingClient->lpDeflateStream != NULL) {
+		nBytesSent = CopyMessageLogTail(lpRoom->lpLog, (int) nLineCount,
+				CompressLogDataToClient, lpSendingClient);
+	} else {
+		nBytesSent = SendMessageLogTail(lpRoom->lpLog,
+				lpSendingClient->nSocket, (int) nLineCount,
+				lpSendingClient->bBinaryProtocol);
+	}
+
+	if (nBytesSent < 0) {
+		return TRUE;	// the client has gone away; its thread will notice
+	}
+
+	lpSendingClient->nBytesSent += (int) nBytesSent;
+
+	SendMultilineDataTerminator(lpSendingClient);
+
+	return TRUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ProcessJoinCommand function
+
+BOOL ProcessJoinCommand(LPCLIENTSTRUCT lpSendingClient, char* pszBuffer) {
+	if (lpSendingClient == NULL) {
+		ThrowNullReferenceException();
+	}
+
+	if (IsNullOrWhiteSpace(pszBuffer)) {
+		ThrowNullReferenceException();
+	}
+
+	if (IsNullOrWhiteSpace(lpSendingClient->pszNickname)) {
+		// Per protocol, chatters have to say who they are first
+		lpSendingClient->nBytesSent +=
+				ReplyToClient(lpSendingClient, ERROR_NO_NICK_RECEIVED);
+		return TRUE;	// command handled but error occurred
+	}
+
+	const int BUFFER_SIZE = strlen(pszBuffer) + 1;
+
+	char szRoomName[BUFFER_SIZE];
+	memset(szRoomName, 0, BUFFER_SIZE);
+
+	Trim(szRoomName, BUFFER_SIZE,
+			pszBuffer + strlen(PROTOCOL_JOIN_COMMAND));
+
+	if (!IsRoomNameValid(szRoomName)) {
+		lpSendingClient->nBytesSent +=
+				ReplyToClient(lpSendingClient, ERROR_ROOM_NAME_INVALID);
+		return TRUE;	// command handled but error occurred
+	}
+
+	char szReplyBuffer[BUFLEN];
+	memset(szReplyBuffer, 0, BUFLEN);
+
+	if (lpSendingClient->lpRoom != NULL
+			&& Equals(lpSendingClient->lpRoom->szName, szRoomName)) {
+		// Already there; just confirm it.
+		sprintf(szReplyBuffer, OK_ROOM_JOINED, szRoomName);
+
+		lpSendingClient->nBytesSent +=
+				ReplyToClient(lpSendingClient, szReplyBuffer);
+		return TRUE;
+	}
+
+	char szOldRoomName[MAX_ROOM_NAME_LEN + 1];
+	memset(szOldRoomName, 0, MAX_ROOM_NAME_LEN + 1);
+
+	if (lpSendingClient->lpRoom != NULL) {
+		strcpy(szOldRoomName, lpSendingClient->lpRoom->szName);
+
+		sprintf(szReplyBuffer, ROOM_CHATTER_LEFT,
+				lpSendingClient->pszNickname, szOldRoomName);
+	}
+
+	LPROOM lpRoom = MoveClientToRoom(lpSendingClient, szRoomName,
+			szReplyBuffer);
+	if (lpRoom == NULL) {
+		lpSendingClient->nBytesSent +=
+				ReplyToClient(lpSendingClient, ERROR_ROOM_LIMIT_REACHED);
+		return TRUE;	// command handled but error occurred
+	}
+
+	if (!IsNullOrWhiteSpace(szOldRoomName)) {
+		PublishRoomEvent(PEER_EVENT_LEAVE, szOldRoomName,
+				lpSendingClient->pszNickname, NULL);
+	}
+
+	sprintf(szReplyBuffer, OK_ROOM_JOINED, lpRoom->szName);
+
+	lpSendingClient->nBytesSent +=
+			ReplyToClient(lpSendingClient, szReplyBuffer);
+
+	/* Catch the newcomer up on what was said before they arrived */
+	ReplayRoomHistory(lpSendingClient);
+
+	/* Tell the other members of the room that someone new is here */
+	sprintf(szReplyBuffer, ROOM_CHATTER_JOINED,
+			lpSendingClient->pszNickname, lpRoom->szName);
+
+	BroadcastToRoomExceptSender(lpRoom, szReplyBuffer, lpSendingClient);
+
+	PublishRoomEvent(PEER_EVENT_JOIN, lpRoom->szName,
+			lpSendingClient->pszNickname, NULL);
+
+	return TRUE;	// command handled successfully
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ProcessMuteCommand function
+
+void ProcessMuteCommand(LPCLIENTSTRUCT lpSendingClient, BOOL bMuted) {
+	if (lpSendingClient == NULL) {
+		return;
+	}
+
+	/* Only this client's own thread ever changes the flag, and a broadcast
+	 * that reads a stale value just sends (or skips) one more message. */
+	lpSendingClient->bMuted = bMuted;
+
+	lpSendingClient->nBytesSent += ReplyToClient(lpSendingClient,
+			bMuted ? OK_ROOM_MUTED : OK_ROOM_UNMUTED);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ProcessPartCommand function
+
+void ProcessPartCommand(LPCLIENTSTRUCT lpSendingClient) {
+	if (lpSendingClient == NULL) {
+		return;
+	}
+
+	if (lpSendingClient->lpRoom == NULL
+			|| IsNullOrWhiteSpace(lpSendingClient->pszNickname)
+			|| Equals(lpSendingClient->lpRoom->szName, DEFAULT_ROOM_NAME)) {
+		lpSendingClient->nBytesSent +=
+				ReplyToClient(lpSendingClient, ERROR_NOT_IN_ROOM);
+		return;
+	}
+
+	/* Save off the name of the room being left, since the room is destroyed
+	 * if we were its last member. */
+	char szOldRoomName[MAX_ROOM_NAME_LEN + 1];
+	memset(szOldRoomName, 0, MAX_ROOM_NAME_LEN + 1);
+	strcpy(szOldRoomName, lpSendingClient->lpRoom->szName);
+
+	char szReplyBuffer[BUFLEN];
+	memset(szReplyBuffer, 0, BUFLEN);
+
+	sprintf(szReplyBuffer, ROOM_CHATTER_LEFT,
+			lpSendingClient->pszNickname, szOldRoomName);
+
+	LPROOM lpRoom = MoveClientToRoom(lpSendingClient, DEFAULT_ROOM_NAME,
+			szReplyBuffer);
+	if (lpRoom == NULL) {
+		return;	// the default room is never destroyed, so we never get here
+	}
+
+	PublishRoomEvent(PEER_EVENT_LEAVE, szOldRoomName,
+			lpSendingClient->pszNickname, NULL);
+
+	sprintf(szReplyBuffer, OK_ROOM_PARTED, szOldRoomName, lpRoom->szName);
+
+	lpSendingClient->nBytesSent +=
+			ReplyToClient(lpSendingClient, szReplyBuffer);
+
+	ReplayRoomHistory(lpSendingClient);
+
+	sprintf(szReplyBuffer, ROOM_CHATTER_JOINED,
+			lpSendingClient->pszNickname, lpRoom->szName);
+
+	BroadcastToRoomExceptSender(lpRoom, szReplyBuffer, lpSendingClient);
+
+	PublishRoomEvent(PEER_EVENT_JOIN, lpRoom->szName,
+			lpSendingClient->pszNickname, NULL);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// ReplayRoomHistory function
+
+void ReplayRoomHistory(LPCLIENTSTRUCT lpClient) {
+	if (lpClient == NULL || lpClient->lpRoom == NULL) {
+		return;
+	}
+
+	/* Only the client's own thread moves it between rooms, and it is the
+	 * one calling us, so the room cannot go away while we use it. */
+	LPMESSAGEBUFFER lpBuffers[HISTORY_REPLAY_COUNT];
+
+	int nCount = GetRecentHistory(&(lpClient->lpRoom->historyRing),
+			lpBuffers, HISTORY_REPLAY_COUNT);
+	if (nCount == 0) {
+		return;	// Nothing has been said in the room yet.
+	}
+
+	int nBytesSent = SendBuffersToClient(lpClient, lpBuffers, nCount);
+	if (nBytesSent > 0) {
+		lpClient->nBytesSent += nBytesSent;
+	}
+
+	for (int i = 0; i < nCount; i++) {
+		ReleaseMessageBuffer(lpBuffers[i]);
+	}
+}
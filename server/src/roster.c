@@ -0,0 +1,306 @@
+// roster.c - Implementation of the roster of the chatters on this server, and
+// of the replies to LIST and LIST SINCE that are built from it
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "roster.h"
+#include "server_functions.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Global variables (used in this file only)
+
+/**
+ * @brief Handle to the mutex that guards the roster.
+ */
+static HMUTEX g_hRosterMutex = INVALID_HANDLE_VALUE;
+
+/**
+ * @brief The nicknames on the roster, in no particular order.  Only the first
+ * g_nRosterCount entries are valid.
+ */
+static char (*g_pszRosterNicknames)[MAX_NICKNAME_LEN + 1] = NULL;
+
+/**
+ * @brief Count of the nicknames on the roster.
+ */
+static int g_nRosterCount = 0;
+
+/**
+ * @brief Count of the nicknames that g_pszRosterNicknames has room for.
+ */
+static int g_nRosterCapacity = 0;
+
+/**
+ * @brief Version of the roster, which goes up by one with each change.
+ */
+static uint64_t g_nRosterVersion = 0;
+
+/**
+ * @brief The last ROSTER_CHANGE_LOG_SIZE changes to the roster.  The change
+ * that brought the roster to a version is kept at the version modulo the size.
+ */
+static ROSTERCHANGE g_rosterChanges[ROSTER_CHANGE_LOG_SIZE];
+
+/**
+ * @brief The reply to LIST for the current version of the roster, or NULL if
+ * the roster has changed since it was last built.
+ */
+static LPMESSAGEBUFFER g_lpRosterSnapshot = NULL;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// BuildRosterSnapshot function - Builds the reply to LIST for the current
+// version of the roster.  The caller must hold the roster mutex.
+//
+
+LPMESSAGEBUFFER BuildRosterSnapshot() {
+	char szHeader[BUFLEN];
+	memset(szHeader, 0, BUFLEN);
+
+	const int HEADER_LENGTH = snprintf(szHeader, BUFLEN, OK_LIST_FOLLOWS,
+			(unsigned long long) g_nRosterVersion);
+
+	const int ENTRY_PREFIX_LENGTH = strlen(ROSTER_ENTRY_PREFIX);
+
+	int nCapacity = HEADER_LENGTH + strlen(MSG_TERMINATOR);
+	for (int i = 0; i < g_nRosterCount; i++) {
+		nCapacity += ENTRY_PREFIX_LENGTH + strlen(g_pszRosterNicknames[i]) + 1;
+	}
+
+	MESSAGEBUILDER builder;
+	BeginMessage(&builder, nCapacity);
+
+	AppendToMessage(&builder, szHeader, HEADER_LENGTH);
+
+	for (int i = 0; i < g_nRosterCount; i++) {
+		AppendToMessage(&builder, ROSTER_ENTRY_PREFIX, ENTRY_PREFIX_LENGTH);
+		AppendToMessage(&builder, g_pszRosterNicknames[i],
+				strlen(g_pszRosterNicknames[i]));
+		AppendToMessage(&builder, "\n", 1);
+	}
+
+	AppendToMessage(&builder, MSG_TERMINATOR, strlen(MSG_TERMINATOR));
+
+	return EndMessage(&builder);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LogRosterChange function - Gives the roster a new version, and keeps the
+// change that brought it there.  The caller must hold the roster mutex.
+//
+
+void LogRosterChange(BOOL bJoined, const char* pszNickname) {
+	g_nRosterVersion++;
+
+	LPROSTERCHANGE lpChange =
+			&g_rosterChanges[g_nRosterVersion % ROSTER_CHANGE_LOG_SIZE];
+
+	lpChange->nVersion = g_nRosterVersion;
+	lpChange->bJoined = bJoined;
+
+	memset(lpChange->szNickname, 0, MAX_NICKNAME_LEN + 1);
+	strncpy(lpChange->szNickname, pszNickname, MAX_NICKNAME_LEN);
+
+	/* Clients that are still sending the old reply keep their references
+	 * to it; the next LIST builds a new one */
+	ReleaseMessageBuffer(g_lpRosterSnapshot);
+	g_lpRosterSnapshot = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// AddToRoster function
+
+void AddToRoster(const char* pszNickname) {
+	if (IsNullOrWhiteSpace(pszNickname)
+			|| INVALID_HANDLE_VALUE == g_hRosterMutex) {
+		return;
+	}
+
+	LockMutex(g_hRosterMutex);
+	{
+		if (g_nRosterCount == g_nRosterCapacity) {
+			const int NEW_CAPACITY = g_nRosterCapacity == 0 ?
+					MAX_ALLOWED_CONNECTIONS : 2 * g_nRosterCapacity;
+
+			void* pvNicknames = realloc(g_pszRosterNicknames,
+					NEW_CAPACITY * sizeof(*g_pszRosterNicknames));
+			if (pvNicknames == NULL) {
+				fprintf(stderr, OUT_OF_MEMORY);
+				CleanupServer(ERROR);
+			}
+
+			g_pszRosterNicknames = pvNicknames;
+			g_nRosterCapacity = NEW_CAPACITY;
+		}
+
+		char* pszEntry = g_pszRosterNicknames[g_nRosterCount++];
+
+		memset(pszEntry, 0, MAX_NICKNAME_LEN + 1);
+		strncpy(pszEntry, pszNickname, MAX_NICKNAME_LEN);
+
+		LogRosterChange(TRUE, pszNickname);
+	}
+	UnlockMutex(g_hRosterMutex);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CreateRoster function
+
+void CreateRoster() {
+	if (INVALID_HANDLE_VALUE != g_hRosterMutex) {
+		return;
+	}
+
+	memset(g_rosterChanges, 0, sizeof(g_rosterChanges));
+
+	g_nRosterCount = 0;
+	g_nRosterVersion = 0;
+
+	g_hRosterMutex = CreateMutex();
+	if (INVALID_HANDLE_VALUE == g_hRosterMutex) {
+		CleanupServer(ERROR);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// DestroyRoster function
+
+void DestroyRoster() {
+	if (INVALID_HANDLE_VALUE == g_hRosterMutex) {
+		return;
+	}
+
+	LockMutex(g_hRosterMutex);
+	{
+		ReleaseMessageBuffer(g_lpRosterSnapshot);
+		g_lpRosterSnapshot = NULL;
+
+		free(g_pszRosterNicknames);
+		g_pszRosterNicknames = NULL;
+
+		g_nRosterCount = 0;
+		g_nRosterCapacity = 0;
+	}
+	UnlockMutex(g_hRosterMutex);
+
+	DestroyMutex(g_hRosterMutex);
+	g_hRosterMutex = INVALID_HANDLE_VALUE;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetRosterChangesSince function
+
+LPMESSAGEBUFFER GetRosterChangesSince(uint64_t nVersion) {
+	if (INVALID_HANDLE_VALUE == g_hRosterMutex) {
+		return NULL;
+	}
+
+	LPMESSAGEBUFFER lpReply = NULL;
+
+	LockMutex(g_hRosterMutex);
+	{
+		/* Only the changes that are still in the log can be sent */
+		if (nVersion <= g_nRosterVersion
+				&& g_nRosterVersion - nVersion <= ROSTER_CHANGE_LOG_SIZE) {
+			char szHeader[BUFLEN];
+			memset(szHeader, 0, BUFLEN);
+
+			const int HEADER_LENGTH = snprintf(szHeader, BUFLEN,
+					OK_LIST_CHANGES_FOLLOW, (unsigned long long) nVersion,
+					(unsigned long long) g_nRosterVersion);
+
+			const int CHANGE_COUNT = (int) (g_nRosterVersion - nVersion);
+
+			const int PREFIX_LENGTH = strlen(ROSTER_JOINED_PREFIX);
+
+			MESSAGEBUILDER builder;
+			BeginMessage(&builder, HEADER_LENGTH + CHANGE_COUNT
+					* (PREFIX_LENGTH + MAX_NICKNAME_LEN + 1)
+					+ strlen(MSG_TERMINATOR));
+
+			AppendToMessage(&builder, szHeader, HEADER_LENGTH);
+
+			for (uint64_t v = nVersion + 1; v <= g_nRosterVersion; v++) {
+				LPROSTERCHANGE lpChange =
+						&g_rosterChanges[v % ROSTER_CHANGE_LOG_SIZE];
+
+				AppendToMessage(&builder, lpChange->bJoined ?
+						ROSTER_JOINED_PREFIX : ROSTER_LEFT_PREFIX,
+						PREFIX_LENGTH);
+				AppendToMessage(&builder, lpChange->szNickname,
+						strlen(lpChange->szNickname));
+				AppendToMessage(&builder, "\n", 1);
+			}
+
+			AppendToMessage(&builder, MSG_TERMINATOR, strlen(MSG_TERMINATOR));
+
+			lpReply = EndMessage(&builder);
+		}
+	}
+	UnlockMutex(g_hRosterMutex);
+
+	return lpReply;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetRosterSnapshot function
+
+LPMESSAGEBUFFER GetRosterSnapshot() {
+	if (INVALID_HANDLE_VALUE == g_hRosterMutex) {
+		return NULL;
+	}
+
+	LPMESSAGEBUFFER lpSnapshot = NULL;
+
+	LockMutex(g_hRosterMutex);
+	{
+		if (g_lpRosterSnapshot == NULL) {
+			g_lpRosterSnapshot = BuildRosterSnapshot();
+		}
+
+		lpSnapshot = g_lpRosterSnapshot;
+		AddMessageBufferRef(lpSnapshot);
+	}
+	UnlockMutex(g_hRosterMutex);
+
+	return lpSnapshot;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RemoveFromRoster function
+
+void RemoveFromRoster(const char* pszNickname) {
+	if (IsNullOrWhiteSpace(pszNickname)
+			|| INVALID_HANDLE_VALUE == g_hRosterMutex) {
+		return;
+	}
+
+	LockMutex(g_hRosterMutex);
+	{
+		for (int i = 0; i < g_nRosterCount; i++) {
+			if (!Equals(g_pszRosterNicknames[i], pszNickname)) {
+				continue;
+			}
+
+			/* The order of the roster does not matter, so the last entry
+			 * fills the gap */
+			g_nRosterCount--;
+			if (i != g_nRosterCount) {
+				memcpy(g_pszRosterNicknames[i],
+						g_pszRosterNicknames[g_nRosterCount],
+						MAX_NICKNAME_LEN + 1);
+			}
+
+			LogRosterChange(FALSE, pszNickname);
+			break;
+		}
+	}
+	UnlockMutex(g_hRosterMutex);
+}
@@ -15,6 +15,13 @@
 #include "stdafx.h"
 #include "server.h"
 
+#include "acceptor_shards.h"
+#include "benchmark.h"
+#include "federation.h"
+#include "heartbeat.h"
+#include "hot_restart.h"
+#include "message_log.h"
+#include "rate_limiter.h"
 #include "server_functions.h"
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -27,6 +34,16 @@ int main(int argc, char *argv[]) {
 
     PrintSoftwareTitleAndCopyright();
 
+    /* Started with -benchmark, the server measures its hot functions against
+     * stubbed clients instead of listening for real ones */
+    if (IsBenchmarkMode(argc, argv)) {
+        CleanupServer(RunBenchmarks(argc, argv) ? OK : ERROR);
+    }
+
+    /* Not started until now, so that the benchmarks leave no room logs
+     * behind on disk */
+    StartMessageLogging();
+
     // Check the arguments.  If the checks fail, then
     // we should print a message to stderr telling the user what to
     // pass on the command line and then quit
@@ -42,6 +59,30 @@ int main(int argc, char *argv[]) {
 
     ParseCommandLine(argc, argv, &nPort, &bDiagnosticMode);
 
+    if (!ConfigureFederation(argc, argv)) {
+        fprintf(stderr, USAGE_STRING);
+
+        exit(ERROR);    /* we can just exit here, no spiffy cleanup needed. */
+    }
+
+    if (!ConfigureRateLimits(argc, argv)) {
+        fprintf(stderr, USAGE_STRING);
+
+        exit(ERROR);    /* we can just exit here, no spiffy cleanup needed. */
+    }
+
+    if (!ConfigureHeartbeat(argc, argv)) {
+        fprintf(stderr, USAGE_STRING);
+
+        exit(ERROR);    /* we can just exit here, no spiffy cleanup needed. */
+    }
+
+    if (!ConfigureAcceptorShards(argc, argv)) {
+        fprintf(stderr, USAGE_STRING);
+
+        exit(ERROR);    /* we can just exit here, no spiffy cleanup needed. */
+    }
+
     SetDiagnosticMode(bDiagnosticMode);
 
     SetServerPort(nPort);
@@ -50,9 +91,28 @@ int main(int argc, char *argv[]) {
     	fprintf(stdout, SERVER_DIAGNOSTIC_MODE_ENABLED);
     }
 
-    SetServerSocket(CreateSocket());
+    /* Sending this process SIGUSR2 hands it over to a new copy of it */
+    InstallHotRestartHandler(argv);
+
+    if (IsHotRestartPending()) {
+        /* We were started by a hot restart; the listening socket and the
+         * clients of the server that started us are ours now */
+        TakeOverFromPreviousServer();
+    } else {
+        SetServerSocket(CreateSocket());
+
+        /* The acceptor shards, if any, listen on the same port */
+        ShareServerPort(GetServerSocket());
+
+        SetUpServerOnPort(nPort);
+    }
+
+    /* Link up with the other servers in the cluster, if there are any */
+    StartFederation();
 
-    SetUpServerOnPort(nPort);
+    /* Start accepting on the sockets of the other acceptor shards, if any;
+     * the master acceptor thread below is shard 0 */
+    StartAcceptorShards(nPort);
 
     CreateMasterAcceptorThread();
 
@@ -63,8 +123,9 @@ int main(int argc, char *argv[]) {
         WaitThread(GetMasterThreadHandle());
     }
 
-    /* We might never get here; but if we do, we arrive here when the master
-     * acceptor thread has terminated. */
+    /* We arrive here when the master acceptor thread has terminated, which
+     * it does once a shutdown has been requested (such as by CTRL+C), so the
+     * cleanup runs on this thread rather than inside a signal handler. */
     CleanupServer(OK);
 
     return OK;
@@ -5,12 +5,38 @@
 #include "stdafx.h"
 #include "server.h"
 
+#include "acceptor_shards.h"
+#include "admission.h"
 #include "client_manager.h"
 #include "client_list_manager.h"
+#include "client_timeouts.h"
+#include "compression.h"
+#include "federation.h"
+#include "hashtag_manager.h"
+#include "heartbeat.h"
+#include "mailbox.h"
 #include "mat.h"
+#include "message_log.h"
+#include "nickname_manager.h"
+#include "presence.h"
+#include "room.h"
+#include "roster.h"
 #include "server_functions.h"
+#include "shutdown.h"
 
-BOOL g_bHasServerQuit = FALSE;
+atomic_int g_bHasServerQuit = FALSE;
+
+/**
+ * @brief Exit code that the server is to end with, which is the one asked for
+ * by the first call to CleanupServer; INT_MIN until then.
+ */
+static atomic_int g_nServerExitCode = INT_MIN;
+
+/**
+ * @brief Flag that is set on the main thread only, which alone tears the
+ * server down.
+ */
+static __thread BOOL g_bIsMainThread = FALSE;
 
 ///////////////////////////////////////////////////////////////////////////////
 // CheckCommandLineArgs function - Checks the command-line args passed (and the
@@ -32,9 +58,38 @@ BOOL CheckCommandLineArgs(int argc, char *argv[]) {
 // threads in an orderly way
 
 void CleanupServer(int nExitCode) {
-    // Handle the case where the user presses CTRL+C in the terminal
-    // by performing an orderly shut down of the server and freeing
-    // operating system resources.
+    /* Whatever thread asks first decides the exit code */
+    int nRecordedExitCode = INT_MIN;
+    if (!atomic_compare_exchange_strong(&g_nServerExitCode,
+            &nRecordedExitCode, nExitCode)) {
+        nExitCode = nRecordedExitCode;
+    }
+
+    /* Any thread other than the main one only asks for a shutdown, and
+     * ends.  The master acceptor thread then returns, and the main thread
+     * does the teardown below, so that it is only ever done once. */
+    if (!g_bIsMainThread) {
+        RequestServerShutdown();
+
+        EndStoppableThread();
+
+        pthread_exit(NULL);
+    }
+
+    // Perform an orderly shut down of the server and free operating system
+    // resources.  Every thread that polls the shutdown eventfd is woken up,
+    // and the thread of each client says goodbye to it and stops by itself.
+    RequestServerShutdown();
+
+    const int nThreadsLeft = WaitForStoppableThreads(
+            SHUTDOWN_DRAIN_TIMEOUT_MS);
+    if (nThreadsLeft > 0) {
+        fprintf(stdout, SHUTDOWN_THREADS_LEFT, nThreadsLeft,
+                SHUTDOWN_DRAIN_TIMEOUT_MS);
+    }
+
+    /* Any clients whose threads did not get round to it in time are
+     * disconnected from here instead */
 
     //fprintf(stdout, "server: Waiting on the client list mutex...\n");
 
@@ -113,6 +168,21 @@ void CreateMasterAcceptorThread() {
     }
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// CreateRoomListMutex function - Sets up operating system resources for the
+// mutex handle which controls threads' access to the list of chat rooms.
+
+void CreateRoomListMutex() {
+    if (INVALID_HANDLE_VALUE != GetRoomListMutex()) {
+        return;
+    }
+
+    SetRoomListMutex(CreateMutex());
+    if (INVALID_HANDLE_VALUE == GetRoomListMutex()) {
+        CleanupServer(ERROR);
+    }
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // CreateSockAddr function - Allocates storage for a new insance of sockaddr_in
 //
@@ -147,19 +217,59 @@ void DestroyClientListMutex() {
     SetClientListMutex(INVALID_HANDLE_VALUE);
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// DestroyRoomListMutex function - Releases the system resources occupied by
+// the room list mutex handle.
+
+void DestroyRoomListMutex() {
+    if (INVALID_HANDLE_VALUE == GetRoomListMutex()) {
+        return;
+    }
+
+    DestroyMutex(GetRoomListMutex());
+    SetRoomListMutex(INVALID_HANDLE_VALUE);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetStringHash function
+
+unsigned int GetStringHash(const char* pszValue) {
+    unsigned int nHash = 2166136261u;
+
+    if (pszValue == NULL) {
+        return nHash;
+    }
+
+    for (const char* pch = pszValue; *pch != '\0'; pch++) {
+        nHash ^= (unsigned char) *pch;
+        nHash *= 16777619u;
+    }
+
+    return nHash;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // InitializeApplication function - Runs functionality that should be executed
 // exactly once during the lifetime of the application, at application startup.
 
 BOOL InitializeApplication() {
+    /* This is the thread that CleanupServer leaves the teardown to */
+    g_bIsMainThread = TRUE;
+
     /* Configure settings for the log file */
     ConfigureLogFile();
 
     // Since the usual way to exit this program is for the user to
-    // press CTRL+C to forcibly terminate it, install a Linux SIGINT
-    // handler here so that when the user does this, we may still
-    // get a chance to run the proper cleanup code.
-    InstallSigintHandler();
+    // press CTRL+C to forcibly terminate it, route SIGINT (and SIGTERM)
+    // to a thread of their own here, so that when the user does this, the
+    // proper cleanup code runs outside of any signal handler.  This has to
+    // come before any other thread is started.
+    InstallShutdownHandler();
+
+    // A write to a client that has reset its connection raises SIGPIPE,
+    // whose default action kills the whole server.  Ignore it, so that the
+    // write fails with EPIPE instead, and only that client is dropped.
+    signal(SIGPIPE, SIG_IGN);
 
     InitializeInterlock();
 
@@ -168,29 +278,19 @@ BOOL InitializeApplication() {
 
     CreateClientListMutex();
 
-    return TRUE;
-}
+    CreateAdmissionTable();
 
-///////////////////////////////////////////////////////////////////////////////
-// InstallSigintHandler function - Registers a function to be called when the
-// user presses CTRL+C, in order to perform an orderly shutdown
+    CreateRoomListMutex();
 
-void InstallSigintHandler() {
-    struct sigaction sigIntHandler;
+    CreateHashtagIndex();
 
-    sigIntHandler.sa_handler = ServerCleanupHandler;
-    sigemptyset(&sigIntHandler.sa_mask);
-    sigIntHandler.sa_flags = 0;
+    CreateNicknameIndex();
 
-    if (OK != sigaction(SIGINT, &sigIntHandler, NULL)) {
-        fprintf(stderr, "server: Unable to install CTRL+C handler.");
+    CreateRoster();
 
-        perror("server[sigaction]");
+    StartPresenceNotifier();
 
-        FreeSocketMutex();
-
-        exit(ERROR);
-    }
+    return TRUE;
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -233,8 +333,11 @@ void ParseCommandLine(int argc,
         exit(ERROR);    /* we can just exit here, no spiffy cleanup needed. */
     }
 
-    if (argc == DIAGNOSTIC_MODE_PARM_COUNT) {
-    	*pbDiagnosticMode = EqualsNoCase(argv[2], "-v");
+    /* The federation options may come before or after -v */
+    for (int i = DIAGNOSTIC_MODE_PARM_COUNT - 1; i < argc; i++) {
+    	if (EqualsNoCase(argv[i], "-v")) {
+    		*pbDiagnosticMode = TRUE;
+    	}
     }
 }
 
@@ -256,25 +359,40 @@ void PrintSoftwareTitleAndCopyright() {
 
 void QuitServer() {
 
-    if (g_bHasServerQuit) {
+    if (atomic_exchange(&g_bHasServerQuit, TRUE)) {
         return;
     }
 
-    if (!g_bHasServerQuit) {
-        g_bHasServerQuit = TRUE;
-    }
-
     LogInfo(SERVER_SHUTTING_DOWN);
 
     if (GetLogFileHandle() != stdout) {
         fprintf(stdout, SERVER_SHUTTING_DOWN);
     }
 
-    if (INVALID_HANDLE_VALUE != GetMasterThreadHandle()) {
-        KillThread(GetMasterThreadHandle());
-    }
+    /* The master acceptor thread polls the shutdown eventfd, and so stops
+     * by itself... */
+    RequestServerShutdown();
+
+    /* ...along with the other acceptor shards, if there are any */
+    StopAcceptorShards();
+
+    /* No more signals are going to be read */
+    StopShutdownHandler();
+
+    /* Joins and leaves still being batched are not announced */
+    StopPresenceNotifier();
+
+    /* Tell the peer servers what was said last, then let go of them */
+    StopFederation();
 
-    sleep(1); /* induce a context switch */
+    ReportCompressionStats();
+
+    ReportAcceptorShardStats();
+    ReportAdmissionStats();
+    ReportTimeoutStats();
+    ReportHeartbeatStats();
+    ReportMailboxStats();
+    ReportPresenceStats();
 
     DestroyInterlock();
 
@@ -290,17 +408,23 @@ void QuitServer() {
 
     ClearList(&g_pClientList, FreeClient);
 
+    ClearList(&g_pRoomList, FreeRoom);
+
     DestroyClientListMutex();
-}
 
-///////////////////////////////////////////////////////////////////////////////
-// ServerCleanupHandler function - Called when the user presses CTRL+C.  This
-// function initiates an orderly shut down of the server application.
+    DestroyRoomListMutex();
+
+    DestroyHashtagIndex();
+
+    DestroyNicknameIndex();
+
+    DestroyRoster();
 
-void ServerCleanupHandler(int signum) {
-    fprintf(stdout, CALLING_CLEANUP_HANDLER);
+    DestroyAdmissionTable();
 
-    CleanupServer(OK);
+    /* Rooms close their own logs when they are freed, so this has to come
+     * after the list of rooms has been cleared */
+    StopMessageLogging();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
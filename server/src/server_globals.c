@@ -11,6 +11,8 @@
 BOOL g_bDiagnosticMode = FALSE;
 POSITION* g_pClientList = NULL;
 HMUTEX g_hClientListMutex = INVALID_HANDLE_VALUE;
+POSITION* g_pRoomList = NULL;
+HMUTEX g_hRoomListMutex = INVALID_HANDLE_VALUE;
 HTHREAD g_hMasterThread = INVALID_HANDLE_VALUE;
 int g_nServerPort = 9000;
 int g_nServerSocket = INVALID_SOCKET_VALUE;
@@ -29,6 +31,13 @@ HTHREAD GetMasterThreadHandle() {
 	return g_hMasterThread;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// GetRoomListMutex function
+
+HMUTEX GetRoomListMutex() {
+	return g_hRoomListMutex;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // GetServerPort function
 
@@ -71,6 +80,13 @@ void SetMasterThreadHandle(HTHREAD value) {
 	g_hMasterThread = value;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// SetRoomListMutex function
+
+void SetRoomListMutex(HMUTEX value) {
+	g_hRoomListMutex = value;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // SetServerPort function
 
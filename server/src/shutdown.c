@@ -0,0 +1,241 @@
+// shutdown.c - Provides the implementation of shutting the server down through
+// a signalfd and a stop eventfd, rather than through signal handlers.
+//
+// The stop flag and the eventfd are set together, and neither is ever cleared,
+// so a thread that checks the flag before it polls cannot miss a shutdown: if
+// the flag was still clear, the eventfd wakes the poll.
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "server_functions.h"
+#include "shutdown.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Global variables (used in this file only)
+
+/**
+ * @brief Flag that is set once a shutdown has been requested.
+ */
+static atomic_int g_bShutdownRequested = FALSE;
+
+/**
+ * @brief File descriptor of the eventfd that is written when a shutdown is
+ * requested.
+ */
+static int g_nShutdownEventFd = -1;
+
+/**
+ * @brief File descriptor of the signalfd that SIGINT and SIGTERM are read
+ * from.
+ */
+static int g_nShutdownSignalFd = -1;
+
+/**
+ * @brief Handle to the thread that reads the signalfd.
+ */
+static HTHREAD g_hShutdownSignalThread = INVALID_HANDLE_VALUE;
+
+/**
+ * @brief Count of the threads that a shutdown waits for.
+ */
+static atomic_int g_nStoppableThreadCount = 0;
+
+/**
+ * @brief Flag that is set if the calling thread is counted in
+ * g_nStoppableThreadCount.
+ */
+static __thread BOOL g_bIsStoppableThread = FALSE;
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// ShutdownSignalThread thread procedure - Waits for SIGINT or SIGTERM to come
+// in on the signalfd, and requests a shutdown when one does.  Stops once a
+// shutdown has been requested, whatever requested it.
+//
+
+void* ShutdownSignalThread(void* pThreadData) {
+	struct pollfd pfds[2];
+
+	pfds[0].fd = g_nShutdownSignalFd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = g_nShutdownEventFd;
+	pfds[1].events = POLLIN;
+
+	while (!IsShutdownRequested()) {
+		pfds[0].revents = 0;
+		pfds[1].revents = 0;
+
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			break;
+		}
+
+		if ((pfds[0].revents & POLLIN) == 0) {
+			continue;
+		}
+
+		struct signalfd_siginfo info;
+		if (read(g_nShutdownSignalFd, &info, sizeof(info)) != sizeof(info)) {
+			continue;
+		}
+
+		fprintf(stdout, SHUTDOWN_SIGNAL_RECEIVED,
+				strsignal((int) info.ssi_signo));
+
+		RequestServerShutdown();
+	}
+
+	return NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// BeginStoppableThread function
+
+void BeginStoppableThread() {
+	if (g_bIsStoppableThread) {
+		return;
+	}
+
+	g_bIsStoppableThread = TRUE;
+
+	atomic_fetch_add(&g_nStoppableThreadCount, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// EndStoppableThread function
+
+void EndStoppableThread() {
+	if (!g_bIsStoppableThread) {
+		return;
+	}
+
+	g_bIsStoppableThread = FALSE;
+
+	atomic_fetch_sub(&g_nStoppableThreadCount, 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetShutdownEventFd function
+
+int GetShutdownEventFd() {
+	return g_nShutdownEventFd;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// InstallShutdownHandler function
+
+void InstallShutdownHandler() {
+	if (INVALID_HANDLE_VALUE != g_hShutdownSignalThread) {
+		return;
+	}
+
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+
+	/* The threads started from here on inherit the mask, so the signals
+	 * only ever come in through the signalfd */
+	const int nResult = pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	if (nResult != OK) {
+		fprintf(stderr, SHUTDOWN_HANDLER_FAILED, strerror(nResult));
+
+		exit(ERROR);
+	}
+
+	g_nShutdownEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	g_nShutdownSignalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+	if (g_nShutdownEventFd < 0 || g_nShutdownSignalFd < 0) {
+		fprintf(stderr, SHUTDOWN_HANDLER_FAILED, strerror(errno));
+
+		exit(ERROR);
+	}
+
+	g_hShutdownSignalThread = CreateThread(ShutdownSignalThread);
+	if (INVALID_HANDLE_VALUE == g_hShutdownSignalThread) {
+		fprintf(stderr, FAILED_LAUNCH_SHUTDOWN_THREAD);
+
+		exit(ERROR);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsShutdownRequested function
+
+BOOL IsShutdownRequested() {
+	return atomic_load(&g_bShutdownRequested);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RequestServerShutdown function
+
+void RequestServerShutdown() {
+	if (atomic_exchange(&g_bShutdownRequested, TRUE)) {
+		return;	// already requested
+	}
+
+	if (g_nShutdownEventFd < 0) {
+		return;
+	}
+
+	const int nSavedErrno = errno;
+
+	const uint64_t ONE = 1;
+	if (write(g_nShutdownEventFd, &ONE, sizeof(ONE)) < 0) {
+		/* Nothing to do; the eventfd is already set */
+	}
+
+	errno = nSavedErrno;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StopShutdownHandler function
+
+void StopShutdownHandler() {
+	if (INVALID_HANDLE_VALUE == g_hShutdownSignalThread) {
+		return;
+	}
+
+	/* The thread is woken by the eventfd, and sees the stop flag */
+	RequestServerShutdown();
+
+	WaitThread(g_hShutdownSignalThread);
+
+	DestroyThread(g_hShutdownSignalThread);
+	g_hShutdownSignalThread = INVALID_HANDLE_VALUE;
+
+	if (g_nShutdownSignalFd >= 0) {
+		close(g_nShutdownSignalFd);
+		g_nShutdownSignalFd = -1;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// WaitForStoppableThreads function
+
+int WaitForStoppableThreads(int nTimeoutMs) {
+	/* The calling thread is not going to stop while it waits */
+	const int SELF = g_bIsStoppableThread ? 1 : 0;
+
+	int nLeft = atomic_load(&g_nStoppableThreadCount) - SELF;
+
+	for (int nWaited = 0; nLeft > 0 && nWaited < nTimeoutMs;
+			nWaited += SHUTDOWN_POLL_INTERVAL_MS) {
+		usleep(SHUTDOWN_POLL_INTERVAL_MS * 1000);
+
+		nLeft = atomic_load(&g_nStoppableThreadCount) - SELF;
+	}
+
+	return nLeft > 0 ? nLeft : 0;
+}
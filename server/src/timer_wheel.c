@@ -0,0 +1,229 @@
+// timer_wheel.c - Provides implementations of the functions that manipulate a
+// TIMERWHEEL instance (TIMERWHEEL is a hashed hierarchical timing wheel).
+//
+
+#include "stdafx.h"
+#include "server.h"
+
+#include "timer_wheel.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// Internal-use-only functions
+
+///////////////////////////////////////////////////////////////////////////////
+// GetTimerSlot function - Works out which slot of the wheel a timer goes in,
+// from how far off its deadline is.
+//
+
+LPTIMER* GetTimerSlot(LPTIMERWHEEL lpWheel, uint64_t nDeadline) {
+	const uint64_t MASK = TIMER_WHEEL_SLOT_COUNT - 1;
+
+	uint64_t nDelta = nDeadline > lpWheel->nCurrentTick
+			? nDeadline - lpWheel->nCurrentTick : 0;
+
+	for (int nLevel = 0; nLevel < TIMER_WHEEL_LEVEL_COUNT; nLevel++) {
+		const int SHIFT = nLevel * TIMER_WHEEL_SLOT_BITS;
+
+		if (nDelta < ((uint64_t) TIMER_WHEEL_SLOT_COUNT << SHIFT)
+				|| nLevel == TIMER_WHEEL_LEVEL_COUNT - 1) {
+			/* Deadlines beyond the reach of the top level wait in its last
+			 * slot, and are looked at again each time it comes round */
+			if (nDelta >= ((uint64_t) TIMER_WHEEL_SLOT_COUNT << SHIFT)) {
+				nDeadline = lpWheel->nCurrentTick
+						+ (((uint64_t) TIMER_WHEEL_SLOT_COUNT << SHIFT) - 1);
+			}
+
+			return &(lpWheel->lpSlots[nLevel][(nDeadline >> SHIFT) & MASK]);
+		}
+	}
+
+	return NULL;	// not reached
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LinkTimer function - Puts a timer, whose deadline is set, into its slot.
+//
+
+void LinkTimer(LPTIMERWHEEL lpWheel, LPTIMER lpTimer) {
+	LPTIMER* ppSlot = GetTimerSlot(lpWheel, lpTimer->nDeadline);
+
+	lpTimer->ppSlot = ppSlot;
+	lpTimer->lpPrev = NULL;
+	lpTimer->lpNext = *ppSlot;
+
+	if (*ppSlot != NULL) {
+		(*ppSlot)->lpPrev = lpTimer;
+	}
+
+	*ppSlot = lpTimer;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CascadeTimers function - Moves the timers in a slot of one of the upper
+// levels down to the levels below it, now that their time has come closer.
+//
+
+void CascadeTimers(LPTIMERWHEEL lpWheel, int nLevel, int nSlot) {
+	LPTIMER lpTimer = lpWheel->lpSlots[nLevel][nSlot];
+
+	lpWheel->lpSlots[nLevel][nSlot] = NULL;
+
+	while (lpTimer != NULL) {
+		LPTIMER lpNext = lpTimer->lpNext;
+
+		LinkTimer(lpWheel, lpTimer);
+
+		lpTimer = lpNext;
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Publicly-exposed functions
+
+///////////////////////////////////////////////////////////////////////////////
+// ArmTimer function
+
+void ArmTimer(LPTIMERWHEEL lpWheel, LPTIMER lpTimer, long nDelayMs,
+		LPTIMER_ROUTINE lpfnRoutine, void* pvUserState) {
+	if (lpWheel == NULL || lpTimer == NULL || lpfnRoutine == NULL) {
+		return;
+	}
+
+	CancelTimer(lpTimer);
+
+	/* Count from the current time rather than from the tick the wheel has
+	 * been run up to, which may be behind it */
+	const uint64_t NOW = GetMonotonicMilliseconds() - lpWheel->nStartTime;
+
+	uint64_t nDelayTicks = ((uint64_t) (nDelayMs > 0 ? nDelayMs : 0)
+			+ TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+	if (nDelayTicks == 0) {
+		nDelayTicks = 1;
+	}
+
+	lpTimer->nDeadline = NOW / TIMER_WHEEL_TICK_MS + nDelayTicks;
+	lpTimer->lpfnRoutine = lpfnRoutine;
+	lpTimer->pvUserState = pvUserState;
+
+	LinkTimer(lpWheel, lpTimer);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// CancelTimer function
+
+void CancelTimer(LPTIMER lpTimer) {
+	if (lpTimer == NULL || lpTimer->ppSlot == NULL) {
+		return;
+	}
+
+	if (lpTimer->lpPrev != NULL) {
+		lpTimer->lpPrev->lpNext = lpTimer->lpNext;
+	} else {
+		*(lpTimer->ppSlot) = lpTimer->lpNext;
+	}
+
+	if (lpTimer->lpNext != NULL) {
+		lpTimer->lpNext->lpPrev = lpTimer->lpPrev;
+	}
+
+	lpTimer->lpNext = NULL;
+	lpTimer->lpPrev = NULL;
+	lpTimer->ppSlot = NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// GetMonotonicMilliseconds function
+
+uint64_t GetMonotonicMilliseconds() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t) now.tv_sec * 1000ULL
+			+ (uint64_t) now.tv_nsec / 1000000ULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// InitializeTimerWheel function
+
+void InitializeTimerWheel(LPTIMERWHEEL lpWheel) {
+	if (lpWheel == NULL) {
+		return;
+	}
+
+	memset(lpWheel->lpSlots, 0, sizeof(lpWheel->lpSlots));
+
+	lpWheel->nCurrentTick = 0;
+	lpWheel->nStartTime = GetMonotonicMilliseconds();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IsTimerArmed function
+
+BOOL IsTimerArmed(LPTIMER lpTimer) {
+	return lpTimer != NULL && lpTimer->ppSlot != NULL;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// RunTimerWheel function
+
+int RunTimerWheel(LPTIMERWHEEL lpWheel) {
+	int nExpiredCount = 0;
+
+	if (lpWheel == NULL) {
+		return nExpiredCount;
+	}
+
+	const uint64_t MASK = TIMER_WHEEL_SLOT_COUNT - 1;
+	const uint64_t TARGET_TICK = (GetMonotonicMilliseconds()
+			- lpWheel->nStartTime) / TIMER_WHEEL_TICK_MS;
+
+	while (lpWheel->nCurrentTick < TARGET_TICK) {
+		lpWheel->nCurrentTick++;
+
+		/* Each time a level comes all the way round, the next slot of the
+		 * level above it is moved down, starting from the top */
+		for (int nLevel = TIMER_WHEEL_LEVEL_COUNT - 1; nLevel > 0;
+				nLevel--) {
+			const uint64_t LOWER_BITS = lpWheel->nCurrentTick
+					& ((1ULL << (nLevel * TIMER_WHEEL_SLOT_BITS)) - 1);
+
+			if (LOWER_BITS == 0) {
+				CascadeTimers(lpWheel, nLevel,
+						(int) ((lpWheel->nCurrentTick
+								>> (nLevel * TIMER_WHEEL_SLOT_BITS)) & MASK));
+			}
+		}
+
+		/* Take the whole slot off the wheel first, so that routines that arm
+		 * timers again do not put them into the list being walked, and that
+		 * routines that cancel other timers in it can still do so */
+		LPTIMER* ppSlot = &(lpWheel->lpSlots[0][lpWheel->nCurrentTick & MASK]);
+		LPTIMER lpDue = *ppSlot;
+
+		*ppSlot = NULL;
+
+		for (LPTIMER lpTimer = lpDue; lpTimer != NULL;
+				lpTimer = lpTimer->lpNext) {
+			lpTimer->ppSlot = &lpDue;
+		}
+
+		while (lpDue != NULL) {
+			LPTIMER lpTimer = lpDue;
+
+			CancelTimer(lpTimer);
+
+			if (lpTimer->nDeadline <= lpWheel->nCurrentTick) {
+				nExpiredCount++;
+
+				lpTimer->lpfnRoutine(lpTimer, lpTimer->pvUserState);
+			} else {
+				/* Only a timer that was too far off for the top level can
+				 * come round before it is due; find it a slot again */
+				LinkTimer(lpWheel, lpTimer);
+			}
+		}
+	}
+
+	return nExpiredCount;
+}